@@ -0,0 +1,107 @@
+#include <string>
+#include <string_view>
+#include <iostream>
+#include <optional>
+#include <utility>
+#include <regex>
+#include <chrono>
+#include <vector>
+#include <functional>
+
+#include "util/util.hpp"
+#include "fsm/CommandFsm.h"
+
+// Compares the cost of parsing PASV and PWD/MKD replies with the string_view
+// parsers in CommandFsm against the std::regex versions they replaced.
+
+namespace {
+
+constexpr int ITERATIONS = 200 * 1000;
+
+// The regex-based parsers as they were before, kept here for comparison.
+
+std::optional<std::pair<std::string, std::string>>
+regexParsePasvReply(const std::string &response)
+{
+  if (response.substr(0, 3) != "227") {
+    return {};
+  }
+  const std::regex portRegex(
+    R"((\d+),(\d+),(\d+),(\d+),(\d+),(\d+))"
+  );
+  std::smatch matches;
+  if (std::regex_search(response, matches, portRegex) && matches.size() == 7) {
+    std::string host(matches[1].str() + "." + matches[2].str() + "." + matches[3].str() + "." + matches[4].str());
+    std::string port = std::to_string(std::stoi(matches[5]) * 256 + std::stoi(matches[6]));
+    return std::make_pair(std::move(host), std::move(port));
+  }
+  return {};
+}
+
+std::optional<std::string>
+regexParseDirectoryReply(const std::string &response)
+{
+  if (response.substr(0, 3) != "257") {
+    return {};
+  }
+  const std::regex regex(
+    R"(257 \"(.*)\".*)"
+  );
+  std::smatch matches;
+  if (std::regex_search(response, matches, regex) && matches.size() == 2) {
+    return matches[1].str();
+  }
+  return {};
+}
+
+// Returns the average time per call in nanoseconds.
+double
+timePerCall(const std::function<bool()> &call)
+{
+  int parsed = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < ITERATIONS; ++i) {
+    parsed += call();
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  if (parsed != ITERATIONS) {
+    LOG_ERROR("Parse failed during benchmark.");
+  }
+  return std::chrono::duration<double, std::nano>(elapsed).count() / ITERATIONS;
+}
+
+void
+report(const std::string &name, double before, double after)
+{
+  std::cout << name << ": regex " << before << " ns/reply, string_view " << after
+    << " ns/reply (" << before / after << "x)" << std::endl;
+}
+
+}
+
+int
+main(void)
+{
+  // The replies are read into a std::string by the caller of the old parsers,
+  // so both versions are given one here to keep the comparison fair.
+  const std::string pasvReply("227 Entering Passive Mode (192,168,100,200,195,80).");
+  const std::string directoryReply("257 \"/home/user/some/longer/directory\" is the current directory");
+
+  if (fsm::parsePasvReply(pasvReply) != regexParsePasvReply(pasvReply)
+        || fsm::parseDirectoryReply(directoryReply) != regexParseDirectoryReply(directoryReply)) {
+    LOG_ERROR("Parsers disagree; the benchmark is meaningless.");
+    return -1;
+  }
+
+  report(
+    "227 (PASV)",
+    timePerCall([&]() { return regexParsePasvReply(pasvReply).has_value(); }),
+    timePerCall([&]() { return fsm::parsePasvReply(pasvReply).has_value(); })
+  );
+  report(
+    "257 (PWD/MKD)",
+    timePerCall([&]() { return regexParseDirectoryReply(directoryReply).has_value(); }),
+    timePerCall([&]() { return fsm::parseDirectoryReply(directoryReply).has_value(); })
+  );
+  return 0;
+}
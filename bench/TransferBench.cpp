@@ -0,0 +1,290 @@
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <filesystem>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "util/util.hpp"
+#include "ftp/Client.h"
+#include "server/LocalServer.h"
+
+// Measures STOR, RETR and LIST against a LocalServer, sweeping file sizes, file
+// counts and simulated round trip times. Each result is printed to stdout as one
+// JSON object per line, so runs can be compared by a script; progress goes to
+// stderr as usual. The percentiles are of whole operations, e.g. a STOR including
+// setting up its data connection, or a directory's worth of them, rather than of
+// single commands.
+//
+// Usage: TransferBench.a [max file size in bytes]
+//
+// The sizes go from 1 KB up to 10 GB, but only those no bigger than the maximum
+// (64 MB by default) are run, since each needs that much disk space twice over.
+
+namespace fs = std::filesystem;
+using fs::path;
+
+using ftp::Client;
+using server::LocalServer;
+
+namespace {
+
+constexpr auto USERNAME = "anonymous", PASSWORD = "anonymous";
+
+constexpr std::uintmax_t KB = 1024, MB = 1024 * KB, GB = 1024 * MB;
+constexpr std::uintmax_t DEFAULT_MAX_SIZE = 64 * MB;
+constexpr std::uintmax_t FILE_SIZES[] = {KB, 16 * KB, 256 * KB, 4 * MB, 64 * MB, GB, 10 * GB};
+constexpr size_t FILE_COUNTS[] = {1, 10, 100};
+constexpr std::uintmax_t FILE_COUNT_SIZE = KB;
+constexpr std::chrono::milliseconds RTTS[] = {
+  std::chrono::milliseconds(0), std::chrono::milliseconds(1), std::chrono::milliseconds(10)
+};
+
+// Enough transfers of each size for stable percentiles, without moving more than
+// about this much data per size.
+constexpr std::uintmax_t BYTES_PER_SIZE = 256 * MB;
+constexpr size_t MIN_SAMPLES = 3, MAX_SAMPLES = 50;
+
+// The bigger sizes take a long time once every command costs a round trip, and
+// tell us nothing more than the small ones about latency.
+constexpr std::uintmax_t MAX_SIZE_WITH_RTT = 4 * MB;
+
+using Clock = std::chrono::steady_clock;
+
+// CPU time used by the calling thread. The server runs on threads of its own, so
+// this is what the client alone costs.
+std::chrono::microseconds
+threadCpuTime()
+{
+  rusage usage{};
+  getrusage(RUSAGE_THREAD, &usage);
+  return std::chrono::seconds(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+    + std::chrono::microseconds(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+void
+writeFile(const path &file, std::uintmax_t size)
+{
+  std::vector<char> block(MB);
+  for (size_t i = 0; i < block.size(); ++i) {
+    block[i] = static_cast<char>(i * 31 + 7);
+  }
+  std::ofstream stream(file, std::ios::binary);
+  for (std::uintmax_t written = 0; written < size; written += block.size()) {
+    stream.write(block.data(), static_cast<std::streamsize>(std::min<std::uintmax_t>(block.size(), size - written)));
+  }
+}
+
+// What one operation took, over all the times it was run in a scenario.
+class Samples
+{
+public:
+  // Runs `operation` once, timing it. Returns whether it succeeded.
+  bool
+  time(const std::function<bool()> &operation)
+  {
+    const auto cpuStart = threadCpuTime();
+    const auto start = Clock::now();
+    const bool isSuccess = operation();
+    latencies_.push_back(Clock::now() - start);
+    cpu_ += threadCpuTime() - cpuStart;
+    return isSuccess;
+  }
+
+  // Prints a line of JSON, as described at the top of the file.
+  void
+  report(const std::string &operation, std::uintmax_t fileSize, size_t numFiles, std::chrono::milliseconds rtt)
+  {
+    if (latencies_.empty()) {
+      return;
+    }
+    std::sort(latencies_.begin(), latencies_.end());
+    Clock::duration total(0);
+    for (const auto &latency : latencies_) {
+      total += latency;
+    }
+    const double seconds = std::chrono::duration<double>(total).count();
+    const double bytes = static_cast<double>(fileSize) * numFiles * latencies_.size();
+    const double cpuSeconds = std::chrono::duration<double>(cpu_).count();
+
+    std::stringstream line;
+    line << "{\"op\":\"" << operation << "\""
+      << ",\"file_size\":" << fileSize
+      << ",\"files\":" << numFiles
+      << ",\"rtt_ms\":" << rtt.count()
+      << ",\"samples\":" << latencies_.size()
+      << ",\"mb_per_s\":" << bytes / MB / seconds
+      << ",\"files_per_s\":" << numFiles * latencies_.size() / seconds
+      << ",\"op_p50_us\":" << percentileMicroseconds(0.5)
+      << ",\"op_p99_us\":" << percentileMicroseconds(0.99)
+      << ",\"cpu_s_per_gb\":" << (bytes > 0 ? cpuSeconds * GB / bytes : 0.0)
+      << "}";
+    std::cout << line.str() << std::endl;
+  }
+
+private:
+  std::vector<Clock::duration> latencies_;
+  std::chrono::microseconds cpu_{0};
+
+  // Nearest rank, so the p99 of fewer than 100 samples is the slowest one.
+  double
+  percentileMicroseconds(double percentile) const
+  {
+    const auto rank = static_cast<size_t>(percentile * latencies_.size() + 0.999999);
+    const auto &latency = latencies_[std::clamp<size_t>(rank, 1, latencies_.size()) - 1];
+    return std::chrono::duration<double, std::micro>(latency).count();
+  }
+};
+
+bool
+connectAndLogin(Client &client, const LocalServer &server)
+{
+  return client.connect(server.host(), server.port()) && client.login(USERNAME, PASSWORD);
+}
+
+void
+setRtt(LocalServer &server, std::chrono::milliseconds rtt)
+{
+  server::Faults faults;
+  faults.replyLatency = rtt;
+  server.setFaults(faults);
+}
+
+// Uploads and downloads one file of each size, repeatedly.
+bool
+benchFileSizes(LocalServer &server, const path &localDir, const path &serverDir, std::uintmax_t maxSize)
+{
+  Client client;
+  if (!connectAndLogin(client, server)) {
+    return false;
+  }
+  for (const auto rtt : RTTS) {
+    setRtt(server, rtt);
+    for (const auto size : FILE_SIZES) {
+      if (size > maxSize || (rtt.count() > 0 && size > MAX_SIZE_WITH_RTT)) {
+        continue;
+      }
+      LOG_INFO("File size " << size << " bytes, RTT " << rtt.count() << " ms");
+      const path source(localDir/"source.bin"), destination(localDir/"destination.bin");
+      writeFile(source, size);
+      const size_t numSamples = std::clamp<size_t>(BYTES_PER_SIZE / size, MIN_SAMPLES, MAX_SAMPLES);
+
+      Samples stor, retr;
+      for (size_t i = 0; i < numSamples; ++i) {
+        // RETR won't overwrite a file.
+        fs::remove(destination);
+        if (!stor.time([&]() { return client.stor(source.string(), "file.bin"); })
+              || !retr.time([&]() { return client.retr("file.bin", destination.string()); })
+              || file_size(destination) != size) {
+          LOG_ERROR("Transfer failed during benchmark.");
+          return false;
+        }
+      }
+      stor.report("stor", size, 1, rtt);
+      retr.report("retr", size, 1, rtt);
+
+      fs::remove(source);
+      fs::remove(destination);
+      fs::remove(serverDir/"file.bin");
+    }
+  }
+  setRtt(server, std::chrono::milliseconds(0));
+  return true;
+}
+
+// Uploads, lists and downloads directories of small files.
+bool
+benchFileCounts(LocalServer &server, const path &localDir, const path &serverDir)
+{
+  Client client;
+  if (!connectAndLogin(client, server)) {
+    return false;
+  }
+  const path source(localDir/"source.bin");
+  writeFile(source, FILE_COUNT_SIZE);
+  for (const auto rtt : RTTS) {
+    setRtt(server, rtt);
+    for (const auto numFiles : FILE_COUNTS) {
+      LOG_INFO(numFiles << " files, RTT " << rtt.count() << " ms");
+      const std::string dir("dir" + std::to_string(numFiles));
+      if (!client.mkd(dir)) {
+        LOG_ERROR("MKD failed during benchmark.");
+        return false;
+      }
+
+      Samples stor, list, retr;
+      const bool isSuccess = stor.time([&]() {
+        for (size_t i = 0; i < numFiles; ++i) {
+          if (!client.stor(source.string(), dir + "/file" + std::to_string(i))) {
+            return false;
+          }
+        }
+        return true;
+      }) && list.time([&]() {
+        size_t numLines = 0;
+        return client.list(dir, [&numLines](std::string_view) { ++numLines; }) && numLines == numFiles;
+      }) && retr.time([&]() {
+        for (size_t i = 0; i < numFiles; ++i) {
+          const path destination(localDir/("file" + std::to_string(i)));
+          if (!client.retr(dir + "/file" + std::to_string(i), destination.string())) {
+            return false;
+          }
+          fs::remove(destination);
+        }
+        return true;
+      });
+      if (!isSuccess) {
+        LOG_ERROR("Transfer failed during benchmark.");
+        return false;
+      }
+      stor.report("stor", FILE_COUNT_SIZE, numFiles, rtt);
+      list.report("list", 0, numFiles, rtt);
+      retr.report("retr", FILE_COUNT_SIZE, numFiles, rtt);
+      fs::remove_all(serverDir/dir);
+    }
+  }
+  setRtt(server, std::chrono::milliseconds(0));
+  return true;
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+  std::uintmax_t maxSize = DEFAULT_MAX_SIZE;
+  if (argc > 1) {
+    char *end = nullptr;
+    maxSize = std::strtoull(argv[1], &end, 10);
+    if (*end != '\0' || maxSize == 0) {
+      LOG_ERROR("Usage: " << argv[0] << " [max file size in bytes]");
+      return -1;
+    }
+  }
+
+  const path benchRoot(fs::temp_directory_path()/("TransferBench-" + std::to_string(::getpid())));
+  const path localDir(benchRoot/"local"), serverDir(benchRoot/"server");
+  fs::create_directories(localDir);
+  fs::create_directories(serverDir);
+
+  int result = 0;
+  {
+    LocalServer server(serverDir);
+    if (!server.start() || !benchFileSizes(server, localDir, serverDir, maxSize)
+          || !benchFileCounts(server, localDir, serverDir)) {
+      LOG_ERROR("Benchmark failed.");
+      result = -1;
+    }
+  }
+
+  fs::remove_all(benchRoot);
+  return result;
+}
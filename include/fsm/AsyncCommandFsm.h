@@ -0,0 +1,81 @@
+#ifndef FSM_ASYNCCOMMANDFSM_H
+#define FSM_ASYNCCOMMANDFSM_H
+
+#include <string>
+#include <utility>
+#include <functional>
+#include <optional>
+#include <cstdint>
+
+#include "io/Socket.h"
+
+// Non-blocking versions of the Fsms in CommandFsm.h. Each one returns
+// immediately and later calls `onComplete`, from the control socket's io
+// context, with whatever the blocking version would have returned. The
+// control socket mustn't be used for anything else in the meantime.
+
+namespace fsm {
+
+template <class T>
+using AsyncResult = std::function<void(T)>;
+
+// Called with the 1xx reply, like `Callback`. The data transfer it starts
+// will be asynchronous too, so it must call the second argument once it
+// has finished with the data connection.
+using AsyncCallback = std::function<void(const std::string &, std::function<void()>)>;
+
+void
+asyncOneStepFsm(
+  io::Socket &controlSocket,
+  const std::string &command,
+  AsyncResult<bool> onComplete
+);
+
+void
+asyncPasvFsm(
+  io::Socket &controlSocket,
+  AsyncResult<std::optional<std::pair<std::string, std::string>>> onComplete
+);
+
+void
+asyncSizeFsm(
+  io::Socket &controlSocket,
+  const std::string &path,
+  AsyncResult<std::optional<std::uintmax_t>> onComplete
+);
+
+void
+asyncDirectoryFsm(
+  io::Socket &controlSocket,
+  const std::optional<std::string> &path,
+  AsyncResult<std::optional<std::string>> onComplete
+);
+
+void
+asyncTwoStepFsm(
+  io::Socket &controlSocket,
+  const std::string &command,
+  AsyncCallback onPreliminaryReply,
+  AsyncResult<bool> onComplete
+);
+
+void
+asyncRenameFsm(
+  io::Socket &controlSocket,
+  const std::string &rnfrArgument,
+  const std::string &rntoArgument,
+  AsyncResult<bool> onComplete
+);
+
+void
+asyncLoginFsm(
+  io::Socket &controlSocket,
+  const std::string &username,
+  const std::optional<std::string> &password,
+  const std::optional<std::string> &account,
+  AsyncResult<bool> onComplete
+);
+
+}
+
+#endif
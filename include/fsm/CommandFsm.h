@@ -2,10 +2,16 @@
 #define FSM_ONESTEPFSM_H
 
 #include <string>
+#include <string_view>
 #include <utility>
 #include <functional>
+#include <optional>
+#include <cstdint>
+#include <vector>
+#include <chrono>
 
 #include "io/Socket.h"
+#include "fsm/ListingParser.h"
 
 namespace fsm {
 
@@ -13,7 +19,12 @@ namespace fsm {
 // of these Fsms in a cpp file, so can't easily use templates, and (2)
 // I want to be able to pass lambdas which have captures, so can't
 // use function pointers.
-using Callback = std::function<void()>;
+// The argument is the 1xx reply that prompted the callback.
+using Callback = std::function<void(const std::string &)>;
+
+// Called with the index of a pipelined command and its reply, or nothing if
+// the connection failed before it arrived. The reply is only valid during the call.
+using PipelineCallback = std::function<void(size_t, const std::optional<io::Reply> &)>;
 
 bool
 oneStepFsm(
@@ -24,6 +35,41 @@ oneStepFsm(
 std::optional<std::pair<std::string, std::string>>
 pasvFsm(io::Socket &controlSocket);
 
+// Sends EPSV (RFC 2428) and returns the port. The host is the control connection's.
+std::optional<std::string>
+epsvFsm(io::Socket &controlSocket);
+
+// Tells the server to connect to `host` and `port` for the next transfer, with PORT
+// if `host` is an IPv4 address and EPRT (RFC 2428) otherwise.
+bool
+portFsm(io::Socket &controlSocket, const std::string &host, const std::string &port);
+
+// Sends SIZE (RFC 3659) and returns the size the server reports.
+std::optional<std::uintmax_t>
+sizeFsm(io::Socket &controlSocket, const std::string &path);
+
+// Sends REST (in its RFC 3659 stream mode meaning) so that the next
+// transfer starts at `offset` bytes into the file.
+bool
+restFsm(io::Socket &controlSocket, std::uintmax_t offset);
+
+// Sends FEAT (RFC 2389) and returns the features the server lists.
+std::optional<std::vector<std::string>>
+featFsm(io::Socket &controlSocket);
+
+// Asks for the CRC-32 of the whole of `path` with the XCRC extension.
+std::optional<std::uint32_t>
+xcrcFsm(io::Socket &controlSocket, const std::string &path);
+
+// Asks for the CRC-32 of the whole of `path` with HASH (draft-bryan-ftpext-hash),
+// first selecting CRC32 as the algorithm with OPTS.
+std::optional<std::uint32_t>
+hashCrcFsm(io::Socket &controlSocket, const std::string &path);
+
+// Sends MLST (RFC 3659) and returns the facts the server gives about `path`.
+std::optional<ListingEntry>
+mlstFsm(io::Socket &controlSocket, const std::string &path);
+
 std::optional<std::string>
 directoryFsm(io::Socket &controlSocket, const std::optional<std::string> &path);
 
@@ -34,6 +80,66 @@ twoStepFsm(
   const Callback &onPreliminaryReply
 );
 
+// Many servers announce the size of a RETR in their 1xx reply, e.g.
+// `150 Opening BINARY mode data connection for x (2050 bytes).`
+// Returns that size if the reply contains one.
+std::optional<std::uintmax_t>
+parseTransferSize(std::string_view preliminaryReply);
+
+// These interpret the replies to specific commands. They're shared by the
+// Fsms here and the asynchronous ones in AsyncCommandFsm.h. Each returns
+// nothing if the reply isn't the expected positive one, and also logs why
+// if it is but can't be parsed.
+
+// Returns the host and port from a 227 reply.
+std::optional<std::pair<std::string, std::string>>
+parsePasvReply(std::string_view reply);
+
+// Returns the port from a 229 reply to EPSV (RFC 2428). The host is the
+// same as the control connection's.
+std::optional<std::string>
+parseEpsvReply(std::string_view reply);
+
+std::optional<std::uintmax_t>
+parseSizeReply(std::string_view reply);
+
+// Returns the directory from a 257 reply, with any doubled quotes undone.
+std::optional<std::string>
+parseDirectoryReply(std::string_view reply);
+
+// Returns the modification time from a 213 reply to MDTM (RFC 3659).
+std::optional<std::chrono::system_clock::time_point>
+parseMdtmReply(std::string_view reply);
+
+// Returns the CRC-32 from a 250 reply to XCRC, e.g. `250 1A2B3C4D`.
+std::optional<std::uint32_t>
+parseXcrcReply(std::string_view reply);
+
+// Returns the CRC-32 from a 213 reply to HASH, e.g. `213 CRC32 0-49 1a2b3c4d x.txt`.
+// Nothing if the server used some other algorithm.
+std::optional<std::uint32_t>
+parseHashCrcReply(std::string_view reply);
+
+// Converts an RFC 3659 time-val, `YYYYMMDDHHMMSS[.sss]` in UTC. Anything after
+// the seconds is ignored.
+std::optional<std::chrono::system_clock::time_point>
+parseTimeVal(std::string_view timeVal);
+
+// Returns one entry per feature line of a 211 reply, e.g. "REST STREAM". A 5xx
+// reply means the server doesn't support FEAT, so it has no features to list.
+std::optional<std::vector<std::string>>
+parseFeatReply(std::string_view reply);
+
+// Sends the commands without waiting for each reply before sending the next,
+// and calls `onReply` with each reply in order. Only suitable for commands
+// whose replies don't decide what to send next.
+void
+pipelineFsm(
+  io::Socket &controlSocket,
+  const std::vector<std::string> &commands,
+  const PipelineCallback &onReply
+);
+
 bool
 renameFsm(
   io::Socket &controlSocket,
@@ -41,12 +147,15 @@ renameFsm(
   const std::string &rntoArgument
 );
 
+// Sends PASS without waiting for the reply to USER if `isPipelined`, which
+// should only be when the password can't be overheard.
 bool
 loginFsm(
   io::Socket &controlSocket,
   const std::string &username,
   const std::optional<std::reference_wrapper<const std::string>> &password,
-  const std::optional<std::reference_wrapper<const std::string>> &account
+  const std::optional<std::reference_wrapper<const std::string>> &account,
+  bool isPipelined
 );
 
 }
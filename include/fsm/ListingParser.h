@@ -0,0 +1,53 @@
+#ifndef FSM_LISTINGPARSER_H
+#define FSM_LISTINGPARSER_H
+
+#include <string>
+#include <string_view>
+#include <optional>
+#include <cstdint>
+#include <chrono>
+
+namespace fsm {
+
+// One entry of a directory listing. Anything the server didn't say is left empty.
+struct ListingEntry
+{
+  enum class Type { File, Directory, CurrentDirectory, ParentDirectory, Link, Other };
+
+  std::string name;
+  Type type = Type::Other;
+  std::optional<std::uintmax_t> size;
+  std::optional<std::chrono::system_clock::time_point> modifyTime;
+  // The `perm` and `unique` facts from RFC 3659 section 7.5. Only MLSD and MLST give these.
+  std::string perm;
+  std::string unique;
+};
+
+// The parsers below overwrite `entry`, reusing its strings' storage, so a caller
+// which passes the same entry for every line of a listing doesn't allocate once
+// the strings are big enough. They return false, and leave `entry` in an
+// unspecified state, if the line isn't an entry.
+
+// Parses a line of MLSD output, e.g. `type=file;size=2050;modify=20200101120000; x.txt`.
+// Unknown facts are ignored.
+bool
+parseMlsxEntry(std::string_view line, ListingEntry &entry);
+
+// Parses a line of LIST output in either the Unix `ls -l` format or the DOS one.
+// Neither says which time zone its times are in, so they are treated as UTC. Unix
+// listings leave out the year of recent files; it's taken to be the year which
+// puts the time in the past relative to `now`.
+bool
+parseListEntry(
+  std::string_view line,
+  ListingEntry &entry,
+  std::chrono::system_clock::time_point now = std::chrono::system_clock::now()
+);
+
+// Returns the entry from a 250 reply to MLST.
+std::optional<ListingEntry>
+parseMlstReply(std::string_view reply);
+
+}
+
+#endif
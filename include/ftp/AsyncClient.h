@@ -0,0 +1,254 @@
+#ifndef FTP_ASYNCCLIENT_H
+#define FTP_ASYNCCLIENT_H
+
+#include <string>
+#include <functional>
+#include <optional>
+#include <memory>
+#include <utility>
+
+#include <boost/asio.hpp>
+
+#include "io/Socket.h"
+
+namespace ftp
+{
+
+// A non-blocking counterpart to Client. Each operation returns immediately
+// and reports its result through a Boost.Asio completion token: a callback,
+// `boost::asio::use_future`, or `boost::asio::use_awaitable` from a coroutine.
+// The results are the same as the corresponding Client method's.
+//
+// Because no thread is tied up while waiting for the server, any number of
+// AsyncClients can share an io context run by a handful of threads.
+// Only one operation may be in progress on an AsyncClient at a time, and the
+// AsyncClient must outlive it. Separate AsyncClients are independent.
+class AsyncClient
+{
+public:
+  // The io context must outlive this AsyncClient.
+  explicit AsyncClient(boost::asio::io_context &ioContext);
+
+  ~AsyncClient() =default;
+
+  // Pending operations refer to the AsyncClient, so it can't be moved.
+  AsyncClient(const AsyncClient &) =delete;
+  AsyncClient(AsyncClient &&) noexcept =delete;
+  AsyncClient &operator=(const AsyncClient &) =delete;
+  AsyncClient &operator=(AsyncClient &&) noexcept =delete;
+
+  template <class CompletionToken>
+  auto asyncConnect(const std::string &host, const std::string &port, CompletionToken &&token)
+  {
+    return initiate<void(bool)>(std::forward<CompletionToken>(token), [this, host, port](auto onComplete) {
+      connect(host, port, std::move(onComplete));
+    });
+  }
+
+  template <class CompletionToken>
+  auto asyncLogin(const std::string &username, CompletionToken &&token)
+  {
+    return initiate<void(bool)>(std::forward<CompletionToken>(token), [this, username](auto onComplete) {
+      login(username, std::nullopt, std::nullopt, std::move(onComplete));
+    });
+  }
+
+  template <class CompletionToken>
+  auto asyncLogin(const std::string &username, const std::string &password, CompletionToken &&token)
+  {
+    return initiate<void(bool)>(std::forward<CompletionToken>(token), [this, username, password](auto onComplete) {
+      login(username, password, std::nullopt, std::move(onComplete));
+    });
+  }
+
+  template <class CompletionToken>
+  auto asyncLogin(
+    const std::string &username,
+    const std::string &password,
+    const std::string &accountName,
+    CompletionToken &&token
+  ) {
+    return initiate<void(bool)>(std::forward<CompletionToken>(token), [this, username, password, accountName](auto onComplete) {
+      login(username, password, accountName, std::move(onComplete));
+    });
+  }
+
+  template <class CompletionToken>
+  auto asyncNoop(CompletionToken &&token)
+  {
+    return initiate<void(bool)>(std::forward<CompletionToken>(token), [this](auto onComplete) {
+      noop(std::move(onComplete));
+    });
+  }
+
+  template <class CompletionToken>
+  auto asyncQuit(CompletionToken &&token)
+  {
+    return initiate<void(bool)>(std::forward<CompletionToken>(token), [this](auto onComplete) {
+      quit(std::move(onComplete));
+    });
+  }
+
+  template <class CompletionToken>
+  auto asyncStor(const std::string &localSrc, const std::string &serverDest, CompletionToken &&token)
+  {
+    return initiate<void(bool)>(std::forward<CompletionToken>(token), [this, localSrc, serverDest](auto onComplete) {
+      storOrAppe(localSrc, serverDest, false, std::move(onComplete));
+    });
+  }
+
+  template <class CompletionToken>
+  auto asyncAppe(const std::string &localSrc, const std::string &serverDest, CompletionToken &&token)
+  {
+    return initiate<void(bool)>(std::forward<CompletionToken>(token), [this, localSrc, serverDest](auto onComplete) {
+      storOrAppe(localSrc, serverDest, true, std::move(onComplete));
+    });
+  }
+
+  template <class CompletionToken>
+  auto asyncRetr(const std::string &serverSrc, const std::string &localDest, CompletionToken &&token)
+  {
+    return initiate<void(bool)>(std::forward<CompletionToken>(token), [this, serverSrc, localDest](auto onComplete) {
+      retr(serverSrc, localDest, std::move(onComplete));
+    });
+  }
+
+  template <class CompletionToken>
+  auto asyncPwd(CompletionToken &&token)
+  {
+    return initiate<void(std::optional<std::string>)>(std::forward<CompletionToken>(token), [this](auto onComplete) {
+      pwd(std::move(onComplete));
+    });
+  }
+
+  template <class CompletionToken>
+  auto asyncCwd(const std::string &newDir, CompletionToken &&token)
+  {
+    return initiate<void(bool)>(std::forward<CompletionToken>(token), [this, newDir](auto onComplete) {
+      cwd(newDir, std::move(onComplete));
+    });
+  }
+
+  template <class CompletionToken>
+  auto asyncMkd(const std::string &newDir, CompletionToken &&token)
+  {
+    return initiate<void(std::optional<std::string>)>(std::forward<CompletionToken>(token), [this, newDir](auto onComplete) {
+      mkd(newDir, std::move(onComplete));
+    });
+  }
+
+  template <class CompletionToken>
+  auto asyncDele(const std::string &fileToDelete, CompletionToken &&token)
+  {
+    return initiate<void(bool)>(std::forward<CompletionToken>(token), [this, fileToDelete](auto onComplete) {
+      dele(fileToDelete, std::move(onComplete));
+    });
+  }
+
+  template <class CompletionToken>
+  auto asyncRmd(const std::string &dirToDelete, CompletionToken &&token)
+  {
+    return initiate<void(bool)>(std::forward<CompletionToken>(token), [this, dirToDelete](auto onComplete) {
+      rmd(dirToDelete, std::move(onComplete));
+    });
+  }
+
+  template <class CompletionToken>
+  auto asyncList(const std::string &dirToList, CompletionToken &&token)
+  {
+    return initiate<void(std::optional<std::string>)>(std::forward<CompletionToken>(token), [this, dirToList](auto onComplete) {
+      list(dirToList, std::move(onComplete));
+    });
+  }
+
+  template <class CompletionToken>
+  auto asyncList(CompletionToken &&token)
+  {
+    return initiate<void(std::optional<std::string>)>(std::forward<CompletionToken>(token), [this](auto onComplete) {
+      list(std::nullopt, std::move(onComplete));
+    });
+  }
+
+  template <class CompletionToken>
+  auto asyncRename(const std::string &from, const std::string &to, CompletionToken &&token)
+  {
+    return initiate<void(bool)>(std::forward<CompletionToken>(token), [this, from, to](auto onComplete) {
+      rename(from, to, std::move(onComplete));
+    });
+  }
+
+private:
+
+  template <class T>
+  using Callback = std::function<void(T)>;
+
+  boost::asio::io_context &ioContext_;
+  io::Socket controlSocket_;
+
+  // Adapts a completion token to the std::function callbacks the operations
+  // are implemented with, so that the implementations can live in the cpp file.
+  // `operation` is called with the callback to use.
+  template <class Signature, class CompletionToken, class Operation>
+  auto initiate(CompletionToken &&token, Operation &&operation)
+  {
+    return boost::asio::async_initiate<CompletionToken, Signature>(
+      [this](auto handler, auto operation) {
+        // Handlers are often move-only, but std::function must be copyable.
+        auto sharedHandler = std::make_shared<decltype(handler)>(std::move(handler));
+        const auto executor = boost::asio::get_associated_executor(*sharedHandler, ioContext_.get_executor());
+        operation([sharedHandler, executor](auto result) {
+          // Always go through the handler's executor, so the handler is never
+          // called from inside the function that started the operation.
+          boost::asio::post(executor, [sharedHandler, result = std::move(result)]() mutable {
+            (*sharedHandler)(std::move(result));
+          });
+        });
+      },
+      token,
+      std::forward<Operation>(operation)
+    );
+  }
+
+  void connect(const std::string &host, const std::string &port, Callback<bool> onComplete);
+
+  void login(
+    const std::string &username,
+    const std::optional<std::string> &password,
+    const std::optional<std::string> &accountName,
+    Callback<bool> onComplete
+  );
+
+  void noop(Callback<bool> onComplete);
+
+  void quit(Callback<bool> onComplete);
+
+  void storOrAppe(
+    const std::string &localSrc,
+    const std::string &serverDest,
+    bool isAppendOperation,
+    Callback<bool> onComplete
+  );
+
+  void retr(const std::string &serverSrc, const std::string &localDest, Callback<bool> onComplete);
+
+  void pwd(Callback<std::optional<std::string>> onComplete);
+
+  void cwd(const std::string &newDir, Callback<bool> onComplete);
+
+  void mkd(const std::string &newDir, Callback<std::optional<std::string>> onComplete);
+
+  void dele(const std::string &fileToDelete, Callback<bool> onComplete);
+
+  void rmd(const std::string &dirToDelete, Callback<bool> onComplete);
+
+  void list(const std::optional<std::string> &dirToList, Callback<std::optional<std::string>> onComplete);
+
+  void rename(const std::string &from, const std::string &to, Callback<bool> onComplete);
+
+  // Calls back with a connected data socket, or null if it couldn't be set up.
+  void setupDataConnection(Callback<std::shared_ptr<io::Socket>> onComplete);
+};
+
+}
+
+#endif
@@ -3,17 +3,36 @@
 
 #include <string>
 #include <functional>
+#include <string_view>
+#include <optional>
+#include <utility>
+#include <filesystem>
+#include <memory>
+#include <cstdint>
+#include <vector>
+#include <chrono>
+
+#include <boost/asio.hpp>
 
 #include "io/Socket.h"
+#include "io/Metrics.h"
+#include "fsm/ListingParser.h"
 
 namespace ftp
 {
 
+// A Client must only be used by one thread at a time, but separate Clients
+// are independent and can be used concurrently from different threads,
+// whether or not they share an io context.
 class Client
 {
 public:
+  // Uses an io context owned by this Client.
   Client();
 
+  // Uses the given io context, which must outlive this Client.
+  explicit Client(boost::asio::io_context &ioContext);
+
   ~Client() =default;
 
   // We can't have these because Boost's io context doesn't have them.
@@ -30,8 +49,11 @@ public:
   //  That way users don't need to wrap their code in try-catch
   //  all the time.
 
+  // Connects to the standard FTP port.
   bool connect(const std::string &url);
 
+  bool connect(const std::string &url, const std::string &port);
+
   bool login(const std::string &username);
 
   bool login(const std::string &username, const std::string &password);
@@ -48,6 +70,150 @@ public:
 
   bool retr(const std::string &serverSrc, const std::string &localDest);
 
+  // The resume variants continue a transfer which stopped part way through,
+  // only sending the part of the file that the destination doesn't have yet.
+  // They use SIZE to find out how much the server has, and REST to skip
+  // what it doesn't need, so they require server support for both (except
+  // `appeResume`, which doesn't need REST).
+
+  // Keeps whatever is already in `localDest`, which is assumed to be a prefix of
+  // `serverSrc`. Acts like `retr` if `localDest` doesn't exist yet.
+  bool retrResume(const std::string &serverSrc, const std::string &localDest);
+
+  // Assumes whatever is already in `serverDest` is a prefix of `localSrc`. Acts
+  // like `stor` if the server can't report the size of `serverDest`.
+  bool storResume(const std::string &localSrc, const std::string &serverDest);
+
+  // `originalServerSize` is the size `serverDest` had before the interrupted
+  // `appe` started (0 if it didn't exist).
+  bool appeResume(const std::string &localSrc, const std::string &serverDest, std::uintmax_t originalServerSize);
+
+  // For files which only ever grow, like logs. Sends just the part of `localSrc`
+  // past the end of `serverDest`, with APPE. The server's copy must be the start of
+  // the local file: its size is checked with SIZE, and if the server supports XCRC,
+  // or HASH with CRC32, so are its contents. Fails without sending anything if it
+  // isn't. Acts like `stor` if the server can't report the size of `serverDest`.
+  bool appeDelta(const std::string &localSrc, const std::string &serverDest);
+
+  // Downloads the file in up to `numConnections` byte ranges at once, each over
+  // its own control connection logged in the same way as this one. Succeeds only
+  // if every range is received. Requires the server to support SIZE, and REST if
+  // more than one connection is used.
+  bool retrSegmented(const std::string &serverSrc, const std::string &localDest, size_t numConnections);
+
+  // Compression done here rather than by the server, for servers without MODE Z.
+  // Files are stored on the server compressed, as gzip.
+
+  struct CompressionOptions
+  {
+    // zlib's, from 1 (fastest) to 9 (smallest).
+    int level = 6;
+    // Threads compressing at once, each taking a 1 MB piece of the file at a time.
+    size_t numThreads = 1;
+  };
+
+  // What the compression did during one transfer.
+  struct CompressionReport
+  {
+    std::uintmax_t uncompressedBytes = 0;
+    std::uintmax_t compressedBytes = 0;
+    // CPU time spent compressing or decompressing, added up across threads.
+    std::chrono::nanoseconds cpuTime{0};
+
+    // Uncompressed size over compressed size.
+    double ratio() const;
+  };
+
+  // Uploads `localSrc` compressed as gzip. The server stores the compressed data as
+  // it is, so `serverDest` would usually end in `.gz`.
+  bool storCompressed(const std::string &localSrc, const std::string &serverDest);
+  bool storCompressed(const std::string &localSrc, const std::string &serverDest, const CompressionOptions &options);
+
+  // Downloads a gzip file, such as one uploaded by `storCompressed`, and decompresses
+  // it on the way into `localDest`.
+  bool retrDecompressed(const std::string &serverSrc, const std::string &localDest);
+
+  // What the most recent `storCompressed` or `retrDecompressed` did, if it got as
+  // far as transferring anything.
+  std::optional<CompressionReport> lastCompressionReport() const;
+
+  // Copies `serverSrc` on this Client's server to `serverDest` on `destination`'s,
+  // with the data going straight from one server to the other (FXP) rather than
+  // through here. This server is sent PASV and `destination`'s is told to connect to
+  // it with PORT, or EPRT for IPv6. Both servers must allow this: many refuse PORT
+  // addresses other than the client's own, as a defence against bounce attacks. If
+  // both support SIZE, the copy's size is checked afterwards.
+  bool fxp(const std::string &serverSrc, Client &destination, const std::string &serverDest);
+
+  // What happened to one file during a `mirror` or `syncUpload`.
+  struct FileTransferResult
+  {
+    std::string serverPath;
+    std::filesystem::path localPath;
+    bool isSuccess = false;
+    std::uintmax_t size = 0;
+  };
+
+  struct MirrorReport
+  {
+    std::vector<FileTransferResult> files;
+    // Directories which couldn't be listed or created locally. Whatever is
+    // in them may have been skipped.
+    std::vector<std::string> failedDirectories;
+    // Bytes received, across every file that succeeded.
+    std::uintmax_t totalBytes = 0;
+    std::chrono::steady_clock::duration elapsed{};
+
+    bool isComplete() const;
+
+    double bytesPerSecond() const;
+  };
+
+  // Downloads the directory tree under `serverDir` into `localDir`, recreating its
+  // subdirectories. Directories are listed and files downloaded over up to
+  // `numConnections` control connections at once, the others logged in the same
+  // way as this one. Each connection has its own queue of work, and takes from the
+  // others' queues when its own is empty. A local file which already exists is only
+  // replaced once its new copy has been received. Links and special files are skipped.
+  MirrorReport mirror(const std::string &serverDir, const std::string &localDir, size_t numConnections);
+
+  struct SyncReport
+  {
+    std::vector<FileTransferResult> uploads;
+    // Server paths of what was created or deleted.
+    std::vector<std::string> createdDirectories;
+    std::vector<std::string> deletedPaths;
+    // Server paths which couldn't be listed, created or deleted, or which are a
+    // file on one side and a directory on the other.
+    std::vector<std::string> failedPaths;
+    // Files which were already up to date.
+    size_t numUnchanged = 0;
+    // Bytes sent, across every upload that succeeded.
+    std::uintmax_t totalBytes = 0;
+    std::chrono::steady_clock::duration elapsed{};
+
+    bool isComplete() const;
+
+    double bytesPerSecond() const;
+  };
+
+  // Makes the tree under `serverDir` match the one under `localDir` by uploading
+  // only the files which are new, or whose size differs, or which were modified
+  // locally after the server's copy. The server's sizes and times come from the
+  // same listings `listEntries` uses, with MDTM filling in exact times if the server
+  // doesn't support MLSD. Missing directories are created. Uploads are spread over
+  // up to `numConnections` control connections, as with `mirror`. If
+  // `isDeletingOrphans` is set, files and directories on the server which don't
+  // exist locally are deleted.
+  SyncReport syncUpload(
+    const std::string &localDir,
+    const std::string &serverDir,
+    size_t numConnections,
+    bool isDeletingOrphans = false
+  );
+
+  std::optional<std::uintmax_t> size(const std::string &serverFile);
+
   std::optional<std::string> pwd();
 
   bool cwd(const std::string &newDir);
@@ -62,17 +228,238 @@ public:
 
   std::optional<std::string> list();
 
+  // Streaming versions of `list`, and of NLST, which lists only the names. Each line
+  // of the listing is passed to `onLine` as it arrives, without its line ending, so
+  // memory use stays the same however big the directory is. The line is only valid
+  // during the call. Returns whether the whole listing was received.
+
+  using LineCallback = std::function<void(std::string_view)>;
+
+  bool list(const std::string &dirToList, const LineCallback &onLine);
+
+  bool list(const LineCallback &onLine);
+
+  bool nlst(const std::string &dirToList, const LineCallback &onLine);
+
+  bool nlst(const LineCallback &onLine);
+
+  // Lists the directory as structured entries, using MLSD (RFC 3659) if the server
+  // advertises MLST in its features, and by parsing LIST's output otherwise. Each
+  // entry is passed to `onEntry` as it arrives and is only valid during the call.
+  // The directory's own `.` and `..` entries, and LIST lines that can't be parsed,
+  // are left out. Returns whether the whole listing was received.
+
+  using EntryCallback = std::function<void(const fsm::ListingEntry &)>;
+
+  bool listEntries(const std::string &dirToList, const EntryCallback &onEntry);
+
+  bool listEntries(const EntryCallback &onEntry);
+
+  // The facts about a single file or directory, using MLST (RFC 3659). Empty if
+  // the server doesn't support it.
+  std::optional<fsm::ListingEntry> mlst(const std::string &path);
+
+  // The file's modification time, using MDTM (RFC 3659).
+  std::optional<std::chrono::system_clock::time_point> mdtm(const std::string &serverFile);
+
+  // Batch versions of the commands above. Each sends its commands without waiting
+  // for the reply to one before sending the next, so a batch costs a few round trips
+  // rather than one per item. They return one result per item, in order, with the
+  // same meaning as the single version's result.
+
+  std::vector<bool> deleBatch(const std::vector<std::string> &filesToDelete);
+
+  std::vector<std::optional<std::string>> mkdBatch(const std::vector<std::string> &newDirs);
+
+  std::vector<bool> rmdBatch(const std::vector<std::string> &dirsToDelete);
+
+  // Each directory is relative to the one before it, as if `cwd` was called on each in turn.
+  std::vector<bool> cwdBatch(const std::vector<std::string> &newDirs);
+
+  // Each item is a pair of the old name and the new one.
+  std::vector<bool> renameBatch(const std::vector<std::pair<std::string, std::string>> &renames);
+
+  std::vector<std::optional<std::uintmax_t>> sizeBatch(const std::vector<std::string> &serverFiles);
+
+  std::vector<std::optional<std::chrono::system_clock::time_point>> mdtmBatch(const std::vector<std::string> &serverFiles);
+
   bool rename(const std::string &from, const std::string &to);
 
+  // The extensions the server lists in reply to FEAT (RFC 2389), e.g. "SIZE" or
+  // "REST STREAM". Empty if the server doesn't support FEAT.
+  std::optional<std::vector<std::string>> features();
+
+  // The Client remembers the transfer type, current directory and features it
+  // has set up or been told about, and doesn't send commands whose effect or
+  // answer it already knows. This counts the round trips that has saved,
+  // including the ones overlapped by data connection prefetch.
+  std::uint64_t roundTripsSaved() const;
+
+  // How the file was sent by the most recent `stor` or `appe`, if one got
+  // as far as sending it.
+  std::optional<io::Socket::SendMethod> lastSendMethod() const;
+
+  // Size of the buffer used to move data from the data connection into the
+  // destination file during `retr`.
+  void setReceiveBufferSize(size_t size);
+
+  // When enabled, as soon as a transfer's data has been sent or received the Client
+  // asks for the next data connection and starts connecting it, while the server is
+  // still finishing the current transfer. The next `stor`, `appe`, `retr` or `list`
+  // then starts straight away. A connection which goes unused for a while is
+  // discarded rather than risk the server having given up on it. Off by default.
+  void setDataConnectionPrefetch(bool isEnabled);
+
+  // Compresses data connections with MODE Z (deflate) at this zlib level, from 1
+  // (fastest) to 9 (smallest), if the server lists MODE Z in its features. Uses
+  // stream mode otherwise, and when empty, which is the default. Applies to the
+  // extra connections opened by `retrSegmented`, `mirror` and `syncUpload` too,
+  // but `fxp` always uses stream mode.
+  void setCompressionLevel(std::optional<int> level);
+
+  // Uses explicit FTPS (RFC 4217) for connections made from now on: AUTH TLS once
+  // the server has said hello, then PBSZ and PROT P so that data connections are
+  // encrypted too. `context` must be a client context which trusts the server's
+  // certificate. Each data connection resumes the control connection's TLS session,
+  // so a batch of small transfers doesn't pay for a full handshake each, and servers
+  // which insist on resumption (e.g. vsftpd's require_ssl_reuse) accept them. The
+  // extra connections opened by `retrSegmented`, `mirror` and `syncUpload` resume it
+  // too. `fxp` fails while data connections are protected. Empty turns TLS off for
+  // later connections.
+  void setTls(std::shared_ptr<io::TlsContext> context);
+
+  // Byte counts, timings and reply codes for everything this Client has done,
+  // including on the extra connections opened by `retrSegmented`, `mirror` and
+  // `syncUpload`. Recording is always on; read it with `snapshot` or `toPrometheus`.
+  const io::Metrics &metrics() const;
+
 private:
 
+  // What's needed to open another control connection to the same server.
+  struct Credentials
+  {
+    std::string username;
+    std::optional<std::string> password;
+    std::optional<std::string> account;
+  };
+
+  // What we know about the session's state on the server. Anything unknown is
+  // empty. It's all forgotten when we reconnect or log in again, and each part is
+  // forgotten when a command which could have changed it fails. The current
+  // directory is also forgotten when any directory is removed or renamed.
+  struct SessionState
+  {
+    // Only image type is ever used, so that's all we need to know about.
+    bool isImageType = false;
+    // MODE Z rather than the default stream mode.
+    bool isModeZ = false;
+    std::optional<std::string> currentDirectory;
+    std::optional<std::vector<std::string>> features;
+  };
+
+  // Only set if this Client created its own context. Declared before the
+  // sockets so that it is destroyed after them.
+  std::unique_ptr<boost::asio::io_context> ownedIoContext_;
+  boost::asio::io_context &ioContext_;
   io::Socket controlSocket_;
+  std::optional<io::Socket::SendMethod> lastSendMethod_;
+  std::optional<CompressionReport> lastCompressionReport_;
+  std::optional<size_t> receiveBufferSize_;
+  std::optional<int> compressionLevel_;
+  std::optional<std::pair<std::string, std::string>> hostAndPort_;
+  std::shared_ptr<io::TlsContext> tlsContext_;
+  // PROT P is in effect, so data connections need TLS.
+  bool isDataProtected_;
+  std::optional<Credentials> credentials_;
+  SessionState sessionState_;
+  std::uint64_t roundTripsSaved_;
+  std::shared_ptr<io::Metrics> metrics_;
+
+  // Data connection prefetch state. `isPasvPending_` means we've sent a PASV whose
+  // reply we haven't read yet; it's queued behind the current transfer's final reply.
+  bool isPrefetchEnabled_;
+  bool isPasvPending_;
+  std::optional<io::Socket> prefetchedDataSocket_;
+  std::chrono::steady_clock::time_point prefetchTime_;
+
+  // Offers `tlsSession` for resumption if TLS is on.
+  bool connect(const std::string &host, const std::string &port, const io::TlsSession &tlsSession);
+
+  bool login(const Credentials &credentials);
+
+  // Upgrades the control connection to TLS and asks for data connections to be protected.
+  bool startTls(const std::string &host, const io::TlsSession &session);
+
+  // Does the data connection's TLS handshake, if data connections are protected. Only
+  // once the server has replied to the command using the connection, because that's
+  // when servers start their side of it.
+  bool secureDataConnection(io::Socket &dataSocket);
+
+  // Opens and logs in another connection to the same server. Resuming `tlsSession`,
+  // taken from this Client's control connection, saves it a full handshake. That has
+  // to be read on the thread using this Client, not the one calling this.
+  std::unique_ptr<Client> connectAnother(const io::TlsSession &tlsSession);
+
+  // Calls `worker` on this Client and on up to `numConnections - 1` others from
+  // `connectAnother`, each on its own thread, along with its index. This one is
+  // index 0 and runs on the calling thread. Returns once they've all finished.
+  void runOnConnections(size_t numConnections, const std::function<void(Client&, size_t)> &worker);
+
+  // Passes the data through `transform`, if given, on its way into `localDest`.
+  bool retr(const std::string &serverSrc, const std::string &localDest, const std::shared_ptr<io::Transform> &transform);
+
+  bool retrRange(
+    const std::string &serverSrc,
+    const std::filesystem::path &destPath,
+    std::uintmax_t offset,
+    std::uintmax_t length
+  );
+
+  // Sends TYPE I unless it's already in effect.
+  bool setImageType();
+
+  // Sends MODE Z or MODE S unless it's already in effect.
+  bool setCompressedMode(bool isCompressed);
 
   std::optional<io::Socket> setupDataConnection();
 
+  // Records a transfer over `dataSocket` whose command was sent at `start`, once it has finished.
+  void recordTransfer(const io::Socket &dataSocket, std::chrono::steady_clock::time_point start);
+
+  // Called once a transfer's data has been moved, to ask for the next data
+  // connection if prefetch is enabled.
+  void requestPrefetch();
+
+  // Called after the transfer's final reply, to start connecting to whatever the
+  // server said in reply to `requestPrefetch`'s PASV.
+  void completePrefetch();
+
+  void discardPrefetch();
+
   std::optional<std::string> list(const std::optional<std::reference_wrapper<const std::string>>&);
 
-  bool storOrAppe(const std::string &localSrc, const std::string &serverDest, bool isAppendOperation);
+  // Whether the server lists `feature`, or a feature starting with it and a space, in its features.
+  bool isFeatureSupported(const std::string &feature);
+
+  bool listEntries(
+    const std::optional<std::reference_wrapper<const std::string>> &maybeDirToList,
+    const EntryCallback &onEntry
+  );
+
+  // Sends LIST, NLST or MLSD, and uses `receive` to read the listing from the data connection.
+  bool retrieveListing(
+    const std::string &verb,
+    const std::optional<std::reference_wrapper<const std::string>> &maybeDirToList,
+    const std::function<bool(io::Socket&)> &receive
+  );
+
+  bool storOrAppe(
+    const std::string &localSrc,
+    const std::string &serverDest,
+    bool isAppendOperation,
+    std::uintmax_t offset = 0,
+    const std::shared_ptr<io::Transform> &transform = nullptr
+  );
 };
 
 }
@@ -0,0 +1,158 @@
+#ifndef FTP_SESSIONPOOL_H
+#define FTP_SESSIONPOOL_H
+
+#include <string>
+#include <optional>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+
+#include "ftp/Client.h"
+
+namespace ftp
+{
+
+// Keeps logged-in Clients open between jobs, so that a job which borrows one skips
+// connecting, the welcome message and logging in. Sessions are kept per server and
+// user, and there are never more than a set number open to one server, counting
+// both borrowed and idle ones. A background thread sends NOOP on sessions which have
+// been idle for a while, so that the server doesn't time them out, and closes any
+// which fail to answer or have been idle for too long.
+//
+// A borrowed session is in whatever state the last borrower left it, e.g. its current
+// directory, so jobs shouldn't rely on that. All methods are thread safe.
+class SessionPool
+{
+public:
+  struct Options
+  {
+    // Sessions open to one host and port, whether borrowed or idle.
+    size_t maxConnectionsPerHost = 4;
+    // Idle sessions are sent NOOP this long after they were last used or checked.
+    // A session which hasn't been used or checked for this long is also checked
+    // before being lent out.
+    std::chrono::milliseconds keepaliveInterval = std::chrono::seconds(30);
+    // Idle sessions are closed after this long without being borrowed.
+    std::chrono::milliseconds maxIdleTime = std::chrono::minutes(5);
+    // How long `acquire` waits for a session when the host is at its limit.
+    std::chrono::milliseconds acquireTimeout = std::chrono::seconds(30);
+  };
+
+  struct Stats
+  {
+    // Sessions which were connected and logged in because none were idle.
+    std::uint64_t numCreated = 0;
+    // Times an idle session was lent out instead.
+    std::uint64_t numReused = 0;
+    // Sessions closed for failing a check, being discarded by a borrower, or idling too long.
+    std::uint64_t numEvicted = 0;
+    std::uint64_t numKeepalives = 0;
+  };
+
+  struct Credentials
+  {
+    std::string host;
+    std::string port;
+    std::string username;
+    std::string password;
+
+    bool operator==(const Credentials &other) const;
+  };
+
+  // A borrowed session, which goes back to the pool when this is destroyed. The pool
+  // must outlive it.
+  class Lease
+  {
+  public:
+    ~Lease();
+
+    Lease(const Lease &) =delete;
+    Lease(Lease &&) noexcept =default;
+    Lease &operator=(const Lease &) =delete;
+    Lease &operator=(Lease &&) noexcept =delete;
+
+    Client &operator*() const;
+
+    Client *operator->() const;
+
+    // Closes the session rather than returning it, e.g. because an error may have
+    // left it in an unknown state.
+    void discard();
+
+  private:
+    friend class SessionPool;
+
+    Lease(SessionPool &pool, Credentials credentials, std::unique_ptr<Client> client);
+
+    SessionPool *pool_;
+    Credentials credentials_;
+    std::unique_ptr<Client> client_;
+    bool isDiscarded_;
+  };
+
+  SessionPool();
+
+  explicit SessionPool(const Options &options);
+
+  // Closes the idle sessions. Every Lease must have been destroyed by now.
+  ~SessionPool();
+
+  SessionPool(const SessionPool &) =delete;
+  SessionPool(SessionPool &&) noexcept =delete;
+  SessionPool &operator=(const SessionPool &) =delete;
+  SessionPool &operator=(SessionPool &&) noexcept =delete;
+
+  // Lends out an idle session for these credentials if there is one, or else opens
+  // a new one. If the host is at its limit, an idle session for another user is
+  // closed to make room, or failing that this waits for one to be returned. Empty if
+  // that takes too long or a new session can't be opened.
+  std::optional<Lease> acquire(const Credentials &credentials);
+
+  // Includes sessions which are being sent a keepalive.
+  size_t numIdle() const;
+
+  Stats stats() const;
+
+private:
+  struct IdleSession
+  {
+    Credentials credentials;
+    std::unique_ptr<Client> client;
+    std::chrono::steady_clock::time_point idleSince;
+    std::chrono::steady_clock::time_point lastChecked;
+  };
+
+  const Options options_;
+
+  // Guards everything below.
+  mutable std::mutex mutex_;
+  // Notified when a session is returned or closed, for `acquire`.
+  std::condition_variable sessionReleased_;
+  // Notified when there's something new for the keepalive thread to do.
+  std::condition_variable keepaliveWake_;
+  // Most recently returned last.
+  std::vector<IdleSession> idle_;
+  // Idle sessions which the keepalive thread has taken out to check.
+  std::vector<Credentials> beingChecked_;
+  // Open sessions by "host:port", including borrowed ones and ones being checked.
+  std::unordered_map<std::string, size_t> numOpen_;
+  Stats stats_;
+  bool isStopping_;
+  std::thread keepaliveThread_;
+
+  void release(const Credentials &credentials, std::unique_ptr<Client> client, bool isDiscarded);
+
+  // Must be called with the lock held.
+  void forget(const Credentials &credentials);
+
+  void keepIdleSessionsAlive();
+};
+
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef IO_DEFLATE_H
+#define IO_DEFLATE_H
+
+#include <cstddef>
+#include <optional>
+#include <string_view>
+#include <functional>
+#include <memory>
+
+#include <zlib.h>
+
+namespace io {
+
+// The wrapper around the compressed data: zlib's (RFC 1950), as used by MODE Z,
+// or gzip's (RFC 1952), as used for .gz files.
+enum class DeflateFormat { Zlib, Gzip };
+
+// Streaming deflate compression. Memory use is fixed however much data passes through.
+class Deflater {
+public:
+  // `level` is zlib's, from 1 (fastest) to 9 (smallest).
+  explicit Deflater(int level, DeflateFormat format = DeflateFormat::Zlib);
+
+  ~Deflater();
+
+  Deflater(const Deflater &) =delete;
+  Deflater(Deflater &&) noexcept =delete;
+  Deflater &operator=(const Deflater &) =delete;
+  Deflater &operator=(Deflater &&) noexcept =delete;
+
+  // Compresses `input`, passing the output to `onOutput` a buffer at a time. Most
+  // input is held back until there's enough to compress well; `isFinal` flushes it
+  // and ends the stream. Returns false if `onOutput` does, or if zlib fails.
+  bool deflate(std::string_view input, bool isFinal, const std::function<bool(std::string_view)> &onOutput);
+
+private:
+  z_stream stream_;
+  bool isInitialised_;
+  std::unique_ptr<char[]> output_;
+};
+
+class Inflater {
+public:
+  explicit Inflater(DeflateFormat format = DeflateFormat::Zlib);
+
+  ~Inflater();
+
+  Inflater(const Inflater &) =delete;
+  Inflater(Inflater &&) noexcept =delete;
+  Inflater &operator=(const Inflater &) =delete;
+  Inflater &operator=(Inflater &&) noexcept =delete;
+
+  // Decompresses as much of `input` as fits into `output`, removing what was used
+  // from the front of `input`, and returns how much of `output` was filled. Stops at
+  // the end of the stream, leaving anything after it in `input`. Empty if the data
+  // is corrupt.
+  std::optional<size_t> inflate(std::string_view &input, char *output, size_t outputSize);
+
+  // Whether the end of the compressed stream has been reached.
+  bool isFinished() const;
+
+  // Starts on a new stream, e.g. the next member of a gzip file.
+  bool reset();
+
+private:
+  z_stream stream_;
+  bool isInitialised_;
+  bool isFinished_;
+};
+
+}
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef IO_FILE_H
+#define IO_FILE_H
+
+#include <cstdint>
+#include <cstddef>
+
+namespace io {
+
+// Owns a raw file descriptor and closes it when it goes out of scope.
+// Used where the transfer code needs to hand the descriptor to the
+// kernel directly, which iostreams don't allow.
+class FileDescriptor {
+public:
+  explicit FileDescriptor(int fd);
+
+  ~FileDescriptor();
+
+  FileDescriptor(const FileDescriptor &) =delete;
+  FileDescriptor(FileDescriptor &&other) noexcept;
+  FileDescriptor &operator=(const FileDescriptor &) =delete;
+  FileDescriptor &operator=(FileDescriptor &&other) noexcept;
+
+  int get() const;
+
+  explicit operator bool() const;
+
+private:
+  int fd_;
+};
+
+// Reserves blocks for the first `size` bytes of the file. If `keepSize` is set
+// the file's apparent size doesn't change; otherwise it is extended to `size`.
+// Returns false if the blocks couldn't be reserved, in which case the file's
+// size is still extended if `keepSize` wasn't set.
+bool preallocate(int fd, std::uintmax_t size, bool keepSize);
+
+// Writes all of `size` bytes to `fd`, throwing if that isn't possible.
+void writeAll(int fd, const char *data, size_t size);
+
+// As `writeAll`, but writes at `offset` without using or moving the file
+// position, so different parts of the file can be written concurrently.
+void writeAllAt(int fd, const char *data, size_t size, std::uintmax_t offset);
+
+}
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef IO_LISTENER_H
+#define IO_LISTENER_H
+
+#include <string>
+#include <optional>
+
+#include <boost/asio.hpp>
+
+#include "io/Socket.h"
+
+namespace io {
+
+// Accepts incoming connections, handing each one out as a Socket.
+class Listener {
+public:
+
+  // The io context must outlive the Listener and any Sockets it accepts.
+  explicit Listener(boost::asio::io_context &ioContext);
+
+  ~Listener() =default;
+
+  Listener(const Listener &) =delete;
+  Listener(Listener &&) noexcept =default;
+  Listener &operator=(const Listener &) =delete;
+  Listener &operator=(Listener &&) noexcept =default;
+
+  // Use port "0" to let the OS pick a free port.
+  bool listen(const std::string &host, const std::string &port);
+
+  // The port actually being listened on.
+  std::optional<std::string> port();
+
+  std::optional<Socket> accept();
+
+  // Makes any thread blocked in `accept` return without a Socket. Unlike
+  // `close`, this is safe to call while another thread is accepting.
+  bool shutdown();
+
+  bool isOpen();
+
+  bool close();
+
+private:
+
+  boost::asio::ip::tcp::acceptor boostAcceptor_;
+
+};
+
+}
+
+#endif
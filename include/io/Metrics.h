@@ -0,0 +1,131 @@
+#ifndef IO_METRICS_H
+#define IO_METRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+
+namespace io {
+
+// Upper bounds of the histogram buckets, from 100us to 10s. Anything slower
+// goes in a final, unbounded bucket.
+constexpr std::array<std::chrono::microseconds, 16> HISTOGRAM_BOUNDS{
+  std::chrono::microseconds(100), std::chrono::microseconds(250), std::chrono::microseconds(500),
+  std::chrono::milliseconds(1), std::chrono::microseconds(2500), std::chrono::milliseconds(5),
+  std::chrono::milliseconds(10), std::chrono::milliseconds(25), std::chrono::milliseconds(50),
+  std::chrono::milliseconds(100), std::chrono::milliseconds(250), std::chrono::milliseconds(500),
+  std::chrono::seconds(1), std::chrono::milliseconds(2500), std::chrono::seconds(5),
+  std::chrono::seconds(10)
+};
+
+struct HistogramSnapshot
+{
+  // How many durations fell into each bucket (not cumulative). The last is the
+  // unbounded one.
+  std::array<std::uint64_t, HISTOGRAM_BOUNDS.size() + 1> bucketCounts{};
+  std::uint64_t count = 0;
+  std::chrono::microseconds sum{0};
+};
+
+// Counts durations into the buckets above. Safe to use from several threads at
+// once, and recording never locks or allocates.
+class Histogram
+{
+public:
+  void record(std::chrono::steady_clock::duration duration);
+
+  HistogramSnapshot snapshot() const;
+
+private:
+  std::array<std::atomic<std::uint64_t>, HISTOGRAM_BOUNDS.size() + 1> bucketCounts_{};
+  std::atomic<std::uint64_t> count_{0};
+  std::atomic<std::uint64_t> sumMicroseconds_{0};
+};
+
+struct MetricsSnapshot
+{
+  // File and listing data moved over data connections. Control traffic isn't included.
+  std::uint64_t bytesSent = 0;
+  std::uint64_t bytesReceived = 0;
+
+  // From sending the command which starts a transfer to its final reply.
+  HistogramSnapshot transferDuration;
+  // From sending RETR, LIST, etc. to the first byte of data arriving.
+  HistogramSnapshot timeToFirstByte;
+  // From deciding a data connection is needed to having one, including any TYPE and PASV.
+  HistogramSnapshot dataConnectionSetup;
+  // TLS handshakes on control and data connections, and how many of them resumed an
+  // earlier session rather than doing the full handshake.
+  std::uint64_t tlsHandshakes = 0;
+  std::uint64_t tlsResumedHandshakes = 0;
+  HistogramSnapshot tlsHandshakeDuration;
+  // From sending a command to its first reply, by verb. Only verbs which have been sent
+  // are present.
+  std::map<std::string, HistogramSnapshot> commandRoundTrip;
+  // How many of each reply code have been received. Only codes which have been seen
+  // are present.
+  std::map<int, std::uint64_t> replyCodes;
+};
+
+// Counters for what one or more connections have done. Updating them is cheap
+// enough to leave on all the time: each update is a few relaxed atomic additions.
+// Reading them gives a snapshot which may be mid-update, but never torn within a
+// single counter.
+class Metrics
+{
+public:
+  // The verbs which get their own round trip histogram. Anything else is counted as "OTHER".
+  static constexpr std::array<std::string_view, 41> VERBS{
+    "ABOR", "ACCT", "APPE", "AUTH", "CDUP", "CWD", "DELE", "EPRT", "EPSV", "FEAT", "HASH",
+    "HELP", "LIST", "MDTM", "MKD", "MLSD", "MLST", "MODE", "NLST", "NOOP", "OPTS", "PASS",
+    "PASV", "PBSZ", "PORT", "PROT", "PWD", "QUIT", "REST", "RETR", "RMD", "RNFR", "RNTO",
+    "SITE", "SIZE", "STAT", "STOR", "SYST", "TYPE", "USER", "XCRC"
+  };
+
+  // An index into VERBS, or VERBS.size() for anything not in it. Looking a verb up
+  // once and recording by index avoids doing it for every reply.
+  static size_t verbIndex(std::string_view verb);
+
+  void addBytesSent(std::uint64_t bytes);
+
+  void addBytesReceived(std::uint64_t bytes);
+
+  void recordTransfer(std::chrono::steady_clock::duration duration);
+
+  void recordTimeToFirstByte(std::chrono::steady_clock::duration duration);
+
+  void recordDataConnectionSetup(std::chrono::steady_clock::duration duration);
+
+  void recordTlsHandshake(std::chrono::steady_clock::duration duration, bool isResumed);
+
+  void recordCommandRoundTrip(size_t verbIndex, std::chrono::steady_clock::duration duration);
+
+  void recordReply(int code);
+
+  MetricsSnapshot snapshot() const;
+
+  // The snapshot in the Prometheus text exposition format, with every metric's
+  // name starting with `prefix`.
+  std::string toPrometheus(const std::string &prefix = "ftp_client") const;
+
+private:
+  std::atomic<std::uint64_t> bytesSent_{0};
+  std::atomic<std::uint64_t> bytesReceived_{0};
+  Histogram transferDuration_;
+  Histogram timeToFirstByte_;
+  Histogram dataConnectionSetup_;
+  std::atomic<std::uint64_t> tlsHandshakes_{0};
+  std::atomic<std::uint64_t> tlsResumedHandshakes_{0};
+  Histogram tlsHandshakeDuration_;
+  std::array<Histogram, VERBS.size() + 1> commandRoundTrip_;
+  // Indexed by code - 100, so every valid code (100 to 599) has a counter.
+  std::array<std::atomic<std::uint64_t>, 500> replyCodes_{};
+};
+
+}
+
+#endif
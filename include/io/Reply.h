@@ -0,0 +1,32 @@
+#ifndef IO_REPLY_H
+#define IO_REPLY_H
+
+#include <string_view>
+#include <utility>
+#include <optional>
+#include <cstddef>
+
+namespace io {
+
+// A complete reply read from an FTP control connection. `text` covers every
+// line of the reply, without the final delimiter, and points into the buffer
+// it was parsed from.
+struct Reply
+{
+  // The three-digit reply code, or 0 if the reply didn't start with one.
+  int code;
+  std::string_view text;
+
+  // The first digit of the code, e.g. 2 for a positive completion reply.
+  int kind() const { return code / 100; }
+};
+
+// Looks for a complete reply at the start of `buffer`. If there is one, returns
+// it along with the number of bytes it takes up, including the final delimiter.
+// Multi-line replies (RFC 959 section 4.2) run from `123-` to the next line
+// that starts with `123 `, and may contain any other lines in between.
+std::optional<std::pair<Reply, size_t>> parseReply(std::string_view buffer);
+
+}
+
+#endif
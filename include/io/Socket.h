@@ -5,15 +5,42 @@
 #include <string>
 #include <filesystem>
 #include <ostream>
+#include <optional>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <chrono>
 
 #include <boost/asio.hpp>
 
+#include "io/Reply.h"
+#include "io/Metrics.h"
+#include "io/Deflate.h"
+#include "io/Transform.h"
+#include "io/Tls.h"
+
 namespace io {
 
 class Socket {
 public:
 
-  Socket();
+  // How `sendFile` moved the file's bytes onto the socket. `ZeroCopy` means
+  // the kernel copied them straight from the file (via sendfile(2)), `Buffered`
+  // means they were read into user space and written out in chunks.
+  enum class SendMethod { ZeroCopy, Buffered };
+
+  // What a Socket is used for, which decides what `setMetrics` records.
+  enum class Connection { Control, Data };
+
+  // Sockets don't own their io context, so it must outlive them. Sockets
+  // which share a context can still be used from different threads.
+  explicit Socket(boost::asio::io_context &ioContext);
+
+  // Takes over an already-connected socket, e.g. one returned by an acceptor.
+  explicit Socket(boost::asio::ip::tcp::socket &&boostSocket);
 
   ~Socket() =default;
 
@@ -24,28 +51,250 @@ public:
 
   bool connect(const std::string &host, const std::string &port);
 
+  // Starts connecting without waiting for the connection to be made, so that the
+  // handshake can happen while the caller gets on with something else. Must be
+  // followed by `finishConnect` before the Socket is used.
+  bool beginConnect(const std::string &host, const std::string &port);
+
+  // Waits for the connection started by `beginConnect`, and says whether it worked.
+  bool finishConnect();
+
+  // Reads and returns everything up to the next `delim`. Any bytes which
+  // arrive after it are kept for the next read.
   std::optional<std::string> readUntil(const std::string &delim);
 
+  // Reads one complete FTP reply, which may span several lines. The reply's text
+  // points into the Socket's receive buffer, so it is only valid until the next
+  // read. The buffer is reused, so reading replies doesn't normally allocate.
+  std::optional<Reply> readReply();
+
+  // Reads whatever has arrived, up to `size` bytes, waiting for at least one byte.
+  // Returns 0 once the other end has finished sending, and nothing on error.
+  std::optional<size_t> readSome(char *buffer, size_t size);
+
+  // Whether bytes have been received which no read has returned yet, so that the
+  // next read may not have to wait for the network.
+  bool hasBufferedInput() const;
+
   size_t sendString(const std::string &string);
 
-  bool sendFile(const std::filesystem::path &filePath);
+  // Sends the file from `offset` bytes in until the end of the file.
+  bool sendFile(const std::filesystem::path &filePath, std::uintmax_t offset = 0);
+
+  // Sends at most `length` bytes of the file, starting `offset` bytes in.
+  bool sendFileRange(const std::filesystem::path &filePath, std::uintmax_t offset, std::uintmax_t length);
+
+  std::optional<SendMethod> lastSendMethod() const;
+
+  // Writes the incoming data straight to a new file at `filePath`. If the size of
+  // the transfer is known in advance, the file's blocks are allocated up front.
+  bool retrieveFile(
+    const std::filesystem::path &filePath,
+    const std::optional<std::uintmax_t> &expectedSize = std::nullopt
+  );
 
-  bool retrieveFile(const std::filesystem::path &filePath);
+  // Writes the incoming data into the existing file at `filePath`, starting at
+  // `offset` and replacing anything that was there from that point on.
+  bool resumeRetrieveFile(const std::filesystem::path &filePath, std::uintmax_t offset);
+
+  // Writes the first `length` bytes of the incoming data into the existing file
+  // at `filePath`, starting at `offset`, then stops reading. Fails if the data
+  // ends before `length` bytes have arrived.
+  bool retrieveFileRange(
+    const std::filesystem::path &filePath,
+    std::uintmax_t offset,
+    std::uintmax_t length
+  );
 
   bool retrieveToStream(std::ostream &stream);
 
+  // Calls `onLine` with each line of the incoming data, minus its line ending, as
+  // soon as the line has arrived. Only a partly received line is kept between reads,
+  // so memory use doesn't grow with the amount of data. Fails if a line is
+  // unreasonably long.
+  bool retrieveLines(const std::function<void(std::string_view)> &onLine);
+
+  void setReceiveBufferSize(size_t size);
+
+  // Records what the socket does in `metrics`, which may be shared with other sockets.
+  // A data connection counts the bytes it moves and notes when data first arrives. A
+  // control connection counts reply codes and times each command from being sent to
+  // its first reply. Only the blocking operations are recorded.
+  void setMetrics(std::shared_ptr<Metrics> metrics, Connection connection);
+
+  // When data first arrived on a data connection with metrics, or when the other end
+  // finished without sending any. Empty if neither has happened yet.
+  std::optional<std::chrono::steady_clock::time_point> firstByteTime() const;
+
+  // For MODE Z: from now on, `sendFile` and `sendFileRange` deflate what they send at
+  // the zlib `level`, and the retrieve methods inflate what they receive. Empty turns
+  // it off. Only the blocking operations support it. Metrics count the compressed bytes.
+  void setCompression(std::optional<int> level);
+
+  // Passes data through `transform` between the file and the connection: what
+  // `sendFile` sends, and what `retrieveFile`, `resumeRetrieveFile` and
+  // `retrieveToStream` receive. It comes before any MODE Z compression on the way out
+  // and after it on the way in. Ranges and lines aren't transformed. Empty removes it.
+  void setTransform(std::shared_ptr<Transform> transform);
+
+  // Secures the connection with TLS, as whichever side `context` is for, doing the
+  // handshake straight away. A client checks that the server's certificate is for
+  // `serverName`, a host name or IP address, and offers to resume `session` if given.
+  // Only the blocking operations support TLS. Records the handshake in the metrics,
+  // whichever kind of connection this is.
+  bool startTls(
+    const std::shared_ptr<TlsContext> &context,
+    const std::string &serverName = "",
+    const TlsSession &session = nullptr
+  );
+
+  // The TLS session, for resuming on another connection. Empty without TLS.
+  TlsSession tlsSession() const;
+
+  bool isTls() const;
+
+  // Whether the TLS handshake resumed an earlier session rather than starting a new one.
+  bool isTlsResumed() const;
+
+  // Turns off Nagle's algorithm, so that small writes go out straight away rather
+  // than waiting for the last one to be acknowledged. Must be connected.
+  bool setNoDelay();
+
+  // Asynchronous versions of the operations above. Each returns immediately and
+  // calls `onComplete` from the io context when it has finished. Until then, the
+  // Socket must not be moved or destroyed and no other operation may be started
+  // on it. Sync and async reads share the receive buffer, so they can be mixed.
+
+  using Callback = std::function<void(bool)>;
+
+  void asyncConnect(const std::string &host, const std::string &port, Callback onComplete);
+
+  void asyncReadUntil(const std::string &delim, std::function<void(std::optional<std::string>)> onComplete);
+
+  void asyncReadReply(std::function<void(std::optional<Reply>)> onComplete);
+
+  void asyncSendString(const std::string &string, Callback onComplete);
+
+  void asyncSendFile(const std::filesystem::path &filePath, Callback onComplete);
+
+  void asyncRetrieveFile(
+    const std::filesystem::path &filePath,
+    const std::optional<std::uintmax_t> &expectedSize,
+    Callback onComplete
+  );
+
+  void asyncRetrieveToStream(std::ostream &stream, Callback onComplete);
+
   bool isOpen();
 
+  // Stops any further sending or receiving without closing the socket. Unlike
+  // `close`, this can be used to unblock another thread that is reading.
+  bool shutdown();
+
+  // With TLS, tells the other end that nothing more is coming first, so that it can
+  // tell the end of the data from a connection which was cut.
   bool close();
 
 private:
 
-  // This is static because it can't be moved but ideally Socket should
-  // be moveable. It's ok to share this between all sockets because this
-  // is a single-threaded application so there can't be any race
-  // conditions.
-  static inline boost::asio::io_context boostIoContext_{};
+  struct SslDeleter
+  {
+    void operator()(SSL *ssl) const;
+  };
+
   boost::asio::ip::tcp::socket boostSocket_;
+  std::optional<SendMethod> lastSendMethod_;
+  size_t receiveBufferSize_;
+
+  // Bytes received by `readUntil`, `readReply` and their async versions. The
+  // first `readBufferConsumed_` of them have already been handed out; they're
+  // kept until the next read so that the last reply's text stays valid.
+  std::string readBuffer_;
+  size_t readBufferConsumed_;
+
+  std::shared_ptr<Metrics> metrics_;
+  Connection connection_;
+  std::optional<std::chrono::steady_clock::time_point> firstByteTime_;
+  // Commands sent on a control connection which haven't had a reply yet, oldest first,
+  // as the index of their verb in Metrics::VERBS and when they were sent.
+  std::deque<std::pair<size_t, std::chrono::steady_clock::time_point>> pendingCommands_;
+  // The last reply was a 1xx, so the next one finishes the same command.
+  bool isAwaitingFinalReply_;
+
+  std::optional<int> compressionLevel_;
+  std::unique_ptr<Inflater> inflater_;
+  // Received but not yet inflated. Points into `compressedBuffer_`.
+  std::string_view compressedInput_;
+  std::vector<char> compressedBuffer_;
+  std::shared_ptr<Transform> transform_;
+  std::unique_ptr<SSL, SslDeleter> ssl_;
+
+  // The basic reads and writes, which go through TLS if it's on. Like read_some,
+  // boost::asio::read and boost::asio::write respectively.
+  size_t receiveSome(char *buffer, size_t size, boost::system::error_code &errorCode);
+
+  size_t receiveAll(char *buffer, size_t size, boost::system::error_code &errorCode);
+
+  void sendAll(const char *data, size_t size);
+
+  // Whether the kernel is encrypting what's sent, so that files can be sent with sendfile.
+  bool isKernelTls() const;
+
+  void countSent(size_t bytes);
+
+  void countReceived(size_t bytes);
+
+  // Waits until there's something to read, to note when data first arrived. Reads
+  // which fill a whole buffer would otherwise only see it once the buffer was full.
+  void waitForFirstByte();
+
+  void noteCommandsSent(std::string_view commands);
+
+  void noteReply(int code);
+
+  void discardConsumedInput();
+
+  // Reads incoming data into `buffer`, inflating it if compression is on. Like
+  // boost::asio::read if `isFilling`, so stops early only at EOF or on error, and
+  // like `read_some` otherwise. Corrupt or truncated compressed data is an error.
+  size_t readData(char *buffer, size_t size, bool isFilling, boost::system::error_code &errorCode);
+
+  // Appends whatever has arrived to the receive buffer, waiting for at least one byte.
+  void readMore();
+
+  // Reads into the receive buffer until `isComplete` returns true.
+  void asyncReadMoreUntil(std::function<bool()> isComplete, Callback onComplete);
+
+  bool sendFileInternal(
+    const std::filesystem::path &filePath,
+    std::uintmax_t offset,
+    const std::optional<std::uintmax_t> &length
+  );
+
+  std::optional<bool> sendFileZeroCopy(
+    const std::filesystem::path &filePath,
+    std::uintmax_t offset,
+    std::optional<std::uintmax_t> length
+  );
+
+  bool sendFileBuffered(
+    const std::filesystem::path &filePath,
+    std::uintmax_t offset,
+    std::optional<std::uintmax_t> length
+  );
+
+  // Sends through the transform and MODE Z compression, whichever are set.
+  bool sendFileTransformed(
+    const std::filesystem::path &filePath,
+    std::uintmax_t offset,
+    std::optional<std::uintmax_t> length
+  );
+
+  // Hands received data to `sink`, through the transform if there is one.
+  // `isFinal` flushes the transform, and fails if its input was incomplete.
+  bool deliver(std::string_view data, bool isFinal, const Transform::OutputCallback &sink);
+
+  void retrieveToFileInternal(int fd);
 
   void retrieveToStreamInternal(std::ostream &stream);
 
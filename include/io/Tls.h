@@ -0,0 +1,56 @@
+#ifndef IO_TLS_H
+#define IO_TLS_H
+
+#include <string>
+#include <memory>
+
+#include <boost/asio/ssl.hpp>
+#include <openssl/ssl.h>
+
+namespace io {
+
+// A TLS session which a client can offer to resume on another connection, skipping
+// most of the handshake. Empty if there's nothing to resume.
+using TlsSession = std::shared_ptr<SSL_SESSION>;
+
+// The TLS settings shared by every connection on one side, e.g. all of a Client's
+// control and data connections. Once set up it can be shared between Sockets on
+// different threads.
+class TlsContext {
+public:
+  enum class Role { Client, Server };
+
+  // Clients check the server's certificate, and trust nothing until told to. Both
+  // sides hand encryption to the kernel (kTLS) where the kernel supports it, which
+  // lets files be sent without copying them through user space.
+  explicit TlsContext(Role role);
+
+  ~TlsContext() =default;
+
+  TlsContext(const TlsContext &) =delete;
+  TlsContext(TlsContext &&) noexcept =delete;
+  TlsContext &operator=(const TlsContext &) =delete;
+  TlsContext &operator=(TlsContext &&) noexcept =delete;
+
+  Role role() const;
+
+  // For clients: trusts certificates signed by the PEM certificate `certificate`, or
+  // `certificate` itself if it's self-signed.
+  bool trustCertificate(const std::string &certificate);
+
+  // For clients: trusts the system's usual certificate authorities.
+  bool trustSystemCertificates();
+
+  // For servers: the PEM certificate chain to present and its private key.
+  bool useCertificate(const std::string &certificateChain, const std::string &privateKey);
+
+  SSL_CTX *nativeHandle();
+
+private:
+  const Role role_;
+  boost::asio::ssl::context context_;
+};
+
+}
+
+#endif
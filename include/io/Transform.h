@@ -0,0 +1,81 @@
+#ifndef IO_TRANSFORM_H
+#define IO_TRANSFORM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "io/Deflate.h"
+
+namespace io {
+
+struct TransformStats
+{
+  std::uintmax_t bytesIn = 0;
+  std::uintmax_t bytesOut = 0;
+  // CPU time spent transforming, added up across every thread that helped.
+  std::chrono::nanoseconds cpuTime{0};
+};
+
+// A stage between a file and a data connection which changes the data on its way
+// through, e.g. compressing it. Each transfer needs a Transform of its own.
+class Transform {
+public:
+  using OutputCallback = std::function<bool(std::string_view)>;
+
+  virtual ~Transform() =default;
+
+  // Transforms `input`, passing the output to `onOutput` in order, possibly some
+  // time later. `isFinal` marks the last input, and flushes anything held back.
+  // Returns false if the input is invalid, or if `onOutput` does.
+  virtual bool process(std::string_view input, bool isFinal, const OutputCallback &onOutput) =0;
+
+  virtual TransformStats stats() const =0;
+};
+
+// Compresses to gzip (RFC 1952). The input is cut into pieces, and up to
+// `numThreads` pieces at a time are compressed at once into gzip members of their
+// own, as pigz does. Any gzip decompressor reads the members back as one file.
+class GzipCompressor : public Transform {
+public:
+  // `level` is zlib's, from 1 (fastest) to 9 (smallest).
+  GzipCompressor(int level, size_t numThreads);
+
+  bool process(std::string_view input, bool isFinal, const OutputCallback &onOutput) override;
+
+  TransformStats stats() const override;
+
+private:
+  const int level_;
+  const size_t numThreads_;
+  // Input waiting to be compressed. Only the last piece may be partly filled.
+  std::vector<std::string> pieces_;
+  bool hasCompressed_;
+  TransformStats stats_;
+
+  bool compressPieces(const OutputCallback &onOutput);
+};
+
+// Decompresses gzip, including files made of several members.
+class GzipDecompressor : public Transform {
+public:
+  GzipDecompressor();
+
+  bool process(std::string_view input, bool isFinal, const OutputCallback &onOutput) override;
+
+  TransformStats stats() const override;
+
+private:
+  Inflater inflater_;
+  std::unique_ptr<char[]> output_;
+  TransformStats stats_;
+};
+
+}
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef SERVER_LOCALSERVER_H
+#define SERVER_LOCALSERVER_H
+
+#include <string>
+#include <optional>
+#include <filesystem>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+
+#include <boost/asio.hpp>
+
+#include "io/Listener.h"
+#include "io/Tls.h"
+
+namespace server
+{
+
+// Misbehaviour the server can be told to inject, so that tests can check
+// how the Client copes with it. Applies to every command received after
+// it is set.
+struct Faults
+{
+  // Close the data connection after this many bytes of a RETR, STOR or
+  // APPE, then reply 426 as if the connection had dropped.
+  std::optional<std::uintmax_t> truncateTransfersAfter;
+
+  // Send every reply in the multi-line form from RFC 959 section 4.2, with
+  // lines in between which could be mistaken for the end of the reply.
+  bool multilineReplies = false;
+
+  // Act as if commands take this long to reach the server, by not replying to one
+  // until this long after it arrived. Commands which arrive together, because they
+  // were pipelined, are delayed together.
+  std::chrono::milliseconds replyLatency{0};
+
+  // Send and receive file data no faster than this many bytes per second. Not
+  // applied in MODE Z.
+  std::optional<std::uintmax_t> bandwidthLimit;
+
+  // Replies to send instead of carrying out the command, by verb, e.g.
+  // {"FEAT", "502 Command not implemented."}.
+  std::unordered_map<std::string, std::string> errorReplies;
+};
+
+// A small FTP server which serves the files under a local directory on the
+// loopback interface. It accepts any username and password, and handles each
+// control connection on its own thread. Only image type is supported, in stream
+// mode or MODE Z. Data connections can be passive, or active with PORT or EPRT
+// so that one LocalServer can send to another in server-to-server transfers. It
+// understands every command the Client sends, so it can stand in for a real
+// server in tests, which then need nothing outside the process. It can also act
+// as an explicit FTPS server, with a certificate it makes for itself.
+class LocalServer
+{
+public:
+  explicit LocalServer(std::filesystem::path root);
+
+  // Stops the server if it's still running.
+  ~LocalServer();
+
+  LocalServer(const LocalServer &) =delete;
+  LocalServer(LocalServer &&) noexcept =delete;
+  LocalServer &operator=(const LocalServer &) =delete;
+  LocalServer &operator=(LocalServer &&) noexcept =delete;
+
+  // Starts listening on a free port and accepting connections in the background.
+  bool start();
+
+  // Stops accepting connections and disconnects every client.
+  void stop();
+
+  std::string host() const;
+
+  std::string port() const;
+
+  // Accepts AUTH TLS from now on, presenting a newly made self-signed certificate
+  // for the server's address. Like vsftpd's require_ssl_reuse, protected data
+  // connections are refused unless they resume a TLS session.
+  bool enableTls();
+
+  // The PEM certificate the server presents, for clients to trust. Empty until
+  // `enableTls` succeeds.
+  std::string certificate() const;
+
+  void setFaults(const Faults &faults);
+
+  Faults faults() const;
+
+  // How many times clients have sent the command `verb` (e.g. "TYPE") since
+  // the server was created.
+  std::size_t commandCount(const std::string &verb) const;
+
+private:
+
+  class Session;
+
+  const std::filesystem::path root_;
+  boost::asio::io_context ioContext_;
+  io::Listener listener_;
+  std::string port_;
+  std::thread acceptThread_;
+
+  // Guards everything below, which is shared with the session threads.
+  mutable std::mutex mutex_;
+  Faults faults_;
+  std::shared_ptr<io::TlsContext> tlsContext_;
+  std::string certificate_;
+  bool isStopping_;
+  std::vector<std::shared_ptr<Session>> sessions_;
+  std::vector<std::thread> sessionThreads_;
+  std::unordered_map<std::string, std::size_t> commandCounts_;
+
+  void acceptConnections();
+};
+
+}
+
+#endif
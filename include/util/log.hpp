@@ -0,0 +1,293 @@
+#ifndef UTIL_LOG_HPP
+#define UTIL_LOG_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <unistd.h>
+
+// Leveled logging which costs the calling thread as little as possible. Messages are
+// formatted where they are logged, then handed to a background thread through a
+// fixed-size lock-free ring buffer, and written to stderr from there. Logging never
+// blocks: if the buffer is full the message is dropped, and the number dropped is
+// reported later.
+//
+// Messages below LOG_MIN_LEVEL are compiled out, and their arguments are never
+// evaluated, e.g. `-DLOG_MIN_LEVEL=LOG_LEVEL_DEBUG` to see every reply. The default
+// leaves out debug messages. `util::log::setLevel` raises the bar further at run time.
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_AT(level, msg) \
+  do { \
+    if constexpr ((level) >= LOG_MIN_LEVEL) { \
+      if (::util::log::isEnabled(static_cast<::util::log::Level>(level))) { \
+        std::ostringstream logStream; \
+        logStream << msg; \
+        ::util::log::write(static_cast<::util::log::Level>(level), logStream.str()); \
+      } \
+    } \
+  } while (false)
+
+#define LOG_DEBUG(msg) LOG_AT(LOG_LEVEL_DEBUG, msg)
+#define LOG_INFO(msg) LOG_AT(LOG_LEVEL_INFO, msg)
+#define LOG_WARN(msg) LOG_AT(LOG_LEVEL_WARN, msg)
+#define LOG_ERROR(msg) LOG_AT(LOG_LEVEL_ERROR, msg)
+
+namespace util::log {
+
+enum class Level { Debug = LOG_LEVEL_DEBUG, Info = LOG_LEVEL_INFO, Warn = LOG_LEVEL_WARN, Error = LOG_LEVEL_ERROR };
+
+namespace detail {
+
+inline std::atomic<Level> runtimeLevel{static_cast<Level>(LOG_MIN_LEVEL)};
+
+inline void
+writeToStderr(std::string_view text)
+{
+  while (!text.empty()) {
+    const ssize_t n = ::write(STDERR_FILENO, text.data(), text.size());
+    if (n <= 0) {
+      return;
+    }
+    text.remove_prefix(static_cast<size_t>(n));
+  }
+}
+
+inline void
+appendLine(std::string &output, Level level, std::string_view message)
+{
+  switch (level) {
+    case Level::Debug: output += "[debug] "; break;
+    case Level::Warn: output += "[warn] "; break;
+    case Level::Error: output += "[error] "; break;
+    case Level::Info: break;
+  }
+  output.append(message).append("\n");
+}
+
+// A bounded queue for many producers and one consumer, after Dmitry Vyukov's. Each
+// slot's sequence number says whose turn it is: a producer may fill slot `i` on lap
+// `n` when it is `i + n * capacity`, and the consumer may empty it when it's one more.
+class RingBuffer
+{
+public:
+  // `capacity` must be a power of two.
+  explicit RingBuffer(size_t capacity)
+    : slots_(std::make_unique<Slot[]>(capacity)),
+      mask_(capacity - 1),
+      enqueuePos_(0),
+      dequeuePos_(0)
+  {
+    for (size_t i = 0; i < capacity; ++i) {
+      slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Returns false, leaving `message` alone, if the buffer is full.
+  bool
+  tryPush(Level level, std::string &message)
+  {
+    size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+    while (true) {
+      Slot &slot = slots_[pos & mask_];
+      const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+      const auto difference = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos);
+      if (difference == 0) {
+        if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          slot.level = level;
+          slot.message.swap(message);
+          slot.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (difference < 0) {
+        return false;
+      } else {
+        pos = enqueuePos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Only ever called from the one consumer thread. Appends the next message to
+  // `output`, if there is one.
+  bool
+  tryPop(std::string &output)
+  {
+    Slot &slot = slots_[dequeuePos_ & mask_];
+    if (slot.sequence.load(std::memory_order_acquire) != dequeuePos_ + 1) {
+      return false;
+    }
+    appendLine(output, slot.level, slot.message);
+    // Keep the string's storage for the next message in this slot.
+    slot.message.clear();
+    slot.sequence.store(dequeuePos_ + mask_ + 1, std::memory_order_release);
+    ++dequeuePos_;
+    return true;
+  }
+
+private:
+  struct Slot
+  {
+    std::atomic<size_t> sequence;
+    Level level = Level::Info;
+    std::string message;
+  };
+
+  const std::unique_ptr<Slot[]> slots_;
+  const size_t mask_;
+  // Apart, so that producers and the consumer don't fight over one cache line.
+  alignas(64) std::atomic<size_t> enqueuePos_;
+  alignas(64) size_t dequeuePos_;
+};
+
+class Logger
+{
+public:
+  static Logger &
+  instance()
+  {
+    // Never destroyed, so that threads which are still running at exit can keep
+    // logging. Whatever is left is written out by the atexit handler.
+    static Logger *logger = []() {
+      auto *newLogger = new Logger();
+      std::atexit([]() { instance().stop(); });
+      return newLogger;
+    }();
+    return *logger;
+  }
+
+  void
+  write(Level level, std::string &&message)
+  {
+    // Sequentially consistent with `stop`, so that either this sees that it has
+    // stopped or `stop` sees this in progress and waits for it.
+    numWriting_.fetch_add(1);
+    if (isStopped_.load()) {
+      std::string line;
+      appendLine(line, level, message);
+      writeToStderr(line);
+    } else if (!buffer_.tryPush(level, message)) {
+      numDropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+    numWriting_.fetch_sub(1, std::memory_order_release);
+  }
+
+  // Writes out everything logged so far, then writes synchronously from then on.
+  void
+  stop()
+  {
+    if (isStopping_.exchange(true)) {
+      return;
+    }
+    drainThread_.join();
+    isStopped_.store(true);
+    // Messages which were being pushed when it stopped would otherwise be left in
+    // the buffer. Any that start from now on are written synchronously.
+    while (numWriting_.load() != 0) {
+      std::this_thread::yield();
+    }
+    // Anything that arrived between the last drain and now.
+    drain();
+  }
+
+private:
+  static constexpr size_t CAPACITY = 8192;
+  // How long the drain thread sleeps, at most, when there's nothing to write.
+  static constexpr std::chrono::milliseconds MAX_IDLE_SLEEP{10};
+
+  RingBuffer buffer_;
+  std::atomic<std::uint64_t> numDropped_;
+  std::atomic<bool> isStopping_;
+  std::atomic<bool> isStopped_;
+  // Calls to `write` in progress.
+  std::atomic<size_t> numWriting_;
+  std::string batch_;
+  std::thread drainThread_;
+
+  Logger()
+    : buffer_(CAPACITY),
+      numDropped_(0),
+      isStopping_(false),
+      isStopped_(false),
+      numWriting_(0),
+      drainThread_([this]() { run(); })
+  { }
+
+  // Returns whether there was anything to write.
+  bool
+  drain()
+  {
+    batch_.clear();
+    while (buffer_.tryPop(batch_)) { }
+    if (const auto numDropped = numDropped_.exchange(0, std::memory_order_relaxed)) {
+      appendLine(batch_, Level::Warn, std::to_string(numDropped) + " log messages dropped because the log buffer was full.");
+    }
+    writeToStderr(batch_);
+    return !batch_.empty();
+  }
+
+  void
+  run()
+  {
+    // Back off while idle, so that an idle process doesn't keep waking up, but get
+    // straight back to it once messages arrive.
+    std::chrono::microseconds sleep(100);
+    while (!isStopping_.load(std::memory_order_acquire)) {
+      if (drain()) {
+        sleep = std::chrono::microseconds(100);
+      } else {
+        std::this_thread::sleep_for(sleep);
+        sleep = std::min<std::chrono::microseconds>(sleep * 2, MAX_IDLE_SLEEP);
+      }
+    }
+    drain();
+  }
+};
+
+}
+
+inline void
+setLevel(Level level)
+{
+  detail::runtimeLevel.store(level, std::memory_order_relaxed);
+}
+
+inline bool
+isEnabled(Level level)
+{
+  return level >= detail::runtimeLevel.load(std::memory_order_relaxed);
+}
+
+inline void
+write(Level level, std::string &&message)
+{
+  detail::Logger::instance().write(level, std::move(message));
+}
+
+// Waits for everything logged so far to be written, and writes synchronously from
+// then on. Called automatically at exit.
+inline void
+stop()
+{
+  detail::Logger::instance().stop();
+}
+
+}
+
+#endif
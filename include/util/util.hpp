@@ -1,8 +1,6 @@
 #ifndef UTIL_UTIL_HPP
 #define UTIL_UTIL_HPP
 
-#include <iostream>
-
-#define LOG(msg) std::cerr << msg << std::endl 
+#include "util/log.hpp"
 
 #endif
@@ -0,0 +1,205 @@
+#include "fsm/AsyncCommandFsm.h"
+
+#include <cassert>
+
+#include "fsm/CommandFsm.h"
+
+namespace {
+
+constexpr auto DELIM = "\r\n";
+
+// As with the blocking version, the reply's text is only valid until the next read.
+void
+asyncSendCommandAndReceiveReply(
+  io::Socket &controlSocket,
+  const std::string &command,
+  fsm::AsyncResult<std::optional<io::Reply>> onReply
+) {
+  controlSocket.asyncSendString(
+    command + DELIM,
+    [&controlSocket, onReply = std::move(onReply)](bool isSent) {
+      if (!isSent) {
+        onReply({});
+        return;
+      }
+      controlSocket.asyncReadReply(onReply);
+    }
+  );
+}
+
+// Sends the command and checks that the reply code starts with one of the digits in `expected`.
+void
+asyncSendCommandExpecting(
+  io::Socket &controlSocket,
+  const std::string &command,
+  const std::string &expected,
+  fsm::AsyncResult<bool> onComplete
+) {
+  asyncSendCommandAndReceiveReply(
+    controlSocket,
+    command,
+    [expected, onComplete = std::move(onComplete)](std::optional<io::Reply> reply) {
+      onComplete(reply && reply->kind() > 0 && expected.find(static_cast<char>('0' + reply->kind())) != std::string::npos);
+    }
+  );
+}
+
+}
+
+namespace fsm {
+
+void
+asyncOneStepFsm(
+  io::Socket &controlSocket,
+  const std::string &command,
+  AsyncResult<bool> onComplete
+) {
+  asyncSendCommandExpecting(controlSocket, command, "2", std::move(onComplete));
+}
+
+void
+asyncPasvFsm(
+  io::Socket &controlSocket,
+  AsyncResult<std::optional<std::pair<std::string, std::string>>> onComplete
+) {
+  asyncSendCommandAndReceiveReply(
+    controlSocket,
+    "PASV",
+    [onComplete = std::move(onComplete)](std::optional<io::Reply> reply) {
+      onComplete(reply ? parsePasvReply(reply->text) : std::nullopt);
+    }
+  );
+}
+
+void
+asyncSizeFsm(
+  io::Socket &controlSocket,
+  const std::string &path,
+  AsyncResult<std::optional<std::uintmax_t>> onComplete
+) {
+  asyncSendCommandAndReceiveReply(
+    controlSocket,
+    std::string("SIZE ") + path,
+    [onComplete = std::move(onComplete)](std::optional<io::Reply> reply) {
+      onComplete(reply ? parseSizeReply(reply->text) : std::nullopt);
+    }
+  );
+}
+
+void
+asyncDirectoryFsm(
+  io::Socket &controlSocket,
+  const std::optional<std::string> &path,
+  AsyncResult<std::optional<std::string>> onComplete
+) {
+  asyncSendCommandAndReceiveReply(
+    controlSocket,
+    path ? (std::string("MKD ") + *path) : std::string("PWD"),
+    [onComplete = std::move(onComplete)](std::optional<io::Reply> reply) {
+      onComplete(reply ? parseDirectoryReply(reply->text) : std::nullopt);
+    }
+  );
+}
+
+// See `twoStepFsm` for why a 1xx reply is required.
+void
+asyncTwoStepFsm(
+  io::Socket &controlSocket,
+  const std::string &command,
+  AsyncCallback onPreliminaryReply,
+  AsyncResult<bool> onComplete
+) {
+  asyncSendCommandAndReceiveReply(
+    controlSocket,
+    command,
+    [&controlSocket, onPreliminaryReply = std::move(onPreliminaryReply), onComplete = std::move(onComplete)](
+      std::optional<io::Reply> firstReply
+    ) {
+      if (!firstReply || firstReply->kind() != 1) {
+        onComplete(false);
+        return;
+      }
+
+      // Once the caller has finished with the data connection, the server
+      // will send the second reply unprompted.
+      onPreliminaryReply(std::string(firstReply->text), [&controlSocket, onComplete]() {
+        controlSocket.asyncReadReply([onComplete](std::optional<io::Reply> secondReply) {
+          onComplete(secondReply && secondReply->kind() == 2);
+        });
+      });
+    }
+  );
+}
+
+void
+asyncRenameFsm(
+  io::Socket &controlSocket,
+  const std::string &rnfrArgument,
+  const std::string &rntoArgument,
+  AsyncResult<bool> onComplete
+) {
+  // Should receive a 3xx reply, which is prompting us to send the RNTO.
+  asyncSendCommandExpecting(
+    controlSocket,
+    std::string("RNFR ") + rnfrArgument,
+    "3",
+    [&controlSocket, rntoArgument, onComplete = std::move(onComplete)](bool isPrompted) {
+      if (!isPrompted) {
+        onComplete(false);
+        return;
+      }
+      asyncSendCommandExpecting(controlSocket, std::string("RNTO ") + rntoArgument, "2", onComplete);
+    }
+  );
+}
+
+// Follows the same rules as `loginFsm`; see there for the reasoning. Never
+// pipelined, because async connections don't support TLS, so the reply to USER is
+// always waited for.
+void
+asyncLoginFsm(
+  io::Socket &controlSocket,
+  const std::string &username,
+  const std::optional<std::string> &password,
+  const std::optional<std::string> &account,
+  AsyncResult<bool> onComplete
+) {
+  assert(!account || password);
+
+  if (!password) {
+    asyncSendCommandExpecting(controlSocket, std::string("USER ") + username, "2", std::move(onComplete));
+    return;
+  }
+
+  asyncSendCommandExpecting(
+    controlSocket,
+    std::string("USER ") + username,
+    "23",
+    [&controlSocket, password, account, onComplete = std::move(onComplete)](bool isUserAccepted) {
+      if (!isUserAccepted) {
+        onComplete(false);
+        return;
+      }
+
+      if (!account) {
+        asyncSendCommandExpecting(controlSocket, std::string("PASS ") + *password, "2", onComplete);
+        return;
+      }
+
+      asyncSendCommandExpecting(
+        controlSocket,
+        std::string("PASS ") + *password,
+        "23",
+        [&controlSocket, account, onComplete](bool isPasswordAccepted) {
+          if (!isPasswordAccepted) {
+            onComplete(false);
+            return;
+          }
+          asyncSendCommandExpecting(controlSocket, std::string("ACCT ") + *account, "2", onComplete);
+        }
+      );
+    }
+  );
+}
+
+}
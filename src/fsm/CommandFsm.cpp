@@ -1,13 +1,94 @@
 #include "fsm/CommandFsm.h"
 
-#include <regex>
 #include <cassert>
+#include <array>
+#include <algorithm>
+#include <ctime>
+
+#include "util/util.hpp"
 
 namespace {
 
 constexpr auto DELIM = "\r\n";
 
+// How many pipelined commands to send before reading their replies. Small enough
+// that neither side's socket buffers can fill up with one window's worth.
+constexpr size_t PIPELINE_WINDOW = 64;
+
+bool
+isDigit(char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+// Eight hex digits, in either case.
+std::optional<std::uint32_t>
+parseCrc(std::string_view text)
+{
+  if (text.size() != 8) {
+    return {};
+  }
+  std::uint32_t crc = 0;
+  for (const char c : text) {
+    int digit;
+    if (isDigit(c)) {
+      digit = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      digit = c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      digit = c - 'A' + 10;
+    } else {
+      return {};
+    }
+    crc = crc * 16 + digit;
+  }
+  return crc;
+}
+
+// Reads the decimal number starting at `i`, leaving `i` just past it. Gives
+// up on numbers with more digits than any reply field should have.
+std::optional<unsigned>
+parseNumber(std::string_view text, size_t &i)
+{
+  const size_t start = i;
+  unsigned number = 0;
+  for (; i < text.size() && isDigit(text[i]); ++i) {
+    if (i - start == 5) {
+      return {};
+    }
+    number = number * 10 + (text[i] - '0');
+  }
+  if (i == start) {
+    return {};
+  }
+  return number;
+}
+
+// Parses a directory name in quotes from the start of `text`. Any quotes in the
+// name are doubled (RFC 959 appendix II), so a lone quote ends it.
 std::optional<std::string>
+parseQuotedDirectory(std::string_view text)
+{
+  if (text.empty() || text[0] != '"') {
+    return {};
+  }
+
+  std::string directory;
+  for (size_t i = 1; i < text.size(); ++i) {
+    if (text[i] != '"') {
+      directory += text[i];
+    } else if (i + 1 < text.size() && text[i + 1] == '"') {
+      directory += '"';
+      ++i;
+    } else {
+      return directory;
+    }
+  }
+  return {};
+}
+
+// The reply's text is only valid until the next read from the control socket.
+std::optional<io::Reply>
 sendCommandAndReceiveReply(io::Socket &controlSocket, const std::string &command)
 {
   const auto commandWithDelim(command + DELIM);
@@ -16,14 +97,7 @@ sendCommandAndReceiveReply(io::Socket &controlSocket, const std::string &command
     return {};
   }
 
-  const auto maybeResponse = controlSocket.readUntil(DELIM);
-  if (!maybeResponse || maybeResponse->size() < 3) {
-    return {};
-  }
-
-  // Note that the response must be at least three characters long,
-  // so it's safe for callers to check e.g. `response.substr(0,3) == "101"`.
-  return *maybeResponse;
+  return controlSocket.readReply();
 }
 
 }
@@ -35,87 +109,286 @@ oneStepFsm(
   io::Socket &controlSocket,
   const std::string &command
 ) {
-  if (auto reply = sendCommandAndReceiveReply(controlSocket, command)) {
-    return (*reply)[0] == '2';
-  } else {
-    return {};
-  }
+  const auto reply = sendCommandAndReceiveReply(controlSocket, command);
+  return reply && reply->kind() == 2;
 }
 
 std::optional<std::pair<std::string, std::string>>
 pasvFsm(io::Socket &controlSocket)
 {
   // Send the command wait for a response.
-  const auto maybeResponse = sendCommandAndReceiveReply(controlSocket, std::string("PASV") + DELIM);
+  const auto maybeResponse = sendCommandAndReceiveReply(controlSocket, "PASV");
   if (!maybeResponse) {
     return {};
   }
-  const auto &response = *maybeResponse;
+  return parsePasvReply(maybeResponse->text);
+}
 
+std::optional<std::string>
+epsvFsm(io::Socket &controlSocket)
+{
+  const auto maybeResponse = sendCommandAndReceiveReply(controlSocket, "EPSV");
+  if (!maybeResponse) {
+    return {};
+  }
+  return parseEpsvReply(maybeResponse->text);
+}
+
+bool
+portFsm(io::Socket &controlSocket, const std::string &host, const std::string &port)
+{
+  std::string command;
+  if (host.find(':') == std::string::npos) {
+    // `PORT h1,h2,h3,h4,p1,p2`, the same format as the address in a PASV reply.
+    std::string hostWithCommas(host);
+    std::replace(hostWithCommas.begin(), hostWithCommas.end(), '.', ',');
+    const unsigned portNumber = std::stoul(port);
+    command = "PORT " + hostWithCommas + "," + std::to_string(portNumber / 256) + "," + std::to_string(portNumber % 256);
+  } else {
+    command = "EPRT |2|" + host + "|" + port + "|";
+  }
+  const auto reply = sendCommandAndReceiveReply(controlSocket, command);
+  return reply && reply->kind() == 2;
+}
+
+std::optional<std::pair<std::string, std::string>>
+parsePasvReply(std::string_view response)
+{
   // Check that we got a positive response. If so, we can parse it for connection information.
-  if (response.substr(0, 3) != "227") {
+  if (response.substr(0, 4) != "227 " && response.substr(0, 4) != "227-") {
     // The PASV request failed so there won't be any connection information.
     return {};
   }
 
-  // Regex for finding the connection information. Usually it's also wrapped in perenthesis
-  // but according to RFC1123 section 4.1.2.6 we can't rely on that (or even that
-  // it's comma-separated, but we will assume so here).
-  const std::regex portRegex(
-    R"((\d+),(\d+),(\d+),(\d+),(\d+),(\d+))"
-  );
-
-  // Look for a match where all the sub-groups also matched.
-  std::smatch matches;
-  if (std::regex_search(response, matches, portRegex) && matches.size() == 7
-        && matches[1].matched && matches[2].matched && matches[3].matched
-        && matches[4].matched && matches[5].matched && matches[6].matched
-  ) {
-    std::string host(matches[1].str() + "." + matches[2].str() + "." + matches[3].str() + "." + matches[4].str());
+  // Usually the connection information is wrapped in parentheses but according to
+  // RFC1123 section 4.1.2.6 we can't rely on that (or even that it's comma-separated,
+  // but we will assume so here). So take the first six comma-separated numbers.
+  for (size_t start = 4; start < response.size(); ++start) {
+    if (!isDigit(response[start]) || isDigit(response[start - 1])) {
+      continue;
+    }
+
+    std::array<unsigned, 6> numbers;
+    size_t i = start;
+    size_t count = 0;
+    while (count < numbers.size()) {
+      const auto maybeNumber = parseNumber(response, i);
+      if (!maybeNumber) {
+        break;
+      }
+      numbers[count++] = *maybeNumber;
+      if (count < numbers.size()) {
+        if (i >= response.size() || response[i] != ',') {
+          break;
+        }
+        ++i;
+      }
+    }
+    if (count < numbers.size()) {
+      continue;
+    }
+
+    if (std::any_of(numbers.begin(), numbers.end(), [](unsigned n) { return n > 255; })) {
+      LOG_WARN("Malformed PASV reply, number out of range: " << response);
+      return {};
+    }
+
+    // These all fit in the strings' small buffers, so nothing is allocated.
+    std::string host = std::to_string(numbers[0]);
+    for (size_t n = 1; n < 4; ++n) {
+      host += '.';
+      host += std::to_string(numbers[n]);
+    }
     // 5th and 6th parts are the upper and lower eight bits of the port number.
-    // Convert them to ints, combine them into one value, then convert back to a string.
-    std::string port = std::to_string(std::stoi(matches[5]) * 256 + std::stoi(matches[6]));
+    std::string port = std::to_string(numbers[4] * 256 + numbers[5]);
     return std::make_pair(std::move(host), std::move(port));
-  } else {
-    // No matches. Can't find the connection information.
-    return {};
   }
+
+  // Can't find the connection information.
+  LOG_WARN("Malformed PASV reply, no address found: " << response);
+  return {};
 }
 
 std::optional<std::string>
-directoryFsm(io::Socket &controlSocket, const std::optional<std::string> &path)
+parseEpsvReply(std::string_view response)
 {
-  const std::string command = (path ? (std::string("MKD ") + *path) : std::string("PWD")) + DELIM;
-  const auto response = sendCommandAndReceiveReply(controlSocket, command);
+  if (response.substr(0, 4) != "229 " && response.substr(0, 4) != "229-") {
+    return {};
+  }
+
+  // RFC 2428 section 3: the port is wrapped as `(<d><d><d><port><d>)`, where
+  // <d> is any printable character, used consistently.
+  const auto open = response.find('(');
+  if (open == std::string_view::npos || response.size() < open + 6) {
+    LOG_WARN("Malformed EPSV reply, no port found: " << response);
+    return {};
+  }
+  const char delim = response[open + 1];
+  if (delim < 33 || delim > 126 || response[open + 2] != delim || response[open + 3] != delim) {
+    LOG_WARN("Malformed EPSV reply, bad delimiters: " << response);
+    return {};
+  }
+
+  size_t i = open + 4;
+  const auto maybePort = parseNumber(response, i);
+  if (!maybePort || *maybePort == 0 || *maybePort > 65535
+        || i + 1 >= response.size() || response[i] != delim || response[i + 1] != ')') {
+    LOG_WARN("Malformed EPSV reply, bad port: " << response);
+    return {};
+  }
+  return std::to_string(*maybePort);
+}
+
+std::optional<std::uintmax_t>
+sizeFsm(io::Socket &controlSocket, const std::string &path)
+{
+  const auto response = sendCommandAndReceiveReply(controlSocket, std::string("SIZE ") + path);
   if (!response) {
     return {};
   }
+  return parseSizeReply(response->text);
+}
 
-  if (response->substr(0, 3) != "257") {
-    // Response indicates failure.
+std::optional<std::uintmax_t>
+parseSizeReply(std::string_view response)
+{
+  if (response.substr(0, 4) != "213 ") {
+    return {};
+  }
+
+  // The response should be of the form `213<sp><size>`, with nothing after the size.
+  std::uintmax_t size = 0;
+  size_t i = 4;
+  for (; i < response.size() && isDigit(response[i]); ++i) {
+    size = size * 10 + (response[i] - '0');
+  }
+  if (i == 4 || i != response.size()) {
     return {};
   }
+  return size;
+}
 
-  // The response should be of the form `257<sp>"<dir>"[<other stuff>]\r\n`
-  // Use regex to extract the part between the quotes.
-  // TODO: how to handle "quote doubling" convention, or other possible conventions for nested
-  //   qoutations (e.g. escape characters) without accidentally grabbing too much?
+bool
+restFsm(io::Socket &controlSocket, std::uintmax_t offset)
+{
+  // The server should tell us to continue with the transfer command.
+  const auto reply = sendCommandAndReceiveReply(controlSocket, std::string("REST ") + std::to_string(offset));
+  return reply && reply->kind() == 3;
+}
+
+std::optional<std::uint32_t>
+xcrcFsm(io::Socket &controlSocket, const std::string &path)
+{
+  const auto response = sendCommandAndReceiveReply(controlSocket, std::string("XCRC ") + path);
+  if (!response) {
+    return {};
+  }
+  return parseXcrcReply(response->text);
+}
 
-  // Note we match the longest substring which is inside quotes. That should handle any nested
-  // quoting but may cause problems if there are quotes elsewhere in the message.
-  const std::regex regex(
-    R"(257 \"(.*)\".*)"
+std::optional<std::uint32_t>
+hashCrcFsm(io::Socket &controlSocket, const std::string &path)
+{
+  // If OPTS fails, HASH uses some other algorithm, which the parser rejects.
+  std::optional<std::uint32_t> crc;
+  pipelineFsm(
+    controlSocket,
+    {"OPTS HASH CRC32", std::string("HASH ") + path},
+    [&crc](size_t i, const std::optional<io::Reply> &reply) {
+      if (i == 1 && reply) {
+        crc = parseHashCrcReply(reply->text);
+      }
+    }
   );
+  return crc;
+}
 
-  std::smatch matches;
-  if (std::regex_search(*response, matches, regex) && matches.size() == 2) {
-    return matches[1].str();
-  } else {
-    // No matches so can't return the path to the directory. Note that we are returning
-    // a null optional here but we did successfully create the directory. In other words,
-    // a null response doesn't imply that the operation failed.
+std::optional<ListingEntry>
+mlstFsm(io::Socket &controlSocket, const std::string &path)
+{
+  const auto response = sendCommandAndReceiveReply(controlSocket, std::string("MLST ") + path);
+  if (!response) {
     return {};
   }
+  return parseMlstReply(response->text);
+}
+
+std::optional<std::vector<std::string>>
+featFsm(io::Socket &controlSocket)
+{
+  const auto response = sendCommandAndReceiveReply(controlSocket, "FEAT");
+  if (!response) {
+    return {};
+  }
+  return parseFeatReply(response->text);
+}
+
+std::optional<std::vector<std::string>>
+parseFeatReply(std::string_view response)
+{
+  if (response.substr(0, 1) == "5") {
+    // Command not recognised, i.e. no extensions.
+    return std::vector<std::string>();
+  }
+  if (response.substr(0, 4) != "211-" && response.substr(0, 4) != "211 ") {
+    return {};
+  }
+
+  // The features are listed one per line, each starting with a space, between
+  // the first and last lines (RFC 2389 section 3.2). A single line reply has none.
+  std::vector<std::string> features;
+  size_t lineStart = response.find(DELIM);
+  while (lineStart != std::string_view::npos) {
+    lineStart += 2;
+    const auto lineEnd = response.find(DELIM, lineStart);
+    const auto line = response.substr(lineStart, lineEnd == std::string_view::npos ? lineEnd : lineEnd - lineStart);
+    if (!line.empty() && line[0] == ' ') {
+      auto feature = line.substr(1);
+      while (!feature.empty() && feature.back() == ' ') {
+        feature.remove_suffix(1);
+      }
+      features.emplace_back(feature);
+    }
+    lineStart = lineEnd;
+  }
+  return features;
+}
+
+std::optional<std::string>
+directoryFsm(io::Socket &controlSocket, const std::optional<std::string> &path)
+{
+  const std::string command = path ? (std::string("MKD ") + *path) : std::string("PWD");
+  const auto response = sendCommandAndReceiveReply(controlSocket, command);
+  if (!response) {
+    return {};
+  }
+  return parseDirectoryReply(response->text);
+}
+
+std::optional<std::string>
+parseDirectoryReply(std::string_view response)
+{
+  if (response.substr(0, 4) != "257 " && response.substr(0, 4) != "257-") {
+    // Response indicates failure.
+    return {};
+  }
+
+  // The response should be of the form `257<sp>"<dir>"[<other stuff>]`. In a multi-line
+  // reply, the directory may be on the last line instead.
+  // Note that when we return a null optional for a malformed reply, the command did
+  // still succeed. In other words, a null response doesn't imply that the operation failed.
+  if (auto directory = parseQuotedDirectory(response.substr(4))) {
+    return directory;
+  }
+  const auto lastLine = response.rfind(DELIM);
+  if (lastLine != std::string_view::npos) {
+    if (auto directory = parseQuotedDirectory(response.substr(lastLine + 2).substr(4))) {
+      return directory;
+    }
+  }
+
+  LOG_WARN("Malformed directory reply, no quoted directory found: " << response);
+  return {};
 }
 
 // Note: for this Fsm, RFC 959 says "[these commands] expect
@@ -132,19 +405,157 @@ twoStepFsm(
   // Send the command, after which we should be told to wait.
   const auto firstReply = sendCommandAndReceiveReply(controlSocket, command);
   // As explained above, assume we will receive a 1xx reply.
-  if (!firstReply || (*firstReply)[0] != '1') {
+  if (!firstReply || firstReply->kind() != 1) {
     return {};
   }
 
   // Let the caller know we received a 1xx; they may need to
   // do something with a data connection.
-  onPreliminaryReply();
+  onPreliminaryReply(std::string(firstReply->text));
 
   // Server will send the second reply unprompted. For commands
   // that use a data connection, the reply comes when that
   // connection is closed.
-  const auto secondReply = controlSocket.readUntil(DELIM);
-  return secondReply && secondReply->size() > 0 && (*secondReply)[0] == '2';
+  const auto secondReply = controlSocket.readReply();
+  return secondReply && secondReply->kind() == 2;
+}
+
+std::optional<std::uintmax_t>
+parseTransferSize(std::string_view preliminaryReply)
+{
+  // Look for the last `(<digits> bytes)` in the reply. Not all servers send this
+  // (it isn't part of RFC 959), so a missing or malformed size just means unknown.
+  const auto open = preliminaryReply.rfind('(');
+  if (open == std::string_view::npos) {
+    return {};
+  }
+
+  std::uintmax_t size = 0;
+  size_t i = open + 1;
+  const size_t firstDigit = i;
+  for (; i < preliminaryReply.size() && isDigit(preliminaryReply[i]); ++i) {
+    size = size * 10 + (preliminaryReply[i] - '0');
+  }
+
+  // Need at least one digit, and for the number to be followed by the unit.
+  if (i == firstDigit || preliminaryReply.substr(i, 7) != " bytes)") {
+    return {};
+  }
+  return size;
+}
+
+void
+pipelineFsm(
+  io::Socket &controlSocket,
+  const std::vector<std::string> &commands,
+  const PipelineCallback &onReply
+) {
+  size_t numReplied = 0;
+  std::string batch;
+  while (numReplied < commands.size()) {
+    // Write a window of commands at once, then read their replies. Sending everything
+    // up front could deadlock: the server stops reading while its replies back up
+    // unread, and then we can't finish writing.
+    const size_t windowEnd = std::min(commands.size(), numReplied + PIPELINE_WINDOW);
+    batch.clear();
+    for (size_t i = numReplied; i < windowEnd; ++i) {
+      batch.append(commands[i]).append(DELIM);
+    }
+    const bool isSent = controlSocket.sendString(batch) == batch.size();
+
+    for (; numReplied < windowEnd; ++numReplied) {
+      const auto reply = isSent ? controlSocket.readReply() : std::nullopt;
+      if (!reply) {
+        // The connection has failed, so none of the rest will get replies.
+        for (; numReplied < commands.size(); ++numReplied) {
+          onReply(numReplied, std::nullopt);
+        }
+        return;
+      }
+      onReply(numReplied, reply);
+    }
+  }
+}
+
+std::optional<std::chrono::system_clock::time_point>
+parseMdtmReply(std::string_view response)
+{
+  if (response.substr(0, 4) != "213 ") {
+    return {};
+  }
+  const auto time = parseTimeVal(response.substr(4));
+  if (!time) {
+    LOG_WARN("Malformed MDTM reply: " << response);
+  }
+  return time;
+}
+
+std::optional<std::uint32_t>
+parseXcrcReply(std::string_view response)
+{
+  if (response.substr(0, 4) != "250 ") {
+    return {};
+  }
+  const auto crc = parseCrc(response.substr(4, response.find(' ', 4) - 4));
+  if (!crc) {
+    LOG_WARN("Malformed XCRC reply: " << response);
+  }
+  return crc;
+}
+
+std::optional<std::uint32_t>
+parseHashCrcReply(std::string_view response)
+{
+  // `213 <algorithm> <start>-<end> <hash> <path>`.
+  if (response.substr(0, 4) != "213 ") {
+    return {};
+  }
+  std::array<std::string_view, 3> fields;
+  size_t start = 4;
+  for (auto &field : fields) {
+    if (start >= response.size()) {
+      return {};
+    }
+    const auto end = std::min(response.find(' ', start), response.size());
+    field = response.substr(start, end - start);
+    start = end + 1;
+  }
+  if (fields[0] != "CRC32") {
+    return {};
+  }
+  const auto crc = parseCrc(fields[2]);
+  if (!crc) {
+    LOG_WARN("Malformed HASH reply: " << response);
+  }
+  return crc;
+}
+
+std::optional<std::chrono::system_clock::time_point>
+parseTimeVal(std::string_view timeVal)
+{
+  if (timeVal.size() < 14) {
+    return {};
+  }
+  const auto digits = timeVal.substr(0, 14);
+  if (!std::all_of(digits.begin(), digits.end(), isDigit)) {
+    return {};
+  }
+  const auto field = [&digits](size_t start, size_t length) {
+    int value = 0;
+    for (size_t i = start; i < start + length; ++i) {
+      value = value * 10 + (digits[i] - '0');
+    }
+    return value;
+  };
+
+  std::tm time{};
+  time.tm_year = field(0, 4) - 1900;
+  time.tm_mon = field(4, 2) - 1;
+  time.tm_mday = field(6, 2);
+  time.tm_hour = field(8, 2);
+  time.tm_min = field(10, 2);
+  time.tm_sec = field(12, 2);
+  return std::chrono::system_clock::from_time_t(timegm(&time));
 }
 
 bool
@@ -155,18 +566,18 @@ renameFsm(
 ) {
   const auto firstReply = sendCommandAndReceiveReply(
     controlSocket,
-    std::string("RNFR ") + rnfrArgument + DELIM
+    std::string("RNFR ") + rnfrArgument
   );
-  if (!firstReply || (*firstReply)[0] != '3') {
+  if (!firstReply || firstReply->kind() != 3) {
     // Should receive a 3xx reply, which is prompting us to send the RNTO.
     return false;
   }
 
   const auto secondReply = sendCommandAndReceiveReply(
     controlSocket,
-    std::string("RNTO ") + rntoArgument + DELIM
+    std::string("RNTO ") + rntoArgument
   );
-  return secondReply && (*secondReply)[0] == '2';
+  return secondReply && secondReply->kind() == 2;
 }
 
 bool
@@ -174,55 +585,67 @@ loginFsm(
   io::Socket &controlSocket,
   const std::string &username,
   const std::optional<std::reference_wrapper<const std::string>> &maybePassword,
-  const std::optional<std::reference_wrapper<const std::string>> &maybeAccount
+  const std::optional<std::reference_wrapper<const std::string>> &maybeAccount,
+  bool isPipelined
 ) {
   // It's not possible to provide an account without providing a password.
   // The RFC 959 login FSM does not support it.
   assert(!maybeAccount || maybePassword);
 
-  // Send username and check for errors.
-  const auto userReply = sendCommandAndReceiveReply(
-    controlSocket,
-    std::string("USER ") + username + DELIM
-  );
-  if (!userReply) {
-    return false;
+  // If no password specified, there's only the username to send. If we get
+  // 2xx response, login succeeded with just username. Otherwise, fail
+  // because password is required.
+  if (!maybePassword) {
+    const auto userReply = sendCommandAndReceiveReply(
+      controlSocket,
+      std::string("USER ") + username
+    );
+    return userReply && userReply->kind() == 2;
   }
 
-  const auto userReplyCode = (*userReply)[0];
-
-  // If no password specified and we get 2xx response, login succeeded
-  // with just username. Otherwise, fail because password is required.
-  if (!maybePassword) {
-    return userReplyCode == '2';
-  } 
-  
   // If there is a password, send it, even if we got 2xx response.
   // This is against what the RFC FSM says but we want to be consistent
   // with the ACCT case below, and it's unlikely for a server to
   // reject a passworded login if it is willing to accept the same
   // login without a password.
-
-  if (userReplyCode != '2' && userReplyCode != '3') {
-    return false;
-  }
+  // That means the reply to USER only decides whether to send the password.
+  // A server can refuse the user for reasons that make sending the password
+  // a mistake, e.g. with 530 because it requires TLS, so normally we wait for
+  // it. Once the connection is encrypted there's nothing to lose by sending
+  // both together: a server which rejects USER rejects the PASS that follows
+  // too, so the outcome is the same but we save a round trip.
 
   const std::string &password = *maybePassword;
-  const auto passwordReply = sendCommandAndReceiveReply(
-    controlSocket,
-    std::string("PASS ") + password + DELIM
-  );
-  if (!passwordReply) {
+  std::optional<int> userReplyKind, passwordReplyKind;
+  if (isPipelined) {
+    pipelineFsm(
+      controlSocket,
+      {std::string("USER ") + username, std::string("PASS ") + password},
+      [&userReplyKind, &passwordReplyKind](size_t i, const std::optional<io::Reply> &reply) {
+        (i == 0 ? userReplyKind : passwordReplyKind) = reply ? std::make_optional(reply->kind()) : std::nullopt;
+      }
+    );
+  } else {
+    const auto userReply = sendCommandAndReceiveReply(controlSocket, std::string("USER ") + username);
+    if (userReply) {
+      userReplyKind = userReply->kind();
+    }
+    if (userReplyKind && (*userReplyKind == 2 || *userReplyKind == 3)) {
+      const auto passwordReply = sendCommandAndReceiveReply(controlSocket, std::string("PASS ") + password);
+      if (passwordReply) {
+        passwordReplyKind = passwordReply->kind();
+      }
+    }
+  }
+  if (!userReplyKind || (*userReplyKind != 2 && *userReplyKind != 3) || !passwordReplyKind) {
     return false;
   }
 
-  const auto passwordReplyCode = (*passwordReply)[0];
-
   // If no account info and 2xx reply, login succeeded
   // with username and password. Otherwise, fail because
   // account info required
   if (!maybeAccount) {
-    return passwordReplyCode == '2';
+    return *passwordReplyKind == 2;
   }
 
   // If there is account info, send it, even if the server
@@ -238,19 +661,19 @@ loginFsm(
   // they need to provide account information, and
   // send it immediately if it's provided.
 
-  if (passwordReplyCode != '2' && passwordReplyCode != '3') {
+  if (*passwordReplyKind != 2 && *passwordReplyKind != 3) {
     return false;
   }
 
   const std::string &accountInfo = *maybeAccount;
   const auto acctReply = sendCommandAndReceiveReply(
     controlSocket,
-    std::string("ACCT ") + accountInfo + DELIM
+    std::string("ACCT ") + accountInfo
   );
 
   // No more commands to send now, so succeed if the final one succeeded.
   // In this case, login succeeded with username, password and account info.
-  return acctReply && (*acctReply)[0] == '2';
+  return acctReply && acctReply->kind() == 2;
 }
 
 }
@@ -0,0 +1,368 @@
+#include "fsm/ListingParser.h"
+
+#include <array>
+#include <ctime>
+#include <limits>
+
+#include "fsm/CommandFsm.h"
+#include "util/util.hpp"
+
+namespace fsm {
+
+namespace {
+
+using TimePoint = std::chrono::system_clock::time_point;
+
+bool
+isDigit(char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+char
+toLower(char c)
+{
+  return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+// `lowerCase` must already be in lower case.
+bool
+equalsIgnoringCase(std::string_view text, std::string_view lowerCase)
+{
+  if (text.size() != lowerCase.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (toLower(text[i]) != lowerCase[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool
+startsWithIgnoringCase(std::string_view text, std::string_view lowerCase)
+{
+  return equalsIgnoringCase(text.substr(0, lowerCase.size()), lowerCase);
+}
+
+std::optional<std::uintmax_t>
+parseNumber(std::string_view text)
+{
+  if (text.empty()) {
+    return {};
+  }
+  std::uintmax_t number = 0;
+  for (const char c : text) {
+    if (!isDigit(c) || number > (std::numeric_limits<std::uintmax_t>::max() - 9) / 10) {
+      return {};
+    }
+    number = number * 10 + (c - '0');
+  }
+  return number;
+}
+
+// Returns the next run of non-space characters, and moves `rest` to just after it.
+std::string_view
+nextToken(std::string_view &rest)
+{
+  const auto start = rest.find_first_not_of(' ');
+  if (start == std::string_view::npos) {
+    rest = {};
+    return {};
+  }
+  rest.remove_prefix(start);
+  const auto end = std::min(rest.find(' '), rest.size());
+  const auto token = rest.substr(0, end);
+  rest.remove_prefix(end);
+  return token;
+}
+
+std::optional<TimePoint>
+makeTime(int year, int month, int day, int hour, int minute)
+{
+  if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59) {
+    return {};
+  }
+  std::tm time{};
+  time.tm_year = year - 1900;
+  time.tm_mon = month - 1;
+  time.tm_mday = day;
+  time.tm_hour = hour;
+  time.tm_min = minute;
+  return std::chrono::system_clock::from_time_t(timegm(&time));
+}
+
+// Returns 1 for "Jan" up to 12 for "Dec".
+std::optional<int>
+parseMonth(std::string_view text)
+{
+  constexpr std::array<std::string_view, 12> MONTHS{
+    "jan", "feb", "mar", "apr", "may", "jun", "jul", "aug", "sep", "oct", "nov", "dec"
+  };
+  for (size_t i = 0; i < MONTHS.size(); ++i) {
+    if (equalsIgnoringCase(text, MONTHS[i])) {
+      return static_cast<int>(i) + 1;
+    }
+  }
+  return {};
+}
+
+// Parses `HH:MM`, optionally followed by AM or PM. Returns hours and minutes.
+std::optional<std::pair<int, int>>
+parseClockTime(std::string_view text)
+{
+  const auto colon = text.find(':');
+  if (colon == std::string_view::npos || colon == 0 || colon > 2 || text.size() < colon + 3) {
+    return {};
+  }
+  const auto hour = parseNumber(text.substr(0, colon));
+  const auto minute = parseNumber(text.substr(colon + 1, 2));
+  const auto suffix = text.substr(colon + 3);
+  if (!hour || !minute) {
+    return {};
+  }
+  int hours = static_cast<int>(*hour);
+  if (equalsIgnoringCase(suffix, "pm") || equalsIgnoringCase(suffix, "am")) {
+    if (hours < 1 || hours > 12) {
+      return {};
+    }
+    hours = hours % 12 + (toLower(suffix[0]) == 'p' ? 12 : 0);
+  } else if (!suffix.empty()) {
+    return {};
+  }
+  return std::make_pair(hours, static_cast<int>(*minute));
+}
+
+void
+resetEntry(ListingEntry &entry)
+{
+  entry.name.clear();
+  entry.type = ListingEntry::Type::Other;
+  entry.size.reset();
+  entry.modifyTime.reset();
+  entry.perm.clear();
+  entry.unique.clear();
+}
+
+// The date and time part of a Unix listing line: `Jan 31 12:00` for recent files,
+// or `Jan 31 2020` for others. Returns the time, and moves `rest` past it.
+std::optional<TimePoint>
+parseUnixTime(std::string_view &rest, TimePoint now)
+{
+  const auto month = parseMonth(nextToken(rest));
+  const auto day = parseNumber(nextToken(rest));
+  const auto yearOrTime = nextToken(rest);
+  if (!month || !day) {
+    return {};
+  }
+
+  if (const auto clockTime = parseClockTime(yearOrTime)) {
+    // Recent, so within the last year. Allow a day's leeway for clocks which disagree.
+    const std::time_t nowTime = std::chrono::system_clock::to_time_t(now);
+    std::tm nowTm;
+    gmtime_r(&nowTime, &nowTm);
+    const int thisYear = nowTm.tm_year + 1900;
+    auto time = makeTime(thisYear, *month, static_cast<int>(*day), clockTime->first, clockTime->second);
+    if (time && *time > now + std::chrono::hours(24)) {
+      time = makeTime(thisYear - 1, *month, static_cast<int>(*day), clockTime->first, clockTime->second);
+    }
+    return time;
+  }
+
+  const auto year = parseNumber(yearOrTime);
+  if (!year || yearOrTime.size() != 4) {
+    return {};
+  }
+  return makeTime(static_cast<int>(*year), *month, static_cast<int>(*day), 0, 0);
+}
+
+// `drwxr-xr-x 2 owner group 4096 Jan 31 12:00 name`. Some servers leave out the
+// group, or the link count, so the size is taken to be whatever comes just
+// before the date.
+bool
+parseUnixListEntry(std::string_view line, ListingEntry &entry, TimePoint now)
+{
+  std::string_view rest = line;
+  const auto mode = nextToken(rest);
+  if (mode.size() < 10) {
+    return false;
+  }
+  switch (mode[0]) {
+    case '-': entry.type = ListingEntry::Type::File; break;
+    case 'd': entry.type = ListingEntry::Type::Directory; break;
+    case 'l': entry.type = ListingEntry::Type::Link; break;
+    case 'b': case 'c': case 'p': case 's': entry.type = ListingEntry::Type::Other; break;
+    default: return false;
+  }
+
+  // Up to four fields (links, owner, group, size) come before the date.
+  std::string_view previous;
+  for (int i = 0; i < 5; ++i) {
+    std::string_view afterDate = rest;
+    const auto modifyTime = parseUnixTime(afterDate, now);
+    const auto size = parseNumber(previous);
+    if (modifyTime && size && afterDate.size() > 1 && afterDate[0] == ' ') {
+      // Exactly one space separates the date from the name, which may contain more.
+      std::string_view name = afterDate.substr(1);
+      if (entry.type == ListingEntry::Type::Link) {
+        name = name.substr(0, name.find(" -> "));
+      }
+      if (name.empty()) {
+        return false;
+      }
+      entry.name.assign(name);
+      entry.modifyTime = modifyTime;
+      if (entry.type == ListingEntry::Type::File) {
+        entry.size = size;
+      }
+      return true;
+    }
+    previous = nextToken(rest);
+    if (previous.empty()) {
+      return false;
+    }
+  }
+  return false;
+}
+
+// `01-31-20  12:00PM       <DIR>          name` or
+// `01-31-2020  12:00PM              2050 name`.
+bool
+parseDosListEntry(std::string_view line, ListingEntry &entry)
+{
+  std::string_view rest = line;
+  const auto date = nextToken(rest);
+  const auto clockTime = parseClockTime(nextToken(rest));
+  const auto sizeOrDir = nextToken(rest);
+  const auto nameStart = rest.find_first_not_of(' ');
+  if ((date.size() != 8 && date.size() != 10) || date[2] != '-' || date[5] != '-'
+    || !clockTime || sizeOrDir.empty() || nameStart == std::string_view::npos
+  ) {
+    return false;
+  }
+  const auto month = parseNumber(date.substr(0, 2));
+  const auto day = parseNumber(date.substr(3, 2));
+  auto year = parseNumber(date.substr(6));
+  if (!month || !day || !year) {
+    return false;
+  }
+  if (date.size() == 8) {
+    // Two digit years are 1970 to 2069.
+    *year += *year < 70 ? 2000 : 1900;
+  }
+
+  if (sizeOrDir == "<DIR>") {
+    entry.type = ListingEntry::Type::Directory;
+  } else if (const auto size = parseNumber(sizeOrDir)) {
+    entry.type = ListingEntry::Type::File;
+    entry.size = size;
+  } else {
+    return false;
+  }
+  entry.name.assign(rest.substr(nameStart));
+  entry.modifyTime = makeTime(
+    static_cast<int>(*year), static_cast<int>(*month), static_cast<int>(*day),
+    clockTime->first, clockTime->second
+  );
+  return true;
+}
+
+std::string_view
+withoutLineEnding(std::string_view line)
+{
+  while (!line.empty() && (line.back() == '\r' || line.back() == '\n')) {
+    line.remove_suffix(1);
+  }
+  return line;
+}
+
+}
+
+bool
+parseMlsxEntry(std::string_view line, ListingEntry &entry)
+{
+  line = withoutLineEnding(line);
+  // RFC 3659 section 7.2: the facts, each ending in a semicolon, then a space and the name.
+  const auto space = line.find(' ');
+  if (space == std::string_view::npos || space + 1 == line.size()) {
+    return false;
+  }
+  std::string_view facts = line.substr(0, space);
+  resetEntry(entry);
+  entry.name.assign(line.substr(space + 1));
+
+  while (!facts.empty()) {
+    const auto end = std::min(facts.find(';'), facts.size());
+    const auto fact = facts.substr(0, end);
+    facts.remove_prefix(std::min(end + 1, facts.size()));
+
+    const auto equals = fact.find('=');
+    if (equals == std::string_view::npos) {
+      continue;
+    }
+    const auto factName = fact.substr(0, equals);
+    const auto value = fact.substr(equals + 1);
+
+    if (equalsIgnoringCase(factName, "type")) {
+      if (equalsIgnoringCase(value, "file")) {
+        entry.type = ListingEntry::Type::File;
+      } else if (equalsIgnoringCase(value, "dir")) {
+        entry.type = ListingEntry::Type::Directory;
+      } else if (equalsIgnoringCase(value, "cdir")) {
+        entry.type = ListingEntry::Type::CurrentDirectory;
+      } else if (equalsIgnoringCase(value, "pdir")) {
+        entry.type = ListingEntry::Type::ParentDirectory;
+      } else if (startsWithIgnoringCase(value, "os.unix=slink") || startsWithIgnoringCase(value, "os.unix=symlink")) {
+        entry.type = ListingEntry::Type::Link;
+      } else {
+        entry.type = ListingEntry::Type::Other;
+      }
+    } else if (equalsIgnoringCase(factName, "size")) {
+      entry.size = parseNumber(value);
+    } else if (equalsIgnoringCase(factName, "modify")) {
+      entry.modifyTime = parseTimeVal(value);
+    } else if (equalsIgnoringCase(factName, "perm")) {
+      entry.perm.assign(value);
+    } else if (equalsIgnoringCase(factName, "unique")) {
+      entry.unique.assign(value);
+    }
+  }
+  return true;
+}
+
+bool
+parseListEntry(std::string_view line, ListingEntry &entry, std::chrono::system_clock::time_point now)
+{
+  line = withoutLineEnding(line);
+  if (line.empty()) {
+    return false;
+  }
+  resetEntry(entry);
+  return isDigit(line[0]) ? parseDosListEntry(line, entry) : parseUnixListEntry(line, entry, now);
+}
+
+std::optional<ListingEntry>
+parseMlstReply(std::string_view response)
+{
+  // RFC 3659 section 7.2: `250-Listing x`, the entry on a line of its own which
+  // starts with a space, then `250 End`.
+  if (response.substr(0, 3) != "250") {
+    return {};
+  }
+  size_t lineStart = response.find('\n');
+  while (lineStart != std::string_view::npos) {
+    ++lineStart;
+    const auto lineEnd = response.find('\n', lineStart);
+    const auto line = response.substr(lineStart, lineEnd == std::string_view::npos ? lineEnd : lineEnd - lineStart);
+    ListingEntry entry;
+    if (!line.empty() && line[0] == ' ' && parseMlsxEntry(line.substr(1), entry)) {
+      return entry;
+    }
+    lineStart = lineEnd;
+  }
+  LOG_WARN("Malformed MLST reply, no entry found: " << response);
+  return {};
+}
+
+}
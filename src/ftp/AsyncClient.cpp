@@ -0,0 +1,287 @@
+#include "ftp/AsyncClient.h"
+
+#include <sstream>
+#include <filesystem>
+#include <utility>
+#include <string>
+
+#include "util/util.hpp"
+#include "fsm/CommandFsm.h"
+#include "fsm/AsyncCommandFsm.h"
+
+namespace ftp
+{
+
+namespace {
+
+// Same check as Client does before downloading.
+bool
+isValidDownloadDest(const std::filesystem::path &destPath)
+{
+  const std::filesystem::path parentPath = destPath.parent_path();
+  return exists(parentPath) && is_directory(parentPath) && !exists(destPath);
+}
+
+// Receives the server's welcome message, skipping any 1xx replies sent while it
+// gets ready, as Client::connect does.
+void
+readWelcome(io::Socket &controlSocket, std::function<void(bool)> onComplete)
+{
+  controlSocket.asyncReadReply([&controlSocket, onComplete = std::move(onComplete)](std::optional<io::Reply> welcome) {
+    if (welcome && welcome->kind() == 1) {
+      readWelcome(controlSocket, onComplete);
+    } else {
+      onComplete(welcome && welcome->kind() == 2);
+    }
+  });
+}
+
+}
+
+AsyncClient::AsyncClient(boost::asio::io_context &ioContext)
+  : ioContext_(ioContext),
+    controlSocket_(ioContext)
+{}
+
+void
+AsyncClient::connect(const std::string &host, const std::string &port, Callback<bool> onComplete)
+{
+  if (controlSocket_.isOpen()) {
+    // Already connected to something, so fail.
+    onComplete(false);
+    return;
+  }
+
+  controlSocket_.asyncConnect(host, port, [this, onComplete = std::move(onComplete)](bool isConnected) {
+    if (!isConnected) {
+      onComplete(false);
+      return;
+    }
+    controlSocket_.setNoDelay();
+    readWelcome(controlSocket_, onComplete);
+  });
+}
+
+void
+AsyncClient::login(
+  const std::string &username,
+  const std::optional<std::string> &password,
+  const std::optional<std::string> &accountName,
+  Callback<bool> onComplete
+) {
+  fsm::asyncLoginFsm(controlSocket_, username, password, accountName, std::move(onComplete));
+}
+
+void
+AsyncClient::noop(Callback<bool> onComplete)
+{
+  fsm::asyncOneStepFsm(controlSocket_, "NOOP", std::move(onComplete));
+}
+
+void
+AsyncClient::quit(Callback<bool> onComplete)
+{
+  if (!controlSocket_.isOpen()) {
+    // Not connected to anything.
+    onComplete(false);
+    return;
+  }
+
+  fsm::asyncOneStepFsm(controlSocket_, "QUIT", [this, onComplete = std::move(onComplete)](bool hasQuit) {
+    if (!hasQuit) {
+      // As in Client::quit, close the socket anyway.
+      LOG_WARN("Error while trying to quit.");
+    }
+    onComplete(controlSocket_.close());
+  });
+}
+
+void
+AsyncClient::storOrAppe(
+  const std::string &localSrc,
+  const std::string &serverDest,
+  bool isAppendOperation,
+  Callback<bool> onComplete
+) {
+try {
+  // Check that the source file exists and is a regular file.
+  const std::filesystem::path srcPath(localSrc);
+  if (!exists(srcPath) || !is_regular_file(srcPath)) {
+    onComplete(false);
+    return;
+  }
+
+  const auto command = std::string(isAppendOperation ? "APPE " : "STOR ") + serverDest;
+  setupDataConnection([this, srcPath, command, onComplete = std::move(onComplete)](std::shared_ptr<io::Socket> dataSocket) {
+    if (!dataSocket) {
+      onComplete(false);
+      return;
+    }
+
+    auto isSent = std::make_shared<bool>(false);
+    const auto onPreliminaryReply = [dataSocket, srcPath, isSent](const std::string &, std::function<void()> done) {
+      dataSocket->asyncSendFile(srcPath, [dataSocket, isSent, done = std::move(done)](bool isFileSent) {
+        *isSent = isFileSent;
+        // Closing the connection tells the server that the file has ended.
+        dataSocket->close();
+        done();
+      });
+    };
+
+    fsm::asyncTwoStepFsm(controlSocket_, command, onPreliminaryReply, [isSent, onComplete](bool isServerHappy) {
+      onComplete(*isSent && isServerHappy);
+    });
+  });
+} catch (const std::filesystem::filesystem_error &e) {
+  LOG_ERROR("Error while sending file: error=" << e.what());
+  onComplete(false);
+}
+}
+
+void
+AsyncClient::retr(const std::string &serverSrc, const std::string &localDest, Callback<bool> onComplete)
+{
+try {
+  const std::filesystem::path destPath(localDest);
+  if (!isValidDownloadDest(destPath)) {
+    onComplete(false);
+    return;
+  }
+
+  setupDataConnection([this, serverSrc, destPath, onComplete = std::move(onComplete)](std::shared_ptr<io::Socket> dataSocket) {
+    if (!dataSocket) {
+      onComplete(false);
+      return;
+    }
+
+    auto isReceived = std::make_shared<bool>(false);
+    const auto onPreliminaryReply = [dataSocket, destPath, isReceived](const std::string &reply, std::function<void()> done) {
+      dataSocket->asyncRetrieveFile(
+        destPath,
+        fsm::parseTransferSize(reply),
+        [dataSocket, isReceived, done = std::move(done)](bool isFileReceived) {
+          *isReceived = isFileReceived;
+          dataSocket->close();
+          done();
+        }
+      );
+    };
+
+    fsm::asyncTwoStepFsm(
+      controlSocket_,
+      std::string("RETR ") + serverSrc,
+      onPreliminaryReply,
+      [destPath, isReceived, onComplete](bool isServerHappy) {
+        std::error_code error;
+        const bool isFileAtDestination = exists(destPath, error);
+        onComplete(*isReceived && isFileAtDestination && isServerHappy);
+      }
+    );
+  });
+} catch (const std::filesystem::filesystem_error &e) {
+  LOG_ERROR("Error while retrieving file: error=" << e.what());
+  onComplete(false);
+}
+}
+
+void
+AsyncClient::pwd(Callback<std::optional<std::string>> onComplete)
+{
+  fsm::asyncDirectoryFsm(controlSocket_, std::nullopt, std::move(onComplete));
+}
+
+void
+AsyncClient::cwd(const std::string &newDir, Callback<bool> onComplete)
+{
+  fsm::asyncOneStepFsm(controlSocket_, std::string("CWD ") + newDir, std::move(onComplete));
+}
+
+void
+AsyncClient::mkd(const std::string &newDir, Callback<std::optional<std::string>> onComplete)
+{
+  fsm::asyncDirectoryFsm(controlSocket_, newDir, std::move(onComplete));
+}
+
+void
+AsyncClient::dele(const std::string &fileToDelete, Callback<bool> onComplete)
+{
+  fsm::asyncOneStepFsm(controlSocket_, std::string("DELE ") + fileToDelete, std::move(onComplete));
+}
+
+void
+AsyncClient::rmd(const std::string &dirToDelete, Callback<bool> onComplete)
+{
+  fsm::asyncOneStepFsm(controlSocket_, std::string("RMD ") + dirToDelete, std::move(onComplete));
+}
+
+void
+AsyncClient::list(const std::optional<std::string> &dirToList, Callback<std::optional<std::string>> onComplete)
+{
+  std::string command("LIST ");
+  if (dirToList) {
+    command.append(*dirToList);
+  }
+
+  setupDataConnection([this, command, onComplete = std::move(onComplete)](std::shared_ptr<io::Socket> dataSocket) {
+    if (!dataSocket) {
+      onComplete({});
+      return;
+    }
+
+    auto listOutput = std::make_shared<std::optional<std::string>>();
+    const auto onPreliminaryReply = [dataSocket, listOutput](const std::string &, std::function<void()> done) {
+      auto outputStream = std::make_shared<std::stringstream>();
+      dataSocket->asyncRetrieveToStream(
+        *outputStream,
+        [dataSocket, listOutput, outputStream, done = std::move(done)](bool isSuccess) {
+          if (isSuccess) {
+            *listOutput = outputStream->str();
+          }
+          if (dataSocket->isOpen()) {
+            dataSocket->close();
+          }
+          done();
+        }
+      );
+    };
+
+    fsm::asyncTwoStepFsm(controlSocket_, command, onPreliminaryReply, [listOutput, onComplete](bool) {
+      onComplete(std::move(*listOutput));
+    });
+  });
+}
+
+void
+AsyncClient::rename(const std::string &from, const std::string &to, Callback<bool> onComplete)
+{
+  fsm::asyncRenameFsm(controlSocket_, from, to, std::move(onComplete));
+}
+
+void
+AsyncClient::setupDataConnection(Callback<std::shared_ptr<io::Socket>> onComplete)
+{
+  // Same sequence as Client::setupDataConnection: image type, then a passive connection.
+  fsm::asyncOneStepFsm(controlSocket_, "TYPE I", [this, onComplete = std::move(onComplete)](bool isTypeSet) {
+    if (!isTypeSet) {
+      onComplete(nullptr);
+      return;
+    }
+
+    fsm::asyncPasvFsm(controlSocket_, [this, onComplete](auto maybeConnectionInfo) {
+      if (!maybeConnectionInfo) {
+        onComplete(nullptr);
+        return;
+      }
+      const auto &[host, port] = *maybeConnectionInfo;
+      LOG_DEBUG("Parsed response: host=" << host << "; port=" << port);
+
+      // Shared so that it outlives this function and the transfer's callbacks can keep it alive.
+      auto dataSocket = std::make_shared<io::Socket>(ioContext_);
+      dataSocket->asyncConnect(host, port, [dataSocket, onComplete](bool isConnected) {
+        onComplete(isConnected ? dataSocket : nullptr);
+      });
+    });
+  });
+}
+
+}
@@ -4,36 +4,300 @@
 #include <fstream>
 #include <iostream>
 #include <filesystem>
-#include <regex>
 #include <utility>
 #include <string>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <map>
+#include <condition_variable>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <cassert>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/crc.hpp>
 
 #include "util/util.hpp"
 #include "fsm/CommandFsm.h"
+#include "io/File.h"
 
 namespace ftp
 {
 
-ftp::Client::Client() : controlSocket_()
-{ }
+namespace {
+
+// Ranges smaller than this aren't worth the cost of logging in another connection.
+constexpr std::uintmax_t MIN_SEGMENT_SIZE = 1024 * 1024;
+
+// Servers stop waiting for a passive connection after a while (vsftpd's default is a
+// minute), so don't use a prefetched one that's older than this.
+constexpr std::chrono::seconds MAX_PREFETCH_AGE(10);
+
+// We won't create directories leading up to the destination file, so if they don't exist then fail.
+// This method can do some funky things if the path contains '.' or '..' (specifically this may not
+// actually be the 'parent' directory -- it may be the same directory or even a child);
+// I think based on this use case it should behave correctly. If not, we may need to canonicalize
+// paths before using them.
+// Note this call can throw implementation-defined exceptions, presumably of
+// type std::filesystem::filesystem_error.
+bool
+isValidDownloadDest(const std::filesystem::path &destPath)
+{
+  const std::filesystem::path parentPath = destPath.parent_path();
+  return exists(parentPath) && is_directory(parentPath) && !exists(destPath);
+}
+
+// The CRC-32 of the first `length` bytes of the file, as XCRC and HASH compute it.
+std::optional<std::uint32_t>
+crc32OfPrefix(const std::filesystem::path &path, std::uintmax_t length)
+{
+  std::ifstream stream(path, std::ios::binary);
+  boost::crc_32_type crc;
+  std::vector<char> buf(64 * 1024);
+  while (length > 0 && stream) {
+    stream.read(buf.data(), static_cast<std::streamsize>(std::min<std::uintmax_t>(length, buf.size())));
+    crc.process_bytes(buf.data(), stream.gcount());
+    length -= stream.gcount();
+  }
+  if (length > 0) {
+    return {};
+  }
+  return crc.checksum();
+}
+
+// A directory to list or a file to download, as part of a mirror.
+struct MirrorTask
+{
+  std::string serverPath;
+  std::filesystem::path localPath;
+  bool isDirectory;
+};
+
+// One deque of tasks per worker. A worker takes the newest task from its own deque,
+// so it works depth first, and when that's empty it steals the oldest task from
+// another's, which tends to be the biggest piece of unexplored tree. Workers spend
+// nearly all their time waiting on the network, so a single lock is plenty.
+template <class Task>
+class WorkQueues
+{
+public:
+  explicit WorkQueues(size_t numWorkers)
+    : queues_(numWorkers),
+      numUnfinished_(0)
+  { }
+
+  void push(size_t worker, Task task)
+  {
+    std::lock_guard lock(mutex_);
+    queues_[worker % queues_.size()].push_back(std::move(task));
+    ++numUnfinished_;
+    taskAdded_.notify_one();
+  }
+
+  // Waits for a task for `worker`. Returns nothing once every task is finished,
+  // since then no more can be added.
+  std::optional<Task> pop(size_t worker)
+  {
+    std::unique_lock lock(mutex_);
+    while (true) {
+      auto &own = queues_[worker];
+      if (!own.empty()) {
+        auto task = std::move(own.back());
+        own.pop_back();
+        return task;
+      }
+      for (size_t i = 1; i < queues_.size(); ++i) {
+        auto &other = queues_[(worker + i) % queues_.size()];
+        if (!other.empty()) {
+          auto task = std::move(other.front());
+          other.pop_front();
+          return task;
+        }
+      }
+      if (numUnfinished_ == 0) {
+        return {};
+      }
+      taskAdded_.wait(lock);
+    }
+  }
+
+  // Called once a task from `pop` has been dealt with, after pushing any tasks it led to.
+  void finish()
+  {
+    std::lock_guard lock(mutex_);
+    if (--numUnfinished_ == 0) {
+      taskAdded_.notify_all();
+    }
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable taskAdded_;
+  std::vector<std::deque<Task>> queues_;
+  size_t numUnfinished_;
+};
+
+// A server directory to list during a sync. `relativePath` is relative to the top
+// of the sync, in the form `std::filesystem::path::generic_string` gives.
+struct SyncListTask
+{
+  std::string serverPath;
+  std::string relativePath;
+};
+
+struct SyncUploadTask
+{
+  std::filesystem::path localPath;
+  std::string serverPath;
+};
+
+// What a sync knows about a file or directory on one side.
+struct SyncEntry
+{
+  bool isDirectory;
+  std::uintmax_t size;
+  std::optional<std::time_t> modifyTime;
+};
+
+std::string
+joinRelativePath(const std::string &dir, const std::string &name)
+{
+  return dir.empty() ? name : dir + "/" + name;
+}
+
+// A listed name which could take us outside the directory being mirrored.
+bool
+isUnsafeName(const std::string &name)
+{
+  return name.empty() || name == "." || name == ".." || name.find('/') != std::string::npos;
+}
+
+std::string
+joinServerPath(const std::string &dir, const std::string &name)
+{
+  if (!dir.empty() && dir.back() == '/') {
+    return dir + name;
+  }
+  return dir + "/" + name;
+}
+
+// Pipelines `<verb> <argument>` for each argument, and turns each reply into a
+// result with `interpret`. Items whose reply never arrived get a default Result.
+template <class Result, class Interpret>
+std::vector<Result>
+pipelineEach(
+  io::Socket &controlSocket,
+  const std::string &verb,
+  const std::vector<std::string> &arguments,
+  const Interpret &interpret
+) {
+  std::vector<std::string> commands;
+  commands.reserve(arguments.size());
+  for (const auto &argument : arguments) {
+    commands.push_back(verb + " " + argument);
+  }
+
+  std::vector<Result> results(arguments.size());
+  fsm::pipelineFsm(controlSocket, commands, [&results, &interpret](size_t i, const std::optional<io::Reply> &reply) {
+    if (reply) {
+      results[i] = interpret(*reply);
+    }
+  });
+  return results;
+}
+
+bool
+isPositiveCompletion(const io::Reply &reply)
+{
+  return reply.kind() == 2;
+}
+
+}
+
+Client::Client()
+  : ownedIoContext_(std::make_unique<boost::asio::io_context>()),
+    ioContext_(*ownedIoContext_),
+    controlSocket_(ioContext_),
+    isDataProtected_(false),
+    roundTripsSaved_(0),
+    metrics_(std::make_shared<io::Metrics>()),
+    isPrefetchEnabled_(false),
+    isPasvPending_(false)
+{
+  controlSocket_.setMetrics(metrics_, io::Socket::Connection::Control);
+}
+
+Client::Client(boost::asio::io_context &ioContext)
+  : ownedIoContext_(),
+    ioContext_(ioContext),
+    controlSocket_(ioContext_),
+    isDataProtected_(false),
+    roundTripsSaved_(0),
+    metrics_(std::make_shared<io::Metrics>()),
+    isPrefetchEnabled_(false),
+    isPasvPending_(false)
+{
+  controlSocket_.setMetrics(metrics_, io::Socket::Connection::Control);
+}
 
 bool
 Client::connect(const std::string &host)
+{
+  return connect(host, "ftp");
+}
+
+bool
+Client::connect(const std::string &host, const std::string &port)
+{
+  return connect(host, port, nullptr);
+}
+
+bool
+Client::connect(const std::string &host, const std::string &port, const io::TlsSession &tlsSession)
 {
   if (controlSocket_.isOpen()) {
     // Already connected to something, so fail.
     return false;
   }
-  bool connected = controlSocket_.connect(host, "ftp");
-  // TODO: what if we get told to delay?
-  // Receive welcome message from the server (it must send this).
-  return connected && controlSocket_.readUntil("\r\n").has_value();
+  if (!controlSocket_.connect(host, port)) {
+    return false;
+  }
+  // Commands are small and sometimes sent back to back, so don't let them wait on
+  // the server's delayed ACK.
+  controlSocket_.setNoDelay();
+  // Receive welcome message from the server (it must send this). A 1xx
+  // reply means the server isn't ready yet and will send another later.
+  auto welcome = controlSocket_.readReply();
+  while (welcome && welcome->kind() == 1) {
+    welcome = controlSocket_.readReply();
+  }
+  if (!welcome || welcome->kind() != 2) {
+    return false;
+  }
+  isDataProtected_ = false;
+  if (tlsContext_ && !startTls(host, tlsSession)) {
+    // Carrying on without TLS would send the password in the clear.
+    controlSocket_.close();
+    return false;
+  }
+
+  // Remember where we connected to so that we can open more connections later.
+  hostAndPort_.emplace(host, port);
+  // Nothing we knew about an earlier session applies to this one.
+  sessionState_ = {};
+  discardPrefetch();
+  return true;
 }
 
 bool
 Client::login(const std::string &username)
 {
-  return fsm::loginFsm(controlSocket_, username, std::nullopt, std::nullopt);
+  return login(Credentials{username, std::nullopt, std::nullopt});
 }
 
 bool
@@ -41,7 +305,7 @@ Client::login(
   const std::string &username,
   const std::string &password
 ) {
-  return fsm::loginFsm(controlSocket_, username, password, std::nullopt);
+  return login(Credentials{username, password, std::nullopt});
 }
 
 bool
@@ -50,7 +314,32 @@ Client::login(
   const std::string &password,
   const std::string &accountName
 ) {
-  return fsm::loginFsm(controlSocket_, username, password, accountName);
+  return login(Credentials{username, password, accountName});
+}
+
+bool
+Client::login(const Credentials &credentials)
+{
+  const auto maybeRef = [](const std::optional<std::string> &maybeString) {
+    return maybeString
+      ? std::make_optional(std::cref(*maybeString))
+      : std::nullopt;
+  };
+
+  // Logging in can reset the session, e.g. a different user may start in a different directory.
+  sessionState_ = {};
+  discardPrefetch();
+  const bool isLoggedIn = fsm::loginFsm(
+    controlSocket_,
+    credentials.username,
+    maybeRef(credentials.password),
+    maybeRef(credentials.account),
+    controlSocket_.isTls()
+  );
+  if (isLoggedIn) {
+    credentials_ = credentials;
+  }
+  return isLoggedIn;
 }
 
 bool
@@ -74,8 +363,11 @@ Client::quit()
     // because that should only happen for syntax errors).
     // In either case, just log it and we will shut down
     // the socket anyway (essentially forcing a quit).
-    LOG("Error while trying to quit.");
+    LOG_WARN("Error while trying to quit.");
   }
+  sessionState_ = {};
+  isDataProtected_ = false;
+  discardPrefetch();
   return controlSocket_.close();
 }
 
@@ -91,22 +383,104 @@ Client::appe(const std::string &localSrc, const std::string &serverDest)
   return storOrAppe(localSrc, serverDest, true);
 }
 
+bool
+Client::storResume(const std::string &localSrc, const std::string &serverDest)
+{
+try {
+  // If the server can't tell us the size, assume the file isn't there yet.
+  const std::uintmax_t offset = size(serverDest).value_or(0);
+  const std::uintmax_t localSize = file_size(std::filesystem::path(localSrc));
+  if (offset == localSize) {
+    // Already complete.
+    return true;
+  } else if (offset > localSize) {
+    // Can't be a prefix of the local file, so this isn't an upload we can resume.
+    return false;
+  }
+  return storOrAppe(localSrc, serverDest, false, offset);
+} catch (const std::filesystem::filesystem_error &e) {
+  return false;
+}
+}
+
+bool
+Client::appeResume(const std::string &localSrc, const std::string &serverDest, std::uintmax_t originalServerSize)
+{
+try {
+  // Whatever the file has gained since the append started must be the start of the local file.
+  const std::uintmax_t serverSize = size(serverDest).value_or(0);
+  const std::uintmax_t localSize = file_size(std::filesystem::path(localSrc));
+  if (serverSize < originalServerSize || serverSize - originalServerSize > localSize) {
+    // The file has changed in some other way, so the append can't be resumed.
+    return false;
+  }
+  const std::uintmax_t offset = serverSize - originalServerSize;
+  if (offset == localSize) {
+    // Already complete.
+    return true;
+  }
+  return storOrAppe(localSrc, serverDest, true, offset);
+} catch (const std::filesystem::filesystem_error &e) {
+  return false;
+}
+}
+
+bool
+Client::appeDelta(const std::string &localSrc, const std::string &serverDest)
+{
+try {
+  const std::filesystem::path path(localSrc);
+  const std::uintmax_t localSize = file_size(path);
+  const auto maybeServerSize = size(serverDest);
+  if (!maybeServerSize) {
+    // Either it doesn't exist or we can't tell how much it has, so send it all.
+    return storOrAppe(localSrc, serverDest, false);
+  }
+  const std::uintmax_t serverSize = *maybeServerSize;
+  if (serverSize > localSize) {
+    // Can't be the start of the local file, e.g. because the log was rotated.
+    LOG_WARN("Server file is bigger than local file; not appending. serverSize=" << serverSize << "; localSize=" << localSize);
+    return false;
+  }
+
+  // Comparing sizes alone misses a local file which was replaced and has since grown
+  // past the server's, so check the contents too if the server can tell us about them.
+  if (serverSize > 0) {
+    std::optional<std::uint32_t> serverCrc;
+    if (isFeatureSupported("XCRC")) {
+      serverCrc = fsm::xcrcFsm(controlSocket_, serverDest);
+    } else if (isFeatureSupported("HASH")) {
+      serverCrc = fsm::hashCrcFsm(controlSocket_, serverDest);
+    }
+    if (serverCrc && serverCrc != crc32OfPrefix(path, serverSize)) {
+      LOG_WARN("Server file isn't the start of the local file; not appending. serverDest=" << serverDest);
+      return false;
+    }
+  }
+
+  if (serverSize == localSize) {
+    // Nothing new.
+    return true;
+  }
+  return storOrAppe(localSrc, serverDest, true, serverSize);
+} catch (const std::filesystem::filesystem_error &e) {
+  return false;
+}
+}
+
 bool
 Client::retr(const std::string &serverSrc, const std::string &localDest)
+{
+  return retr(serverSrc, localDest, nullptr);
+}
+
+bool
+Client::retr(const std::string &serverSrc, const std::string &localDest, const std::shared_ptr<io::Transform> &transform)
 {
 try {
   // Check that the destination is valid.
   const std::filesystem::path destPath(localDest);
-  // We won't create directories leading up to the destination file, so if they don't exist then fail.
-  // This method can do some funky things if the path contains '.' or '..' (specifically this may not
-  // actually be the 'parent' directory -- it may be the same directory or even a child);
-  // I think based on this use case it should behave correctly. If not, we may need to canonicalize
-  // paths before using them.
-  // Note this call can throw implementation-defined exceptions, presumably of
-  // type std::filesystem::filesystem_error.
-  const std::filesystem::path parentPath = destPath.parent_path();
-  const bool isValidDest = exists(parentPath) && is_directory(parentPath) && !exists(destPath);
-  if (!isValidDest) {
+  if (!isValidDownloadDest(destPath)) {
     return false;
   }
 
@@ -117,11 +491,18 @@ try {
   }
   io::Socket &dataSocket = *maybeDataSocket;
 
+  if (receiveBufferSize_) {
+    dataSocket.setReceiveBufferSize(*receiveBufferSize_);
+  }
+  dataSocket.setTransform(transform);
+
   // This lambda is called if/when we receive a 1xx reply from the server.
   bool isReceived = false;
-  const auto onPreliminaryReply = [&dataSocket, &destPath, &isReceived]() {
-    // Save the data arriving on the data socket until it is closed by the server.
-    isReceived = dataSocket.retrieveFile(destPath);
+  const auto onPreliminaryReply = [this, &dataSocket, &destPath, &isReceived](const std::string &reply) {
+    // Save the data arriving on the data socket until it is closed by the server. If the server
+    // told us how big the file is, the destination can be allocated before the data arrives.
+    isReceived = secureDataConnection(dataSocket)
+      && dataSocket.retrieveFile(destPath, fsm::parseTransferSize(reply));
     // The connection should still be open here, regardless of whether or not we received an EOF.
     // Close it to make sure the server knows we've finished reading. If the server had sent an EOF
     // then it will probably think the transfer succeeded but we also need to check that there were
@@ -129,132 +510,1152 @@ try {
     // end it doesn't necessarily mean the  transfer succeeded as something may have gone wrong
     // on the server's end.
     dataSocket.close();
+    requestPrefetch();
   };
 
   // Try to retrieve the file from the server.
   // This may fail if e.g. we don't permission or the file doesn't exist on the server.
+  const auto start = std::chrono::steady_clock::now();
   const bool isServerHappy = fsm::twoStepFsm(
     controlSocket_,
     std::string("RETR ") + serverSrc,
     onPreliminaryReply
   );
+  recordTransfer(dataSocket, start);
+  completePrefetch();
+  if (transform) {
+    const auto stats = transform->stats();
+    lastCompressionReport_ = CompressionReport{stats.bytesOut, stats.bytesIn, stats.cpuTime};
+  }
 
   // Extra sanity check: the file should exist at the destination now.
   const bool isFileAtDestination = exists(destPath);
 
   return isReceived && isFileAtDestination && isServerHappy;
 } catch (const std::filesystem::filesystem_error &e) {
-  LOG("Error while retrieving file: error=" << e.what());
+  LOG_ERROR("Error while retrieving file: error=" << e.what());
   return false;
 }
 }
 
-std::optional<std::string>
-Client::pwd()
+bool
+Client::retrResume(const std::string &serverSrc, const std::string &localDest)
 {
-  return fsm::directoryFsm(controlSocket_, {});
+try {
+  const std::filesystem::path destPath(localDest);
+  if (!exists(destPath)) {
+    // Nothing to resume.
+    return retr(serverSrc, localDest);
+  }
+  if (!is_regular_file(destPath)) {
+    return false;
+  }
+
+  // Assume what we have is a prefix of the server's file, so we only need
+  // whatever comes after it.
+  const auto maybeServerSize = size(serverSrc);
+  if (!maybeServerSize) {
+    return false;
+  }
+  const std::uintmax_t offset = file_size(destPath);
+  if (offset == *maybeServerSize) {
+    // Already complete.
+    return true;
+  } else if (offset > *maybeServerSize) {
+    // Can't be a prefix of the server's file, so this isn't a download we can resume.
+    return false;
+  }
+
+  auto maybeDataSocket = setupDataConnection();
+  if (!maybeDataSocket) {
+    return false;
+  }
+  io::Socket &dataSocket = *maybeDataSocket;
+
+  if (receiveBufferSize_) {
+    dataSocket.setReceiveBufferSize(*receiveBufferSize_);
+  }
+
+  // REST has to come immediately before the RETR it applies to.
+  if (!fsm::restFsm(controlSocket_, offset)) {
+    return false;
+  }
+
+  bool isReceived = false;
+  const auto onPreliminaryReply = [this, &dataSocket, &destPath, offset, &isReceived](const std::string &) {
+    isReceived = secureDataConnection(dataSocket) && dataSocket.resumeRetrieveFile(destPath, offset);
+    dataSocket.close();
+    requestPrefetch();
+  };
+
+  const auto start = std::chrono::steady_clock::now();
+  const bool isServerHappy = fsm::twoStepFsm(
+    controlSocket_,
+    std::string("RETR ") + serverSrc,
+    onPreliminaryReply
+  );
+  recordTransfer(dataSocket, start);
+  completePrefetch();
+
+  // We know how big the file should be, so check we ended up with all of it.
+  return isReceived && isServerHappy && file_size(destPath) == *maybeServerSize;
+} catch (const std::filesystem::filesystem_error &e) {
+  LOG_ERROR("Error while resuming retrieval: error=" << e.what());
+  return false;
+}
 }
 
 bool
-Client::cwd(const std::string &newDir)
+Client::retrSegmented(const std::string &serverSrc, const std::string &localDest, size_t numConnections)
 {
-  return fsm::oneStepFsm(controlSocket_, std::string("CWD ") + newDir);
+  assert(numConnections > 0);
+try {
+  const std::filesystem::path destPath(localDest);
+  if (!isValidDownloadDest(destPath)) {
+    return false;
+  }
+
+  if (!hostAndPort_ || !credentials_) {
+    // We don't know how to open the other connections.
+    return false;
+  }
+
+  const auto maybeFileSize = size(serverSrc);
+  if (!maybeFileSize) {
+    return false;
+  }
+  const std::uintmax_t fileSize = *maybeFileSize;
+  if (fileSize == 0) {
+    // Nothing to split up.
+    return retr(serverSrc, localDest);
+  }
+
+  // Don't use more connections than there are worthwhile ranges.
+  const size_t numSegments = static_cast<size_t>(std::min<std::uintmax_t>(
+    numConnections,
+    std::max<std::uintmax_t>(1, fileSize / MIN_SEGMENT_SIZE)
+  ));
+
+  // Create the whole file up front so that every range can be written into place
+  // as it arrives.
+  {
+    const io::FileDescriptor file(::open(destPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666));
+    if (!file) {
+      LOG_ERROR("Could not create file: destPath=" << destPath);
+      return false;
+    }
+    io::preallocate(file.get(), fileSize, false);
+  }
+
+  const auto rangeStart = [fileSize, numSegments](size_t i) {
+    return fileSize * i / numSegments;
+  };
+
+  // Not std::vector<bool> because each element is written by a different thread.
+  std::vector<char> isRangeReceived(numSegments, false);
+  // Read here because this connection is in use while the others are opened.
+  const auto tlsSession = controlSocket_.tlsSession();
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < numSegments; ++i) {
+    threads.emplace_back([this, i, &serverSrc, &destPath, &rangeStart, &isRangeReceived, &tlsSession]() {
+      const auto other = connectAnother(tlsSession);
+      if (!other) {
+        return;
+      }
+      isRangeReceived[i] = other->retrRange(serverSrc, destPath, rangeStart(i), rangeStart(i + 1) - rangeStart(i));
+      other->quit();
+    });
+  }
+
+  // This connection fetches the first range while the others fetch theirs.
+  isRangeReceived[0] = retrRange(serverSrc, destPath, 0, rangeStart(1));
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  const bool isComplete = std::all_of(isRangeReceived.cbegin(), isRangeReceived.cend(), [](char b) { return b; });
+  if (!isComplete) {
+    // A file with holes in it is worse than no file, because it looks complete.
+    LOG_WARN("Not all ranges were received; removing partial file.");
+    std::filesystem::remove(destPath);
+  }
+  return isComplete;
+} catch (const std::filesystem::filesystem_error &e) {
+  LOG_ERROR("Error while retrieving file: error=" << e.what());
+  return false;
+}
 }
 
-std::optional<std::string>
-Client::mkd(const std::string &newDir)
+double
+Client::CompressionReport::ratio() const
 {
-  return fsm::directoryFsm(controlSocket_, newDir);
+  return compressedBytes > 0 ? static_cast<double>(uncompressedBytes) / compressedBytes : 0.0;
 }
 
 bool
-Client::dele(const std::string &fileToDelete)
+Client::storCompressed(const std::string &localSrc, const std::string &serverDest)
 {
-  return fsm::oneStepFsm(controlSocket_, std::string("DELE ") + fileToDelete);
+  return storCompressed(localSrc, serverDest, CompressionOptions());
 }
 
 bool
-Client::rmd(const std::string &dirToDelete)
+Client::storCompressed(const std::string &localSrc, const std::string &serverDest, const CompressionOptions &options)
 {
-  return fsm::oneStepFsm(controlSocket_, std::string("RMD ") + dirToDelete);
+  assert(options.level >= 1 && options.level <= 9 && options.numThreads > 0);
+  lastCompressionReport_.reset();
+  return storOrAppe(localSrc, serverDest, false, 0, std::make_shared<io::GzipCompressor>(options.level, options.numThreads));
 }
 
-std::optional<std::string>
-Client::list(const std::string &dirToList)
+bool
+Client::retrDecompressed(const std::string &serverSrc, const std::string &localDest)
 {
-  return list(std::make_optional(dirToList));
+  lastCompressionReport_.reset();
+  return retr(serverSrc, localDest, std::make_shared<io::GzipDecompressor>());
 }
 
-std::optional<std::string>
-Client::list()
+std::optional<Client::CompressionReport>
+Client::lastCompressionReport() const
 {
-  return list(std::nullopt);
+  return lastCompressionReport_;
 }
 
-std::optional<std::string>
-Client::list(const std::optional<std::reference_wrapper<const std::string>> &maybeDirToList)
+bool
+Client::fxp(const std::string &serverSrc, Client &destination, const std::string &serverDest)
 {
-  // Assume the output fits sensibly into a string. If there were many directories in the
-  // output, this would not be reasonable. Ideally, we should truncate the output if it's
-  // above a certain size.
-  std::optional<std::string> maybeListOutput(std::nullopt);
+  if (&destination == this) {
+    return false;
+  }
+  if (isDataProtected_ || destination.isDataProtected_) {
+    // The servers would have to do a TLS handshake with each other (SSCN or CPSV),
+    // which few support. Refuse rather than send the file in the clear.
+    LOG_ERROR("Server-to-server transfers aren't supported with protected data connections.");
+    return false;
+  }
 
-  // Construct command depending on whether user specified a directory explicitly.
-  // If not, the server should assume they want to list the current directory.
-  std::string command("LIST ");
-  if (maybeDirToList) {
-    command.append(*maybeDirToList);
+  // Neither data connection would be ours, so don't keep a prefetched one open
+  // while the servers talk to each other. Both servers need to agree on the type
+  // and mode, and stream mode is the one they're sure to share.
+  discardPrefetch();
+  destination.discardPrefetch();
+  if (!setImageType() || !destination.setImageType()
+        || !setCompressedMode(false) || !destination.setCompressedMode(false)) {
+    return false;
   }
 
-  // Set up data connection. Note the original ftp says we should use the ASCII transfer type
-  // for list commands but we will assume the server is robust to any transfer type (specifically
-  // to image type, which we use everywhere else). It shouldn't matter to the server or to us
-  // because we just print the data we receive as a string; we don't need to interpret it.
-  auto maybeDataSocket = setupDataConnection();
-  if (!maybeDataSocket) {
-    return {};
+  // Fail before involving the destination if the file obviously isn't there, because
+  // backing out once the destination is waiting for data takes an ABOR.
+  std::optional<std::uintmax_t> maybeSrcSize;
+  if (isFeatureSupported("SIZE")) {
+    maybeSrcSize = size(serverSrc);
+    if (!maybeSrcSize) {
+      return false;
+    }
   }
-  io::Socket &dataSocket = *maybeDataSocket;
 
-  const auto onPreliminaryReply = [&maybeListOutput, &dataSocket]() {
-    std::stringstream outputStream;
+  // This server listens and the destination connects to it.
+  const auto maybeConnectionInfo = fsm::pasvFsm(controlSocket_);
+  if (!maybeConnectionInfo) {
+    sessionState_ = {};
+    return false;
+  }
+  const auto &[host, port] = *maybeConnectionInfo;
+  LOG_DEBUG("Parsed response: host=" << host << "; port=" << port);
+  if (!fsm::portFsm(destination.controlSocket_, host, port)) {
+    return false;
+  }
 
-    bool isSuccess = dataSocket.retrieveToStream(outputStream);
-    if (isSuccess) {
-      // It would be nice to do std::move(outputStream).str() here
-      // to move assign the output from the string stream. Unfortunately,
-      // that's not possible until C++20, which means we have to make
-      // a copy of the (potentially large) string that is placed in
-      // the stringstream by the socket operation.
-      // I don't know a workaround for this that works with output streams.
-      maybeListOutput = outputStream.str();
+  // The destination has to be ready to receive before the source starts sending,
+  // so the RETR happens while the STOR is waiting for its final reply.
+  bool isSent = false;
+  bool isAborted = false;
+  const auto onPreliminaryReply = [this, &serverSrc, &destination, &isSent, &isAborted](const std::string &) {
+    isSent = fsm::twoStepFsm(controlSocket_, std::string("RETR ") + serverSrc, [](const std::string &) { });
+    if (!isSent) {
+      // Otherwise the destination would wait for data that's never coming.
+      const std::string abor("ABOR\r\n");
+      isAborted = destination.controlSocket_.sendString(abor) == abor.size();
     }
+  };
+
+  const auto start = std::chrono::steady_clock::now();
+  const bool isServerHappy = fsm::twoStepFsm(
+    destination.controlSocket_,
+    std::string("STOR ") + serverDest,
+    onPreliminaryReply
+  );
+  if (isAborted) {
+    // The STOR's final reply has been read; this is the ABOR's.
+    destination.controlSocket_.readReply();
+  }
+  metrics_->recordTransfer(std::chrono::steady_clock::now() - start);
+
+  if (!isSent || !isServerHappy) {
+    return false;
+  }
+  // Extra sanity check, since we never see the data ourselves.
+  if (maybeSrcSize && destination.isFeatureSupported("SIZE")) {
+    return destination.size(serverDest) == maybeSrcSize;
+  }
+  return true;
+}
+
+bool
+Client::MirrorReport::isComplete() const
+{
+  return failedDirectories.empty()
+    && std::all_of(files.cbegin(), files.cend(), [](const FileTransferResult &file) { return file.isSuccess; });
+}
+
+double
+Client::MirrorReport::bytesPerSecond() const
+{
+  const double seconds = std::chrono::duration<double>(elapsed).count();
+  return seconds > 0 ? totalBytes / seconds : 0;
+}
+
+Client::MirrorReport
+Client::mirror(const std::string &serverDir, const std::string &localDir, size_t numConnections)
+{
+  assert(numConnections > 0);
+  const auto startTime = std::chrono::steady_clock::now();
+  MirrorReport report;
+  std::mutex reportMutex;
+  // Numbers the files being downloaded, so that each has its own partial file.
+  std::atomic<std::uintmax_t> nextPartId{0};
+
+  WorkQueues<MirrorTask> queues(numConnections);
+  queues.push(0, {serverDir, std::filesystem::path(localDir), true});
+
+  const auto runWorker = [&queues, &report, &reportMutex, &nextPartId](Client &client, size_t worker) {
+    while (const auto task = queues.pop(worker)) {
+      if (task->isDirectory) {
+        std::error_code error;
+        std::filesystem::create_directories(task->localPath, error);
+        const bool isListed = !error && client.listEntries(task->serverPath, [&queues, &task, worker](const fsm::ListingEntry &entry) {
+          if (isUnsafeName(entry.name)) {
+            LOG_WARN("Skipping unsafe name in listing: " << entry.name);
+            return;
+          }
+          if (entry.type == fsm::ListingEntry::Type::Directory || entry.type == fsm::ListingEntry::Type::File) {
+            queues.push(worker, {
+              joinServerPath(task->serverPath, entry.name),
+              task->localPath/entry.name,
+              entry.type == fsm::ListingEntry::Type::Directory
+            });
+          }
+        });
+        if (!isListed) {
+          std::lock_guard lock(reportMutex);
+          report.failedDirectories.push_back(task->serverPath);
+        }
+      } else {
+        // Download next to the destination, so that an existing file is only
+        // replaced by a complete copy. The partial file is hidden and numbered, so
+        // that it can't be the destination of another file in the listing, e.g. "x"
+        // and "x.part", which other workers may be downloading at the same time.
+        const auto partPath = task->localPath.parent_path()/(
+          "." + task->localPath.filename().string()
+          + ".ftp-" + std::to_string(::getpid()) + "-" + std::to_string(nextPartId++) + ".part"
+        );
+        std::error_code error;
+        FileTransferResult result{task->serverPath, task->localPath, false, 0};
+        if (std::filesystem::exists(partPath, error)) {
+          // Not ours, so leave it alone.
+          LOG_ERROR("Partial file already exists: partPath=" << partPath);
+        } else if (client.retr(task->serverPath, partPath.string())) {
+          std::filesystem::rename(partPath, task->localPath, error);
+          result.isSuccess = !error;
+          result.size = result.isSuccess ? std::filesystem::file_size(task->localPath, error) : 0;
+          if (!result.isSuccess) {
+            std::filesystem::remove(partPath, error);
+          }
+        } else {
+          std::filesystem::remove(partPath, error);
+        }
+        std::lock_guard lock(reportMutex);
+        report.totalBytes += result.size;
+        report.files.push_back(std::move(result));
+      }
+      queues.finish();
+    }
+  };
+
+  // This connection starts by listing the top directory while the others connect.
+  runOnConnections(numConnections, runWorker);
+
+  report.elapsed = std::chrono::steady_clock::now() - startTime;
+  return report;
+}
+
+bool
+Client::SyncReport::isComplete() const
+{
+  return failedPaths.empty()
+    && std::all_of(uploads.cbegin(), uploads.cend(), [](const FileTransferResult &file) { return file.isSuccess; });
+}
+
+double
+Client::SyncReport::bytesPerSecond() const
+{
+  const double seconds = std::chrono::duration<double>(elapsed).count();
+  return seconds > 0 ? totalBytes / seconds : 0;
+}
+
+Client::SyncReport
+Client::syncUpload(
+  const std::string &localDir,
+  const std::string &serverDir,
+  size_t numConnections,
+  bool isDeletingOrphans
+)
+{
+  assert(numConnections > 0);
+  const auto startTime = std::chrono::steady_clock::now();
+  SyncReport report;
+  const auto serverPathOf = [&serverDir](const std::string &relativePath) {
+    return relativePath.empty() ? serverDir : joinServerPath(serverDir, relativePath);
+  };
+
+  // Everything under the local directory, keyed by relative path. Sorted, so that
+  // a directory always comes before what's in it.
+  std::map<std::string, SyncEntry> localEntries;
+  {
+    const std::filesystem::path localRoot(localDir);
+    std::error_code error;
+    for (std::filesystem::recursive_directory_iterator it(localRoot, error), end; !error && it != end; it.increment(error)) {
+      struct stat status;
+      if (::stat(it->path().c_str(), &status) != 0 || !(S_ISDIR(status.st_mode) || S_ISREG(status.st_mode))) {
+        continue;
+      }
+      localEntries[it->path().lexically_relative(localRoot).generic_string()] = {
+        S_ISDIR(status.st_mode),
+        static_cast<std::uintmax_t>(status.st_size),
+        status.st_mtime
+      };
+    }
+    if (error) {
+      LOG_ERROR("Could not read local directory: localDir=" << localDir << "; error=" << error.message());
+      report.failedPaths.push_back(serverDir);
+      report.elapsed = std::chrono::steady_clock::now() - startTime;
+      return report;
+    }
+  }
+
+  // List the server's side, in parallel in the same way as `mirror`. Directories
+  // which don't exist locally are only worth listing if their contents are to be deleted.
+  // Listings only give times to the minute or worse, unless they come from MLSD.
+  const bool isMlsd = isFeatureSupported("MLST");
+  std::map<std::string, SyncEntry> serverEntries;
+  std::mutex serverEntriesMutex;
+  bool isTopListed = false;
+  WorkQueues<SyncListTask> listQueues(numConnections);
+  listQueues.push(0, {serverDir, ""});
+
+  runOnConnections(numConnections, [&](Client &client, size_t worker) {
+    while (const auto task = listQueues.pop(worker)) {
+      const bool isListed = client.listEntries(task->serverPath, [&](const fsm::ListingEntry &entry) {
+        const bool isDirectory = entry.type == fsm::ListingEntry::Type::Directory;
+        if (isUnsafeName(entry.name) || (!isDirectory && entry.type != fsm::ListingEntry::Type::File)) {
+          return;
+        }
+        const auto relativePath = joinRelativePath(task->relativePath, entry.name);
+        std::optional<std::time_t> modifyTime;
+        if (isMlsd && entry.modifyTime) {
+          modifyTime = std::chrono::system_clock::to_time_t(*entry.modifyTime);
+        }
+        {
+          std::lock_guard lock(serverEntriesMutex);
+          serverEntries[relativePath] = {isDirectory, entry.size.value_or(0), modifyTime};
+        }
+        const auto local = localEntries.find(relativePath);
+        if (isDirectory && (isDeletingOrphans || (local != localEntries.end() && local->second.isDirectory))) {
+          listQueues.push(worker, {joinServerPath(task->serverPath, entry.name), relativePath});
+        }
+      });
+      std::lock_guard lock(serverEntriesMutex);
+      if (task->relativePath.empty()) {
+        isTopListed = isListed;
+      } else if (!isListed) {
+        report.failedPaths.push_back(task->serverPath);
+      }
+      listQueues.finish();
+    }
+  });
+
+  // Some servers list a missing directory as an empty one, so try to create the top
+  // directory unless it had something in it. It failing just means it already exists.
+  if (!isTopListed || serverEntries.empty()) {
+    if (mkd(serverDir)) {
+      report.createdDirectories.push_back(serverDir);
+    } else if (!isTopListed) {
+      report.failedPaths.push_back(serverDir);
+      report.elapsed = std::chrono::steady_clock::now() - startTime;
+      return report;
+    }
+  }
+
+  // Work out what needs doing.
+  std::vector<std::string> dirsToCreate;
+  std::vector<std::string> filesToUpload;
+  std::vector<std::string> filesToCheckTime;
+  for (const auto &[relativePath, local] : localEntries) {
+    const auto server = serverEntries.find(relativePath);
+    if (server == serverEntries.end()) {
+      (local.isDirectory ? dirsToCreate : filesToUpload).push_back(relativePath);
+    } else if (server->second.isDirectory != local.isDirectory) {
+      report.failedPaths.push_back(serverPathOf(relativePath));
+    } else if (local.isDirectory) {
+      continue;
+    } else if (server->second.size != local.size) {
+      filesToUpload.push_back(relativePath);
+    } else if (!server->second.modifyTime) {
+      filesToCheckTime.push_back(relativePath);
+    } else if (local.modifyTime > server->second.modifyTime) {
+      filesToUpload.push_back(relativePath);
+    } else {
+      ++report.numUnchanged;
+    }
+  }
+
+  // Sizes match but the listing didn't give exact times, so ask for them all at once.
+  if (!filesToCheckTime.empty()) {
+    std::vector<std::string> serverPaths;
+    for (const auto &relativePath : filesToCheckTime) {
+      serverPaths.push_back(serverPathOf(relativePath));
+    }
+    const auto times = mdtmBatch(serverPaths);
+    for (size_t i = 0; i < filesToCheckTime.size(); ++i) {
+      const auto &local = localEntries.at(filesToCheckTime[i]);
+      if (!times[i] || local.modifyTime > std::chrono::system_clock::to_time_t(*times[i])) {
+        filesToUpload.push_back(filesToCheckTime[i]);
+      } else {
+        ++report.numUnchanged;
+      }
+    }
+  }
+
+  // Parents come before their children, so these can all be sent at once.
+  if (!dirsToCreate.empty()) {
+    std::vector<std::string> serverPaths;
+    for (const auto &relativePath : dirsToCreate) {
+      serverPaths.push_back(serverPathOf(relativePath));
+    }
+    const auto created = mkdBatch(serverPaths);
+    for (size_t i = 0; i < serverPaths.size(); ++i) {
+      (created[i] ? report.createdDirectories : report.failedPaths).push_back(serverPaths[i]);
+    }
+  }
+
+  // Share the uploads out evenly; connections which finish early take from the others.
+  WorkQueues<SyncUploadTask> uploadQueues(numConnections);
+  for (size_t i = 0; i < filesToUpload.size(); ++i) {
+    uploadQueues.push(i, {std::filesystem::path(localDir)/filesToUpload[i], serverPathOf(filesToUpload[i])});
+  }
+  std::mutex reportMutex;
+  const size_t numUploadConnections = std::min(numConnections, std::max<size_t>(filesToUpload.size(), 1));
+  runOnConnections(numUploadConnections, [&uploadQueues, &report, &reportMutex](Client &client, size_t worker) {
+    while (const auto task = uploadQueues.pop(worker)) {
+      FileTransferResult result{task->serverPath, task->localPath, false, 0};
+      result.isSuccess = client.stor(task->localPath.string(), task->serverPath);
+      if (result.isSuccess) {
+        std::error_code error;
+        result.size = std::filesystem::file_size(task->localPath, error);
+      }
+      std::lock_guard lock(reportMutex);
+      report.totalBytes += result.size;
+      report.uploads.push_back(std::move(result));
+      uploadQueues.finish();
+    }
+  });
+
+  // Delete orphans last, so that a sync which fails part way leaves extra files
+  // behind rather than missing ones. Files go first, then directories from the
+  // deepest up, since they must be empty.
+  if (isDeletingOrphans) {
+    std::vector<std::string> orphanFiles;
+    std::vector<std::string> orphanDirs;
+    for (auto it = serverEntries.crbegin(); it != serverEntries.crend(); ++it) {
+      if (localEntries.count(it->first) == 0) {
+        (it->second.isDirectory ? orphanDirs : orphanFiles).push_back(serverPathOf(it->first));
+      }
+    }
+    const auto filesDeleted = deleBatch(orphanFiles);
+    for (size_t i = 0; i < orphanFiles.size(); ++i) {
+      (filesDeleted[i] ? report.deletedPaths : report.failedPaths).push_back(orphanFiles[i]);
+    }
+    const auto dirsDeleted = rmdBatch(orphanDirs);
+    for (size_t i = 0; i < orphanDirs.size(); ++i) {
+      (dirsDeleted[i] ? report.deletedPaths : report.failedPaths).push_back(orphanDirs[i]);
+    }
+  }
+
+  report.elapsed = std::chrono::steady_clock::now() - startTime;
+  return report;
+}
+
+std::optional<std::uintmax_t>
+Client::size(const std::string &serverFile)
+{
+  // The size depends on the transfer type, and we only ever transfer in image type.
+  if (!setImageType()) {
+    return {};
+  }
+  return fsm::sizeFsm(controlSocket_, serverFile);
+}
+
+std::optional<std::string>
+Client::pwd()
+{
+  if (sessionState_.currentDirectory) {
+    ++roundTripsSaved_;
+    return sessionState_.currentDirectory;
+  }
+  sessionState_.currentDirectory = fsm::directoryFsm(controlSocket_, {});
+  return sessionState_.currentDirectory;
+}
+
+bool
+Client::cwd(const std::string &newDir)
+{
+  // Only skip it if it's exactly the directory the server told us we're in. Anything
+  // else could resolve differently on the server (e.g. through links), so we'd have to
+  // ask where we ended up anyway.
+  if (sessionState_.currentDirectory && newDir == *sessionState_.currentDirectory) {
+    ++roundTripsSaved_;
+    return true;
+  }
+  sessionState_.currentDirectory.reset();
+  return fsm::oneStepFsm(controlSocket_, std::string("CWD ") + newDir);
+}
+
+std::optional<std::string>
+Client::mkd(const std::string &newDir)
+{
+  return fsm::directoryFsm(controlSocket_, newDir);
+}
+
+bool
+Client::dele(const std::string &fileToDelete)
+{
+  return fsm::oneStepFsm(controlSocket_, std::string("DELE ") + fileToDelete);
+}
+
+bool
+Client::rmd(const std::string &dirToDelete)
+{
+  // It might be the one we're in, or a parent of it, in which case CWD to it would fail.
+  sessionState_.currentDirectory.reset();
+  return fsm::oneStepFsm(controlSocket_, std::string("RMD ") + dirToDelete);
+}
+
+std::optional<std::string>
+Client::list(const std::string &dirToList)
+{
+  return list(std::make_optional(dirToList));
+}
+
+std::optional<std::string>
+Client::list()
+{
+  return list(std::nullopt);
+}
+
+bool
+Client::list(const std::string &dirToList, const LineCallback &onLine)
+{
+  return retrieveListing("LIST", std::make_optional(std::cref(dirToList)), [&onLine](io::Socket &dataSocket) {
+    return dataSocket.retrieveLines(onLine);
+  });
+}
+
+bool
+Client::list(const LineCallback &onLine)
+{
+  return retrieveListing("LIST", std::nullopt, [&onLine](io::Socket &dataSocket) {
+    return dataSocket.retrieveLines(onLine);
+  });
+}
+
+bool
+Client::nlst(const std::string &dirToList, const LineCallback &onLine)
+{
+  return retrieveListing("NLST", std::make_optional(std::cref(dirToList)), [&onLine](io::Socket &dataSocket) {
+    return dataSocket.retrieveLines(onLine);
+  });
+}
+
+bool
+Client::nlst(const LineCallback &onLine)
+{
+  return retrieveListing("NLST", std::nullopt, [&onLine](io::Socket &dataSocket) {
+    return dataSocket.retrieveLines(onLine);
+  });
+}
+
+bool
+Client::listEntries(const std::string &dirToList, const EntryCallback &onEntry)
+{
+  return listEntries(std::make_optional(std::cref(dirToList)), onEntry);
+}
+
+bool
+Client::listEntries(const EntryCallback &onEntry)
+{
+  return listEntries(std::nullopt, onEntry);
+}
+
+bool
+Client::listEntries(
+  const std::optional<std::reference_wrapper<const std::string>> &maybeDirToList,
+  const EntryCallback &onEntry
+)
+{
+  const bool isMlsd = isFeatureSupported("MLST");
+
+  // Reused for every line, so that parsing doesn't allocate once it's warmed up.
+  fsm::ListingEntry entry;
+  const auto now = std::chrono::system_clock::now();
+  const auto onLine = [&onEntry, &entry, &now, isMlsd](std::string_view line) {
+    const bool isEntry = isMlsd ? fsm::parseMlsxEntry(line, entry) : fsm::parseListEntry(line, entry, now);
+    if (!isEntry) {
+      if (!line.empty()) {
+        LOG_WARN("Skipping unrecognised listing line: " << line);
+      }
+      return;
+    }
+    if (entry.type != fsm::ListingEntry::Type::CurrentDirectory && entry.type != fsm::ListingEntry::Type::ParentDirectory) {
+      onEntry(entry);
+    }
+  };
+
+  return retrieveListing(isMlsd ? "MLSD" : "LIST", maybeDirToList, [&onLine](io::Socket &dataSocket) {
+    return dataSocket.retrieveLines(onLine);
+  });
+}
+
+bool
+Client::isFeatureSupported(const std::string &feature)
+{
+  const auto maybeFeatures = features();
+  return maybeFeatures && std::any_of(
+    maybeFeatures->cbegin(),
+    maybeFeatures->cend(),
+    [&feature](const std::string &supported) {
+      return supported == feature || supported.rfind(feature + " ", 0) == 0;
+    }
+  );
+}
+
+std::optional<fsm::ListingEntry>
+Client::mlst(const std::string &path)
+{
+  return fsm::mlstFsm(controlSocket_, path);
+}
+
+std::optional<std::string>
+Client::list(const std::optional<std::reference_wrapper<const std::string>> &maybeDirToList)
+{
+  // This holds the whole listing in memory, which isn't reasonable for a big
+  // directory. The streaming overloads avoid that.
+  std::optional<std::string> maybeListOutput(std::nullopt);
+
+  retrieveListing("LIST", maybeDirToList, [&maybeListOutput](io::Socket &dataSocket) {
+    std::stringstream outputStream;
+
+    bool isSuccess = dataSocket.retrieveToStream(outputStream);
+    if (isSuccess) {
+      // It would be nice to do std::move(outputStream).str() here
+      // to move assign the output from the string stream. Unfortunately,
+      // that's not possible until C++20, which means we have to make
+      // a copy of the (potentially large) string that is placed in
+      // the stringstream by the socket operation.
+      // I don't know a workaround for this that works with output streams.
+      maybeListOutput = outputStream.str();
+    }
+    return isSuccess;
+  });
+
+  return maybeListOutput;
+}
+
+bool
+Client::retrieveListing(
+  const std::string &verb,
+  const std::optional<std::reference_wrapper<const std::string>> &maybeDirToList,
+  const std::function<bool(io::Socket&)> &receive
+)
+{
+  // Construct command depending on whether user specified a directory explicitly.
+  // If not, the server should assume they want to list the current directory.
+  std::string command(verb + " ");
+  if (maybeDirToList) {
+    command.append(*maybeDirToList);
+  }
+
+  // Set up data connection. Note the original ftp says we should use the ASCII transfer type
+  // for list commands but we will assume the server is robust to any transfer type (specifically
+  // to image type, which we use everywhere else). It shouldn't matter to the server or to us
+  // because we just print the data we receive as a string; we don't need to interpret it.
+  auto maybeDataSocket = setupDataConnection();
+  if (!maybeDataSocket) {
+    return false;
+  }
+  io::Socket &dataSocket = *maybeDataSocket;
+
+  bool isReceived = false;
+  const auto onPreliminaryReply = [this, &receive, &isReceived, &dataSocket](const std::string &) {
+    isReceived = secureDataConnection(dataSocket) && receive(dataSocket);
 
     if (dataSocket.isOpen()) {
       dataSocket.close();
     }
+    requestPrefetch();
   };
 
   // Send request and return response.
-  fsm::twoStepFsm(controlSocket_, command, onPreliminaryReply);
+  const auto start = std::chrono::steady_clock::now();
+  const bool isServerHappy = fsm::twoStepFsm(controlSocket_, command, onPreliminaryReply);
+  recordTransfer(dataSocket, start);
+  completePrefetch();
 
-  return maybeListOutput;
+  return isReceived && isServerHappy;
 }
 
 bool
 Client::rename(const std::string &from, const std::string &to)
 {
+  // See `rmd`.
+  sessionState_.currentDirectory.reset();
   return fsm::renameFsm(controlSocket_, from, to);
 }
 
+std::optional<std::chrono::system_clock::time_point>
+Client::mdtm(const std::string &serverFile)
+{
+  return mdtmBatch({serverFile}).front();
+}
+
+std::vector<bool>
+Client::deleBatch(const std::vector<std::string> &filesToDelete)
+{
+  return pipelineEach<bool>(controlSocket_, "DELE", filesToDelete, isPositiveCompletion);
+}
+
+std::vector<std::optional<std::string>>
+Client::mkdBatch(const std::vector<std::string> &newDirs)
+{
+  return pipelineEach<std::optional<std::string>>(controlSocket_, "MKD", newDirs, [](const io::Reply &reply) {
+    return fsm::parseDirectoryReply(reply.text);
+  });
+}
+
+std::vector<bool>
+Client::rmdBatch(const std::vector<std::string> &dirsToDelete)
+{
+  sessionState_.currentDirectory.reset();
+  return pipelineEach<bool>(controlSocket_, "RMD", dirsToDelete, isPositiveCompletion);
+}
+
+std::vector<bool>
+Client::cwdBatch(const std::vector<std::string> &newDirs)
+{
+  sessionState_.currentDirectory.reset();
+  return pipelineEach<bool>(controlSocket_, "CWD", newDirs, isPositiveCompletion);
+}
+
+std::vector<bool>
+Client::renameBatch(const std::vector<std::pair<std::string, std::string>> &renames)
+{
+  // If an RNFR fails, the server rejects the RNTO after it as out of sequence,
+  // so it's safe to send each pair without checking the first reply.
+  sessionState_.currentDirectory.reset();
+  std::vector<std::string> commands;
+  commands.reserve(2 * renames.size());
+  for (const auto &[from, to] : renames) {
+    commands.push_back(std::string("RNFR ") + from);
+    commands.push_back(std::string("RNTO ") + to);
+  }
+
+  std::vector<bool> results(renames.size());
+  fsm::pipelineFsm(controlSocket_, commands, [&results](size_t i, const std::optional<io::Reply> &reply) {
+    if (i % 2 == 0) {
+      results[i / 2] = reply && reply->kind() == 3;
+    } else {
+      results[i / 2] = results[i / 2] && reply && reply->kind() == 2;
+    }
+  });
+  return results;
+}
+
+std::vector<std::optional<std::uintmax_t>>
+Client::sizeBatch(const std::vector<std::string> &serverFiles)
+{
+  // As for `size`, the sizes depend on the transfer type.
+  if (!setImageType()) {
+    return std::vector<std::optional<std::uintmax_t>>(serverFiles.size());
+  }
+  return pipelineEach<std::optional<std::uintmax_t>>(controlSocket_, "SIZE", serverFiles, [](const io::Reply &reply) {
+    return fsm::parseSizeReply(reply.text);
+  });
+}
+
+std::vector<std::optional<std::chrono::system_clock::time_point>>
+Client::mdtmBatch(const std::vector<std::string> &serverFiles)
+{
+  return pipelineEach<std::optional<std::chrono::system_clock::time_point>>(
+    controlSocket_,
+    "MDTM",
+    serverFiles,
+    [](const io::Reply &reply) { return fsm::parseMdtmReply(reply.text); }
+  );
+}
+
+std::optional<std::vector<std::string>>
+Client::features()
+{
+  // The server's features don't change during a session.
+  if (sessionState_.features) {
+    ++roundTripsSaved_;
+    return sessionState_.features;
+  }
+  sessionState_.features = fsm::featFsm(controlSocket_);
+  return sessionState_.features;
+}
+
+std::uint64_t
+Client::roundTripsSaved() const
+{
+  return roundTripsSaved_;
+}
+
+std::optional<io::Socket::SendMethod>
+Client::lastSendMethod() const
+{
+  return lastSendMethod_;
+}
+
+void
+Client::setReceiveBufferSize(size_t size)
+{
+  receiveBufferSize_ = size;
+}
+
+void
+Client::setDataConnectionPrefetch(bool isEnabled)
+{
+  isPrefetchEnabled_ = isEnabled;
+  if (!isEnabled) {
+    discardPrefetch();
+  }
+}
+
+void
+Client::setCompressionLevel(std::optional<int> level)
+{
+  assert(!level || (*level >= 1 && *level <= 9));
+  compressionLevel_ = level;
+  // A prefetched connection would skip setting up the new mode.
+  discardPrefetch();
+}
+
+void
+Client::setTls(std::shared_ptr<io::TlsContext> context)
+{
+  assert(!context || context->role() == io::TlsContext::Role::Client);
+  tlsContext_ = std::move(context);
+}
+
+const io::Metrics &
+Client::metrics() const
+{
+  return *metrics_;
+}
+
+void
+Client::runOnConnections(size_t numConnections, const std::function<void(Client&, size_t)> &worker)
+{
+  std::vector<std::thread> threads;
+  // Without these we can't open the other connections, so this one does everything.
+  if (hostAndPort_ && credentials_) {
+    // Read here because this connection is in use while the others are opened.
+    const auto tlsSession = controlSocket_.tlsSession();
+    for (size_t i = 1; i < numConnections; ++i) {
+      threads.emplace_back([this, i, &worker, tlsSession]() {
+        const auto other = connectAnother(tlsSession);
+        if (!other) {
+          // The other connections carry on without this one.
+          return;
+        }
+        worker(*other, i);
+        other->quit();
+      });
+    }
+  }
+
+  worker(*this, 0);
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+std::unique_ptr<Client>
+Client::connectAnother(const io::TlsSession &tlsSession)
+{
+  assert(hostAndPort_ && credentials_);
+  // Share our io context; Clients are independent even when they do.
+  auto other = std::make_unique<Client>(ioContext_);
+  other->metrics_ = metrics_;
+  other->controlSocket_.setMetrics(metrics_, io::Socket::Connection::Control);
+  other->tlsContext_ = tlsContext_;
+  if (!other->connect(hostAndPort_->first, hostAndPort_->second, tlsSession) || !other->login(*credentials_)) {
+    return {};
+  }
+  if (receiveBufferSize_) {
+    other->setReceiveBufferSize(*receiveBufferSize_);
+  }
+  other->compressionLevel_ = compressionLevel_;
+  return other;
+}
+
+bool
+Client::retrRange(
+  const std::string &serverSrc,
+  const std::filesystem::path &destPath,
+  std::uintmax_t offset,
+  std::uintmax_t length
+) {
+  auto maybeDataSocket = setupDataConnection();
+  if (!maybeDataSocket) {
+    return false;
+  }
+  io::Socket &dataSocket = *maybeDataSocket;
+
+  if (receiveBufferSize_) {
+    dataSocket.setReceiveBufferSize(*receiveBufferSize_);
+  }
+
+  // REST has to come immediately before the RETR it applies to. There's no need
+  // for it at the start of the file, which also means a single range works on
+  // servers that don't support it.
+  if (offset > 0 && !fsm::restFsm(controlSocket_, offset)) {
+    return false;
+  }
+
+  bool isReceived = false;
+  const auto onPreliminaryReply = [this, &dataSocket, &destPath, offset, length, &isReceived](const std::string &) {
+    isReceived = secureDataConnection(dataSocket) && dataSocket.retrieveFileRange(destPath, offset, length);
+    dataSocket.close();
+  };
+
+  // Closing the data connection as soon as we have our range means the server will
+  // usually report the transfer as aborted, so its final reply doesn't tell us
+  // anything. Whether we received the whole range is all that matters.
+  const auto start = std::chrono::steady_clock::now();
+  fsm::twoStepFsm(
+    controlSocket_,
+    std::string("RETR ") + serverSrc,
+    onPreliminaryReply
+  );
+  recordTransfer(dataSocket, start);
+  return isReceived;
+}
+
+bool
+Client::startTls(const std::string &host, const io::TlsSession &session)
+{
+  // RFC 4217: AUTH TLS, the handshake, then PBSZ (meaningless for TLS, but required)
+  // and PROT before any data connection is opened.
+  if (!fsm::oneStepFsm(controlSocket_, "AUTH TLS")) {
+    LOG_ERROR("Server refused AUTH TLS.");
+    return false;
+  }
+  if (!controlSocket_.startTls(tlsContext_, host, session)) {
+    return false;
+  }
+  isDataProtected_ = fsm::oneStepFsm(controlSocket_, "PBSZ 0") && fsm::oneStepFsm(controlSocket_, "PROT P");
+  if (!isDataProtected_) {
+    LOG_ERROR("Server refused to protect data connections.");
+  }
+  return isDataProtected_;
+}
+
+bool
+Client::secureDataConnection(io::Socket &dataSocket)
+{
+  if (!isDataProtected_) {
+    return true;
+  }
+  // The control connection's session has picked up any tickets the server sent after
+  // its handshake, so the data connection can resume it. The data connection's
+  // certificate, if it comes to that, is checked against the control connection's host.
+  return dataSocket.startTls(tlsContext_, hostAndPort_->first, controlSocket_.tlsSession());
+}
+
+bool
+Client::setImageType()
+{
+  if (sessionState_.isImageType) {
+    ++roundTripsSaved_;
+    return true;
+  }
+  sessionState_.isImageType = fsm::oneStepFsm(controlSocket_, "TYPE I");
+  return sessionState_.isImageType;
+}
+
+bool
+Client::setCompressedMode(bool isCompressed)
+{
+  if (sessionState_.isModeZ == isCompressed) {
+    return true;
+  }
+  if (!fsm::oneStepFsm(controlSocket_, isCompressed ? "MODE Z" : "MODE S")) {
+    // Servers leave the mode alone when they refuse to change it.
+    return false;
+  }
+  sessionState_.isModeZ = isCompressed;
+  return true;
+}
+
 std::optional<io::Socket>
 Client::setupDataConnection()
 {
+  const auto start = std::chrono::steady_clock::now();
+  const auto connected = [this, start](io::Socket &dataSocket) {
+    dataSocket.setMetrics(metrics_, io::Socket::Connection::Data);
+    dataSocket.setCompression(sessionState_.isModeZ ? compressionLevel_ : std::nullopt);
+    metrics_->recordDataConnectionSetup(std::chrono::steady_clock::now() - start);
+  };
+
+  // Use the connection prefetched during the last transfer, if there is one. It
+  // was set up after the transfer type, so that's already in effect.
+  if (prefetchedDataSocket_) {
+    auto dataSocket = std::move(*prefetchedDataSocket_);
+    const bool isFresh = std::chrono::steady_clock::now() - prefetchTime_ < MAX_PREFETCH_AGE;
+    prefetchedDataSocket_.reset();
+    if (isFresh && dataSocket.finishConnect()) {
+      // Both the PASV and the connection's handshake happened during the last transfer.
+      roundTripsSaved_ += 2;
+      LOG_DEBUG("Using prefetched data connection.");
+      connected(dataSocket);
+      return dataSocket;
+    }
+    // Otherwise start again. The server replaces its passive listener when we send another PASV.
+  }
+
   // Set correct transfer type.
   // Only the unstructured "image" type is supported.
   // Users can still have structure in their data but they have
   // to manage it themselves.
-  if (!fsm::oneStepFsm(controlSocket_, "TYPE I")) {
+  if (!setImageType()) {
+    return {};
+  }
+
+  // Compress if we've been asked to and the server can. If the server turns down
+  // MODE Z anyway, carry on in stream mode, but a failed MODE S leaves us stuck.
+  const bool isCompressing = compressionLevel_ && isFeatureSupported("MODE Z");
+  if (!setCompressedMode(isCompressing) && !isCompressing) {
     return {};
   }
 
@@ -262,26 +1663,101 @@ Client::setupDataConnection()
   // We use passive connections so that we can initiate the data connection. Otherwise, the server
   // will try to contact us at a port it specifies but that is unlikely to work because most
   // clients won't have that port exposed to the internet.
-  const auto maybeConnectionInfo = fsm::pasvFsm(controlSocket_);
+  auto maybeConnectionInfo = fsm::pasvFsm(controlSocket_);
+  if (!maybeConnectionInfo && hostAndPort_) {
+    // Servers which only listen on IPv6 addresses can't answer PASV, which only has
+    // room for an IPv4 one, but can still tell us a port with EPSV.
+    if (auto maybePort = fsm::epsvFsm(controlSocket_)) {
+      maybeConnectionInfo.emplace(hostAndPort_->first, std::move(*maybePort));
+    }
+  }
   if (!maybeConnectionInfo) {
     // The server didn't give us valid connection information, or some other problem occurred.
+    // Either way, we can't be sure what state it's in any more.
+    sessionState_ = {};
     return {};
   }
   const auto &[host, port] = *maybeConnectionInfo;
-  LOG("Parsed response: host=" << host << "; port=" << port);
-  // TODO: threading considerations?
-  io::Socket dataSocket;
+  LOG_DEBUG("Parsed response: host=" << host << "; port=" << port);
+  io::Socket dataSocket(ioContext_);
   if (!dataSocket.connect(host, port)) {
     return {};
   }
-  LOG("Data socket connected.");
+  LOG_DEBUG("Data socket connected.");
+  connected(dataSocket);
   return dataSocket;
 }
 
+void
+Client::recordTransfer(const io::Socket &dataSocket, std::chrono::steady_clock::time_point start)
+{
+  metrics_->recordTransfer(std::chrono::steady_clock::now() - start);
+  if (const auto firstByteTime = dataSocket.firstByteTime()) {
+    metrics_->recordTimeToFirstByte(*firstByteTime - start);
+  }
+}
+
+void
+Client::requestPrefetch()
+{
+  if (!isPrefetchEnabled_ || isPasvPending_) {
+    return;
+  }
+  // Don't wait for the reply: the server won't send it until it has finished the
+  // current transfer, and we still have to read that transfer's final reply first.
+  // The transfer type was set for the current transfer, so it's still in effect.
+  const std::string pasv("PASV\r\n");
+  isPasvPending_ = controlSocket_.sendString(pasv) == pasv.size();
+}
+
+void
+Client::completePrefetch()
+{
+  if (!isPasvPending_) {
+    return;
+  }
+  isPasvPending_ = false;
+
+  // Always read the reply, even if the transfer failed, so that the next reply we
+  // read is the one to the next command.
+  const auto reply = controlSocket_.readReply();
+  if (!reply) {
+    sessionState_ = {};
+    return;
+  }
+  const auto maybeConnectionInfo = fsm::parsePasvReply(reply->text);
+  if (!maybeConnectionInfo) {
+    return;
+  }
+
+  const auto &[host, port] = *maybeConnectionInfo;
+  io::Socket dataSocket(ioContext_);
+  if (dataSocket.beginConnect(host, port)) {
+    prefetchedDataSocket_.emplace(std::move(dataSocket));
+    prefetchTime_ = std::chrono::steady_clock::now();
+  }
+}
+
+void
+Client::discardPrefetch()
+{
+  // A PASV reply that's still pending belongs to the old session, and will be
+  // discarded with it.
+  isPasvPending_ = false;
+  prefetchedDataSocket_.reset();
+}
+
 bool
-Client::storOrAppe(const std::string &localSrc, const std::string &serverDest, bool isAppendOperation)
-{ // TODO: try-catch still needed?
+Client::storOrAppe(
+  const std::string &localSrc,
+  const std::string &serverDest,
+  bool isAppendOperation,
+  std::uintmax_t offset,
+  const std::shared_ptr<io::Transform> &transform
+) { // TODO: try-catch still needed?
 try {
+  lastSendMethod_.reset();
+
   std::filesystem::path path(localSrc);
   if (!exists(path)) {
     return false;
@@ -294,12 +1770,26 @@ try {
   }
   io::Socket &dataSocket = *maybeDataSocket;
 
+  // When resuming a STOR, tell the server where to start writing. APPE always
+  // writes at the end of the file so doesn't need it. REST has to come immediately
+  // before the command it applies to.
+  if (offset > 0 && !isAppendOperation && !fsm::restFsm(controlSocket_, offset)) {
+    return false;
+  }
+
   // Lambda for sending the file; called if/when the server responds
   // with a 1xx.
   bool isSent = false;
-  const auto onPreliminaryReply = [&dataSocket, &path, &isSent]() {
-    // Try and send the file over the data connection.
-    isSent = dataSocket.sendFile(path);
+  const auto onPreliminaryReply = [this, &dataSocket, &path, offset, &transform, &isSent](const std::string &) {
+    // Try and send the file over the data connection, skipping anything the
+    // server already has.
+    dataSocket.setTransform(transform);
+    isSent = secureDataConnection(dataSocket) && dataSocket.sendFile(path, offset);
+    lastSendMethod_ = dataSocket.lastSendMethod();
+    if (transform) {
+      const auto stats = transform->stats();
+      lastCompressionReport_ = CompressionReport{stats.bytesIn, stats.bytesOut, stats.cpuTime};
+    }
 
     // Close data connection.
     // The server should close this on its end but the io::Socket will still be
@@ -307,15 +1797,19 @@ try {
     if (dataSocket.isOpen()) {
       dataSocket.close();
     }
+    requestPrefetch();
   };
 
   // Send the request, using either append mode or overwrite mode depending on
   // the argument.
+  const auto start = std::chrono::steady_clock::now();
   const bool isServerHappy = fsm::twoStepFsm(
     controlSocket_,
     std::string(isAppendOperation ? "APPE " : "STOR ") + serverDest,
     onPreliminaryReply
   );
+  recordTransfer(dataSocket, start);
+  completePrefetch();
 
   // TODO: what if something goes wrong on our end after we've sent some bytes, and the server thinks
   // we've sent the whole file and so sends a positive response? Do we then tell it to delete the
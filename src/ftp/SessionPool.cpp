@@ -0,0 +1,285 @@
+#include "ftp/SessionPool.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "util/util.hpp"
+
+namespace ftp
+{
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+std::string
+hostKey(const SessionPool::Credentials &credentials)
+{
+  return credentials.host + ":" + credentials.port;
+}
+
+}
+
+bool
+SessionPool::Credentials::operator==(const Credentials &other) const
+{
+  return host == other.host && port == other.port && username == other.username && password == other.password;
+}
+
+SessionPool::Lease::Lease(SessionPool &pool, Credentials credentials, std::unique_ptr<Client> client)
+  : pool_(&pool),
+    credentials_(std::move(credentials)),
+    client_(std::move(client)),
+    isDiscarded_(false)
+{ }
+
+SessionPool::Lease::~Lease()
+{
+  // Moved-from Leases have nothing to give back.
+  if (client_) {
+    pool_->release(credentials_, std::move(client_), isDiscarded_);
+  }
+}
+
+Client &
+SessionPool::Lease::operator*() const
+{
+  return *client_;
+}
+
+Client *
+SessionPool::Lease::operator->() const
+{
+  return client_.get();
+}
+
+void
+SessionPool::Lease::discard()
+{
+  isDiscarded_ = true;
+}
+
+SessionPool::SessionPool()
+  : SessionPool(Options{})
+{ }
+
+SessionPool::SessionPool(const Options &options)
+  : options_(options),
+    isStopping_(false),
+    keepaliveThread_([this]() { keepIdleSessionsAlive(); })
+{
+  assert(options_.maxConnectionsPerHost > 0);
+}
+
+SessionPool::~SessionPool()
+{
+  {
+    std::lock_guard lock(mutex_);
+    isStopping_ = true;
+  }
+  keepaliveWake_.notify_all();
+  // Only once it has finished, because it puts the sessions it was checking back.
+  keepaliveThread_.join();
+
+  std::vector<IdleSession> idle;
+  {
+    std::lock_guard lock(mutex_);
+    idle.swap(idle_);
+  }
+  for (auto &session : idle) {
+    session.client->quit();
+  }
+}
+
+std::optional<SessionPool::Lease>
+SessionPool::acquire(const Credentials &credentials)
+{
+  const auto deadline = Clock::now() + options_.acquireTimeout;
+  const std::string host(hostKey(credentials));
+
+  std::unique_lock lock(mutex_);
+  while (true) {
+    // The most recently returned session is the least likely to have been timed out by the server.
+    const auto reusable = std::find_if(idle_.rbegin(), idle_.rend(), [&credentials](const IdleSession &session) {
+      return session.credentials == credentials;
+    });
+    if (reusable != idle_.rend()) {
+      IdleSession session(std::move(*reusable));
+      idle_.erase(std::next(reusable).base());
+      lock.unlock();
+
+      const bool isStale = Clock::now() - session.lastChecked >= options_.keepaliveInterval;
+      if (isStale && !session.client->noop()) {
+        LOG_WARN("Pooled session failed its check; closing it. host=" << host);
+        lock.lock();
+        ++stats_.numEvicted;
+        forget(credentials);
+        continue;
+      }
+
+      lock.lock();
+      ++stats_.numReused;
+      return Lease(*this, credentials, std::move(session.client));
+    }
+
+    // Rather than open another session, wait for one that's only out for a keepalive.
+    const bool isBeingChecked = std::find(beingChecked_.cbegin(), beingChecked_.cend(), credentials)
+      != beingChecked_.cend();
+    if (!isBeingChecked && numOpen_[host] < options_.maxConnectionsPerHost) {
+      ++numOpen_[host];
+      lock.unlock();
+
+      auto client = std::make_unique<Client>();
+      const bool isLoggedIn = client->connect(credentials.host, credentials.port)
+        && client->login(credentials.username, credentials.password);
+
+      lock.lock();
+      if (!isLoggedIn) {
+        LOG_ERROR("Could not open pooled session. host=" << host << "; username=" << credentials.username);
+        forget(credentials);
+        return {};
+      }
+      ++stats_.numCreated;
+      return Lease(*this, credentials, std::move(client));
+    }
+
+    // The host is at its limit. If some of its sessions are idle, they belong to other
+    // users, so close the one which has been idle longest to make room.
+    const auto other = std::find_if(idle_.begin(), idle_.end(), [&host](const IdleSession &session) {
+      return hostKey(session.credentials) == host;
+    });
+    if (!isBeingChecked && other != idle_.end()) {
+      auto client = std::move(other->client);
+      idle_.erase(other);
+      ++stats_.numEvicted;
+      forget(credentials);
+      lock.unlock();
+      client->quit();
+      lock.lock();
+      continue;
+    }
+
+    if (sessionReleased_.wait_until(lock, deadline) == std::cv_status::timeout) {
+      LOG_WARN("Timed out waiting for a pooled session. host=" << host);
+      return {};
+    }
+  }
+}
+
+size_t
+SessionPool::numIdle() const
+{
+  std::lock_guard lock(mutex_);
+  return idle_.size() + beingChecked_.size();
+}
+
+SessionPool::Stats
+SessionPool::stats() const
+{
+  std::lock_guard lock(mutex_);
+  return stats_;
+}
+
+void
+SessionPool::release(const Credentials &credentials, std::unique_ptr<Client> client, bool isDiscarded)
+{
+  if (isDiscarded) {
+    // Don't bother with QUIT; the session may not be in a state to answer it.
+    client.reset();
+    std::lock_guard lock(mutex_);
+    ++stats_.numEvicted;
+    forget(credentials);
+    return;
+  }
+
+  {
+    std::lock_guard lock(mutex_);
+    const auto now = Clock::now();
+    // Being used counts as a check: it answered whatever the borrower sent.
+    idle_.push_back(IdleSession{credentials, std::move(client), now, now});
+  }
+  sessionReleased_.notify_all();
+  keepaliveWake_.notify_all();
+}
+
+void
+SessionPool::forget(const Credentials &credentials)
+{
+  const auto found = numOpen_.find(hostKey(credentials));
+  assert(found != numOpen_.end() && found->second > 0);
+  if (--found->second == 0) {
+    numOpen_.erase(found);
+  }
+  sessionReleased_.notify_all();
+}
+
+void
+SessionPool::keepIdleSessionsAlive()
+{
+  std::unique_lock lock(mutex_);
+  while (!isStopping_) {
+    // Sleep until the next session is due a check or due to be closed.
+    std::optional<Clock::time_point> nextDue;
+    for (const auto &session : idle_) {
+      const auto due = std::min(session.lastChecked + options_.keepaliveInterval, session.idleSince + options_.maxIdleTime);
+      nextDue = nextDue ? std::min(*nextDue, due) : due;
+    }
+    if (!nextDue) {
+      keepaliveWake_.wait(lock);
+      continue;
+    } else if (Clock::now() < *nextDue) {
+      keepaliveWake_.wait_until(lock, *nextDue);
+      continue;
+    }
+
+    // Take the sessions which are due out of the pool, so that nobody borrows them
+    // while they're being dealt with.
+    const auto now = Clock::now();
+    std::vector<IdleSession> expired, toCheck;
+    for (auto it = idle_.begin(); it != idle_.end();) {
+      if (now - it->idleSince >= options_.maxIdleTime) {
+        expired.push_back(std::move(*it));
+      } else if (now - it->lastChecked >= options_.keepaliveInterval) {
+        toCheck.push_back(std::move(*it));
+      } else {
+        ++it;
+        continue;
+      }
+      it = idle_.erase(it);
+    }
+    for (const auto &session : toCheck) {
+      beingChecked_.push_back(session.credentials);
+    }
+    lock.unlock();
+
+    for (auto &session : expired) {
+      session.client->quit();
+    }
+    std::vector<bool> isAlive;
+    for (auto &session : toCheck) {
+      isAlive.push_back(session.client->noop());
+    }
+
+    lock.lock();
+    beingChecked_.clear();
+    for (const auto &session : expired) {
+      ++stats_.numEvicted;
+      forget(session.credentials);
+    }
+    for (size_t i = 0; i < toCheck.size(); ++i) {
+      ++stats_.numKeepalives;
+      if (isAlive[i]) {
+        toCheck[i].lastChecked = Clock::now();
+        idle_.push_back(std::move(toCheck[i]));
+      } else {
+        LOG_WARN("Pooled session failed its keepalive; closing it. host=" << hostKey(toCheck[i].credentials));
+        ++stats_.numEvicted;
+        forget(toCheck[i].credentials);
+      }
+    }
+    // Checked sessions are available again.
+    sessionReleased_.notify_all();
+  }
+}
+
+}
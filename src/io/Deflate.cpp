@@ -0,0 +1,142 @@
+#include "io/Deflate.h"
+
+#include <cassert>
+#include <limits>
+
+#include "util/util.hpp"
+
+namespace io {
+
+namespace {
+
+// Each call to `onOutput` gets at most this much.
+constexpr size_t DEFLATE_OUTPUT_SIZE = 64 * 1024;
+
+// zlib counts in uInt, so bigger inputs are passed in pieces.
+constexpr size_t MAX_ZLIB_CHUNK = std::numeric_limits<uInt>::max();
+
+// zlib picks the wrapper from the window size it's given: 16 more for gzip.
+int
+windowBits(DeflateFormat format)
+{
+  return format == DeflateFormat::Gzip ? MAX_WBITS + 16 : MAX_WBITS;
+}
+
+}
+
+Deflater::Deflater(int level, DeflateFormat format)
+  : stream_(),
+    isInitialised_(false),
+    output_(std::make_unique<char[]>(DEFLATE_OUTPUT_SIZE))
+{
+  assert(level >= Z_BEST_SPEED && level <= Z_BEST_COMPRESSION);
+  isInitialised_ = ::deflateInit2(&stream_, level, Z_DEFLATED, windowBits(format), 8, Z_DEFAULT_STRATEGY) == Z_OK;
+  if (!isInitialised_) {
+    LOG_ERROR("Could not initialise deflate. level=" << level);
+  }
+}
+
+Deflater::~Deflater()
+{
+  if (isInitialised_) {
+    ::deflateEnd(&stream_);
+  }
+}
+
+bool
+Deflater::deflate(std::string_view input, bool isFinal, const std::function<bool(std::string_view)> &onOutput)
+{
+  if (!isInitialised_) {
+    return false;
+  }
+
+  while (true) {
+    const size_t chunkSize = std::min(input.size(), MAX_ZLIB_CHUNK);
+    const bool isLastChunk = chunkSize == input.size();
+    stream_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+    stream_.avail_in = static_cast<uInt>(chunkSize);
+    const int flush = isFinal && isLastChunk ? Z_FINISH : Z_NO_FLUSH;
+
+    // Keep going until zlib has taken all of the input, and, when finishing, has
+    // written out everything it was holding.
+    int result;
+    do {
+      stream_.next_out = reinterpret_cast<Bytef *>(output_.get());
+      stream_.avail_out = static_cast<uInt>(DEFLATE_OUTPUT_SIZE);
+      result = ::deflate(&stream_, flush);
+      if (result == Z_STREAM_ERROR) {
+        LOG_ERROR("Deflate failed.");
+        return false;
+      }
+      const size_t produced = DEFLATE_OUTPUT_SIZE - stream_.avail_out;
+      if (produced > 0 && !onOutput(std::string_view(output_.get(), produced))) {
+        return false;
+      }
+    } while (stream_.avail_out == 0 || (flush == Z_FINISH && result != Z_STREAM_END));
+
+    input.remove_prefix(chunkSize);
+    if (isLastChunk) {
+      return true;
+    }
+  }
+}
+
+Inflater::Inflater(DeflateFormat format)
+  : stream_(),
+    isInitialised_(false),
+    isFinished_(false)
+{
+  isInitialised_ = ::inflateInit2(&stream_, windowBits(format)) == Z_OK;
+  if (!isInitialised_) {
+    LOG_ERROR("Could not initialise inflate.");
+  }
+}
+
+Inflater::~Inflater()
+{
+  if (isInitialised_) {
+    ::inflateEnd(&stream_);
+  }
+}
+
+std::optional<size_t>
+Inflater::inflate(std::string_view &input, char *output, size_t outputSize)
+{
+  if (!isInitialised_) {
+    return {};
+  }
+  if (isFinished_) {
+    return 0;
+  }
+
+  stream_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+  stream_.avail_in = static_cast<uInt>(std::min(input.size(), MAX_ZLIB_CHUNK));
+  stream_.next_out = reinterpret_cast<Bytef *>(output);
+  stream_.avail_out = static_cast<uInt>(std::min(outputSize, MAX_ZLIB_CHUNK));
+  const uInt availIn = stream_.avail_in, availOut = stream_.avail_out;
+
+  const int result = ::inflate(&stream_, Z_NO_FLUSH);
+  if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+    LOG_ERROR("Inflate failed: error=" << (stream_.msg ? stream_.msg : "unknown"));
+    return {};
+  }
+
+  input.remove_prefix(availIn - stream_.avail_in);
+  isFinished_ = result == Z_STREAM_END;
+  return availOut - stream_.avail_out;
+}
+
+bool
+Inflater::isFinished() const
+{
+  return isFinished_;
+}
+
+bool
+Inflater::reset()
+{
+  isFinished_ = false;
+  return isInitialised_ && ::inflateReset(&stream_) == Z_OK;
+}
+
+}
@@ -0,0 +1,102 @@
+#include "io/File.h"
+
+#include <cerrno>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/system/system_error.hpp>
+
+namespace io {
+
+FileDescriptor::FileDescriptor(int fd) : fd_(fd)
+{ }
+
+FileDescriptor::~FileDescriptor()
+{
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+}
+
+FileDescriptor::FileDescriptor(FileDescriptor &&other) noexcept
+  : fd_(std::exchange(other.fd_, -1))
+{ }
+
+FileDescriptor &
+FileDescriptor::operator=(FileDescriptor &&other) noexcept
+{
+  if (this != &other) {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+    fd_ = std::exchange(other.fd_, -1);
+  }
+  return *this;
+}
+
+int
+FileDescriptor::get() const
+{
+  return fd_;
+}
+
+FileDescriptor::operator bool() const
+{
+  return fd_ >= 0;
+}
+
+bool
+preallocate(int fd, std::uintmax_t size, bool keepSize)
+{
+  if (::fallocate(fd, keepSize ? FALLOC_FL_KEEP_SIZE : 0, 0, size) == 0) {
+    return true;
+  }
+
+  // The filesystem doesn't support reserving blocks. Callers which asked for
+  // the size to change still rely on that, so fall back to a sparse file.
+  if (!keepSize) {
+    while (::ftruncate(fd, size) != 0) {
+      if (errno != EINTR) {
+        throw boost::system::system_error(errno, boost::system::system_category());
+      }
+    }
+  }
+  return false;
+}
+
+void
+writeAll(int fd, const char *data, size_t size)
+{
+  while (size > 0) {
+    const ssize_t n = ::write(fd, data, size);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw boost::system::system_error(errno, boost::system::system_category());
+    }
+    data += n;
+    size -= n;
+  }
+}
+
+void
+writeAllAt(int fd, const char *data, size_t size, std::uintmax_t offset)
+{
+  while (size > 0) {
+    const ssize_t n = ::pwrite(fd, data, size, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw boost::system::system_error(errno, boost::system::system_category());
+    }
+    data += n;
+    size -= n;
+    offset += n;
+  }
+}
+
+}
@@ -0,0 +1,82 @@
+#include "io/Listener.h"
+
+#include <exception>
+
+#include <sys/socket.h>
+
+#include "util/util.hpp"
+
+using boost::asio::ip::tcp;
+
+namespace io {
+
+Listener::Listener(boost::asio::io_context &ioContext) : boostAcceptor_(ioContext)
+{ }
+
+bool
+Listener::listen(
+  const std::string &host,
+  const std::string &port
+) {
+try {
+  const auto endpoint = *tcp::resolver(boostAcceptor_.get_executor()).resolve(host, port).begin();
+  boostAcceptor_.open(endpoint.endpoint().protocol());
+  boostAcceptor_.set_option(tcp::acceptor::reuse_address(true));
+  boostAcceptor_.bind(endpoint);
+  boostAcceptor_.listen();
+  return true;
+} catch (const std::exception &e) {
+  LOG_ERROR(
+    "Could not listen. host=" << host
+    << "; port=" << port
+    << "; error=" << e.what()
+  );
+  return false;
+}
+}
+
+std::optional<std::string>
+Listener::port()
+{
+  boost::system::error_code errorCode;
+  const auto endpoint = boostAcceptor_.local_endpoint(errorCode);
+  if (errorCode) {
+    return {};
+  }
+  return std::to_string(endpoint.port());
+}
+
+std::optional<Socket>
+Listener::accept()
+{
+  boost::system::error_code errorCode;
+  tcp::socket boostSocket = boostAcceptor_.accept(errorCode);
+  if (errorCode) {
+    return {};
+  }
+  return Socket(std::move(boostSocket));
+}
+
+bool
+Listener::shutdown()
+{
+  // Boost doesn't offer this for acceptors, but on Linux shutting down a listening
+  // socket wakes up anything blocked in accept(2) on it.
+  return ::shutdown(boostAcceptor_.native_handle(), SHUT_RDWR) == 0;
+}
+
+bool
+Listener::isOpen()
+{
+  return boostAcceptor_.is_open();
+}
+
+bool
+Listener::close()
+{
+  boost::system::error_code errorCode;
+  boostAcceptor_.close(errorCode);
+  return !errorCode;
+}
+
+}
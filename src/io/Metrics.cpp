@@ -0,0 +1,192 @@
+#include "io/Metrics.h"
+
+#include <algorithm>
+#include <sstream>
+
+namespace io {
+
+namespace {
+
+constexpr auto RELAXED = std::memory_order_relaxed;
+
+double
+toSeconds(std::chrono::microseconds duration)
+{
+  return std::chrono::duration<double>(duration).count();
+}
+
+void
+writeHistogram(
+  std::ostream &output,
+  const std::string &name,
+  const std::string &labels,
+  const HistogramSnapshot &histogram
+) {
+  // Prometheus buckets are cumulative, and labels go before `le`.
+  const std::string labelPrefix(labels.empty() ? "" : labels + ",");
+  std::uint64_t cumulative = 0;
+  for (size_t i = 0; i < HISTOGRAM_BOUNDS.size(); ++i) {
+    cumulative += histogram.bucketCounts[i];
+    output << name << "_bucket{" << labelPrefix << "le=\"" << toSeconds(HISTOGRAM_BOUNDS[i]) << "\"} "
+      << cumulative << "\n";
+  }
+  output << name << "_bucket{" << labelPrefix << "le=\"+Inf\"} " << histogram.count << "\n";
+  const std::string braced(labels.empty() ? "" : "{" + labels + "}");
+  output << name << "_sum" << braced << " " << toSeconds(histogram.sum) << "\n";
+  output << name << "_count" << braced << " " << histogram.count << "\n";
+}
+
+}
+
+void
+Histogram::record(std::chrono::steady_clock::duration duration)
+{
+  const auto microseconds = std::max(
+    std::chrono::duration_cast<std::chrono::microseconds>(duration), std::chrono::microseconds(0)
+  );
+  const auto bucket = std::lower_bound(HISTOGRAM_BOUNDS.cbegin(), HISTOGRAM_BOUNDS.cend(), microseconds);
+  bucketCounts_[bucket - HISTOGRAM_BOUNDS.cbegin()].fetch_add(1, RELAXED);
+  count_.fetch_add(1, RELAXED);
+  sumMicroseconds_.fetch_add(microseconds.count(), RELAXED);
+}
+
+HistogramSnapshot
+Histogram::snapshot() const
+{
+  HistogramSnapshot snapshot;
+  for (size_t i = 0; i < bucketCounts_.size(); ++i) {
+    snapshot.bucketCounts[i] = bucketCounts_[i].load(RELAXED);
+  }
+  snapshot.count = count_.load(RELAXED);
+  snapshot.sum = std::chrono::microseconds(sumMicroseconds_.load(RELAXED));
+  return snapshot;
+}
+
+size_t
+Metrics::verbIndex(std::string_view verb)
+{
+  // VERBS is sorted, and short enough that this is cheap.
+  const auto found = std::lower_bound(VERBS.cbegin(), VERBS.cend(), verb);
+  return found != VERBS.cend() && *found == verb ? found - VERBS.cbegin() : VERBS.size();
+}
+
+void
+Metrics::addBytesSent(std::uint64_t bytes)
+{
+  bytesSent_.fetch_add(bytes, RELAXED);
+}
+
+void
+Metrics::addBytesReceived(std::uint64_t bytes)
+{
+  bytesReceived_.fetch_add(bytes, RELAXED);
+}
+
+void
+Metrics::recordTransfer(std::chrono::steady_clock::duration duration)
+{
+  transferDuration_.record(duration);
+}
+
+void
+Metrics::recordTimeToFirstByte(std::chrono::steady_clock::duration duration)
+{
+  timeToFirstByte_.record(duration);
+}
+
+void
+Metrics::recordDataConnectionSetup(std::chrono::steady_clock::duration duration)
+{
+  dataConnectionSetup_.record(duration);
+}
+
+void
+Metrics::recordTlsHandshake(std::chrono::steady_clock::duration duration, bool isResumed)
+{
+  tlsHandshakes_.fetch_add(1, RELAXED);
+  if (isResumed) {
+    tlsResumedHandshakes_.fetch_add(1, RELAXED);
+  }
+  tlsHandshakeDuration_.record(duration);
+}
+
+void
+Metrics::recordCommandRoundTrip(size_t verbIndex, std::chrono::steady_clock::duration duration)
+{
+  commandRoundTrip_[std::min(verbIndex, VERBS.size())].record(duration);
+}
+
+void
+Metrics::recordReply(int code)
+{
+  if (code >= 100 && code <= 599) {
+    replyCodes_[code - 100].fetch_add(1, RELAXED);
+  }
+}
+
+MetricsSnapshot
+Metrics::snapshot() const
+{
+  MetricsSnapshot snapshot;
+  snapshot.bytesSent = bytesSent_.load(RELAXED);
+  snapshot.bytesReceived = bytesReceived_.load(RELAXED);
+  snapshot.transferDuration = transferDuration_.snapshot();
+  snapshot.timeToFirstByte = timeToFirstByte_.snapshot();
+  snapshot.dataConnectionSetup = dataConnectionSetup_.snapshot();
+  snapshot.tlsHandshakes = tlsHandshakes_.load(RELAXED);
+  snapshot.tlsResumedHandshakes = tlsResumedHandshakes_.load(RELAXED);
+  snapshot.tlsHandshakeDuration = tlsHandshakeDuration_.snapshot();
+  for (size_t i = 0; i < commandRoundTrip_.size(); ++i) {
+    auto histogram = commandRoundTrip_[i].snapshot();
+    if (histogram.count > 0) {
+      const std::string verb(i < VERBS.size() ? VERBS[i] : "OTHER");
+      snapshot.commandRoundTrip.emplace(verb, std::move(histogram));
+    }
+  }
+  for (size_t i = 0; i < replyCodes_.size(); ++i) {
+    if (const auto count = replyCodes_[i].load(RELAXED)) {
+      snapshot.replyCodes.emplace(static_cast<int>(i) + 100, count);
+    }
+  }
+  return snapshot;
+}
+
+std::string
+Metrics::toPrometheus(const std::string &prefix) const
+{
+  const auto metrics = snapshot();
+  std::stringstream output;
+
+  output << "# TYPE " << prefix << "_bytes_sent_total counter\n"
+    << prefix << "_bytes_sent_total " << metrics.bytesSent << "\n";
+  output << "# TYPE " << prefix << "_bytes_received_total counter\n"
+    << prefix << "_bytes_received_total " << metrics.bytesReceived << "\n";
+  output << "# TYPE " << prefix << "_tls_handshakes_total counter\n"
+    << prefix << "_tls_handshakes_total{resumed=\"false\"} " << metrics.tlsHandshakes - metrics.tlsResumedHandshakes << "\n"
+    << prefix << "_tls_handshakes_total{resumed=\"true\"} " << metrics.tlsResumedHandshakes << "\n";
+
+  const std::pair<std::string, const HistogramSnapshot&> histograms[] = {
+    {prefix + "_transfer_duration_seconds", metrics.transferDuration},
+    {prefix + "_time_to_first_byte_seconds", metrics.timeToFirstByte},
+    {prefix + "_data_connection_setup_seconds", metrics.dataConnectionSetup},
+    {prefix + "_tls_handshake_seconds", metrics.tlsHandshakeDuration},
+  };
+  for (const auto &[name, histogram] : histograms) {
+    output << "# TYPE " << name << " histogram\n";
+    writeHistogram(output, name, "", histogram);
+  }
+
+  const std::string roundTripName(prefix + "_command_round_trip_seconds");
+  output << "# TYPE " << roundTripName << " histogram\n";
+  for (const auto &[verb, histogram] : metrics.commandRoundTrip) {
+    writeHistogram(output, roundTripName, "verb=\"" + verb + "\"", histogram);
+  }
+
+  output << "# TYPE " << prefix << "_replies_total counter\n";
+  for (const auto &[code, count] : metrics.replyCodes) {
+    output << prefix << "_replies_total{code=\"" << code << "\"} " << count << "\n";
+  }
+  return output.str();
+}
+
+}
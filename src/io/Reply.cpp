@@ -0,0 +1,59 @@
+#include "io/Reply.h"
+
+#include <utility>
+
+namespace io {
+
+namespace {
+
+constexpr std::string_view DELIM = "\r\n";
+
+bool
+isDigit(char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+// Returns the reply code at the start of `line`, or 0 if there isn't one.
+int
+codeOf(std::string_view line)
+{
+  if (line.size() < 3 || !isDigit(line[0]) || !isDigit(line[1]) || !isDigit(line[2])) {
+    return 0;
+  }
+  return (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+}
+
+}
+
+std::optional<std::pair<Reply, size_t>>
+parseReply(std::string_view buffer)
+{
+  const auto firstLineEnd = buffer.find(DELIM);
+  if (firstLineEnd == std::string_view::npos) {
+    return {};
+  }
+
+  const int code = codeOf(buffer);
+  const bool isMultiline = code != 0 && firstLineEnd > 3 && buffer[3] == '-';
+  if (!isMultiline) {
+    return std::make_pair(Reply{code, buffer.substr(0, firstLineEnd)}, firstLineEnd + DELIM.size());
+  }
+
+  // The last line repeats the code, followed by a space. Lines in between
+  // can look like anything, including other codes.
+  size_t lineStart = firstLineEnd + DELIM.size();
+  while (true) {
+    const auto lineEnd = buffer.find(DELIM, lineStart);
+    if (lineEnd == std::string_view::npos) {
+      return {};
+    }
+    const auto line = buffer.substr(lineStart, lineEnd - lineStart);
+    if (codeOf(line) == code && (line.size() == 3 || line[3] == ' ')) {
+      return std::make_pair(Reply{code, buffer.substr(0, lineEnd)}, lineEnd + DELIM.size());
+    }
+    lineStart = lineEnd + DELIM.size();
+  }
+}
+
+}
@@ -2,14 +2,276 @@
 
 #include <fstream>
 #include <exception>
+#include <stdexcept>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <memory>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <openssl/err.h>
 
 #include "util/util.hpp"
+#include "io/File.h"
 
 using boost::asio::ip::tcp;
 
 namespace io {
 
-Socket::Socket() : boostSocket_(boostIoContext_)
+namespace {
+
+// Large enough that a fast link delivers a few hundred KB per read, which keeps the number
+// of read/write syscall pairs per GB in the low thousands.
+constexpr size_t DEFAULT_RECEIVE_BUFFER_SIZE = 256 * 1024;
+
+// Control messages are small, so this is usually enough for a whole reply in one read.
+constexpr size_t CONTROL_READ_SIZE = 4 * 1024;
+
+// Stops a server which never finishes its reply from making us buffer without limit.
+constexpr size_t MAX_CONTROL_MESSAGE_SIZE = 1024 * 1024;
+
+// Compressed data is read, and files to be compressed are read, this much at a time.
+constexpr size_t COMPRESSED_CHUNK_SIZE = 64 * 1024;
+
+// The most a TLS record can hold, so sending files in chunks this big doesn't waste records.
+constexpr size_t TLS_RECORD_SIZE = 16 * 1024;
+
+// Directory listings are read this much at a time.
+constexpr size_t LINE_READ_SIZE = 64 * 1024;
+
+// No sensible listing has lines anywhere near this long, so stop rather than buffer more.
+constexpr size_t MAX_LINE_SIZE = 64 * 1024;
+
+// Blocks SIGPIPE on the current thread while it's in scope. If one was raised in the
+// meantime, it is discarded rather than delivered when the signal is unblocked.
+class SigpipeBlocker {
+public:
+  SigpipeBlocker()
+  {
+    sigemptyset(&sigpipe_);
+    sigaddset(&sigpipe_, SIGPIPE);
+
+    sigset_t pending;
+    sigpending(&pending);
+    // If there's already one pending then it isn't ours, so leave it alone.
+    wasPending_ = sigismember(&pending, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe_, &oldMask_);
+  }
+
+  ~SigpipeBlocker()
+  {
+    if (!wasPending_) {
+      sigset_t pending;
+      sigpending(&pending);
+      if (sigismember(&pending, SIGPIPE)) {
+        const timespec noWait{0, 0};
+        sigtimedwait(&sigpipe_, nullptr, &noWait);
+      }
+    }
+    pthread_sigmask(SIG_SETMASK, &oldMask_, nullptr);
+  }
+
+  SigpipeBlocker(const SigpipeBlocker &) =delete;
+  SigpipeBlocker &operator=(const SigpipeBlocker &) =delete;
+
+private:
+  sigset_t sigpipe_;
+  sigset_t oldMask_;
+  bool wasPending_;
+};
+
+// Why the last OpenSSL call on `ssl` failed, as an error code like Asio's own: eof
+// when the other end closed the TLS session properly. A connection closed without
+// doing so may have been cut short, so that's an error. The thread's error queue and
+// errno must have been cleared before that call, or something left over from another
+// connection could be blamed on this one.
+boost::system::error_code
+tlsErrorCode(SSL *ssl, int result)
+{
+  const int error = SSL_get_error(ssl, result);
+  if (error == SSL_ERROR_ZERO_RETURN) {
+    return boost::asio::error::eof;
+  } else if (error == SSL_ERROR_SYSCALL && errno != 0) {
+    return boost::system::error_code(errno, boost::system::system_category());
+  }
+  const unsigned long queued = ERR_get_error();
+  if (queued == 0 || ERR_GET_REASON(queued) == SSL_R_UNEXPECTED_EOF_WHILE_READING) {
+    return boost::asio::ssl::error::stream_truncated;
+  }
+  return boost::system::error_code(static_cast<int>(queued), boost::asio::error::get_ssl_category());
+}
+
+// State shared between the steps of the asynchronous file transfers.
+struct AsyncTransfer
+{
+  tcp::socket &socket;
+  std::filesystem::path filePath;
+  FileDescriptor file;
+  std::ifstream stream;
+  std::ostream *outputStream;
+  std::vector<char> buf;
+  off_t offset;
+  Socket::Callback onComplete;
+  // Where a send records how it's going, once it has the file open.
+  std::optional<Socket::SendMethod> *sendMethod = nullptr;
+
+  void finish(bool isSuccess)
+  {
+    // Make sure the next owner of the callback can't be invoked twice.
+    const auto callback = std::move(onComplete);
+    callback(isSuccess);
+  }
+};
+
+void continueBufferedSend(std::shared_ptr<AsyncTransfer> transfer);
+
+void
+continueZeroCopySend(std::shared_ptr<AsyncTransfer> transfer)
+{
+  // See `sendFileZeroCopy`. The difference here is that the socket is non-blocking,
+  // so when it's full we wait for it asynchronously rather than blocking the thread.
+  constexpr size_t maxChunkSize = 16 * 1024 * 1024;
+  while (true) {
+    ssize_t n;
+    {
+      const SigpipeBlocker sigpipeBlocker;
+      n = ::sendfile(transfer->socket.native_handle(), transfer->file.get(), &transfer->offset, maxChunkSize);
+    }
+    if (n > 0) {
+      continue;
+    } else if (n == 0) {
+      transfer->socket.native_non_blocking(false);
+      transfer->finish(true);
+      return;
+    }
+
+    if (errno == EINTR) {
+      continue;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      transfer->socket.async_wait(
+        tcp::socket::wait_write,
+        [transfer](const boost::system::error_code &errorCode) {
+          if (errorCode) {
+            transfer->socket.native_non_blocking(false);
+            transfer->finish(false);
+          } else {
+            continueZeroCopySend(transfer);
+          }
+        }
+      );
+      return;
+    } else if ((errno == EINVAL || errno == ENOSYS) && transfer->offset == 0) {
+      // Nothing sent yet, so the buffered loop can start from the beginning.
+      LOG_WARN("Zero-copy send unavailable; falling back to buffered send.");
+      transfer->socket.native_non_blocking(false);
+      continueBufferedSend(transfer);
+      return;
+    }
+
+    LOG_ERROR("sendfile failed part way through. Stopping. offset=" << transfer->offset << "; error=" << std::strerror(errno));
+    transfer->socket.native_non_blocking(false);
+    transfer->finish(false);
+    return;
+  }
+}
+
+void
+continueBufferedSend(std::shared_ptr<AsyncTransfer> transfer)
+{
+  if (!transfer->stream.is_open()) {
+    // First time round, so the file still needs opening.
+    transfer->stream.open(transfer->filePath, std::ios::binary);
+    if (!transfer->stream) {
+      LOG_ERROR("Could not open filestream; path=" << transfer->filePath);
+      transfer->finish(false);
+      return;
+    }
+    *transfer->sendMethod = Socket::SendMethod::Buffered;
+  }
+  transfer->stream.read(transfer->buf.data(), transfer->buf.size());
+  const auto n = transfer->stream.gcount();
+  if (n == 0) {
+    transfer->finish(transfer->stream.eof());
+    return;
+  }
+
+  boost::asio::async_write(
+    transfer->socket,
+    boost::asio::buffer(transfer->buf.data(), n),
+    [transfer](const boost::system::error_code &errorCode, size_t) {
+      if (errorCode) {
+        transfer->finish(false);
+      } else {
+        continueBufferedSend(transfer);
+      }
+    }
+  );
+}
+
+// Reads until the server closes the connection, writing into the transfer's file.
+void
+continueRetrieveToFile(std::shared_ptr<AsyncTransfer> transfer)
+{
+  boost::asio::async_read(
+    transfer->socket,
+    boost::asio::buffer(transfer->buf),
+    [transfer](const boost::system::error_code &errorCode, size_t n) {
+      try {
+        writeAll(transfer->file.get(), transfer->buf.data(), n);
+      } catch (const std::exception &e) {
+        LOG_ERROR("Error while retreiving file. error=" << e.what());
+        transfer->finish(false);
+        return;
+      }
+      if (!errorCode) {
+        continueRetrieveToFile(transfer);
+      } else {
+        transfer->finish(errorCode == boost::asio::error::eof);
+      }
+    }
+  );
+}
+
+// Reads until the server closes the connection, writing into the transfer's stream.
+void
+continueRetrieveToStream(std::shared_ptr<AsyncTransfer> transfer)
+{
+  transfer->socket.async_read_some(
+    boost::asio::buffer(transfer->buf),
+    [transfer](const boost::system::error_code &errorCode, size_t n) {
+      transfer->outputStream->write(transfer->buf.data(), n);
+      if (!errorCode) {
+        continueRetrieveToStream(transfer);
+      } else {
+        transfer->finish(errorCode == boost::asio::error::eof);
+      }
+    }
+  );
+}
+
+}
+
+Socket::Socket(boost::asio::io_context &ioContext)
+  : boostSocket_(ioContext),
+    receiveBufferSize_(DEFAULT_RECEIVE_BUFFER_SIZE),
+    readBufferConsumed_(0),
+    connection_(Connection::Data),
+    isAwaitingFinalReply_(false)
+{ }
+
+Socket::Socket(boost::asio::ip::tcp::socket &&boostSocket)
+  : boostSocket_(std::move(boostSocket)),
+    receiveBufferSize_(DEFAULT_RECEIVE_BUFFER_SIZE),
+    readBufferConsumed_(0),
+    connection_(Connection::Data),
+    isAwaitingFinalReply_(false)
 { }
 
 bool
@@ -18,11 +280,11 @@ Socket::connect(
   const std::string &port
 ) {
 try {
-  auto endpoints = tcp::resolver(boostIoContext_).resolve(host, port);
+  auto endpoints = tcp::resolver(boostSocket_.get_executor()).resolve(host, port);
   boost::asio::connect(boostSocket_, std::move(endpoints));
   return true;
 } catch (const std::exception &e) {
-  LOG(
+  LOG_ERROR(
     "Could not make connection. host=" << host
     << "; port=" << port
     << "; error=" << e.what()
@@ -31,37 +293,132 @@ try {
 }
 }
 
+bool
+Socket::beginConnect(const std::string &host, const std::string &port)
+{
+try {
+  // Asio's blocking connect would wait for the handshake even on a non-blocking
+  // socket, so start it with connect(2) instead.
+  const auto endpoints = tcp::resolver(boostSocket_.get_executor()).resolve(host, port);
+  const tcp::endpoint endpoint = *endpoints.begin();
+  boostSocket_.open(endpoint.protocol());
+  boostSocket_.native_non_blocking(true);
+  if (::connect(boostSocket_.native_handle(), endpoint.data(), endpoint.size()) != 0 && errno != EINPROGRESS) {
+    LOG_ERROR("Could not start connection. host=" << host << "; port=" << port << "; error=" << std::strerror(errno));
+    boostSocket_.close();
+    return false;
+  }
+  return true;
+} catch (const std::exception &e) {
+  LOG_ERROR(
+    "Could not start connection. host=" << host
+    << "; port=" << port
+    << "; error=" << e.what()
+  );
+  boostSocket_.close();
+  return false;
+}
+}
+
+bool
+Socket::finishConnect()
+{
+try {
+  // Writable once the handshake has finished, whether or not it succeeded.
+  boostSocket_.wait(tcp::socket::wait_write);
+  int error = 0;
+  socklen_t errorSize = sizeof(error);
+  if (::getsockopt(boostSocket_.native_handle(), SOL_SOCKET, SO_ERROR, &error, &errorSize) != 0 || error != 0) {
+    LOG_ERROR("Could not make connection. error=" << std::strerror(error));
+    boostSocket_.close();
+    return false;
+  }
+  boostSocket_.native_non_blocking(false);
+  return true;
+} catch (const std::exception &e) {
+  LOG_ERROR("Could not make connection. error=" << e.what());
+  boostSocket_.close();
+  return false;
+}
+}
+
 std::optional<std::string>
 Socket::readUntil(const std::string &delim)
 {
 try {
-  std::string output;
-  // TODO: what if we never receive a reply, or it's malformed? Probably use std::optional.
-  //  Note: may be malformed in that there may be characters after the
-  //  delimiter, but we're not expecting that as there should only be at
-  //  most one pending response from the server on the control socket.
-  const size_t n = boost::asio::read_until(
-    boostSocket_,
-    boost::asio::dynamic_buffer(output),
-    delim
-  );
-  output.erase(output.begin() + n, output.end());
-  if (output.size() >= delim.size()) {
-    // Remove the delim because it's not part of the response.
-    output.erase(output.end() - delim.size(), output.end());
+  discardConsumedInput();
+  size_t searchFrom = 0;
+  while (true) {
+    const auto end = readBuffer_.find(delim, searchFrom);
+    if (end != std::string::npos) {
+      readBufferConsumed_ = end + delim.size();
+      std::string output = readBuffer_.substr(0, end);
+      LOG_DEBUG(output);
+      return output;
+    }
+    // The delimiter could straddle what we have and what comes next.
+    searchFrom = readBuffer_.size() < delim.size() ? 0 : readBuffer_.size() - delim.size() + 1;
+    readMore();
+  }
+} catch (const std::exception &e) {
+  return {};
+}
+}
+
+std::optional<Reply>
+Socket::readReply()
+{
+try {
+  discardConsumedInput();
+  while (true) {
+    if (const auto parsed = parseReply(readBuffer_)) {
+      const auto &[reply, size] = *parsed;
+      readBufferConsumed_ = size;
+      LOG_DEBUG(reply.text);
+      noteReply(reply.code);
+      return reply;
+    }
+    readMore();
   }
-  LOG(output);
-  return output;
 } catch (const std::exception &e) {
   return {};
 }
 }
 
+std::optional<size_t>
+Socket::readSome(char *buffer, size_t size)
+{
+  if (hasBufferedInput()) {
+    const size_t n = std::min(size, readBuffer_.size() - readBufferConsumed_);
+    std::memcpy(buffer, readBuffer_.data() + readBufferConsumed_, n);
+    readBufferConsumed_ += n;
+    return n;
+  }
+  boost::system::error_code errorCode;
+  const size_t n = receiveSome(buffer, size, errorCode);
+  if (errorCode == boost::asio::error::eof) {
+    return 0;
+  } else if (errorCode) {
+    return {};
+  }
+  countReceived(n);
+  return n;
+}
+
+bool
+Socket::hasBufferedInput() const
+{
+  return readBufferConsumed_ < readBuffer_.size();
+}
+
 size_t
 Socket::sendString(const std::string &string)
 {
 try {
-  return boost::asio::write(boostSocket_, boost::asio::buffer(string, string.size()));
+  noteCommandsSent(string);
+  sendAll(string.data(), string.size());
+  countSent(string.size());
+  return string.size();
 } catch (const std::exception &e) {
   return -1;
 }
@@ -69,72 +426,347 @@ try {
 
 
 bool
-Socket::sendFile(const std::filesystem::path &filePath)
+Socket::sendFile(const std::filesystem::path &filePath, std::uintmax_t offset)
 {
-  assert(exists(filePath) && (is_regular_file(filePath) || is_character_file(filePath)));
-try
+  return sendFileInternal(filePath, offset, std::nullopt);
+}
+
+bool
+Socket::sendFileRange(const std::filesystem::path &filePath, std::uintmax_t offset, std::uintmax_t length)
 {
+  return sendFileInternal(filePath, offset, length);
+}
+
+std::optional<Socket::SendMethod>
+Socket::lastSendMethod() const
+{
+  return lastSendMethod_;
+}
+
+bool
+Socket::sendFileInternal(
+  const std::filesystem::path &filePath,
+  std::uintmax_t offset,
+  const std::optional<std::uintmax_t> &length
+) {
+  assert(exists(filePath) && (is_regular_file(filePath) || is_character_file(filePath)));
+  // Each method records itself once it has the file open, so nothing is recorded
+  // for a file that couldn't be opened.
+  lastSendMethod_.reset();
+try {
+  if (compressionLevel_ || transform_) {
+    // The data has to pass through here to be changed.
+    return sendFileTransformed(filePath, offset, length);
+  }
+
+  // Regular files can be handed to the kernel, which copies them from the page cache
+  // straight into the socket without the data ever passing through user space.
+  // sendfile(2) doesn't support character devices, so those always use the buffered loop.
+  // With TLS, the kernel has to be doing the encryption as well.
+  if (is_regular_file(filePath) && (!ssl_ || isKernelTls())) {
+    if (const auto maybeSent = sendFileZeroCopy(filePath, offset, length)) {
+      return *maybeSent;
+    }
+    // The kernel refused before sending anything, so it's safe to start again below.
+    LOG_WARN("Zero-copy send unavailable; falling back to buffered send.");
+  }
+
+  return sendFileBuffered(filePath, offset, length);
+} catch (const std::exception &e) {
+  LOG_ERROR("Error while sending file. error=" << e.what());
+  return false;
+}
+}
+
+std::optional<bool>
+Socket::sendFileZeroCopy(
+  const std::filesystem::path &filePath,
+  std::uintmax_t offset,
+  std::optional<std::uintmax_t> length
+) {
+  const FileDescriptor file(::open(filePath.c_str(), O_RDONLY | O_CLOEXEC));
+  if (!file) {
+    LOG_ERROR("Could not open file; path=" << filePath << "; error=" << std::strerror(errno));
+    return false;
+  }
+  lastSendMethod_ = SendMethod::ZeroCopy;
+
+  // Unlike the socket writes Boost does for us, sendfile can't be told not to raise
+  // SIGPIPE if the peer has gone away, and by default that kills the process.
+  const SigpipeBlocker sigpipeBlocker;
+
+  // Cap each call so that a huge file doesn't hold the thread in the kernel for too long
+  // in one go. This is large enough that the per-call overhead is negligible.
+  constexpr size_t maxChunkSize = 16 * 1024 * 1024;
+  const int socketFd = boostSocket_.native_handle();
+  const off_t startOffset = offset;
+  off_t fileOffset = startOffset;
+
+  LOG_DEBUG("Sending file via sendfile: maxChunkSize=" << maxChunkSize << "; offset=" << offset);
+  // Keep going until sendfile reports that it's reached the end of the file (or we've
+  // sent the requested length). This matches the buffered loop, which also sends until
+  // EOF rather than until a size measured up front.
+  while (true) {
+    size_t chunkSize = maxChunkSize;
+    if (length) {
+      if (*length == 0) {
+        return true;
+      }
+      chunkSize = static_cast<size_t>(std::min<std::uintmax_t>(chunkSize, *length));
+    }
+
+    // Unlike sendfile, SSL_sendfile leaves it to us to move the offset on.
+    ERR_clear_error();
+    errno = 0;
+    const ssize_t n = ssl_
+      ? SSL_sendfile(ssl_.get(), file.get(), fileOffset, chunkSize, 0)
+      : ::sendfile(socketFd, file.get(), &fileOffset, chunkSize);
+    if (n > 0) {
+      if (ssl_) {
+        fileOffset += n;
+      }
+      countSent(n);
+      if (length) {
+        *length -= n;
+      }
+      continue;
+    } else if (n == 0) {
+      // A range which runs past the end of the file just sends what there is.
+      return true;
+    }
+
+    if (errno == EINTR) {
+      continue;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      // Only happens if the socket has been put in non-blocking mode. Wait until
+      // there's space in the send buffer, which throws if anything goes wrong.
+      boostSocket_.wait(tcp::socket::wait_write);
+      continue;
+    } else if ((errno == EINVAL || errno == ENOSYS) && fileOffset == startOffset) {
+      // The file or socket doesn't support sendfile (e.g. some FUSE filesystems), but
+      // nothing has been sent yet so the caller can use another method instead.
+      return {};
+    }
+
+    // TODO: how do we tell the server that file is useless / not complete?
+    LOG_ERROR("sendfile failed part way through. Stopping. offset=" << fileOffset << "; error=" << std::strerror(errno));
+    return false;
+  }
+}
+
+bool
+Socket::sendFileBuffered(
+  const std::filesystem::path &filePath,
+  std::uintmax_t offset,
+  std::optional<std::uintmax_t> length
+) {
   std::ifstream fileStream(filePath, std::ios::binary);
   if (!fileStream) {
-    LOG("Could not open filestream; path=" << filePath);
+    LOG_ERROR("Could not open filestream; path=" << filePath);
+    return false;
+  }
+  lastSendMethod_ = SendMethod::Buffered;
+
+  if (offset > 0 && !fileStream.seekg(offset)) {
+    LOG_ERROR("Could not seek in filestream; path=" << filePath << "; offset=" << offset);
     return false;
   }
 
   // Reset gcount before the loop starts.
   fileStream.peek();
 
-  constexpr size_t chunkSize = 1024;
-  std::array<char, chunkSize> buf;
+  // Each write is a record of its own with TLS, so fill the records.
+  const size_t chunkSize = ssl_ ? TLS_RECORD_SIZE : 1024;
+  std::vector<char> buf(chunkSize);
 
-  // Send 1KB chunks until the stream fails.
-  LOG("Sending file: chunkSize=" << chunkSize);
+  // Send chunks until the stream fails (or we've sent the requested length).
+  LOG_DEBUG("Sending file: chunkSize=" << chunkSize << "; offset=" << offset);
   // Keep looping while the stream is reading data. `read` will return false when it reaches EOF
   // but if it read any bytes before that (likely) then we will still write them because `gcount`
   // will be > 0; on the next iteration read will still return false but gcount will be zero and
   // the loop won't be entered.
-  while (fileStream.read(buf.data(), chunkSize) || fileStream.gcount() > 0) {
+  const auto nextChunkSize = [&length, chunkSize]() {
+    return length ? static_cast<size_t>(std::min(std::uintmax_t{chunkSize}, *length)) : chunkSize;
+  };
+  while (nextChunkSize() > 0 && (fileStream.read(buf.data(), nextChunkSize()) || fileStream.gcount() > 0)) {
     // Assume if anything goes wrong an exception will be thrown i.e. no need
     // to check return value.
-    boost::asio::write(boostSocket_, boost::asio::buffer(buf, fileStream.gcount()));
+    sendAll(buf.data(), fileStream.gcount());
+    countSent(fileStream.gcount());
+    if (length) {
+      *length -= fileStream.gcount();
+    }
   }
 
-  if (!fileStream.eof()) {
-    // The stream didn't fail because of reaching the end of the file, so
-    // something went wrong.
+  if (fileStream.bad() || (!fileStream.eof() && (!length || *length > 0))) {
+    // The stream didn't fail because of reaching the end of the file (or the range),
+    // so something went wrong.
     // TODO: how do we tell the server that file is useless / not complete?
-    LOG("File stream did not complete correctly. Stopping.");
+    LOG_ERROR("File stream did not complete correctly. Stopping.");
     return false;
   } else {
     return true;
   }
+}
+
+bool
+Socket::sendFileTransformed(
+  const std::filesystem::path &filePath,
+  std::uintmax_t offset,
+  std::optional<std::uintmax_t> length
+) {
+  const FileDescriptor file(::open(filePath.c_str(), O_RDONLY | O_CLOEXEC));
+  if (!file) {
+    LOG_ERROR("Could not open file; path=" << filePath << "; error=" << std::strerror(errno));
+    return false;
+  }
+  lastSendMethod_ = SendMethod::Buffered;
+
+  // Only a chunk of the file and whatever the stages hold back are in memory at a time.
+  std::optional<Deflater> deflater;
+  if (compressionLevel_) {
+    deflater.emplace(*compressionLevel_);
+  }
+  const auto send = [this](std::string_view data) {
+    sendAll(data.data(), data.size());
+    countSent(data.size());
+    return true;
+  };
+  const auto compressAndSend = [&deflater, &send](std::string_view data) {
+    return deflater ? deflater->deflate(data, false, send) : send(data);
+  };
+
+  std::vector<char> buf(COMPRESSED_CHUNK_SIZE);
+  LOG_DEBUG("Sending file through transform: isModeZ=" << deflater.has_value() << "; offset=" << offset);
+  while (true) {
+    const size_t toRead = length ? static_cast<size_t>(std::min<std::uintmax_t>(buf.size(), *length)) : buf.size();
+    const ssize_t n = toRead == 0 ? 0 : ::pread(file.get(), buf.data(), toRead, static_cast<off_t>(offset));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_ERROR("Could not read file; path=" << filePath << "; error=" << std::strerror(errno));
+      return false;
+    }
+    offset += n;
+    if (length) {
+      *length -= n;
+    }
+    // A range which runs past the end of the file just sends what there is.
+    const bool isEnd = n == 0;
+    const std::string_view chunk(buf.data(), n);
+    if (!(transform_ ? transform_->process(chunk, isEnd, compressAndSend) : compressAndSend(chunk))) {
+      return false;
+    }
+    if (isEnd) {
+      return !deflater || deflater->deflate({}, true, send);
+    }
+  }
+}
+
+bool
+Socket::retrieveFile(
+  const std::filesystem::path &filePath,
+  const std::optional<std::uintmax_t> &expectedSize
+) {
+  assert(!exists(filePath));
+try {
+
+  // Create the file for saving the data. The destination file shouldn't exist, so
+  // refuse to open it if it does rather than truncating someone else's data.
+  const FileDescriptor file(::open(filePath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666));
+  if (!file) {
+    LOG_ERROR("Could not create file: filePath=" << filePath << "; error=" << std::strerror(errno));
+    return false;
+  }
+
+  if (expectedSize && *expectedSize > 0) {
+    // Reserve the blocks now so that the filesystem can lay the file out contiguously and so
+    // that we find out about a full disk before receiving anything. KEEP_SIZE means the file
+    // still only grows as data is written, so a short transfer doesn't leave garbage at the end.
+    // This is only an optimisation so it doesn't matter if the filesystem doesn't support it.
+    if (!preallocate(file.get(), *expectedSize, true)) {
+      LOG_WARN("Could not preallocate file: expectedSize=" << *expectedSize << "; error=" << std::strerror(errno));
+    }
+  }
+
+  // Read the data from the socket and write it directly into the file.
+  retrieveToFileInternal(file.get());
+
+  // If no exceptions are thrown, the transfer succeed (or it didn't definitely fail).
+  return true;
 } catch (const std::exception &e) {
-  LOG("Error while sending file. error=" << e.what());
+  LOG_ERROR("Error while retreiving file. error=" << e.what());
   return false;
 }
 }
 
-
 bool
-Socket::retrieveFile(const std::filesystem::path &filePath)
+Socket::resumeRetrieveFile(const std::filesystem::path &filePath, std::uintmax_t offset)
 {
-  assert(!exists(filePath));
+  assert(exists(filePath));
 try {
+  const FileDescriptor file(::open(filePath.c_str(), O_WRONLY | O_CLOEXEC));
+  if (!file) {
+    LOG_ERROR("Could not open file: filePath=" << filePath << "; error=" << std::strerror(errno));
+    return false;
+  }
 
-  // Create a binary stream for saving the data. The destination file shouldn't exist but
-  // this will create it for us (and there won't be any errors as long as it's successful).
-  std::ofstream fileStream(filePath, std::ios::binary);
-  if (!fileStream) {
-    LOG("Could not create file stream: filePath=" << filePath);
+  // Anything past the offset is about to be sent again, so get rid of it. Otherwise a
+  // file that is shorter on the server than it was locally would keep its old tail.
+  if (::ftruncate(file.get(), offset) != 0 || ::lseek(file.get(), offset, SEEK_SET) < 0) {
+    LOG_ERROR("Could not move to offset: filePath=" << filePath << "; offset=" << offset << "; error=" << std::strerror(errno));
     return false;
   }
 
-  // Read the data from the socket and write it into the file stream.
-  retrieveToStreamInternal(fileStream);
+  retrieveToFileInternal(file.get());
+  return true;
+} catch (const std::exception &e) {
+  LOG_ERROR("Error while resuming file retrieval. error=" << e.what());
+  return false;
+}
+}
+
+bool
+Socket::retrieveFileRange(
+  const std::filesystem::path &filePath,
+  std::uintmax_t offset,
+  std::uintmax_t length
+) {
+  assert(exists(filePath));
+try {
+  // The file already exists (and has usually been preallocated) so that several
+  // sockets can fill in different parts of it at once.
+  const FileDescriptor file(::open(filePath.c_str(), O_WRONLY | O_CLOEXEC));
+  if (!file) {
+    LOG_ERROR("Could not open file: filePath=" << filePath << "; error=" << std::strerror(errno));
+    return false;
+  }
+
+  std::vector<char> buf(receiveBufferSize_);
+  boost::system::error_code errorCode;
+  waitForFirstByte();
+  // Stop once we have the whole range, rather than waiting for EOF, because the server
+  // sends everything from the offset to the end of the file and the rest belongs to
+  // another range.
+  while (length > 0 && !errorCode) {
+    const size_t toRead = static_cast<size_t>(std::min<std::uintmax_t>(buf.size(), length));
+    const size_t n = readData(buf.data(), toRead, true, errorCode);
+    writeAllAt(file.get(), buf.data(), n, offset);
+    offset += n;
+    length -= n;
+  }
+
+  if (length > 0) {
+    // Either the server closed the connection before sending the whole range, or
+    // something went wrong on our end. In both cases, part of the range is missing.
+    LOG_ERROR("Data connection ended before range was received: remaining=" << length << "; error=" << errorCode.message());
+    return false;
+  }
 
-  // If no exceptions are thrown, the transfer succeed (or it didn't definitely fail).
   return true;
 } catch (const std::exception &e) {
-  LOG("Error while retreiving file. error=" << e.what());
+  LOG_ERROR("Error while retrieving file range. error=" << e.what());
   return false;
 }
 }
@@ -150,16 +782,211 @@ try {
 }
 }
 
+bool
+Socket::retrieveLines(const std::function<void(std::string_view)> &onLine)
+{
+try {
+  std::vector<char> buf(LINE_READ_SIZE);
+  // The start of a line which didn't fit into the last read.
+  std::string partialLine;
+
+  const auto emit = [&onLine](std::string_view line) {
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+    onLine(line);
+  };
+
+  boost::system::error_code errorCode;
+  while (!errorCode) {
+    const size_t n = readData(buf.data(), buf.size(), false, errorCode);
+    std::string_view chunk(buf.data(), n);
+
+    size_t end;
+    while ((end = chunk.find('\n')) != std::string_view::npos) {
+      if (partialLine.empty()) {
+        emit(chunk.substr(0, end));
+      } else {
+        partialLine.append(chunk.substr(0, end));
+        emit(partialLine);
+        partialLine.clear();
+      }
+      chunk.remove_prefix(end + 1);
+    }
+
+    partialLine.append(chunk);
+    if (partialLine.size() > MAX_LINE_SIZE) {
+      throw std::length_error("Line too long.");
+    }
+  }
+
+  if (errorCode != boost::asio::error::eof) {
+    throw boost::system::system_error(errorCode);
+  }
+
+  // The last line might not have had a line ending.
+  if (!partialLine.empty()) {
+    emit(partialLine);
+  }
+  return true;
+} catch (const std::exception &e) {
+  LOG_ERROR("Error while retrieving lines: error=" << e.what());
+  return false;
+}
+}
+
+void
+Socket::setReceiveBufferSize(size_t size)
+{
+  assert(size > 0);
+  receiveBufferSize_ = size;
+}
+
+void
+Socket::setMetrics(std::shared_ptr<Metrics> metrics, Connection connection)
+{
+  metrics_ = std::move(metrics);
+  connection_ = connection;
+}
+
+std::optional<std::chrono::steady_clock::time_point>
+Socket::firstByteTime() const
+{
+  return firstByteTime_;
+}
+
+void
+Socket::setCompression(std::optional<int> level)
+{
+  compressionLevel_ = level;
+  if (level) {
+    inflater_ = std::make_unique<Inflater>();
+    compressedBuffer_.resize(COMPRESSED_CHUNK_SIZE);
+  } else {
+    inflater_.reset();
+  }
+  compressedInput_ = {};
+}
+
+void
+Socket::setTransform(std::shared_ptr<Transform> transform)
+{
+  transform_ = std::move(transform);
+}
+
+bool
+Socket::startTls(const std::shared_ptr<TlsContext> &context, const std::string &serverName, const TlsSession &session)
+{
+  const bool isClient = context->role() == TlsContext::Role::Client;
+  assert(!ssl_ && (!isClient || !serverName.empty()));
+  ERR_clear_error();
+  std::unique_ptr<SSL, SslDeleter> ssl(SSL_new(context->nativeHandle()));
+  if (!ssl || SSL_set_fd(ssl.get(), boostSocket_.native_handle()) != 1) {
+    LOG_ERROR("Could not set up TLS.");
+    return false;
+  }
+
+  if (isClient) {
+    // Certificates name IP addresses differently from hosts, and SNI is only for hosts.
+    boost::system::error_code errorCode;
+    boost::asio::ip::make_address(serverName, errorCode);
+    const bool isNameSet = errorCode
+      ? SSL_set1_host(ssl.get(), serverName.c_str()) == 1 && SSL_set_tlsext_host_name(ssl.get(), serverName.c_str()) == 1
+      : X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl.get()), serverName.c_str()) == 1;
+    if (!isNameSet || (session && SSL_set_session(ssl.get(), session.get()) != 1)) {
+      LOG_ERROR("Could not set up TLS. serverName=" << serverName);
+      return false;
+    }
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  int result;
+  {
+    const SigpipeBlocker sigpipeBlocker;
+    ERR_clear_error();
+    errno = 0;
+    result = isClient ? SSL_connect(ssl.get()) : SSL_accept(ssl.get());
+  }
+  if (result != 1) {
+    LOG_ERROR("TLS handshake failed. error=" << tlsErrorCode(ssl.get(), result).message());
+    return false;
+  }
+  const bool isResumed = SSL_session_reused(ssl.get()) == 1;
+  if (metrics_) {
+    metrics_->recordTlsHandshake(std::chrono::steady_clock::now() - start, isResumed);
+  }
+
+  ssl_ = std::move(ssl);
+  LOG_DEBUG(
+    "TLS started: version=" << SSL_get_version(ssl_.get())
+    << "; cipher=" << SSL_get_cipher_name(ssl_.get())
+    << "; isResumed=" << isResumed
+    << "; isKernelTls=" << isKernelTls()
+  );
+  return true;
+}
+
+TlsSession
+Socket::tlsSession() const
+{
+  if (!ssl_) {
+    return nullptr;
+  }
+  return TlsSession(SSL_get1_session(ssl_.get()), SSL_SESSION_free);
+}
+
+bool
+Socket::isTls() const
+{
+  return static_cast<bool>(ssl_);
+}
+
+bool
+Socket::isTlsResumed() const
+{
+  return ssl_ && SSL_session_reused(ssl_.get()) == 1;
+}
+
+bool
+Socket::setNoDelay()
+{
+  boost::system::error_code errorCode;
+  boostSocket_.set_option(tcp::no_delay(true), errorCode);
+  if (errorCode) {
+    LOG_WARN("Could not set TCP_NODELAY: error=" << errorCode.message());
+    return false;
+  }
+  return true;
+}
+
 bool
 Socket::isOpen()
 {
   return boostSocket_.is_open();
 }
 
+bool
+Socket::shutdown()
+{
+  boost::system::error_code errorCode;
+  boostSocket_.shutdown(tcp::socket::shutdown_both, errorCode);
+  return !errorCode;
+}
+
 bool
 Socket::close()
 {
 try {
+  // Nothing sent so far will get a reply now.
+  pendingCommands_.clear();
+  isAwaitingFinalReply_ = false;
+  if (ssl_) {
+    // Send our close_notify, but don't wait for theirs: nothing else is coming.
+    const SigpipeBlocker sigpipeBlocker;
+    ERR_clear_error();
+    SSL_shutdown(ssl_.get());
+    ssl_.reset();
+  }
   boostSocket_.shutdown(tcp::socket::shutdown_both);
   boostSocket_.close();
   return true;
@@ -168,6 +995,196 @@ try {
 }
 }
 
+void
+Socket::asyncConnect(const std::string &host, const std::string &port, Callback onComplete)
+{
+  // The resolver has to live until the resolution finishes.
+  auto resolver = std::make_shared<tcp::resolver>(boostSocket_.get_executor());
+  resolver->async_resolve(
+    host,
+    port,
+    [this, resolver, host, port, onComplete](const boost::system::error_code &errorCode, tcp::resolver::results_type endpoints) {
+      if (errorCode) {
+        LOG_ERROR(
+          "Could not resolve host. host=" << host
+          << "; port=" << port
+          << "; error=" << errorCode.message()
+        );
+        onComplete(false);
+        return;
+      }
+      boost::asio::async_connect(
+        boostSocket_,
+        endpoints,
+        [onComplete](const boost::system::error_code &errorCode, const tcp::endpoint &) {
+          onComplete(!errorCode);
+        }
+      );
+    }
+  );
+}
+
+void
+Socket::asyncReadUntil(const std::string &delim, std::function<void(std::optional<std::string>)> onComplete)
+{
+  discardConsumedInput();
+  asyncReadMoreUntil(
+    [this, delim]() { return readBuffer_.find(delim) != std::string::npos; },
+    [this, delim, onComplete = std::move(onComplete)](bool isComplete) {
+      if (!isComplete) {
+        onComplete({});
+        return;
+      }
+      const auto end = readBuffer_.find(delim);
+      readBufferConsumed_ = end + delim.size();
+      std::string output = readBuffer_.substr(0, end);
+      LOG_DEBUG(output);
+      onComplete(std::move(output));
+    }
+  );
+}
+
+void
+Socket::asyncReadReply(std::function<void(std::optional<Reply>)> onComplete)
+{
+  discardConsumedInput();
+  asyncReadMoreUntil(
+    [this]() { return parseReply(readBuffer_).has_value(); },
+    [this, onComplete = std::move(onComplete)](bool isComplete) {
+      if (!isComplete) {
+        onComplete({});
+        return;
+      }
+      // Parsing again is cheaper than keeping the result around between reads.
+      const auto [reply, size] = *parseReply(readBuffer_);
+      readBufferConsumed_ = size;
+      LOG_DEBUG(reply.text);
+      onComplete(reply);
+    }
+  );
+}
+
+void
+Socket::asyncSendString(const std::string &string, Callback onComplete)
+{
+  // The data has to live until it's all been sent.
+  auto data = std::make_shared<std::string>(string);
+  boost::asio::async_write(
+    boostSocket_,
+    boost::asio::buffer(*data),
+    [data, onComplete](const boost::system::error_code &errorCode, size_t n) {
+      onComplete(!errorCode && n == data->size());
+    }
+  );
+}
+
+void
+Socket::asyncSendFile(const std::filesystem::path &filePath, Callback onComplete)
+{
+  assert(exists(filePath) && (is_regular_file(filePath) || is_character_file(filePath)));
+  constexpr size_t chunkSize = 1024;
+  auto transfer = std::make_shared<AsyncTransfer>(AsyncTransfer{
+    boostSocket_, filePath, FileDescriptor(-1), {}, nullptr, std::vector<char>(chunkSize), 0, std::move(onComplete)
+  });
+  lastSendMethod_.reset();
+  transfer->sendMethod = &lastSendMethod_;
+
+  // As with `sendFile`, prefer to let the kernel do the copying.
+  if (is_regular_file(filePath)) {
+    transfer->file = FileDescriptor(::open(filePath.c_str(), O_RDONLY | O_CLOEXEC));
+    if (transfer->file) {
+      // Changed to Buffered if sendfile turns out not to be supported.
+      lastSendMethod_ = SendMethod::ZeroCopy;
+      boostSocket_.native_non_blocking(true);
+      continueZeroCopySend(transfer);
+      return;
+    }
+  }
+
+  continueBufferedSend(transfer);
+}
+
+void
+Socket::asyncRetrieveFile(
+  const std::filesystem::path &filePath,
+  const std::optional<std::uintmax_t> &expectedSize,
+  Callback onComplete
+) {
+  assert(!exists(filePath));
+  auto transfer = std::make_shared<AsyncTransfer>(AsyncTransfer{
+    boostSocket_,
+    filePath,
+    FileDescriptor(::open(filePath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666)),
+    {},
+    nullptr,
+    std::vector<char>(receiveBufferSize_),
+    0,
+    std::move(onComplete)
+  });
+  if (!transfer->file) {
+    LOG_ERROR("Could not create file: filePath=" << filePath << "; error=" << std::strerror(errno));
+    transfer->finish(false);
+    return;
+  }
+  if (expectedSize && *expectedSize > 0) {
+    // See `retrieveFile`.
+    preallocate(transfer->file.get(), *expectedSize, true);
+  }
+
+  continueRetrieveToFile(transfer);
+}
+
+void
+Socket::asyncRetrieveToStream(std::ostream &stream, Callback onComplete)
+{
+  auto transfer = std::make_shared<AsyncTransfer>(AsyncTransfer{
+    boostSocket_, {}, FileDescriptor(-1), {}, &stream, std::vector<char>(receiveBufferSize_), 0, std::move(onComplete)
+  });
+
+  continueRetrieveToStream(transfer);
+}
+
+bool
+Socket::deliver(std::string_view data, bool isFinal, const Transform::OutputCallback &sink)
+{
+  if (transform_) {
+    return transform_->process(data, isFinal, sink);
+  }
+  return data.empty() || sink(data);
+}
+
+void
+Socket::retrieveToFileInternal(int fd)
+{
+  std::vector<char> buf(receiveBufferSize_);
+  boost::system::error_code errorCode;
+  waitForFirstByte();
+  // Read until the server closes the socket -- which indicates that the transfer has
+  // finished (successfully or otherwise). Unlike read_some, `read` keeps going until
+  // the whole buffer is full, so each write to the file is as large as possible.
+  const auto writeToFile = [fd](std::string_view data) {
+    writeAll(fd, data.data(), data.size());
+    return true;
+  };
+  while (!errorCode) { // TODO: what if adversarial server doesn't reply? Need a timeout.
+    const size_t n = readData(buf.data(), buf.size(), true, errorCode);
+    if (!deliver(std::string_view(buf.data(), n), false, writeToFile)) {
+      throw std::runtime_error("Could not transform received data.");
+    }
+  }
+
+  if (errorCode != boost::asio::error::eof) {
+    // Something went wrong on our end, so the transfer should definitely be considered a failure.
+    throw boost::system::system_error(errorCode);
+  }
+  if (!deliver({}, true, writeToFile)) {
+    throw std::runtime_error("Received data ended before the transform expected.");
+  }
+
+  // Server closed the socket on their end. There may still be an error on the server's side
+  // but from the perspective of this method, the transfer succeeded.
+}
+
 void
 Socket::retrieveToStreamInternal(std::ostream &stream)
 {
@@ -182,18 +1199,266 @@ Socket::retrieveToStreamInternal(std::ostream &stream)
   boost::system::error_code errorCode;
   // Read until the server closes the socket -- which indicates that the transfer has
   // finished (successfully or otherwise).
+  const auto writeToStream = [&stream](std::string_view data) {
+    stream.write(data.data(), data.size());
+    return true;
+  };
   while (!errorCode) { // TODO: what if adversarial server doesn't reply? Need a timeout.
-    size_t n = boostSocket_.read_some(boost::asio::buffer(buf), errorCode);
-    stream.write(buf.data(), n);
+    size_t n = readData(buf.data(), buf.size(), false, errorCode);
+    if (!deliver(std::string_view(buf.data(), n), false, writeToStream)) {
+      throw std::runtime_error("Could not transform received data.");
+    }
   }
 
   if (errorCode != boost::asio::error::eof) {
     // Something went wrong on our end, so the transfer should definitely be considered a failure.
     throw boost::system::system_error(errorCode);
   }
+  if (!deliver({}, true, writeToStream)) {
+    throw std::runtime_error("Received data ended before the transform expected.");
+  }
 
   // Server closed the socket on their end. There may still be an error on the server's side
   // but from the perspective of this method, the transfer succeeded.
 }
 
+size_t
+Socket::readData(char *buffer, size_t size, bool isFilling, boost::system::error_code &errorCode)
+{
+  if (!inflater_) {
+    const size_t n = isFilling ? receiveAll(buffer, size, errorCode) : receiveSome(buffer, size, errorCode);
+    countReceived(n);
+    return n;
+  }
+
+  size_t filled = 0;
+  while (true) {
+    const auto n = inflater_->inflate(compressedInput_, buffer + filled, size - filled);
+    if (!n) {
+      errorCode = boost::system::errc::make_error_code(boost::system::errc::bad_message);
+      return filled;
+    }
+    filled += *n;
+    if (inflater_->isFinished()) {
+      // Nothing after the end of the stream is data.
+      compressedInput_ = {};
+    }
+    if (filled == size || (!isFilling && filled > 0)) {
+      return filled;
+    }
+    if (!compressedInput_.empty()) {
+      // The inflater is holding back output until it has more input.
+      continue;
+    }
+
+    const size_t received = receiveSome(compressedBuffer_.data(), compressedBuffer_.size(), errorCode);
+    countReceived(received);
+    compressedInput_ = std::string_view(compressedBuffer_.data(), received);
+    if (errorCode == boost::asio::error::eof && !inflater_->isFinished()) {
+      // The other end stopped part way through the stream, so some data is missing.
+      LOG_ERROR("Compressed data ended early.");
+      errorCode = boost::system::errc::make_error_code(boost::system::errc::bad_message);
+    }
+    if (errorCode) {
+      return filled;
+    }
+  }
+}
+
+void
+Socket::SslDeleter::operator()(SSL *ssl) const
+{
+  SSL_free(ssl);
+}
+
+size_t
+Socket::receiveSome(char *buffer, size_t size, boost::system::error_code &errorCode)
+{
+  if (!ssl_) {
+    return boostSocket_.read_some(boost::asio::buffer(buffer, size), errorCode);
+  }
+  ERR_clear_error();
+  errno = 0;
+  size_t n = 0;
+  const int result = SSL_read_ex(ssl_.get(), buffer, size, &n);
+  errorCode = result == 1 ? boost::system::error_code() : tlsErrorCode(ssl_.get(), result);
+  return n;
+}
+
+size_t
+Socket::receiveAll(char *buffer, size_t size, boost::system::error_code &errorCode)
+{
+  if (!ssl_) {
+    return boost::asio::read(boostSocket_, boost::asio::buffer(buffer, size), errorCode);
+  }
+  errorCode.clear();
+  size_t filled = 0;
+  while (filled < size && !errorCode) {
+    filled += receiveSome(buffer + filled, size - filled, errorCode);
+  }
+  return filled;
+}
+
+void
+Socket::sendAll(const char *data, size_t size)
+{
+  if (!ssl_) {
+    boost::asio::write(boostSocket_, boost::asio::buffer(data, size));
+    return;
+  }
+  // OpenSSL writes with write(2), which raises SIGPIPE if the other end has gone.
+  const SigpipeBlocker sigpipeBlocker;
+  while (size > 0) {
+    ERR_clear_error();
+    errno = 0;
+    size_t n = 0;
+    const int result = SSL_write_ex(ssl_.get(), data, size, &n);
+    if (result != 1) {
+      throw boost::system::system_error(tlsErrorCode(ssl_.get(), result));
+    }
+    data += n;
+    size -= n;
+  }
+}
+
+bool
+Socket::isKernelTls() const
+{
+  return ssl_ && BIO_get_ktls_send(SSL_get_wbio(ssl_.get()));
+}
+
+void
+Socket::countSent(size_t bytes)
+{
+  if (metrics_ && connection_ == Connection::Data) {
+    metrics_->addBytesSent(bytes);
+  }
+}
+
+void
+Socket::countReceived(size_t bytes)
+{
+  if (!metrics_ || connection_ != Connection::Data || bytes == 0) {
+    return;
+  }
+  if (!firstByteTime_) {
+    firstByteTime_ = std::chrono::steady_clock::now();
+  }
+  metrics_->addBytesReceived(bytes);
+}
+
+void
+Socket::waitForFirstByte()
+{
+  if (!metrics_ || connection_ != Connection::Data || firstByteTime_) {
+    return;
+  }
+  // Any error will turn up again in the read which follows. With TLS, data may already
+  // have been decrypted along with the end of the handshake.
+  boost::system::error_code errorCode;
+  if (!ssl_ || SSL_pending(ssl_.get()) == 0) {
+    boostSocket_.wait(tcp::socket::wait_read, errorCode);
+  }
+  firstByteTime_ = std::chrono::steady_clock::now();
+}
+
+void
+Socket::noteCommandsSent(std::string_view commands)
+{
+  if (!metrics_ || connection_ != Connection::Control) {
+    return;
+  }
+  // Pipelined commands are sent together, one per line.
+  const auto now = std::chrono::steady_clock::now();
+  while (!commands.empty()) {
+    const auto lineEnd = std::min(commands.find('\n'), commands.size());
+    const auto line = commands.substr(0, lineEnd);
+    commands.remove_prefix(std::min(lineEnd + 1, commands.size()));
+    if (!line.empty() && line != "\r") {
+      pendingCommands_.emplace_back(Metrics::verbIndex(line.substr(0, line.find_first_of(" \r"))), now);
+    }
+  }
+}
+
+void
+Socket::noteReply(int code)
+{
+  if (!metrics_ || connection_ != Connection::Control) {
+    return;
+  }
+  metrics_->recordReply(code);
+
+  // Each command gets exactly one final reply, possibly after some 1xx ones. Its
+  // round trip ends at whichever comes first.
+  const bool isPreliminary = code / 100 == 1;
+  if (isAwaitingFinalReply_) {
+    isAwaitingFinalReply_ = isPreliminary;
+    return;
+  }
+  if (pendingCommands_.empty()) {
+    // Not a reply to anything we sent, e.g. the welcome message.
+    return;
+  }
+  const auto [verbIndex, sentTime] = pendingCommands_.front();
+  pendingCommands_.pop_front();
+  metrics_->recordCommandRoundTrip(verbIndex, std::chrono::steady_clock::now() - sentTime);
+  isAwaitingFinalReply_ = isPreliminary;
+}
+
+void
+Socket::discardConsumedInput()
+{
+  readBuffer_.erase(0, readBufferConsumed_);
+  readBufferConsumed_ = 0;
+}
+
+void
+Socket::readMore()
+{
+  if (readBuffer_.size() >= MAX_CONTROL_MESSAGE_SIZE) {
+    throw std::length_error("Control message too long.");
+  }
+  // The string keeps its capacity, so after the first few reads this doesn't allocate.
+  const size_t oldSize = readBuffer_.size();
+  readBuffer_.resize(oldSize + CONTROL_READ_SIZE);
+  boost::system::error_code errorCode;
+  const size_t n = receiveSome(&readBuffer_[oldSize], CONTROL_READ_SIZE, errorCode);
+  readBuffer_.resize(oldSize + n);
+  if (errorCode) {
+    throw boost::system::system_error(errorCode);
+  }
+}
+
+void
+Socket::asyncReadMoreUntil(std::function<bool()> isComplete, Callback onComplete)
+{
+  if (isComplete()) {
+    // Already have it from an earlier read. Still complete from the io context,
+    // like every other async operation.
+    boost::asio::post(boostSocket_.get_executor(), [onComplete = std::move(onComplete)]() { onComplete(true); });
+    return;
+  }
+  if (readBuffer_.size() >= MAX_CONTROL_MESSAGE_SIZE) {
+    boost::asio::post(boostSocket_.get_executor(), [onComplete = std::move(onComplete)]() { onComplete(false); });
+    return;
+  }
+
+  const size_t oldSize = readBuffer_.size();
+  readBuffer_.resize(oldSize + CONTROL_READ_SIZE);
+  boostSocket_.async_read_some(
+    boost::asio::buffer(&readBuffer_[oldSize], CONTROL_READ_SIZE),
+    [this, oldSize, isComplete = std::move(isComplete), onComplete = std::move(onComplete)](
+      const boost::system::error_code &errorCode,
+      size_t n
+    ) mutable {
+      readBuffer_.resize(oldSize + n);
+      if (errorCode) {
+        onComplete(false);
+        return;
+      }
+      asyncReadMoreUntil(std::move(isComplete), std::move(onComplete));
+    }
+  );
+}
+
 }
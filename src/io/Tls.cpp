@@ -0,0 +1,80 @@
+#include "io/Tls.h"
+
+#include "util/util.hpp"
+
+namespace io {
+
+namespace {
+
+// Servers only resume sessions which were started under the same context id.
+constexpr unsigned char SESSION_ID_CONTEXT[] = "ftp";
+
+}
+
+TlsContext::TlsContext(Role role)
+  : role_(role),
+    context_(role == Role::Client ? boost::asio::ssl::context::tls_client : boost::asio::ssl::context::tls_server)
+{
+  SSL_CTX *const context = context_.native_handle();
+  SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+  // Only takes effect if the kernel has the tls module, and for ciphers it supports.
+  SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+  if (role_ == Role::Client) {
+    context_.set_verify_mode(boost::asio::ssl::verify_peer);
+  } else {
+    SSL_CTX_set_session_id_context(context, SESSION_ID_CONTEXT, sizeof(SESSION_ID_CONTEXT) - 1);
+  }
+}
+
+TlsContext::Role
+TlsContext::role() const
+{
+  return role_;
+}
+
+bool
+TlsContext::trustCertificate(const std::string &certificate)
+{
+  boost::system::error_code errorCode;
+  context_.add_certificate_authority(boost::asio::buffer(certificate), errorCode);
+  if (errorCode) {
+    LOG_ERROR("Could not trust certificate. error=" << errorCode.message());
+    return false;
+  }
+  return true;
+}
+
+bool
+TlsContext::trustSystemCertificates()
+{
+  boost::system::error_code errorCode;
+  context_.set_default_verify_paths(errorCode);
+  if (errorCode) {
+    LOG_ERROR("Could not load system certificates. error=" << errorCode.message());
+    return false;
+  }
+  return true;
+}
+
+bool
+TlsContext::useCertificate(const std::string &certificateChain, const std::string &privateKey)
+{
+  boost::system::error_code errorCode;
+  context_.use_certificate_chain(boost::asio::buffer(certificateChain), errorCode);
+  if (!errorCode) {
+    context_.use_private_key(boost::asio::buffer(privateKey), boost::asio::ssl::context::pem, errorCode);
+  }
+  if (errorCode) {
+    LOG_ERROR("Could not use certificate. error=" << errorCode.message());
+    return false;
+  }
+  return true;
+}
+
+SSL_CTX *
+TlsContext::nativeHandle()
+{
+  return context_.native_handle();
+}
+
+}
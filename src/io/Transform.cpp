@@ -0,0 +1,166 @@
+#include "io/Transform.h"
+
+#include <algorithm>
+#include <cassert>
+#include <thread>
+
+#include <time.h>
+
+#include "util/util.hpp"
+
+namespace io {
+
+namespace {
+
+// Big enough that each gzip member's header and the window it starts without cost
+// next to nothing, small enough that a few per thread don't use much memory.
+constexpr size_t PIECE_SIZE = 1024 * 1024;
+
+constexpr size_t INFLATE_OUTPUT_SIZE = 256 * 1024;
+
+std::chrono::nanoseconds
+threadCpuTime()
+{
+  timespec time;
+  ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+  return std::chrono::seconds(time.tv_sec) + std::chrono::nanoseconds(time.tv_nsec);
+}
+
+}
+
+GzipCompressor::GzipCompressor(int level, size_t numThreads)
+  : level_(level),
+    numThreads_(numThreads),
+    pieces_(),
+    hasCompressed_(false),
+    stats_()
+{
+  assert(numThreads_ > 0);
+}
+
+bool
+GzipCompressor::process(std::string_view input, bool isFinal, const OutputCallback &onOutput)
+{
+  stats_.bytesIn += input.size();
+  while (!input.empty()) {
+    if (pieces_.empty() || pieces_.back().size() == PIECE_SIZE) {
+      // Every thread has a full piece to work on.
+      if (pieces_.size() == numThreads_ && !compressPieces(onOutput)) {
+        return false;
+      }
+      pieces_.emplace_back();
+      pieces_.back().reserve(PIECE_SIZE);
+    }
+    const size_t n = std::min(input.size(), PIECE_SIZE - pieces_.back().size());
+    pieces_.back().append(input.substr(0, n));
+    input.remove_prefix(n);
+  }
+
+  if (!isFinal) {
+    return true;
+  }
+  if (!hasCompressed_ && pieces_.empty()) {
+    // Even an empty file needs one member to be valid gzip.
+    pieces_.emplace_back();
+  }
+  return compressPieces(onOutput);
+}
+
+TransformStats
+GzipCompressor::stats() const
+{
+  return stats_;
+}
+
+bool
+GzipCompressor::compressPieces(const OutputCallback &onOutput)
+{
+  hasCompressed_ = true;
+  std::vector<std::string> members(pieces_.size());
+  std::vector<std::chrono::nanoseconds> cpuTimes(pieces_.size());
+  // Not std::vector<bool> because each element is written by a different thread.
+  std::vector<char> isCompressed(pieces_.size(), false);
+
+  const auto compress = [this, &members, &cpuTimes, &isCompressed](size_t i) {
+    const auto start = threadCpuTime();
+    Deflater deflater(level_, DeflateFormat::Gzip);
+    isCompressed[i] = deflater.deflate(pieces_[i], true, [&member = members[i]](std::string_view output) {
+      member.append(output);
+      return true;
+    });
+    cpuTimes[i] = threadCpuTime() - start;
+  };
+
+  // This thread takes the first piece while the others take the rest.
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < pieces_.size(); ++i) {
+    threads.emplace_back(compress, i);
+  }
+  compress(0);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  pieces_.clear();
+
+  for (size_t i = 0; i < members.size(); ++i) {
+    stats_.cpuTime += cpuTimes[i];
+    if (!isCompressed[i]) {
+      return false;
+    }
+    stats_.bytesOut += members[i].size();
+    if (!onOutput(members[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+GzipDecompressor::GzipDecompressor()
+  : inflater_(DeflateFormat::Gzip),
+    output_(std::make_unique<char[]>(INFLATE_OUTPUT_SIZE)),
+    stats_()
+{ }
+
+bool
+GzipDecompressor::process(std::string_view input, bool isFinal, const OutputCallback &onOutput)
+{
+  stats_.bytesIn += input.size();
+  // zlib may still have output to give after taking all of the input, and only
+  // stops when the output buffer is full, so go round again while it is.
+  bool isOutputFull = false;
+  while (!input.empty() || isOutputFull) {
+    if (inflater_.isFinished()) {
+      // More input after the end of a member means another member.
+      if (input.empty()) {
+        break;
+      } else if (!inflater_.reset()) {
+        return false;
+      }
+    }
+    const auto start = threadCpuTime();
+    const auto n = inflater_.inflate(input, output_.get(), INFLATE_OUTPUT_SIZE);
+    stats_.cpuTime += threadCpuTime() - start;
+    if (!n) {
+      return false;
+    }
+    stats_.bytesOut += *n;
+    if (*n > 0 && !onOutput(std::string_view(output_.get(), *n))) {
+      return false;
+    }
+    isOutputFull = *n == INFLATE_OUTPUT_SIZE;
+  }
+
+  if (isFinal && !inflater_.isFinished()) {
+    LOG_ERROR("Gzip data ended part way through a member.");
+    return false;
+  }
+  return true;
+}
+
+TransformStats
+GzipDecompressor::stats() const
+{
+  return stats_;
+}
+
+}
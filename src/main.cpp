@@ -10,7 +10,7 @@ main(void)
   assert(client.connect("127.0.0.1"));
   assert(client.login("anonymous", "anonymous"));
   //assert(client.noop());
-  assert(client.stor("./scratch/file.txt"));
+  assert(client.stor("./scratch/file.txt", "file.txt"));
   assert(client.quit());
   return 0;
 }
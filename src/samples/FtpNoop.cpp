@@ -12,21 +12,21 @@ readFromSocketUntilClosed(tcp::socket &socket)
   std::string output;
   boost::system::error_code errorCode;
   while (true) {
-    LOG("readFromSocket: iteration begin.");
+    LOG_INFO("readFromSocket: iteration begin.");
     std::array<char, 128> buf;
     size_t n = socket.read_some(boost::asio::buffer(buf), errorCode);
 
     if (errorCode) {
       break;
     } else {
-      LOG("readFromSocket: Appending " << n << " bytes of data.");
+      LOG_INFO("readFromSocket: Appending " << n << " bytes of data.");
       output.append(buf.data(), n);
-      LOG("readFromSocket: output=" << output);
-      LOG("readFromSocket: errorCode=" << errorCode);
+      LOG_INFO("readFromSocket: output=" << output);
+      LOG_INFO("readFromSocket: errorCode=" << errorCode);
     }
   }
 
-  LOG("readFromSocket: break from loop.");
+  LOG_INFO("readFromSocket: break from loop.");
   if (errorCode == boost::asio::error::eof) {
     return output;
   } else {
@@ -67,10 +67,10 @@ template <class T>
 std::string
 logSendAndReceive(const std::string &tag, tcp::socket &socket, T &&command)
 {
-  LOG("(S) " << tag);
+  LOG_INFO("(S) " << tag);
   sendCommand(socket, std::forward<T>(command));
   const std::string response = receiveResponse(socket);
-  LOG("(R) " << tag << ": " << response);
+  LOG_INFO("(R) " << tag << ": " << response);
   return response;
 }
 
@@ -83,9 +83,9 @@ try {
   auto endpoints = tcp::resolver(ioContext).resolve(ftpServer, "ftp");
   tcp::socket socket(ioContext);
 
-  LOG("(S) connect");
+  LOG_INFO("(S) connect");
   boost::asio::connect(socket, endpoints);
-  LOG("(R) connect: " << receiveResponse(socket));
+  LOG_INFO("(R) connect: " << receiveResponse(socket));
 
   logSendAndReceive("username", socket, "USER anonymous\r\n");
   logSendAndReceive("password", socket, "PASS anonymous\r\n");
@@ -95,19 +95,19 @@ try {
   switch(response[0]) {
     case '1' :
     case '3' : 
-      LOG("Error when receiving noop response :(");break;
+      LOG_INFO("Error when receiving noop response :(");break;
     case '2' : 
-      LOG("Noop successfully received :)");break;
+      LOG_INFO("Noop successfully received :)");break;
     case '4' :
     case '5' :
-      LOG("Failed to send and receive noop :(");break;
+      LOG_INFO("Failed to send and receive noop :(");break;
   }
 
   logSendAndReceive("quit", socket, "QUIT\r\n");
 
   return 0;
 } catch (const std::exception &e) {
-  LOG(e.what());
+  LOG_INFO(e.what());
   return 1;
 }
 }
@@ -0,0 +1,1141 @@
+#include "server/LocalServer.h"
+
+#include <fstream>
+#include <utility>
+#include <cctype>
+#include <algorithm>
+#include <ctime>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <memory>
+
+#include <sys/stat.h>
+
+#include <boost/crc.hpp>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+#include "util/util.hpp"
+#include "io/Deflate.h"
+
+namespace fs = std::filesystem;
+
+namespace server
+{
+
+namespace {
+
+constexpr auto DELIM = "\r\n";
+constexpr auto HOST = "127.0.0.1";
+
+// What data is compressed at in MODE Z.
+constexpr int COMPRESSION_LEVEL = 6;
+
+// Long enough for any test run.
+constexpr long CERTIFICATE_LIFETIME_SECONDS = 24 * 60 * 60;
+
+// RFC 959 says a quote in a pathname is sent as two quotes.
+std::string
+doubleQuotes(const std::string &string)
+{
+  std::string output;
+  for (const char c : string) {
+    output.push_back(c);
+    if (c == '"') {
+      output.push_back('"');
+    }
+  }
+  return output;
+}
+
+std::optional<std::uintmax_t>
+parseOffset(const std::string &string)
+{
+  if (string.empty() || !std::all_of(string.cbegin(), string.cend(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); })) {
+    return {};
+  }
+  std::uintmax_t offset = 0;
+  for (const char c : string) {
+    offset = offset * 10 + (c - '0');
+  }
+  return offset;
+}
+
+// Splits `string` at each `delim`.
+std::vector<std::string>
+split(const std::string &string, char delim)
+{
+  std::vector<std::string> fields;
+  std::size_t start = 0;
+  for (std::size_t end; (end = string.find(delim, start)) != std::string::npos; start = end + 1) {
+    fields.push_back(string.substr(start, end - start));
+  }
+  fields.push_back(string.substr(start));
+  return fields;
+}
+
+// The address in a PORT argument, `h1,h2,h3,h4,p1,p2`.
+std::optional<std::pair<std::string, std::string>>
+parsePortArgument(const std::string &argument)
+{
+  const auto fields = split(argument, ',');
+  std::vector<std::uintmax_t> numbers;
+  for (const auto &field : fields) {
+    const auto number = parseOffset(field);
+    if (!number || *number > 255) {
+      return {};
+    }
+    numbers.push_back(*number);
+  }
+  if (numbers.size() != 6) {
+    return {};
+  }
+  return std::make_pair(
+    std::to_string(numbers[0]) + "." + std::to_string(numbers[1]) + "."
+      + std::to_string(numbers[2]) + "." + std::to_string(numbers[3]),
+    std::to_string(numbers[4] * 256 + numbers[5])
+  );
+}
+
+// The address in an EPRT argument (RFC 2428), e.g. `|1|127.0.0.1|5000|`.
+std::optional<std::pair<std::string, std::string>>
+parseEprtArgument(const std::string &argument)
+{
+  if (argument.size() < 2 || argument.back() != argument.front()) {
+    return {};
+  }
+  // Without the first and last delimiters, that leaves protocol, address and port.
+  const auto fields = split(argument.substr(1, argument.size() - 2), argument.front());
+  const auto port = fields.size() == 3 ? parseOffset(fields[2]) : std::nullopt;
+  if (!port || *port == 0 || *port > 65535 || (fields[0] != "1" && fields[0] != "2")) {
+    return {};
+  }
+  return std::make_pair(fields[1], fields[2]);
+}
+
+// Data sent or received under a bandwidth limit is moved in chunks this big, so
+// that the rate is steady over a tenth of a second or so.
+std::size_t
+throttledChunkSize(std::uintmax_t bytesPerSecond)
+{
+  return static_cast<std::size_t>(std::clamp<std::uintmax_t>(bytesPerSecond / 10, 1, 64 * 1024));
+}
+
+// Waits until having moved `bytes` since `start` is within the limit.
+void
+throttle(std::chrono::steady_clock::time_point start, std::uintmax_t bytes, std::uintmax_t bytesPerSecond)
+{
+  std::this_thread::sleep_until(start + std::chrono::microseconds(bytes * 1000000 / bytesPerSecond));
+}
+
+// Sends the file from `offset`, stopping after `length` bytes if given.
+bool
+sendThrottled(
+  io::Socket &dataSocket,
+  const fs::path &path,
+  std::uintmax_t offset,
+  const std::optional<std::uintmax_t> &length,
+  std::uintmax_t bytesPerSecond
+) {
+  std::ifstream stream(path, std::ios::binary);
+  stream.seekg(offset);
+  std::string chunk;
+  const auto start = std::chrono::steady_clock::now();
+  std::uintmax_t sent = 0;
+  while (!length || sent < *length) {
+    const auto wanted = length ? std::min<std::uintmax_t>(throttledChunkSize(bytesPerSecond), *length - sent) : throttledChunkSize(bytesPerSecond);
+    chunk.resize(wanted);
+    stream.read(chunk.data(), chunk.size());
+    chunk.resize(stream.gcount());
+    if (chunk.empty()) {
+      break;
+    }
+    if (dataSocket.sendString(chunk) != chunk.size()) {
+      return false;
+    }
+    sent += chunk.size();
+    throttle(start, sent, bytesPerSecond);
+  }
+  return true;
+}
+
+// Writes what arrives into the file from `offset`, stopping after `maxLength` bytes
+// if given. Returns how many bytes arrived, or nothing if something went wrong.
+std::optional<std::uintmax_t>
+receiveThrottled(
+  io::Socket &dataSocket,
+  const fs::path &path,
+  std::uintmax_t offset,
+  const std::optional<std::uintmax_t> &maxLength,
+  std::uintmax_t bytesPerSecond
+) {
+  std::fstream stream(path, std::ios::binary | std::ios::in | std::ios::out);
+  stream.seekp(offset);
+  std::vector<char> buf(throttledChunkSize(bytesPerSecond));
+  const auto start = std::chrono::steady_clock::now();
+  std::uintmax_t received = 0;
+  while (!maxLength || received < *maxLength) {
+    const auto wanted = maxLength ? std::min<std::uintmax_t>(buf.size(), *maxLength - received) : buf.size();
+    const auto n = dataSocket.readSome(buf.data(), static_cast<std::size_t>(wanted));
+    if (!n) {
+      return {};
+    } else if (*n == 0) {
+      break;
+    }
+    stream.write(buf.data(), *n);
+    received += *n;
+    throttle(start, received, bytesPerSecond);
+  }
+  if (!stream) {
+    return {};
+  }
+  return received;
+}
+
+// RFC 3659 section 2.3: `YYYYMMDDHHMMSS`, in UTC.
+std::string
+timeVal(std::time_t time)
+{
+  std::tm utcTime;
+  gmtime_r(&time, &utcTime);
+  char timestamp[15];
+  std::strftime(timestamp, sizeof(timestamp), "%Y%m%d%H%M%S", &utcTime);
+  return timestamp;
+}
+
+// The facts MLSD and MLST give about a file or directory (RFC 3659 section 7),
+// each followed by a semicolon.
+std::optional<std::string>
+mlsxFacts(const fs::path &path)
+{
+  struct stat status;
+  if (::stat(path.c_str(), &status) != 0) {
+    return {};
+  }
+  std::string facts;
+  if (S_ISDIR(status.st_mode)) {
+    facts = "type=dir;perm=flcdmpe;";
+  } else if (S_ISREG(status.st_mode)) {
+    facts = "type=file;size=" + std::to_string(status.st_size) + ";perm=adfrw;";
+  } else {
+    return {};
+  }
+  return facts + "modify=" + timeVal(status.st_mtime) + ";"
+    + "unique=" + std::to_string(status.st_dev) + "U" + std::to_string(status.st_ino) + ";";
+}
+
+// A line of `ls -l` style output, which is what most servers send for LIST.
+std::optional<std::string>
+unixListLine(const fs::path &path)
+{
+  struct stat status;
+  if (::stat(path.c_str(), &status) != 0 || !(S_ISDIR(status.st_mode) || S_ISREG(status.st_mode))) {
+    return {};
+  }
+  // Like ls, give the time for recent files and the year for others.
+  constexpr std::time_t SIX_MONTHS = 183 * 24 * 60 * 60;
+  const bool isRecent = std::time(nullptr) - status.st_mtime < SIX_MONTHS;
+  std::tm time;
+  gmtime_r(&status.st_mtime, &time);
+  char date[13];
+  std::strftime(date, sizeof(date), isRecent ? "%b %d %H:%M" : "%b %d  %Y", &time);
+  return std::string(S_ISDIR(status.st_mode) ? "drwxr-xr-x" : "-rw-r--r--")
+    + " 1 owner group " + std::to_string(status.st_size) + " " + date + " " + path.filename().string();
+}
+
+// A certificate for the IP address `host`, signed with its own new key, and that key.
+// Both are PEM.
+std::optional<std::pair<std::string, std::string>>
+makeSelfSignedCertificate(const std::string &host)
+{
+  const std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> key(EVP_EC_gen("P-256"), EVP_PKEY_free);
+  const std::unique_ptr<X509, decltype(&X509_free)> certificate(X509_new(), X509_free);
+  if (!key || !certificate) {
+    return {};
+  }
+  X509 *const cert = certificate.get();
+  X509_set_version(cert, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+  X509_gmtime_adj(X509_getm_notAfter(cert), CERTIFICATE_LIFETIME_SECONDS);
+  X509_set_pubkey(cert, key.get());
+  X509_NAME *const name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char *>(host.c_str()), -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+
+  // Clients check IP addresses against the subject alternative names, not the common name.
+  X509V3_CTX context;
+  X509V3_set_ctx_nodb(&context);
+  X509V3_set_ctx(&context, cert, cert, nullptr, nullptr, 0);
+  const std::unique_ptr<X509_EXTENSION, decltype(&X509_EXTENSION_free)> altName(
+    X509V3_EXT_conf_nid(nullptr, &context, NID_subject_alt_name, ("IP:" + host).c_str()),
+    X509_EXTENSION_free
+  );
+  if (!altName || X509_add_ext(cert, altName.get(), -1) != 1 || X509_sign(cert, key.get(), EVP_sha256()) == 0) {
+    return {};
+  }
+
+  const auto toPem = [](const std::function<int(BIO *)> &write) -> std::optional<std::string> {
+    const std::unique_ptr<BIO, decltype(&BIO_free)> bio(BIO_new(BIO_s_mem()), BIO_free);
+    if (!bio || write(bio.get()) != 1) {
+      return {};
+    }
+    char *data;
+    const long size = BIO_get_mem_data(bio.get(), &data);
+    return std::string(data, size);
+  };
+  const auto certificatePem = toPem([cert](BIO *bio) { return PEM_write_bio_X509(bio, cert); });
+  const auto keyPem = toPem([&key](BIO *bio) {
+    return PEM_write_bio_PrivateKey(bio, key.get(), nullptr, nullptr, 0, nullptr, nullptr);
+  });
+  if (!certificatePem || !keyPem) {
+    return {};
+  }
+  return std::make_pair(*certificatePem, *keyPem);
+}
+
+}
+
+// One control connection, and the data connections it opens.
+class LocalServer::Session
+{
+public:
+  Session(LocalServer &server, io::Socket &&controlSocket)
+    : server_(server),
+      controlSocket_(std::move(controlSocket)),
+      cwd_("/"),
+      commandTime_(std::chrono::steady_clock::now()),
+      isLoggedIn_(false),
+      isModeZ_(false),
+      isDataProtected_(false),
+      restOffset_(0),
+      isShutdown_(false)
+  {
+    // Replies are often sent back to back (e.g. 150 then 226) with nothing read in
+    // between, which Nagle's algorithm would hold up until the client's delayed ACK.
+    controlSocket_.setNoDelay();
+  }
+
+  // Handles commands until the client quits or disconnects.
+  void run();
+
+  // Makes `run` return soon, even if it's waiting for the client. Can be
+  // called from any thread.
+  void shutdown();
+
+private:
+  LocalServer &server_;
+  io::Socket controlSocket_;
+  fs::path cwd_;
+  // When the command being handled arrived, for `Faults::replyLatency`.
+  std::chrono::steady_clock::time_point commandTime_;
+  bool isLoggedIn_;
+  bool isModeZ_;
+  // Set once the control connection is using TLS.
+  std::shared_ptr<io::TlsContext> tlsContext_;
+  // PROT P, so data connections must use TLS too.
+  bool isDataProtected_;
+  std::uintmax_t restOffset_;
+  std::optional<fs::path> renameFrom_;
+  // Where to connect for the next data connection, if the client sent PORT or
+  // EPRT rather than PASV.
+  std::optional<std::pair<std::string, std::string>> activeAddress_;
+
+  // Guards the sockets below, which are replaced by the session's own thread
+  // but may be shut down from another.
+  std::mutex mutex_;
+  bool isShutdown_;
+  std::optional<io::Listener> dataListener_;
+  std::optional<io::Socket> dataSocket_;
+
+  bool reply(const std::string &reply);
+
+  // Sends a message on the control connection as it is.
+  bool send(const std::string &message);
+
+  // Handles one command. Returns false if the session should end.
+  bool handle(const std::string &verb, const std::string &argument);
+
+  // Upgrades the control connection to TLS. Returns false if the session should end.
+  bool auth(const std::string &argument);
+
+  fs::path virtualPath(const std::string &argument) const;
+
+  fs::path localPath(const std::string &argument) const;
+
+  // PASV or EPSV.
+  void pasv(const std::string &verb);
+
+  void portOrEprt(const std::string &verb, const std::string &argument);
+
+  void retr(const std::string &argument);
+
+  void storOrAppe(const std::string &argument, bool isAppendOperation);
+
+  // Sends LIST, NLST or MLSD output for the file or directory.
+  void listing(const std::string &verb, const std::string &argument);
+
+  bool sendFileData(
+    io::Socket &dataSocket,
+    const fs::path &path,
+    std::uintmax_t offset,
+    const std::optional<std::uintmax_t> &length
+  );
+
+  // Accepts the connection to our PASV listener, or connects to the client's
+  // PORT or EPRT address.
+  io::Socket *openDataConnection();
+
+  void closeDataConnection();
+};
+
+void
+LocalServer::Session::run()
+{
+  if (!reply("220 Local stand-in FTP server ready.")) {
+    return;
+  }
+
+  while (true) {
+    const bool isBuffered = controlSocket_.hasBufferedInput();
+    const auto maybeLine = controlSocket_.readUntil(DELIM);
+    if (!maybeLine) {
+      // Client disconnected, or we were shut down.
+      break;
+    }
+    if (!isBuffered) {
+      // Otherwise it arrived along with the command before it.
+      commandTime_ = std::chrono::steady_clock::now();
+    }
+    if (maybeLine->empty()) {
+      // Not a command. Some clients send blank lines, which real servers ignore.
+      continue;
+    }
+
+    const auto space = maybeLine->find(' ');
+    std::string verb = maybeLine->substr(0, space);
+    std::transform(verb.begin(), verb.end(), verb.begin(), [](unsigned char c) { return std::toupper(c); });
+    const std::string argument = space == std::string::npos ? "" : maybeLine->substr(space + 1);
+
+    {
+      std::lock_guard lock(server_.mutex_);
+      ++server_.commandCounts_[verb];
+    }
+
+    const auto errorReplies = server_.faults().errorReplies;
+    if (const auto errorReply = errorReplies.find(verb); errorReply != errorReplies.end()) {
+      if (!reply(errorReply->second)) {
+        break;
+      }
+      continue;
+    }
+
+    if (!handle(verb, argument)) {
+      break;
+    }
+  }
+
+  std::lock_guard lock(mutex_);
+  if (dataListener_) {
+    dataListener_->close();
+  }
+  if (dataSocket_) {
+    dataSocket_->close();
+  }
+  controlSocket_.close();
+}
+
+void
+LocalServer::Session::shutdown()
+{
+  std::lock_guard lock(mutex_);
+  isShutdown_ = true;
+  if (dataListener_) {
+    dataListener_->shutdown();
+  }
+  if (dataSocket_) {
+    dataSocket_->shutdown();
+  }
+  controlSocket_.shutdown();
+}
+
+bool
+LocalServer::Session::reply(const std::string &reply)
+{
+  std::string replyWithDelim(reply + DELIM);
+  if (server_.faults().multilineReplies) {
+    const auto code = reply.substr(0, 3);
+    const auto otherCode = code == "200" ? "500" : "200";
+    replyWithDelim = code + "-Multi-line reply follows." + DELIM
+      + " " + code + " Indented, so not the last line." + DELIM
+      + otherCode + " A different code, so not the last line." + DELIM
+      + replyWithDelim;
+  }
+  return send(replyWithDelim);
+}
+
+bool
+LocalServer::Session::send(const std::string &message)
+{
+  const auto latency = server_.faults().replyLatency;
+  if (latency.count() > 0) {
+    std::this_thread::sleep_until(commandTime_ + latency);
+  }
+  return controlSocket_.sendString(message) == message.size();
+}
+
+bool
+LocalServer::Session::handle(const std::string &verb, const std::string &argument)
+{
+  if (verb == "USER") {
+    isLoggedIn_ = false;
+    return reply("331 Please specify the password.");
+  } else if (verb == "PASS") {
+    isLoggedIn_ = true;
+    return reply("230 Login successful.");
+  } else if (verb == "QUIT") {
+    reply("221 Goodbye.");
+    return false;
+  } else if (verb == "NOOP") {
+    return reply("200 NOOP ok.");
+  } else if (verb == "AUTH") {
+    return auth(argument);
+  } else if (verb == "PBSZ") {
+    // Only meaningful for other security mechanisms; TLS always uses 0 (RFC 4217).
+    return reply(tlsContext_ ? "200 PBSZ=0" : "503 PBSZ needs a secure connection.");
+  } else if (verb == "PROT") {
+    if (!tlsContext_) {
+      return reply("503 PROT needs a secure connection.");
+    } else if (argument != "P" && argument != "C") {
+      return reply("536 PROT level not supported.");
+    }
+    isDataProtected_ = argument == "P";
+    return reply(isDataProtected_ ? "200 PROT now Private." : "200 PROT now Clear.");
+  } else if (verb == "FEAT") {
+    bool isTlsEnabled;
+    {
+      std::lock_guard lock(server_.mutex_);
+      isTlsEnabled = server_.tlsContext_ != nullptr;
+    }
+    const std::string tlsFeatures = isTlsEnabled
+      ? std::string(" AUTH TLS") + DELIM + " PBSZ" + DELIM + " PROT" + DELIM
+      : "";
+    // Always multi-line (RFC 2389), so it can't go through `reply`.
+    const std::string features = std::string("211-Features:") + DELIM
+      + tlsFeatures
+      + " SIZE" + DELIM
+      + " REST STREAM" + DELIM
+      + " MDTM" + DELIM
+      + " XCRC" + DELIM
+      + " MLST type*;size*;modify*;perm*;unique*;" + DELIM
+      + " MODE Z" + DELIM
+      + "211 End" + DELIM;
+    return send(features);
+  }
+
+  if (!isLoggedIn_) {
+    return reply("530 Please login with USER and PASS.");
+  }
+
+  // RNTO only applies if it comes straight after RNFR.
+  const auto renameFrom = std::exchange(renameFrom_, std::nullopt);
+
+  if (verb == "TYPE") {
+    return reply("200 Switching to Binary mode.");
+  } else if (verb == "MODE") {
+    std::string mode(argument);
+    std::transform(mode.begin(), mode.end(), mode.begin(), [](unsigned char c) { return std::toupper(c); });
+    if (mode != "S" && mode != "Z") {
+      return reply("504 Unsupported mode.");
+    }
+    isModeZ_ = mode == "Z";
+    return reply("200 Mode set to " + mode + ".");
+  } else if (verb == "PASV" || verb == "EPSV") {
+    pasv(verb);
+  } else if (verb == "PORT" || verb == "EPRT") {
+    portOrEprt(verb, argument);
+  } else if (verb == "REST") {
+    const auto maybeOffset = parseOffset(argument);
+    if (!maybeOffset) {
+      return reply("501 REST requires a number.");
+    }
+    restOffset_ = *maybeOffset;
+    return reply("350 Restart position accepted (" + argument + ").");
+  } else if (verb == "SIZE") {
+    const auto path = localPath(argument);
+    if (!is_regular_file(path)) {
+      return reply("550 Could not get file size.");
+    }
+    return reply("213 " + std::to_string(file_size(path)));
+  } else if (verb == "RETR") {
+    retr(argument);
+  } else if (verb == "STOR") {
+    storOrAppe(argument, false);
+  } else if (verb == "APPE") {
+    storOrAppe(argument, true);
+  } else if (verb == "PWD") {
+    return reply("257 \"" + doubleQuotes(cwd_.generic_string()) + "\" is the current directory");
+  } else if (verb == "CWD") {
+    const auto newDir = virtualPath(argument);
+    if (!is_directory(localPath(argument))) {
+      return reply("550 Failed to change directory.");
+    }
+    cwd_ = newDir;
+    return reply("250 Directory successfully changed.");
+  } else if (verb == "MKD") {
+    std::error_code error;
+    if (!create_directory(localPath(argument), error) || error) {
+      return reply("550 Create directory operation failed.");
+    }
+    return reply("257 \"" + doubleQuotes(virtualPath(argument).generic_string()) + "\" created");
+  } else if (verb == "RMD") {
+    const auto path = localPath(argument);
+    std::error_code error;
+    if (!is_directory(path) || !remove(path, error) || error) {
+      return reply("550 Remove directory operation failed.");
+    }
+    return reply("250 Remove directory operation successful.");
+  } else if (verb == "DELE") {
+    const auto path = localPath(argument);
+    std::error_code error;
+    if (!is_regular_file(path) || !remove(path, error) || error) {
+      return reply("550 Delete operation failed.");
+    }
+    return reply("250 Delete operation successful.");
+  } else if (verb == "RNFR") {
+    const auto path = localPath(argument);
+    if (!exists(path)) {
+      return reply("550 RNFR command failed.");
+    }
+    renameFrom_ = path;
+    return reply("350 Ready for RNTO.");
+  } else if (verb == "RNTO") {
+    if (!renameFrom) {
+      return reply("503 RNFR required first.");
+    }
+    std::error_code error;
+    rename(*renameFrom, localPath(argument), error);
+    if (error) {
+      return reply("550 Rename failed.");
+    }
+    return reply("250 Rename successful.");
+  } else if (verb == "MDTM") {
+    struct stat status;
+    if (::stat(localPath(argument).c_str(), &status) != 0 || !S_ISREG(status.st_mode)) {
+      return reply("550 Could not get file modification time.");
+    }
+    return reply("213 " + timeVal(status.st_mtime));
+  } else if (verb == "XCRC") {
+    const auto path = localPath(argument);
+    if (!is_regular_file(path)) {
+      return reply("550 Could not get file CRC.");
+    }
+    std::ifstream stream(path, std::ios::binary);
+    boost::crc_32_type crc;
+    std::vector<char> buf(64 * 1024);
+    while (stream.read(buf.data(), buf.size()) || stream.gcount() > 0) {
+      crc.process_bytes(buf.data(), stream.gcount());
+    }
+    char hex[9];
+    std::snprintf(hex, sizeof(hex), "%08X", static_cast<unsigned>(crc.checksum()));
+    return reply(std::string("250 ") + hex);
+  } else if (verb == "MLST") {
+    const auto facts = mlsxFacts(localPath(argument));
+    if (!facts) {
+      return reply("550 No such file or directory.");
+    }
+    // Always multi-line, like FEAT.
+    const std::string listing = "250-Listing " + argument + DELIM
+      + " " + *facts + " " + virtualPath(argument).generic_string() + DELIM
+      + "250 End" + DELIM;
+    return send(listing);
+  } else if (verb == "LIST" || verb == "NLST" || verb == "MLSD") {
+    listing(verb, argument);
+  } else {
+    return reply("502 Command not implemented.");
+  }
+  return true;
+}
+
+bool
+LocalServer::Session::auth(const std::string &argument)
+{
+  std::shared_ptr<io::TlsContext> context;
+  {
+    std::lock_guard lock(server_.mutex_);
+    context = server_.tlsContext_;
+  }
+  std::string mechanism(argument);
+  std::transform(mechanism.begin(), mechanism.end(), mechanism.begin(), [](unsigned char c) { return std::toupper(c); });
+  if (!context) {
+    return reply("502 Command not implemented.");
+  } else if (mechanism != "TLS" && mechanism != "TLS-C" && mechanism != "SSL") {
+    return reply("504 Unknown AUTH type.");
+  } else if (tlsContext_) {
+    return reply("503 Already using TLS.");
+  } else if (!reply("234 Proceeding with negotiation.")) {
+    return false;
+  }
+
+  // A new security exchange means logging in again (RFC 4217 section 4).
+  isLoggedIn_ = false;
+  // After a failed handshake, neither side knows what state the connection is in.
+  if (!controlSocket_.startTls(context)) {
+    return false;
+  }
+  tlsContext_ = context;
+  return true;
+}
+
+fs::path
+LocalServer::Session::virtualPath(const std::string &argument) const
+{
+  // Normalising an absolute path removes any `..` that would go above the root,
+  // so clients can't reach anything outside it.
+  fs::path path = (cwd_ / argument).lexically_normal();
+  if (path.has_filename() || path == path.root_path()) {
+    return path;
+  }
+  // Drop the trailing separator left by arguments like `dir/`.
+  return path.parent_path();
+}
+
+fs::path
+LocalServer::Session::localPath(const std::string &argument) const
+{
+  return server_.root_ / virtualPath(argument).relative_path();
+}
+
+void
+LocalServer::Session::pasv(const std::string &verb)
+{
+  io::Listener listener(server_.ioContext_);
+  if (!listener.listen(HOST, "0")) {
+    reply("425 Could not listen for data connection.");
+    return;
+  }
+  const int port = std::stoi(*listener.port());
+
+  {
+    std::lock_guard lock(mutex_);
+    if (isShutdown_) {
+      return;
+    }
+    dataListener_ = std::move(listener);
+  }
+  activeAddress_.reset();
+
+  if (verb == "EPSV") {
+    reply("229 Entering Extended Passive Mode (|||" + std::to_string(port) + "|).");
+    return;
+  }
+  reply(
+    std::string("227 Entering Passive Mode (127,0,0,1,")
+    + std::to_string(port / 256) + "," + std::to_string(port % 256) + ")."
+  );
+}
+
+void
+LocalServer::Session::portOrEprt(const std::string &verb, const std::string &argument)
+{
+  const auto address = verb == "PORT" ? parsePortArgument(argument) : parseEprtArgument(argument);
+  if (!address) {
+    reply("501 Illegal " + verb + " command.");
+    return;
+  }
+  {
+    std::lock_guard lock(mutex_);
+    if (dataListener_) {
+      dataListener_->close();
+      dataListener_.reset();
+    }
+  }
+  activeAddress_ = address;
+  reply("200 " + verb + " command successful.");
+}
+
+void
+LocalServer::Session::retr(const std::string &argument)
+{
+  const auto path = localPath(argument);
+  const auto offset = std::exchange(restOffset_, 0);
+  if (!dataListener_ && !activeAddress_) {
+    reply("425 Use PORT or PASV first.");
+    return;
+  }
+  if (!is_regular_file(path)) {
+    reply("550 Failed to open file.");
+    return;
+  }
+  const auto size = file_size(path);
+  if (offset > size) {
+    reply("554 Restart position is past the end of the file.");
+    return;
+  }
+
+  const auto truncateAfter = server_.faults().truncateTransfersAfter;
+  reply(
+    "150 Opening BINARY mode data connection for " + argument
+    + " (" + std::to_string(size - offset) + " bytes)."
+  );
+
+  io::Socket *dataSocket = openDataConnection();
+  if (!dataSocket) {
+    reply("425 Failed to establish connection.");
+    return;
+  }
+
+  const bool isTruncated = truncateAfter && size - offset > *truncateAfter;
+  const bool isSent = sendFileData(*dataSocket, path, offset, isTruncated ? truncateAfter : std::nullopt);
+  closeDataConnection();
+
+  if (isTruncated) {
+    reply("426 Connection closed; transfer aborted.");
+  } else if (!isSent) {
+    reply("451 Failure writing network stream.");
+  } else {
+    reply("226 Transfer complete.");
+  }
+}
+
+void
+LocalServer::Session::storOrAppe(const std::string &argument, bool isAppendOperation)
+{
+  const auto path = localPath(argument);
+  const auto restOffset = std::exchange(restOffset_, 0);
+  if (!dataListener_ && !activeAddress_) {
+    reply("425 Use PORT or PASV first.");
+    return;
+  }
+  if (!is_directory(path.parent_path()) || is_directory(path)) {
+    reply("553 Could not create file.");
+    return;
+  }
+
+  // Make sure the file exists and contains only what should be kept.
+  // APPE keeps everything, STOR keeps whatever comes before the REST offset.
+  if (!exists(path)) {
+    std::ofstream(path, std::ios::binary);
+  }
+  const auto existingSize = file_size(path);
+  if (!isAppendOperation && restOffset > existingSize) {
+    reply("554 Restart position is past the end of the file.");
+    return;
+  }
+  const auto offset = isAppendOperation ? existingSize : restOffset;
+  fs::resize_file(path, offset);
+
+  const auto faults = server_.faults();
+  const auto truncateAfter = faults.truncateTransfersAfter;
+  reply("150 Ok to send data.");
+
+  io::Socket *dataSocket = openDataConnection();
+  if (!dataSocket) {
+    reply("425 Failed to establish connection.");
+    return;
+  }
+
+  // When truncating, a transfer which is shorter than the limit completes
+  // normally; receiving the whole limit means the client had more to send.
+  bool isTruncated = false;
+  bool isReceived = false;
+  if (faults.bandwidthLimit && !isModeZ_) {
+    const auto received = receiveThrottled(*dataSocket, path, offset, truncateAfter, *faults.bandwidthLimit);
+    isReceived = received.has_value();
+    isTruncated = truncateAfter && received == truncateAfter;
+  } else if (truncateAfter) {
+    isTruncated = dataSocket->retrieveFileRange(path, offset, *truncateAfter);
+    isReceived = true;
+  } else {
+    isReceived = dataSocket->resumeRetrieveFile(path, offset);
+  }
+  closeDataConnection();
+
+  if (isTruncated) {
+    reply("426 Connection closed; transfer aborted.");
+  } else if (!isReceived) {
+    reply("451 Failure reading network stream.");
+  } else {
+    reply("226 Transfer complete.");
+  }
+}
+
+void
+LocalServer::Session::listing(const std::string &verb, const std::string &argument)
+{
+  const auto path = localPath(argument);
+  if (!dataListener_ && !activeAddress_) {
+    reply("425 Use PORT or PASV first.");
+    return;
+  }
+  // MLSD only lists directories, but LIST and NLST list a file on its own.
+  if (verb == "MLSD" && !is_directory(path)) {
+    reply("501 Not a directory.");
+    return;
+  } else if (!exists(path)) {
+    reply("550 No such file or directory.");
+    return;
+  }
+
+  reply("150 Here comes the directory listing.");
+
+  io::Socket *dataSocket = openDataConnection();
+  if (!dataSocket) {
+    reply("425 Failed to establish connection.");
+    return;
+  }
+
+  const auto line = [&verb](const fs::path &entry) -> std::optional<std::string> {
+    if (verb == "NLST") {
+      return entry.filename().string();
+    } else if (verb == "LIST") {
+      return unixListLine(entry);
+    }
+    const auto facts = mlsxFacts(entry);
+    if (!facts) {
+      return {};
+    }
+    return *facts + " " + entry.filename().string();
+  };
+  const auto sendData = [dataSocket](std::string_view data) {
+    return dataSocket->sendString(std::string(data)) == data.size();
+  };
+  std::optional<io::Deflater> deflater;
+  if (isModeZ_) {
+    deflater.emplace(COMPRESSION_LEVEL);
+  }
+  const auto sendLine = [&line, &sendData, &deflater](const fs::path &entry) {
+    if (const auto maybeLine = line(entry)) {
+      const std::string lineWithDelim = *maybeLine + DELIM;
+      return deflater ? deflater->deflate(lineWithDelim, false, sendData) : sendData(lineWithDelim);
+    }
+    return true;
+  };
+
+  // Sent an entry at a time, so that big directories don't have to fit in memory.
+  bool isSent = true;
+  std::error_code error;
+  if (is_directory(path)) {
+    for (fs::directory_iterator it(path, error), end; isSent && !error && it != end; it.increment(error)) {
+      isSent = sendLine(it->path());
+    }
+  } else {
+    isSent = sendLine(path);
+  }
+  if (deflater && isSent) {
+    isSent = deflater->deflate({}, true, sendData);
+  }
+  closeDataConnection();
+
+  if (!isSent || error) {
+    reply("451 Failure writing network stream.");
+  } else {
+    reply("226 Directory send OK.");
+  }
+}
+
+bool
+LocalServer::Session::sendFileData(
+  io::Socket &dataSocket,
+  const fs::path &path,
+  std::uintmax_t offset,
+  const std::optional<std::uintmax_t> &length
+) {
+  if (const auto limit = server_.faults().bandwidthLimit; limit && !isModeZ_) {
+    return sendThrottled(dataSocket, path, offset, length, *limit);
+  }
+  return length ? dataSocket.sendFileRange(path, offset, *length) : dataSocket.sendFile(path, offset);
+}
+
+io::Socket *
+LocalServer::Session::openDataConnection()
+{
+  std::optional<io::Socket> maybeSocket;
+  if (const auto address = std::exchange(activeAddress_, std::nullopt)) {
+    io::Socket socket(server_.ioContext_);
+    if (socket.connect(address->first, address->second)) {
+      maybeSocket = std::move(socket);
+    }
+  } else {
+    // The client connects as soon as it gets our PASV reply, so the
+    // connection should already be waiting.
+    maybeSocket = dataListener_->accept();
+  }
+
+  io::Socket *dataSocket;
+  {
+    std::lock_guard lock(mutex_);
+    if (dataListener_) {
+      dataListener_->close();
+      dataListener_.reset();
+    }
+    if (!maybeSocket || isShutdown_) {
+      return nullptr;
+    }
+    dataSocket_ = std::move(maybeSocket);
+    dataSocket_->setCompression(isModeZ_ ? std::optional<int>(COMPRESSION_LEVEL) : std::nullopt);
+    dataSocket = &*dataSocket_;
+  }
+
+  // Outside the lock, so that `shutdown` can interrupt the handshake.
+  if (isDataProtected_) {
+    if (!dataSocket->startTls(tlsContext_)) {
+      closeDataConnection();
+      return nullptr;
+    } else if (!dataSocket->isTlsResumed()) {
+      LOG_WARN("Refusing data connection which didn't resume the TLS session.");
+      closeDataConnection();
+      return nullptr;
+    }
+  }
+  return dataSocket;
+}
+
+void
+LocalServer::Session::closeDataConnection()
+{
+  std::lock_guard lock(mutex_);
+  if (dataSocket_) {
+    dataSocket_->close();
+    dataSocket_.reset();
+  }
+}
+
+LocalServer::LocalServer(fs::path root)
+  : root_(std::move(root)),
+    ioContext_(),
+    listener_(ioContext_),
+    port_(),
+    acceptThread_(),
+    mutex_(),
+    faults_(),
+    tlsContext_(),
+    certificate_(),
+    isStopping_(false),
+    sessions_(),
+    sessionThreads_()
+{ }
+
+LocalServer::~LocalServer()
+{
+  stop();
+}
+
+bool
+LocalServer::start()
+{
+  if (listener_.isOpen() || !listener_.listen(HOST, "0")) {
+    return false;
+  }
+  port_ = *listener_.port();
+  acceptThread_ = std::thread([this]() { acceptConnections(); });
+  return true;
+}
+
+void
+LocalServer::stop()
+{
+  {
+    std::lock_guard lock(mutex_);
+    if (isStopping_ || !acceptThread_.joinable()) {
+      return;
+    }
+    isStopping_ = true;
+  }
+
+  listener_.shutdown();
+  acceptThread_.join();
+  listener_.close();
+
+  // No new sessions can be added now that the accept thread has finished.
+  for (const auto &session : sessions_) {
+    session->shutdown();
+  }
+  for (auto &thread : sessionThreads_) {
+    thread.join();
+  }
+  sessions_.clear();
+  sessionThreads_.clear();
+}
+
+std::string
+LocalServer::host() const
+{
+  return HOST;
+}
+
+std::string
+LocalServer::port() const
+{
+  return port_;
+}
+
+void
+LocalServer::setFaults(const Faults &faults)
+{
+  std::lock_guard lock(mutex_);
+  faults_ = faults;
+}
+
+bool
+LocalServer::enableTls()
+{
+  const auto certificateAndKey = makeSelfSignedCertificate(HOST);
+  auto context = std::make_shared<io::TlsContext>(io::TlsContext::Role::Server);
+  if (!certificateAndKey || !context->useCertificate(certificateAndKey->first, certificateAndKey->second)) {
+    LOG_ERROR("Could not set up local server's certificate.");
+    return false;
+  }
+  std::lock_guard lock(mutex_);
+  tlsContext_ = std::move(context);
+  certificate_ = certificateAndKey->first;
+  return true;
+}
+
+std::string
+LocalServer::certificate() const
+{
+  std::lock_guard lock(mutex_);
+  return certificate_;
+}
+
+Faults
+LocalServer::faults() const
+{
+  std::lock_guard lock(mutex_);
+  return faults_;
+}
+
+std::size_t
+LocalServer::commandCount(const std::string &verb) const
+{
+  std::lock_guard lock(mutex_);
+  const auto it = commandCounts_.find(verb);
+  return it == commandCounts_.end() ? 0 : it->second;
+}
+
+void
+LocalServer::acceptConnections()
+{
+  while (true) {
+    auto maybeSocket = listener_.accept();
+
+    std::lock_guard lock(mutex_);
+    if (isStopping_) {
+      break;
+    }
+    if (!maybeSocket) {
+      LOG_WARN("Local server failed to accept a connection.");
+      continue;
+    }
+
+    auto session = std::make_shared<Session>(*this, std::move(*maybeSocket));
+    sessions_.push_back(session);
+    sessionThreads_.emplace_back([session]() { session->run(); });
+  }
+}
+
+}
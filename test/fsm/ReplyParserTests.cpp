@@ -0,0 +1,245 @@
+#include <unordered_map>
+#include <string>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <chrono>
+
+#include "util/util.hpp"
+#include "io/Reply.h"
+#include "fsm/CommandFsm.h"
+#include "fsm/ListingParser.h"
+
+#define TEST_ASSERT(e) throwIfFalse(e, __LINE__)
+
+using TestFunction = void(*)();
+
+// These check the reply parsers directly, against replies that real servers
+// send but that would be awkward to get out of one on demand.
+
+namespace {
+
+template <class T>
+void
+throwIfFalse(const T &expression, int line)
+{
+  if (!expression) {
+    std::stringstream msg;
+    msg << "Assertion triggered at line " << line << std::endl;
+    throw std::runtime_error(msg.str());
+  }
+}
+
+auto tests = std::unordered_map<std::string, TestFunction> {
+  { "Test parse PASV reply",
+  []() {
+    const auto expected = std::make_pair(std::string("192.168.1.2"), std::string("50000"));
+    TEST_ASSERT(fsm::parsePasvReply("227 Entering Passive Mode (192,168,1,2,195,80).") == expected);
+    // RFC 1123 says the parentheses can't be relied on.
+    TEST_ASSERT(fsm::parsePasvReply("227 =192,168,1,2,195,80") == expected);
+    // Numbers before the address which aren't part of it.
+    TEST_ASSERT(fsm::parsePasvReply("227 Mode 2, address 192,168,1,2,195,80") == expected);
+  }
+  },
+
+  { "Test malformed PASV replies",
+  []() {
+    TEST_ASSERT(!fsm::parsePasvReply("425 Can't open data connection."));
+    TEST_ASSERT(!fsm::parsePasvReply("227 Entering Passive Mode (192,168,1,2,195)."));
+    TEST_ASSERT(!fsm::parsePasvReply("227 Entering Passive Mode (192,168,1,256,195,80)."));
+    TEST_ASSERT(!fsm::parsePasvReply("227 Entering Passive Mode (192,168,1,2,195,1234567)."));
+    TEST_ASSERT(!fsm::parsePasvReply("22"));
+  }
+  },
+
+  { "Test parse EPSV reply",
+  []() {
+    TEST_ASSERT(fsm::parseEpsvReply("229 Entering Extended Passive Mode (|||6446|)") == "6446");
+    TEST_ASSERT(fsm::parseEpsvReply("229 Entering Extended Passive Mode (!!!6446!)") == "6446");
+    TEST_ASSERT(!fsm::parseEpsvReply("229 Entering Extended Passive Mode (|||6446!)"));
+    TEST_ASSERT(!fsm::parseEpsvReply("229 Entering Extended Passive Mode (||6446|)"));
+    TEST_ASSERT(!fsm::parseEpsvReply("229 Entering Extended Passive Mode (|||70000|)"));
+    TEST_ASSERT(!fsm::parseEpsvReply("229 Entering Extended Passive Mode"));
+    TEST_ASSERT(!fsm::parseEpsvReply("500 EPSV not understood"));
+  }
+  },
+
+  { "Test parse directory reply",
+  []() {
+    TEST_ASSERT(fsm::parseDirectoryReply("257 \"/usr/dm\" is current directory.") == "/usr/dm");
+    TEST_ASSERT(fsm::parseDirectoryReply("257 \"/\"") == "/");
+    // RFC 959 appendix II quote doubling.
+    TEST_ASSERT(fsm::parseDirectoryReply("257 \"/usr/dm/foo\"\"bar\" created.") == "/usr/dm/foo\"bar");
+    TEST_ASSERT(fsm::parseDirectoryReply("257 \"\"\"quoted\"\"\" created.") == "\"quoted\"");
+    TEST_ASSERT(fsm::parseDirectoryReply("257-Some banner\r\n257 \"/dir\" is current directory.") == "/dir");
+  }
+  },
+
+  { "Test malformed directory replies",
+  []() {
+    TEST_ASSERT(!fsm::parseDirectoryReply("550 Permission denied."));
+    TEST_ASSERT(!fsm::parseDirectoryReply("257 /dir is current directory."));
+    TEST_ASSERT(!fsm::parseDirectoryReply("257 \"/dir is current directory."));
+    TEST_ASSERT(!fsm::parseDirectoryReply("257"));
+  }
+  },
+
+  { "Test parse FEAT reply",
+  []() {
+    const auto features = fsm::parseFeatReply("211-Extensions supported:\r\n SIZE\r\n REST STREAM \r\n211 END");
+    TEST_ASSERT(features == std::vector<std::string>({"SIZE", "REST STREAM"}));
+    TEST_ASSERT(fsm::parseFeatReply("211 No extensions") == std::vector<std::string>());
+    TEST_ASSERT(fsm::parseFeatReply("500 FEAT not understood") == std::vector<std::string>());
+    TEST_ASSERT(!fsm::parseFeatReply("421 Closing connection"));
+  }
+  },
+
+  { "Test parse MDTM reply",
+  []() {
+    // 2001-09-09 01:46:40 UTC.
+    const auto expected = std::chrono::system_clock::from_time_t(1000000000);
+    TEST_ASSERT(fsm::parseMdtmReply("213 20010909014640") == expected);
+    TEST_ASSERT(fsm::parseMdtmReply("213 20010909014640.123") == expected);
+    TEST_ASSERT(!fsm::parseMdtmReply("213 2001090901464"));
+    TEST_ASSERT(!fsm::parseMdtmReply("213 2001O909014640"));
+    TEST_ASSERT(!fsm::parseMdtmReply("550 No such file"));
+  }
+  },
+
+  { "Test parse MLSD entries",
+  []() {
+    using Type = fsm::ListingEntry::Type;
+    fsm::ListingEntry entry;
+
+    TEST_ASSERT(fsm::parseMlsxEntry("type=file;size=2050;modify=20010909014640.5;perm=adfrw;unique=801U1A; my file.txt\r\n", entry));
+    TEST_ASSERT(entry.name == "my file.txt" && entry.type == Type::File && entry.size == 2050u);
+    TEST_ASSERT(entry.modifyTime == std::chrono::system_clock::from_time_t(1000000000));
+    TEST_ASSERT(entry.perm == "adfrw" && entry.unique == "801U1A");
+
+    // Fact names and types aren't case sensitive, and unknown facts are ignored.
+    TEST_ASSERT(fsm::parseMlsxEntry("Type=DIR;UNIX.mode=0755;Modify=20010909014640; dir", entry));
+    TEST_ASSERT(entry.name == "dir" && entry.type == Type::Directory && !entry.size && entry.modifyTime && entry.perm.empty());
+
+    TEST_ASSERT(fsm::parseMlsxEntry("type=cdir; .", entry) && entry.type == Type::CurrentDirectory);
+    TEST_ASSERT(fsm::parseMlsxEntry("type=pdir; ..", entry) && entry.type == Type::ParentDirectory);
+    TEST_ASSERT(fsm::parseMlsxEntry("type=OS.unix=slink:/target; link", entry) && entry.type == Type::Link);
+    TEST_ASSERT(fsm::parseMlsxEntry(" no facts", entry) && entry.name == "no facts" && entry.type == Type::Other);
+
+    TEST_ASSERT(!fsm::parseMlsxEntry("type=file;size=1;", entry));
+    TEST_ASSERT(!fsm::parseMlsxEntry("type=file;size=1; ", entry));
+
+    const auto maybeEntry = fsm::parseMlstReply("250-Listing x\r\n type=file;size=3; /dir/x\r\n250 End");
+    TEST_ASSERT(maybeEntry && maybeEntry->name == "/dir/x" && maybeEntry->size == 3u);
+    TEST_ASSERT(!fsm::parseMlstReply("550 No such file"));
+    TEST_ASSERT(!fsm::parseMlstReply("250-Listing x\r\n250 End"));
+  }
+  },
+
+  { "Test parse LIST entries",
+  []() {
+    using Type = fsm::ListingEntry::Type;
+    using std::chrono::system_clock;
+    fsm::ListingEntry entry;
+    // 2001-09-09 01:46:40 UTC.
+    const auto now = system_clock::from_time_t(1000000000);
+
+    TEST_ASSERT(fsm::parseListEntry("-rw-r--r--    1 owner    group        2050 Jan 31  1999 big file.txt", entry, now));
+    TEST_ASSERT(entry.name == "big file.txt" && entry.type == Type::File && entry.size == 2050u);
+    TEST_ASSERT(entry.modifyTime == system_clock::from_time_t(917740800));
+
+    // Without a year, the time is in the last year.
+    TEST_ASSERT(fsm::parseListEntry("drwxr-xr-x 2 owner group 4096 Sep 01 12:30 dir", entry, now));
+    TEST_ASSERT(entry.name == "dir" && entry.type == Type::Directory && !entry.size);
+    TEST_ASSERT(entry.modifyTime == system_clock::from_time_t(999347400));
+    TEST_ASSERT(fsm::parseListEntry("-rw-r--r-- 1 owner group 1 Dec 25 00:00 x", entry, now));
+    TEST_ASSERT(entry.modifyTime == system_clock::from_time_t(977702400));
+
+    // No group, and a link.
+    TEST_ASSERT(fsm::parseListEntry("lrwxrwxrwx 1 owner 7 Jan 31  1999 link -> target", entry, now));
+    TEST_ASSERT(entry.name == "link" && entry.type == Type::Link);
+
+    TEST_ASSERT(fsm::parseListEntry("01-31-99  01:30PM       <DIR>          dos dir", entry, now));
+    TEST_ASSERT(entry.name == "dos dir" && entry.type == Type::Directory);
+    TEST_ASSERT(entry.modifyTime == system_clock::from_time_t(917740800 + 13 * 3600 + 30 * 60));
+    TEST_ASSERT(fsm::parseListEntry("09-09-2001  12:00AM                 2050 dos.txt\r", entry, now));
+    TEST_ASSERT(entry.name == "dos.txt" && entry.type == Type::File && entry.size == 2050u);
+    TEST_ASSERT(entry.modifyTime == system_clock::from_time_t(999993600));
+
+    TEST_ASSERT(!fsm::parseListEntry("total 12", entry, now));
+    TEST_ASSERT(!fsm::parseListEntry("", entry, now));
+    TEST_ASSERT(!fsm::parseListEntry("-rw-r--r-- 1 owner group 2050 Foo 31 1999 x", entry, now));
+    TEST_ASSERT(!fsm::parseListEntry("01-31-99  13:30PM  1 x", entry, now));
+  }
+  },
+
+  { "Test parse CRC replies",
+  []() {
+    TEST_ASSERT(fsm::parseXcrcReply("250 1A2B3C4D") == 0x1A2B3C4Du);
+    TEST_ASSERT(fsm::parseXcrcReply("250 1a2b3c4d file.txt") == 0x1A2B3C4Du);
+    TEST_ASSERT(!fsm::parseXcrcReply("250 1A2B3C4"));
+    TEST_ASSERT(!fsm::parseXcrcReply("250 1A2B3C4G"));
+    TEST_ASSERT(!fsm::parseXcrcReply("550 No such file"));
+
+    TEST_ASSERT(fsm::parseHashCrcReply("213 CRC32 0-49 0000ffff my file.txt") == 0xFFFFu);
+    TEST_ASSERT(!fsm::parseHashCrcReply("213 SHA-1 0-49 0000ffff file.txt"));
+    TEST_ASSERT(!fsm::parseHashCrcReply("213 CRC32 0-49"));
+    TEST_ASSERT(!fsm::parseHashCrcReply("504 Unknown algorithm"));
+  }
+  },
+
+  { "Test parse single-line replies",
+  []() {
+    const auto parsed = io::parseReply("200 OK\r\n331 Next");
+    TEST_ASSERT(parsed && parsed->first.code == 200 && parsed->first.text == "200 OK" && parsed->second == 8);
+    TEST_ASSERT(!io::parseReply("200 OK"));
+    TEST_ASSERT(io::parseReply("garbage\r\n")->first.code == 0);
+  }
+  },
+
+  { "Test parse multi-line replies",
+  []() {
+    const std::string reply("211-Features:\r\n SIZE\r\n211-not the end\r\n200 nor this\r\n211 End\r\n");
+    const auto parsed = io::parseReply(reply);
+    TEST_ASSERT(parsed && parsed->first.code == 211 && parsed->second == reply.size());
+    TEST_ASSERT(parsed->first.text == std::string_view(reply).substr(0, reply.size() - 2));
+    // Incomplete until the closing line arrives.
+    TEST_ASSERT(!io::parseReply("211-Features:\r\n SIZE\r\n211 En"));
+  }
+  },
+};
+}
+
+int
+main(void)
+{
+  LOG_INFO("");
+  auto testsExecuted = 0;
+  auto testsPassed = 0;
+
+  for (const auto &[name, testFunc] : tests) {
+    LOG_INFO("");
+    LOG_INFO("===");
+    LOG_INFO("Running test: " << name);
+    LOG_INFO("---");
+
+    try {
+      ++testsExecuted;
+      testFunc();
+      // If no exception thrown, test passes.
+      ++testsPassed;
+      LOG_INFO("PASSED");
+    } catch (const std::exception &e) {
+      LOG_INFO("FAILED: " << e.what());
+    }
+
+    LOG_INFO("===");
+  }
+
+  std::stringstream summary;
+  summary << "Tests passed: " << testsPassed << "/" << testsExecuted << std::endl;
+  LOG_INFO("");
+  LOG_INFO(summary.str());
+
+  return testsPassed == testsExecuted ? 0 : -1;
+}
@@ -0,0 +1,267 @@
+#include <unordered_map>
+#include <string>
+#include <sstream>
+#include <stdexcept>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <future>
+
+#include <boost/asio.hpp>
+
+#include "util/util.hpp"
+#include "ftp/AsyncClient.h"
+#include "server/LocalServer.h"
+
+#define TEST_ASSERT(e) throwIfFalse(e, __LINE__)
+
+namespace fs = std::filesystem;
+using fs::path;
+
+using boost::asio::io_context;
+using boost::asio::use_future;
+using ftp::AsyncClient;
+using server::LocalServer;
+using TestFunction = void(*)(io_context&, LocalServer&, const path&, const path&);
+
+namespace {
+
+constexpr auto USERNAME = "anonymous", PASSWORD = "anonymous";
+
+constexpr std::uintmax_t FILE_SIZE = 300 * 1000;
+
+// Many more sessions than there are threads running the io context.
+constexpr int NUM_SESSIONS = 50, NUM_THREADS = 2;
+
+template <class T>
+void
+throwIfFalse(const T &expression, int line)
+{
+  if (!expression) {
+    std::stringstream msg;
+    msg << "Assertion triggered at line " << line << std::endl;
+    throw std::runtime_error(msg.str());
+  }
+}
+
+void
+writeRandomFile(const path &file, std::uintmax_t size)
+{
+  std::mt19937 generator(size);
+  std::ofstream stream(file, std::ios::binary);
+  for (std::uintmax_t i = 0; i < size; ++i) {
+    stream.put(static_cast<char>(generator()));
+  }
+}
+
+std::string
+readFile(const path &file)
+{
+  std::ifstream stream(file, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+}
+
+// Uploads `localSrc`, downloads it again to `localDest`, and quits, calling
+// `onComplete` with whether every step succeeded.
+void
+uploadThenDownload(
+  AsyncClient &client,
+  const LocalServer &server,
+  const path &localSrc,
+  const std::string &serverFile,
+  const path &localDest,
+  std::function<void(bool)> onComplete
+) {
+  client.asyncConnect(server.host(), server.port(), [=, &client](bool isConnected) {
+    if (!isConnected) return onComplete(false);
+    client.asyncLogin(USERNAME, PASSWORD, [=, &client](bool isLoggedIn) {
+      if (!isLoggedIn) return onComplete(false);
+      client.asyncStor(localSrc, serverFile, [=, &client](bool isStored) {
+        if (!isStored) return onComplete(false);
+        client.asyncRetr(serverFile, localDest, [=, &client](bool isRetrieved) {
+          if (!isRetrieved) return onComplete(false);
+          client.asyncQuit(onComplete);
+        });
+      });
+    });
+  });
+}
+
+auto tests = std::unordered_map<std::string, TestFunction> {
+  { "Test upload and download with futures",
+  [](io_context &ioContext, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    const auto fileToUpload(localTemp/"upload.bin"), downloadedFile(localTemp/"download.bin");
+    writeRandomFile(fileToUpload, FILE_SIZE);
+
+    AsyncClient client(ioContext);
+    TEST_ASSERT(client.asyncConnect(server.host(), server.port(), use_future).get());
+    TEST_ASSERT(client.asyncLogin(USERNAME, PASSWORD, use_future).get());
+    TEST_ASSERT(client.asyncStor(fileToUpload, "file.bin", use_future).get());
+    TEST_ASSERT(readFile(serverRoot/"file.bin") == readFile(fileToUpload));
+    TEST_ASSERT(client.asyncRetr("file.bin", downloadedFile, use_future).get());
+    TEST_ASSERT(readFile(downloadedFile) == readFile(fileToUpload));
+    TEST_ASSERT(client.asyncQuit(use_future).get());
+  }
+  },
+
+  { "Test directory commands with futures",
+  [](io_context &ioContext, LocalServer &server, const path &, const path &serverRoot) {
+    fs::create_directory(serverRoot/"dir");
+
+    AsyncClient client(ioContext);
+    TEST_ASSERT(client.asyncConnect(server.host(), server.port(), use_future).get());
+    TEST_ASSERT(client.asyncLogin(USERNAME, PASSWORD, use_future).get());
+    TEST_ASSERT(client.asyncPwd(use_future).get() == "/");
+    TEST_ASSERT(client.asyncCwd("dir", use_future).get());
+    TEST_ASSERT(client.asyncPwd(use_future).get() == "/dir");
+    TEST_ASSERT(!client.asyncCwd("nonexistent", use_future).get());
+    TEST_ASSERT(client.asyncNoop(use_future).get());
+    TEST_ASSERT(client.asyncQuit(use_future).get());
+  }
+  },
+
+  { "Test download of non-existent file fails",
+  [](io_context &ioContext, LocalServer &server, const path &localTemp, const path &) {
+    AsyncClient client(ioContext);
+    TEST_ASSERT(client.asyncConnect(server.host(), server.port(), use_future).get());
+    TEST_ASSERT(client.asyncLogin(USERNAME, PASSWORD, use_future).get());
+    TEST_ASSERT(!client.asyncRetr("nonexistent.bin", localTemp/"file.bin", use_future).get());
+    // The session should still be usable afterwards.
+    TEST_ASSERT(client.asyncNoop(use_future).get());
+    TEST_ASSERT(client.asyncQuit(use_future).get());
+  }
+  },
+
+  { "Test multi-line replies",
+  [](io_context &ioContext, LocalServer &server, const path &localTemp, const path &) {
+    const auto fileToUpload(localTemp/"upload.bin"), downloadedFile(localTemp/"download.bin");
+    writeRandomFile(fileToUpload, FILE_SIZE);
+    server.setFaults({std::nullopt, true});
+
+    AsyncClient client(ioContext);
+    TEST_ASSERT(client.asyncConnect(server.host(), server.port(), use_future).get());
+    TEST_ASSERT(client.asyncLogin(USERNAME, PASSWORD, use_future).get());
+    TEST_ASSERT(client.asyncPwd(use_future).get() == "/");
+    TEST_ASSERT(client.asyncStor(fileToUpload, "file.bin", use_future).get());
+    TEST_ASSERT(client.asyncRetr("file.bin", downloadedFile, use_future).get());
+    TEST_ASSERT(readFile(downloadedFile) == readFile(fileToUpload));
+    TEST_ASSERT(!client.asyncCwd("nonexistent", use_future).get());
+    TEST_ASSERT(client.asyncQuit(use_future).get());
+  }
+  },
+
+  { "Test handler isn't called before the operation returns",
+  [](io_context &, LocalServer &, const path &, const path &) {
+    // A context of our own which nothing else is running, so we decide when handlers run.
+    io_context localContext;
+    AsyncClient client(localContext);
+    std::optional<bool> result;
+    // Not connected, so this fails without doing any I/O.
+    client.asyncQuit([&result](bool hasQuit) { result = hasQuit; });
+    TEST_ASSERT(!result);
+    localContext.run();
+    TEST_ASSERT(result && !*result);
+  }
+  },
+
+  { "Test many concurrent sessions with callbacks",
+  [](io_context &ioContext, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    const auto fileToUpload(localTemp/"upload.bin");
+    writeRandomFile(fileToUpload, FILE_SIZE);
+
+    std::vector<std::unique_ptr<AsyncClient>> clients;
+    for (int i = 0; i < NUM_SESSIONS; ++i) {
+      clients.push_back(std::make_unique<AsyncClient>(ioContext));
+    }
+
+    std::atomic<int> numFinished(0), numSucceeded(0);
+    std::promise<void> allFinished;
+    for (int i = 0; i < NUM_SESSIONS; ++i) {
+      const auto name = std::to_string(i) + ".bin";
+      uploadThenDownload(*clients[i], server, fileToUpload, name, localTemp/name, [&](bool isSuccess) {
+        if (isSuccess) {
+          ++numSucceeded;
+        }
+        if (++numFinished == NUM_SESSIONS) {
+          allFinished.set_value();
+        }
+      });
+    }
+    allFinished.get_future().wait();
+
+    TEST_ASSERT(numSucceeded == NUM_SESSIONS);
+    const auto expected = readFile(fileToUpload);
+    for (int i = 0; i < NUM_SESSIONS; ++i) {
+      const auto name = std::to_string(i) + ".bin";
+      TEST_ASSERT(readFile(serverRoot/name) == expected);
+      TEST_ASSERT(readFile(localTemp/name) == expected);
+    }
+  }
+  },
+};
+}
+
+int
+main(void)
+{
+  LOG_INFO("");
+  auto testsExecuted = 0;
+  auto testsPassed = 0;
+
+  const path testRoot(fs::temp_directory_path()/"ftp-async-client-tests");
+  const path localTemp(testRoot/"local"), serverRoot(testRoot/"server");
+
+  // Shared by every test, and run by a fixed number of threads no matter how
+  // many sessions a test has open.
+  io_context ioContext;
+  auto work = boost::asio::make_work_guard(ioContext);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < NUM_THREADS; ++i) {
+    threads.emplace_back([&ioContext]() { ioContext.run(); });
+  }
+
+  for (const auto &[name, testFunc] : tests) {
+    LOG_INFO("");
+    LOG_INFO("===");
+    LOG_INFO("Running test: " << name);
+    LOG_INFO("---");
+
+    fs::remove_all(testRoot);
+    fs::create_directories(localTemp);
+    fs::create_directories(serverRoot);
+
+    LocalServer server(serverRoot);
+
+    try {
+      ++testsExecuted;
+      TEST_ASSERT(server.start());
+      testFunc(ioContext, server, localTemp, serverRoot);
+      // If no exception thrown, test passes.
+      ++testsPassed;
+      LOG_INFO("PASSED");
+    } catch (const std::exception &e) {
+      LOG_INFO("FAILED: " << e.what());
+    }
+
+    LOG_INFO("===");
+  }
+
+  work.reset();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  fs::remove_all(testRoot);
+
+  std::stringstream summary;
+  summary << "Tests passed: " << testsPassed << "/" << testsExecuted << std::endl;
+  LOG_INFO("");
+  LOG_INFO(summary.str());
+
+  return testsPassed == testsExecuted ? 0 : -1;
+}
@@ -0,0 +1,137 @@
+#include <string>
+#include <sstream>
+#include <stdexcept>
+#include <filesystem>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <fstream>
+
+#include <unistd.h>
+
+#include <boost/asio.hpp>
+
+#include "util/util.hpp"
+#include "ftp/Client.h"
+#include "server/LocalServer.h"
+
+#define TEST_ASSERT(e) throwIfFalse(e, __LINE__)
+
+namespace fs = std::filesystem;
+using fs::path;
+
+using ftp::Client;
+using server::LocalServer;
+
+namespace {
+
+constexpr auto HOST = "127.0.0.1", USERNAME = "anonymous", PASSWORD = "anonymous";
+
+// Enough clients that they will definitely overlap, but few enough that
+// the server won't start refusing connections.
+constexpr size_t NUM_CLIENTS = 16;
+constexpr size_t ITERATIONS_PER_CLIENT = 10;
+
+template <class T>
+void
+throwIfFalse(const T &expression, int line)
+{
+  if (!expression) {
+    std::stringstream msg;
+    msg << "Assertion triggered at line " << line << std::endl;
+    throw std::runtime_error(msg.str());
+  }
+}
+
+// Does a full session's worth of work with its own files, so that any
+// interference between clients shows up as a failed assertion.
+void
+runSession(Client &client, const std::string &port, const std::string &name, const path &localTemp, const path &serverTemp)
+{
+  const path fileToUpload("scratch/files/bigfile-2049.txt");
+
+  TEST_ASSERT(client.connect(HOST, port));
+  TEST_ASSERT(client.login(USERNAME, PASSWORD));
+
+  const std::string serverFile("temp/" + name);
+  TEST_ASSERT(client.stor(fileToUpload, serverFile));
+  TEST_ASSERT(file_size(serverTemp/name) == 2049);
+
+  const path downloadedFile(localTemp/name);
+  TEST_ASSERT(client.retr(serverFile, downloadedFile));
+  TEST_ASSERT(exists(downloadedFile) && file_size(downloadedFile) == 2049);
+
+  TEST_ASSERT(client.dele(serverFile));
+  TEST_ASSERT(!exists(serverTemp/name));
+
+  TEST_ASSERT(client.quit());
+}
+
+}
+
+int
+main(void)
+{
+  LOG_INFO("");
+
+  // The files and the server are set up from scratch, as in the functional tests.
+  const path fixture(fs::temp_directory_path()/("ClientConcurrencyTests-" + std::to_string(::getpid())));
+  fs::remove_all(fixture);
+  fs::create_directories(fixture/"scratch"/"files");
+  fs::create_directories(fixture/"scratch"/"temp");
+  fs::create_directories(fixture/"server"/"temp");
+  std::ofstream(fixture/"scratch"/"files"/"bigfile-2049.txt", std::ios::binary) << std::string(2049, 'x');
+  fs::current_path(fixture);
+
+  LocalServer server(fixture/"server");
+  if (!server.start()) {
+    LOG_INFO("Not proceeding with tests because the server couldn't be started.");
+    return -1;
+  }
+  const std::string port = server.port();
+
+  path localTemp("./scratch/temp");
+  path serverTemp("./server/temp");
+
+  // Half the clients share one context and the other half have their own,
+  // to check both configurations are safe.
+  boost::asio::io_context sharedIoContext;
+
+  std::atomic<size_t> sessionsPassed = 0;
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < NUM_CLIENTS; ++i) {
+    workers.emplace_back([i, &port, &sharedIoContext, &sessionsPassed, &localTemp, &serverTemp]() {
+      for (size_t j = 0; j < ITERATIONS_PER_CLIENT; ++j) {
+        const std::string name("client-" + std::to_string(i) + "-" + std::to_string(j) + ".txt");
+        try {
+          if (i % 2 == 0) {
+            Client client(sharedIoContext);
+            runSession(client, port, name, localTemp, serverTemp);
+          } else {
+            Client client;
+            runSession(client, port, name, localTemp, serverTemp);
+          }
+          ++sessionsPassed;
+        } catch (const std::exception &e) {
+          LOG_INFO("FAILED: session=" << name << "; error=" << e.what());
+        }
+      }
+    });
+  }
+
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  server.stop();
+  fs::current_path(fixture.parent_path());
+  fs::remove_all(fixture);
+
+  const size_t sessionsExecuted = NUM_CLIENTS * ITERATIONS_PER_CLIENT;
+  std::stringstream summary;
+  summary << "Concurrent sessions passed: " << sessionsPassed << "/" << sessionsExecuted << std::endl;
+  LOG_INFO("");
+  LOG_INFO(summary.str());
+
+  return sessionsPassed == sessionsExecuted ? 0 : -1;
+}
@@ -0,0 +1,1021 @@
+#include <unordered_map>
+#include <string>
+#include <sstream>
+#include <stdexcept>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <algorithm>
+#include <vector>
+#include <chrono>
+#include <thread>
+
+#include "util/util.hpp"
+#include "ftp/Client.h"
+#include "ftp/SessionPool.h"
+#include "server/LocalServer.h"
+
+#define TEST_ASSERT(e) throwIfFalse(e, __LINE__)
+
+namespace fs = std::filesystem;
+using fs::path;
+
+using ftp::Client;
+using ftp::SessionPool;
+using server::LocalServer;
+using server::Faults;
+using TestFunction = void(*)(Client&, LocalServer&, const path&, const path&);
+
+// These tests run against a LocalServer rather than a real one, because they
+// need the server to misbehave in specific ways at specific times.
+
+namespace {
+
+constexpr auto USERNAME = "anonymous", PASSWORD = "anonymous";
+
+// Big enough that a transfer cut off after TRUNCATE_AFTER bytes is
+// well short of the whole file.
+constexpr std::uintmax_t FILE_SIZE = 300 * 1000, TRUNCATE_AFTER = 100 * 1000;
+
+template <class T>
+void
+throwIfFalse(const T &expression, int line)
+{
+  if (!expression) {
+    std::stringstream msg;
+    msg << "Assertion triggered at line " << line << std::endl;
+    throw std::runtime_error(msg.str());
+  }
+}
+
+void
+writeRandomFile(const path &file, std::uintmax_t size)
+{
+  std::mt19937 generator(size);
+  std::ofstream stream(file, std::ios::binary);
+  for (std::uintmax_t i = 0; i < size; ++i) {
+    stream.put(static_cast<char>(generator()));
+  }
+}
+
+std::string
+readFile(const path &file)
+{
+  std::ifstream stream(file, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+}
+
+SessionPool::Credentials
+poolCredentials(const LocalServer &server, const std::string &username = USERNAME)
+{
+  return {server.host(), server.port(), username, PASSWORD};
+}
+
+// Compresses about as well as the CSV and logs MODE Z is meant for.
+void
+writeCsvFile(const path &file, std::uintmax_t numRows)
+{
+  std::ofstream stream(file, std::ios::binary);
+  for (std::uintmax_t i = 0; i < numRows; ++i) {
+    stream << i << ",2024-01-01T00:00:" << (i % 60) << "Z,sensor-" << (i % 8) << "," << (i * 37 % 1000) << ",OK\r\n";
+  }
+}
+
+void
+assertConnectAndLogin(Client &client, const LocalServer &server)
+{
+  TEST_ASSERT(client.connect(server.host(), server.port()));
+  TEST_ASSERT(client.login(USERNAME, PASSWORD));
+}
+
+auto tests = std::unordered_map<std::string, TestFunction> {
+  { "Test resume download after data connection is cut",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    writeRandomFile(serverRoot/"file.bin", FILE_SIZE);
+    assertConnectAndLogin(client, server);
+
+    server.setFaults({TRUNCATE_AFTER});
+    const auto downloadedFile(localTemp/"file.bin");
+    TEST_ASSERT(!client.retr("file.bin", downloadedFile));
+    // We should have kept what we received before the connection was cut.
+    TEST_ASSERT(file_size(downloadedFile) == TRUNCATE_AFTER);
+
+    server.setFaults({});
+    TEST_ASSERT(client.retrResume("file.bin", downloadedFile));
+    TEST_ASSERT(readFile(downloadedFile) == readFile(serverRoot/"file.bin"));
+  }
+  },
+
+  { "Test resume download of complete file",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    writeRandomFile(serverRoot/"file.bin", FILE_SIZE);
+    assertConnectAndLogin(client, server);
+
+    const auto downloadedFile(localTemp/"file.bin");
+    TEST_ASSERT(client.retr("file.bin", downloadedFile));
+
+    // Nothing left to fetch, which should still count as success.
+    TEST_ASSERT(client.retrResume("file.bin", downloadedFile));
+    TEST_ASSERT(readFile(downloadedFile) == readFile(serverRoot/"file.bin"));
+  }
+  },
+
+  { "Test resume download without partial file",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    writeRandomFile(serverRoot/"file.bin", FILE_SIZE);
+    assertConnectAndLogin(client, server);
+
+    // Should behave like a normal download.
+    const auto downloadedFile(localTemp/"file.bin");
+    TEST_ASSERT(client.retrResume("file.bin", downloadedFile));
+    TEST_ASSERT(readFile(downloadedFile) == readFile(serverRoot/"file.bin"));
+  }
+  },
+
+  { "Test resume upload after data connection is cut",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    const auto fileToUpload(localTemp/"file.bin");
+    writeRandomFile(fileToUpload, FILE_SIZE);
+    assertConnectAndLogin(client, server);
+
+    server.setFaults({TRUNCATE_AFTER});
+    TEST_ASSERT(!client.stor(fileToUpload, "file.bin"));
+    TEST_ASSERT(file_size(serverRoot/"file.bin") == TRUNCATE_AFTER);
+
+    server.setFaults({});
+    TEST_ASSERT(client.storResume(fileToUpload, "file.bin"));
+    TEST_ASSERT(readFile(serverRoot/"file.bin") == readFile(fileToUpload));
+  }
+  },
+
+  { "Test resume upload without partial file",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    const auto fileToUpload(localTemp/"file.bin");
+    writeRandomFile(fileToUpload, FILE_SIZE);
+    assertConnectAndLogin(client, server);
+
+    TEST_ASSERT(client.storResume(fileToUpload, "file.bin"));
+    TEST_ASSERT(readFile(serverRoot/"file.bin") == readFile(fileToUpload));
+  }
+  },
+
+  { "Test resume append after data connection is cut",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    const auto fileToUpload(localTemp/"file.bin");
+    writeRandomFile(fileToUpload, FILE_SIZE);
+    const std::string originalContents("existing contents");
+    std::ofstream(serverRoot/"file.bin", std::ios::binary) << originalContents;
+    assertConnectAndLogin(client, server);
+
+    server.setFaults({TRUNCATE_AFTER});
+    TEST_ASSERT(!client.appe(fileToUpload, "file.bin"));
+    TEST_ASSERT(file_size(serverRoot/"file.bin") == originalContents.size() + TRUNCATE_AFTER);
+
+    server.setFaults({});
+    TEST_ASSERT(client.appeResume(fileToUpload, "file.bin", originalContents.size()));
+    TEST_ASSERT(readFile(serverRoot/"file.bin") == originalContents + readFile(fileToUpload));
+  }
+  },
+
+  { "Test multi-line replies",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    const auto fileToUpload(localTemp/"upload.bin");
+    writeRandomFile(fileToUpload, FILE_SIZE);
+    fs::create_directory(serverRoot/"dir");
+
+    // Set before connecting so that the welcome message is multi-line too.
+    server.setFaults({std::nullopt, true});
+    assertConnectAndLogin(client, server);
+    TEST_ASSERT(client.noop());
+    TEST_ASSERT(client.cwd("dir"));
+    TEST_ASSERT(client.pwd() == "/dir");
+    TEST_ASSERT(client.stor(fileToUpload, "file.bin"));
+    const auto downloadedFile(localTemp/"download.bin");
+    TEST_ASSERT(client.retr("file.bin", downloadedFile));
+    TEST_ASSERT(readFile(downloadedFile) == readFile(fileToUpload));
+    // A failed command's multi-line reply shouldn't be mistaken for success.
+    TEST_ASSERT(!client.cwd("nonexistent"));
+    TEST_ASSERT(client.quit());
+  }
+  },
+
+  { "Test redundant commands are skipped",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    const auto fileToUpload(localTemp/"upload.bin");
+    writeRandomFile(fileToUpload, FILE_SIZE);
+    fs::create_directory(serverRoot/"dir");
+    assertConnectAndLogin(client, server);
+
+    // Only the first of these needs to set the transfer type.
+    TEST_ASSERT(client.stor(fileToUpload, "file.bin"));
+    TEST_ASSERT(client.retr("file.bin", localTemp/"download.bin"));
+    TEST_ASSERT(client.size("file.bin") == FILE_SIZE);
+    TEST_ASSERT(server.commandCount("TYPE") == 1);
+    TEST_ASSERT(client.roundTripsSaved() == 2);
+
+    TEST_ASSERT(client.cwd("dir"));
+    TEST_ASSERT(client.pwd() == "/dir");
+    TEST_ASSERT(client.pwd() == "/dir");
+    TEST_ASSERT(client.cwd("/dir"));
+    TEST_ASSERT(server.commandCount("PWD") == 1);
+    TEST_ASSERT(server.commandCount("CWD") == 1);
+    // A different directory has to go to the server, and then we don't know where we are.
+    TEST_ASSERT(client.cwd("/"));
+    TEST_ASSERT(client.pwd() == "/");
+    TEST_ASSERT(server.commandCount("PWD") == 2);
+
+    const auto features = client.features();
+    TEST_ASSERT(features && std::count(features->begin(), features->end(), "REST STREAM") == 1);
+    TEST_ASSERT(client.features() == features);
+    TEST_ASSERT(server.commandCount("FEAT") == 1);
+    TEST_ASSERT(client.roundTripsSaved() == 5);
+
+    // Once the directory we're in has gone, CWD to it has to fail.
+    TEST_ASSERT(client.cwd("/dir"));
+    TEST_ASSERT(client.pwd() == "/dir");
+    TEST_ASSERT(client.rename("/dir", "/moved"));
+    TEST_ASSERT(!client.cwd("/dir"));
+    TEST_ASSERT(client.cwd("/moved"));
+    TEST_ASSERT(client.pwd() == "/moved");
+    TEST_ASSERT(client.rmd("/moved"));
+    TEST_ASSERT(!client.cwd("/moved"));
+
+    // Nothing carries over to a new session.
+    TEST_ASSERT(client.quit());
+    assertConnectAndLogin(client, server);
+    TEST_ASSERT(client.size("file.bin") == FILE_SIZE);
+    TEST_ASSERT(server.commandCount("TYPE") == 2);
+  }
+  },
+
+  { "Test data connection prefetch",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    constexpr int NUM_TRANSFERS = 5;
+    const auto fileToUpload(localTemp/"upload.bin");
+    writeRandomFile(fileToUpload, FILE_SIZE);
+    assertConnectAndLogin(client, server);
+    client.setDataConnectionPrefetch(true);
+
+    // Other commands in between shouldn't get in the way.
+    for (int i = 0; i < NUM_TRANSFERS; ++i) {
+      const auto name = std::to_string(i) + ".bin";
+      TEST_ASSERT(client.stor(fileToUpload, name));
+      TEST_ASSERT(client.noop());
+      TEST_ASSERT(client.retr(name, localTemp/name));
+      TEST_ASSERT(readFile(localTemp/name) == readFile(fileToUpload));
+    }
+    // Each transfer asks for the next one's connection, and only the first had to wait for it.
+    TEST_ASSERT(server.commandCount("PASV") == 2 * NUM_TRANSFERS + 1);
+    TEST_ASSERT(server.commandCount("TYPE") == 1);
+    // PASV and the handshake for every transfer after the first.
+    TEST_ASSERT(client.roundTripsSaved() == 2 * (2 * NUM_TRANSFERS - 1));
+
+    // A failed transfer still leaves the control connection in step.
+    TEST_ASSERT(!client.retr("nonexistent.bin", localTemp/"nonexistent.bin"));
+    server.setFaults({TRUNCATE_AFTER});
+    TEST_ASSERT(!client.retr("0.bin", localTemp/"truncated.bin"));
+    server.setFaults({});
+    TEST_ASSERT(client.retr("0.bin", localTemp/"after.bin"));
+    TEST_ASSERT(readFile(localTemp/"after.bin") == readFile(serverRoot/"0.bin"));
+
+    // Turning it off drops the spare connection.
+    client.setDataConnectionPrefetch(false);
+    TEST_ASSERT(client.retr("1.bin", localTemp/"off.bin"));
+    TEST_ASSERT(client.quit());
+  }
+  },
+
+  { "Test batch commands",
+  [](Client &client, LocalServer &server, const path &, const path &serverRoot) {
+    // More than fit in one window of pipelined commands.
+    constexpr size_t NUM_ITEMS = 150, MISSING_ITEM = 100;
+    std::vector<std::string> files, dirs;
+    for (size_t i = 0; i < NUM_ITEMS; ++i) {
+      files.push_back("file" + std::to_string(i));
+      dirs.push_back("dir" + std::to_string(i));
+      if (i != MISSING_ITEM) {
+        std::ofstream(serverRoot/files.back()) << std::string(i, 'x');
+      }
+    }
+    assertConnectAndLogin(client, server);
+
+    const auto sizes = client.sizeBatch(files);
+    const auto times = client.mdtmBatch(files);
+    TEST_ASSERT(sizes.size() == NUM_ITEMS && times.size() == NUM_ITEMS);
+    for (size_t i = 0; i < NUM_ITEMS; ++i) {
+      TEST_ASSERT(i == MISSING_ITEM ? !sizes[i] && !times[i] : sizes[i] == i && times[i].has_value());
+    }
+    TEST_ASSERT(client.mdtm(files[0]) == times[0]);
+
+    const auto created = client.mkdBatch(dirs);
+    TEST_ASSERT(created.front() == "/dir0" && created.back() == "/" + dirs.back());
+    TEST_ASSERT(client.cwdBatch({"dir0", "../dir1", "nonexistent", "/"}) == std::vector<bool>({true, true, false, true}));
+    TEST_ASSERT(client.rmdBatch(dirs) == std::vector<bool>(NUM_ITEMS, true));
+
+    // A failed RNFR mustn't let its RNTO rename anything.
+    const auto renamed = client.renameBatch({{files[0], "renamed0"}, {files[MISSING_ITEM], "renamed1"}, {files[1], "renamed2"}});
+    TEST_ASSERT(renamed == std::vector<bool>({true, false, true}));
+    TEST_ASSERT(exists(serverRoot/"renamed0") && !exists(serverRoot/"renamed1") && exists(serverRoot/"renamed2"));
+    files[0] = "renamed0";
+    files[1] = "renamed2";
+
+    auto deleted = client.deleBatch(files);
+    TEST_ASSERT(deleted[MISSING_ITEM] == false);
+    deleted[MISSING_ITEM] = true;
+    TEST_ASSERT(deleted == std::vector<bool>(NUM_ITEMS, true));
+    TEST_ASSERT(fs::is_empty(serverRoot));
+
+    // The control connection should still be in step afterwards.
+    TEST_ASSERT(client.noop());
+  }
+  },
+
+  { "Test structured listing with MLSD",
+  [](Client &client, LocalServer &server, const path &, const path &serverRoot) {
+    std::ofstream(serverRoot/"file.txt") << "hello";
+    fs::create_directory(serverRoot/"dir");
+    assertConnectAndLogin(client, server);
+
+    std::vector<fsm::ListingEntry> entries;
+    TEST_ASSERT(client.listEntries([&entries](const fsm::ListingEntry &entry) { entries.push_back(entry); }));
+    TEST_ASSERT(server.commandCount("MLSD") == 1 && server.commandCount("LIST") == 0);
+    TEST_ASSERT(entries.size() == 2);
+    std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b) { return a.name < b.name; });
+    TEST_ASSERT(entries[0].name == "dir" && entries[0].type == fsm::ListingEntry::Type::Directory);
+    TEST_ASSERT(entries[1].name == "file.txt" && entries[1].type == fsm::ListingEntry::Type::File);
+    TEST_ASSERT(entries[1].size == 5u && entries[1].modifyTime && !entries[1].unique.empty());
+
+    // Everything a sync needs, without a SIZE or MDTM per file.
+    TEST_ASSERT(server.commandCount("SIZE") == 0 && server.commandCount("MDTM") == 0);
+    TEST_ASSERT(entries[1].modifyTime == client.mdtm("file.txt"));
+
+    const auto maybeEntry = client.mlst("file.txt");
+    TEST_ASSERT(maybeEntry && maybeEntry->name == "/file.txt" && maybeEntry->size == 5u);
+    TEST_ASSERT(maybeEntry->unique == entries[1].unique);
+    TEST_ASSERT(!client.mlst("missing.txt"));
+    TEST_ASSERT(!client.listEntries("file.txt", [](const fsm::ListingEntry &) { }));
+    TEST_ASSERT(client.noop());
+  }
+  },
+
+  { "Test structured listing falls back to LIST",
+  [](Client &client, LocalServer &server, const path &, const path &serverRoot) {
+    std::ofstream(serverRoot/"file.txt") << "hello";
+    fs::create_directory(serverRoot/"dir");
+    Faults faults;
+    faults.errorReplies = {{"FEAT", "502 Command not implemented."}};
+    server.setFaults(faults);
+    assertConnectAndLogin(client, server);
+
+    // Without FEAT the client can't know MLSD is there, so mustn't try it.
+    std::vector<fsm::ListingEntry> entries;
+    TEST_ASSERT(client.listEntries([&entries](const fsm::ListingEntry &entry) { entries.push_back(entry); }));
+    TEST_ASSERT(server.commandCount("MLSD") == 0 && server.commandCount("LIST") == 1);
+    TEST_ASSERT(entries.size() == 2);
+    std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b) { return a.name < b.name; });
+    TEST_ASSERT(entries[0].name == "dir" && entries[0].type == fsm::ListingEntry::Type::Directory);
+    TEST_ASSERT(entries[1].name == "file.txt" && entries[1].type == fsm::ListingEntry::Type::File);
+    TEST_ASSERT(entries[1].size == 5u && entries[1].modifyTime);
+
+    std::vector<std::string> names;
+    TEST_ASSERT(client.nlst([&names](std::string_view name) { names.emplace_back(name); }));
+    std::sort(names.begin(), names.end());
+    TEST_ASSERT(names == std::vector<std::string>({"dir", "file.txt"}));
+    TEST_ASSERT(!client.list("missing"));
+    TEST_ASSERT(client.noop());
+  }
+  },
+
+  { "Test error replies",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    std::ofstream(serverRoot/"file.txt") << "hello";
+    assertConnectAndLogin(client, server);
+
+    Faults faults;
+    faults.errorReplies = {{"RETR", "451 Local error in processing."}, {"NOOP", "421 Service not available."}};
+    server.setFaults(faults);
+    TEST_ASSERT(!client.retr("file.txt", localTemp/"file.txt"));
+    TEST_ASSERT(!client.noop());
+    TEST_ASSERT(server.commandCount("RETR") == 1);
+
+    server.setFaults({});
+    TEST_ASSERT(client.retr("file.txt", localTemp/"file.txt"));
+    TEST_ASSERT(readFile(localTemp/"file.txt") == "hello");
+  }
+  },
+
+  { "Test pipelining hides reply latency",
+  [](Client &client, LocalServer &server, const path &, const path &serverRoot) {
+    // Few enough that they all fit in one window of pipelined commands.
+    constexpr size_t NUM_FILES = 40;
+    constexpr std::chrono::milliseconds LATENCY(25);
+    std::vector<std::string> files;
+    for (size_t i = 0; i < NUM_FILES; ++i) {
+      files.push_back("file" + std::to_string(i));
+      std::ofstream(serverRoot/files.back()) << std::string(i, 'x');
+    }
+    assertConnectAndLogin(client, server);
+    Faults faults;
+    faults.replyLatency = LATENCY;
+    server.setFaults(faults);
+
+    auto start = std::chrono::steady_clock::now();
+    TEST_ASSERT(client.noop());
+    TEST_ASSERT(std::chrono::steady_clock::now() - start >= LATENCY);
+
+    start = std::chrono::steady_clock::now();
+    const auto sizes = client.sizeBatch(files);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    for (size_t i = 0; i < NUM_FILES; ++i) {
+      TEST_ASSERT(sizes[i] == i);
+    }
+    // One at a time, these would take NUM_FILES round trips.
+    TEST_ASSERT(elapsed >= LATENCY && elapsed < LATENCY * (NUM_FILES / 4));
+  }
+  },
+
+  { "Test EPSV is used when PASV is refused",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    writeRandomFile(serverRoot/"file.bin", FILE_SIZE);
+    assertConnectAndLogin(client, server);
+    Faults faults;
+    faults.errorReplies = {{"PASV", "500 PASV not understood."}};
+    server.setFaults(faults);
+
+    const auto downloadedFile(localTemp/"file.bin");
+    TEST_ASSERT(client.retr("file.bin", downloadedFile));
+    TEST_ASSERT(readFile(downloadedFile) == readFile(serverRoot/"file.bin"));
+    TEST_ASSERT(server.commandCount("EPSV") == 1);
+  }
+  },
+
+  { "Test password not sent after USER is refused",
+  [](Client &client, LocalServer &server, const path &, const path &) {
+    Faults faults;
+    faults.errorReplies = {{"USER", "530 Non-anonymous sessions must use encryption."}};
+    server.setFaults(faults);
+
+    TEST_ASSERT(client.connect(server.host(), server.port()));
+    TEST_ASSERT(!client.login(USERNAME, PASSWORD));
+    TEST_ASSERT(server.commandCount("USER") == 1 && server.commandCount("PASS") == 0);
+    TEST_ASSERT(client.noop());
+  }
+  },
+
+  { "Test bandwidth limit",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    constexpr std::uintmax_t BYTES_PER_SECOND = FILE_SIZE * 2;
+    writeRandomFile(serverRoot/"file.bin", FILE_SIZE);
+    writeRandomFile(localTemp/"upload.bin", FILE_SIZE);
+    assertConnectAndLogin(client, server);
+    Faults faults;
+    faults.bandwidthLimit = BYTES_PER_SECOND;
+    server.setFaults(faults);
+
+    // Each transfer should take at least half a second.
+    constexpr std::chrono::milliseconds MIN_DURATION(FILE_SIZE * 1000 / BYTES_PER_SECOND);
+    auto start = std::chrono::steady_clock::now();
+    TEST_ASSERT(client.retr("file.bin", localTemp/"file.bin"));
+    TEST_ASSERT(std::chrono::steady_clock::now() - start >= MIN_DURATION);
+    TEST_ASSERT(readFile(localTemp/"file.bin") == readFile(serverRoot/"file.bin"));
+
+    start = std::chrono::steady_clock::now();
+    TEST_ASSERT(client.stor(localTemp/"upload.bin", "upload.bin"));
+    TEST_ASSERT(std::chrono::steady_clock::now() - start >= MIN_DURATION);
+    TEST_ASSERT(readFile(serverRoot/"upload.bin") == readFile(localTemp/"upload.bin"));
+  }
+  },
+
+  { "Test metrics",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    writeRandomFile(serverRoot/"file.bin", FILE_SIZE);
+    writeRandomFile(localTemp/"upload.bin", TRUNCATE_AFTER);
+    assertConnectAndLogin(client, server);
+
+    TEST_ASSERT(client.retr("file.bin", localTemp/"file.bin"));
+    TEST_ASSERT(client.stor(localTemp/"upload.bin", "upload.bin"));
+    TEST_ASSERT(client.list("", [](std::string_view) { }));
+    // Pipelined commands are timed separately.
+    TEST_ASSERT(client.sizeBatch({"file.bin", "missing.bin"}).size() == 2);
+
+    const auto metrics = client.metrics().snapshot();
+    // The listing is received too, so there's a little more than the file.
+    TEST_ASSERT(metrics.bytesReceived > FILE_SIZE && metrics.bytesSent == TRUNCATE_AFTER);
+    TEST_ASSERT(metrics.transferDuration.count == 3 && metrics.dataConnectionSetup.count == 3);
+    // STOR doesn't receive anything.
+    TEST_ASSERT(metrics.timeToFirstByte.count == 2);
+    TEST_ASSERT(metrics.timeToFirstByte.sum <= metrics.transferDuration.sum);
+    TEST_ASSERT(metrics.commandRoundTrip.at("RETR").count == 1 && metrics.commandRoundTrip.at("STOR").count == 1);
+    TEST_ASSERT(metrics.commandRoundTrip.at("SIZE").count == 2 && metrics.commandRoundTrip.at("PASV").count == 3);
+    TEST_ASSERT(metrics.commandRoundTrip.count("OPTS") == 0);
+    // One each for RETR, STOR and LIST.
+    TEST_ASSERT(metrics.replyCodes.at(150) == 3 && metrics.replyCodes.at(226) == 3);
+    TEST_ASSERT(metrics.replyCodes.at(213) == 1 && metrics.replyCodes.at(550) == 1);
+    TEST_ASSERT(metrics.replyCodes.at(220) == 1);
+
+    const auto text = client.metrics().toPrometheus();
+    TEST_ASSERT(text.find("ftp_client_bytes_sent_total " + std::to_string(TRUNCATE_AFTER) + "\n") != std::string::npos);
+    TEST_ASSERT(text.find("ftp_client_command_round_trip_seconds_count{verb=\"RETR\"} 1\n") != std::string::npos);
+    TEST_ASSERT(text.find("ftp_client_transfer_duration_seconds_bucket{le=\"+Inf\"} 3\n") != std::string::npos);
+    TEST_ASSERT(text.find("ftp_client_replies_total{code=\"226\"} 3\n") != std::string::npos);
+  }
+  },
+
+  { "Test mirror directory tree",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    // Wide and deep enough that every connection gets some of the work.
+    std::vector<path> files;
+    for (size_t i = 0; i < 4; ++i) {
+      for (size_t j = 0; j < 3; ++j) {
+        const auto dir = serverRoot/"tree"/("dir" + std::to_string(i))/("sub" + std::to_string(j));
+        fs::create_directories(dir);
+        files.push_back(fs::relative(dir/"file.bin", serverRoot/"tree"));
+        writeRandomFile(serverRoot/"tree"/files.back(), 1000 * (i * 3 + j));
+      }
+    }
+    fs::create_directories(serverRoot/"tree"/"empty");
+    files.push_back("top.bin");
+    writeRandomFile(serverRoot/"tree"/"top.bin", FILE_SIZE);
+    // Mustn't be confused with a partial download of the one above.
+    files.push_back("top.bin.part");
+    writeRandomFile(serverRoot/"tree"/"top.bin.part", FILE_SIZE / 2);
+
+    // A stale local copy should be replaced.
+    fs::create_directories(localTemp/"mirror");
+    writeRandomFile(localTemp/"mirror"/"top.bin", 10);
+
+    assertConnectAndLogin(client, server);
+    const auto report = client.mirror("tree", (localTemp/"mirror").string(), 4);
+    TEST_ASSERT(report.isComplete());
+    TEST_ASSERT(report.files.size() == files.size());
+    TEST_ASSERT(report.bytesPerSecond() > 0);
+
+    std::uintmax_t totalSize = 0;
+    for (const auto &file : files) {
+      TEST_ASSERT(readFile(localTemp/"mirror"/file) == readFile(serverRoot/"tree"/file));
+      totalSize += fs::file_size(serverRoot/"tree"/file);
+    }
+    TEST_ASSERT(report.totalBytes == totalSize);
+    TEST_ASSERT(fs::is_directory(localTemp/"mirror"/"empty"));
+    // No partial files left behind.
+    size_t numLocalFiles = 0;
+    for (const auto &entry : fs::recursive_directory_iterator(localTemp/"mirror")) {
+      numLocalFiles += entry.is_regular_file();
+    }
+    TEST_ASSERT(numLocalFiles == files.size());
+    // This connection, and three more.
+    TEST_ASSERT(server.commandCount("PASS") == 4);
+    TEST_ASSERT(client.noop());
+  }
+  },
+
+  { "Test mirror reports failures",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    fs::create_directories(serverRoot/"tree");
+    writeRandomFile(serverRoot/"tree"/"file.bin", FILE_SIZE);
+    assertConnectAndLogin(client, server);
+
+    server.setFaults({TRUNCATE_AFTER});
+    auto report = client.mirror("tree", (localTemp/"mirror").string(), 2);
+    TEST_ASSERT(!report.isComplete());
+    TEST_ASSERT(report.files.size() == 1 && !report.files[0].isSuccess && report.totalBytes == 0);
+    TEST_ASSERT(fs::is_empty(localTemp/"mirror"));
+
+    server.setFaults({});
+    report = client.mirror("missing", (localTemp/"other").string(), 2);
+    TEST_ASSERT(!report.isComplete());
+    TEST_ASSERT(report.failedDirectories == std::vector<std::string>({"missing"}));
+  }
+  },
+
+  { "Test sync uploads only what changed",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    const auto localTree(localTemp/"tree");
+    std::vector<path> files;
+    for (size_t i = 0; i < 3; ++i) {
+      const auto dir = path("dir" + std::to_string(i))/"sub";
+      fs::create_directories(localTree/dir);
+      for (size_t j = 0; j < 4; ++j) {
+        files.push_back(dir/("file" + std::to_string(j) + ".bin"));
+        writeRandomFile(localTree/files.back(), 1000 * (i * 4 + j + 1));
+      }
+    }
+    fs::create_directories(localTree/"empty");
+    assertConnectAndLogin(client, server);
+
+    auto report = client.syncUpload(localTree.string(), "tree", 3);
+    TEST_ASSERT(report.isComplete());
+    TEST_ASSERT(report.uploads.size() == files.size() && report.numUnchanged == 0);
+    for (const auto &file : files) {
+      TEST_ASSERT(readFile(serverRoot/"tree"/file) == readFile(localTree/file));
+    }
+    TEST_ASSERT(fs::is_directory(serverRoot/"tree"/"empty"));
+
+    // Nothing changed, so nothing is sent.
+    const auto storCount = server.commandCount("STOR");
+    report = client.syncUpload(localTree.string(), "tree", 3);
+    TEST_ASSERT(report.isComplete());
+    TEST_ASSERT(report.uploads.empty() && report.createdDirectories.empty());
+    TEST_ASSERT(report.numUnchanged == files.size());
+    TEST_ASSERT(server.commandCount("STOR") == storCount);
+    // The listings gave exact times, so no MDTM was needed.
+    TEST_ASSERT(server.commandCount("MDTM") == 0);
+
+    // One file changes size, one is modified in place, and there's a new directory.
+    writeRandomFile(localTree/files[0], 1);
+    std::ofstream(localTree/files[1], std::ios::binary | std::ios::in) << "x";
+    fs::last_write_time(localTree/files[1], fs::last_write_time(localTree/files[1]) + std::chrono::hours(1));
+    fs::create_directories(localTree/"new");
+    writeRandomFile(localTree/"new"/"file.bin", 10);
+    // And the server has things we don't.
+    fs::create_directories(serverRoot/"tree"/"orphan"/"deeper");
+    writeRandomFile(serverRoot/"tree"/"orphan"/"deeper"/"file.bin", 10);
+    writeRandomFile(serverRoot/"tree"/"orphan.bin", 10);
+
+    report = client.syncUpload(localTree.string(), "tree", 3, true);
+    TEST_ASSERT(report.isComplete());
+    TEST_ASSERT(report.uploads.size() == 3 && report.numUnchanged == files.size() - 2);
+    TEST_ASSERT(report.createdDirectories == std::vector<std::string>({"tree/new"}));
+    TEST_ASSERT(report.deletedPaths.size() == 4);
+    TEST_ASSERT(!exists(serverRoot/"tree"/"orphan") && !exists(serverRoot/"tree"/"orphan.bin"));
+    for (const auto &file : {files[0], files[1], path("new")/"file.bin"}) {
+      TEST_ASSERT(readFile(serverRoot/"tree"/file) == readFile(localTree/file));
+    }
+    TEST_ASSERT(client.noop());
+  }
+  },
+
+  { "Test append delta sends only new bytes",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    const auto localFile(localTemp/"log.bin");
+    writeRandomFile(localFile, FILE_SIZE);
+    assertConnectAndLogin(client, server);
+
+    // Nothing on the server yet, so it's all sent.
+    TEST_ASSERT(client.appeDelta(localFile.string(), "log.bin"));
+    TEST_ASSERT(readFile(serverRoot/"log.bin") == readFile(localFile));
+    TEST_ASSERT(client.appeDelta(localFile.string(), "log.bin"));
+
+    // Sending the whole file now would be cut off, so this only works if just
+    // the new bytes are sent.
+    std::ofstream(localFile, std::ios::binary | std::ios::app) << std::string(1000, 'x');
+    server.setFaults({TRUNCATE_AFTER});
+    TEST_ASSERT(client.appeDelta(localFile.string(), "log.bin"));
+    TEST_ASSERT(readFile(serverRoot/"log.bin") == readFile(localFile));
+    TEST_ASSERT(server.commandCount("APPE") == 1 && server.commandCount("XCRC") == 2);
+  }
+  },
+
+  { "Test append delta refuses a different prefix",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    const auto localFile(localTemp/"log.bin");
+    writeRandomFile(localFile, FILE_SIZE);
+    // Same size as the start of the local file, but different contents.
+    std::ofstream(serverRoot/"log.bin", std::ios::binary) << std::string(1000, 'x');
+    assertConnectAndLogin(client, server);
+
+    TEST_ASSERT(!client.appeDelta(localFile.string(), "log.bin"));
+    TEST_ASSERT(file_size(serverRoot/"log.bin") == 1000);
+
+    // Bigger than the local file, e.g. because it was rotated.
+    writeRandomFile(serverRoot/"log.bin", FILE_SIZE + 1);
+    TEST_ASSERT(!client.appeDelta(localFile.string(), "log.bin"));
+    TEST_ASSERT(file_size(serverRoot/"log.bin") == FILE_SIZE + 1);
+    TEST_ASSERT(server.commandCount("APPE") == 0 && server.commandCount("STOR") == 0);
+  }
+  },
+
+  { "Test can't resume upload when server file is bigger",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    const auto fileToUpload(localTemp/"file.bin");
+    writeRandomFile(fileToUpload, TRUNCATE_AFTER);
+    writeRandomFile(serverRoot/"file.bin", FILE_SIZE);
+    assertConnectAndLogin(client, server);
+
+    // The server's file can't be a prefix of ours, so there's nothing sensible to do.
+    TEST_ASSERT(!client.storResume(fileToUpload, "file.bin"));
+    TEST_ASSERT(file_size(serverRoot/"file.bin") == FILE_SIZE);
+  }
+  },
+
+  { "Test session pool reuses logged-in sessions",
+  [](Client &, LocalServer &server, const path &, const path &serverRoot) {
+    writeRandomFile(serverRoot/"file.bin", FILE_SIZE);
+    SessionPool pool;
+
+    for (int i = 0; i < 3; ++i) {
+      auto lease = pool.acquire(poolCredentials(server));
+      TEST_ASSERT(lease);
+      const auto size = (*lease)->size("file.bin");
+      TEST_ASSERT(size && *size == FILE_SIZE);
+    }
+    TEST_ASSERT(server.commandCount("USER") == 1);
+    TEST_ASSERT(pool.numIdle() == 1);
+    const auto stats = pool.stats();
+    TEST_ASSERT(stats.numCreated == 1 && stats.numReused == 2 && stats.numEvicted == 0);
+
+    // Another user gets a session of their own.
+    TEST_ASSERT(pool.acquire(poolCredentials(server, "someone-else")));
+    TEST_ASSERT(server.commandCount("USER") == 2);
+    TEST_ASSERT(pool.numIdle() == 2);
+  }
+  },
+
+  { "Test session pool limits sessions per host",
+  [](Client &, LocalServer &server, const path &, const path &) {
+    SessionPool::Options options;
+    options.maxConnectionsPerHost = 2;
+    options.acquireTimeout = std::chrono::milliseconds(200);
+    SessionPool pool(options);
+
+    auto first = pool.acquire(poolCredentials(server));
+    auto second = pool.acquire(poolCredentials(server));
+    TEST_ASSERT(first && second);
+    TEST_ASSERT(!pool.acquire(poolCredentials(server)));
+
+    // Returning one from another thread wakes up the waiting acquire.
+    std::thread releaser([&first]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      first.reset();
+    });
+    TEST_ASSERT(pool.acquire(poolCredentials(server)));
+    releaser.join();
+    TEST_ASSERT(server.commandCount("USER") == 2);
+
+    // An idle session for one user is closed to make room for another.
+    TEST_ASSERT(pool.numIdle() == 1);
+    TEST_ASSERT(pool.acquire(poolCredentials(server, "someone-else")));
+    TEST_ASSERT(server.commandCount("USER") == 3);
+    TEST_ASSERT(pool.stats().numEvicted == 1);
+  }
+  },
+
+  { "Test session pool keeps idle sessions alive",
+  [](Client &, LocalServer &server, const path &, const path &) {
+    SessionPool::Options options;
+    options.keepaliveInterval = std::chrono::milliseconds(50);
+    SessionPool pool(options);
+
+    TEST_ASSERT(pool.acquire(poolCredentials(server)));
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    TEST_ASSERT(server.commandCount("NOOP") >= 2);
+    TEST_ASSERT(pool.stats().numKeepalives >= 2);
+    TEST_ASSERT(pool.numIdle() == 1);
+
+    TEST_ASSERT(pool.acquire(poolCredentials(server)));
+    TEST_ASSERT(server.commandCount("USER") == 1);
+  }
+  },
+
+  { "Test session pool evicts broken and expired sessions",
+  [](Client &, LocalServer &server, const path &, const path &) {
+    SessionPool::Options options;
+    options.keepaliveInterval = std::chrono::milliseconds(50);
+    options.maxIdleTime = std::chrono::seconds(10);
+    {
+      SessionPool pool(options);
+      TEST_ASSERT(pool.acquire(poolCredentials(server)));
+
+      Faults faults;
+      faults.errorReplies = {{"NOOP", "421 Service not available."}};
+      server.setFaults(faults);
+      std::this_thread::sleep_for(std::chrono::milliseconds(300));
+      TEST_ASSERT(pool.numIdle() == 0);
+      TEST_ASSERT(pool.stats().numEvicted == 1);
+
+      server.setFaults({});
+      TEST_ASSERT(pool.acquire(poolCredentials(server)));
+      TEST_ASSERT(server.commandCount("USER") == 2);
+
+      // A session the borrower gives up on isn't lent out again.
+      auto lease = pool.acquire(poolCredentials(server));
+      TEST_ASSERT(lease);
+      lease->discard();
+      lease.reset();
+      TEST_ASSERT(pool.numIdle() == 0);
+      TEST_ASSERT(pool.stats().numEvicted == 2);
+    }
+
+    options.maxIdleTime = std::chrono::milliseconds(100);
+    SessionPool pool(options);
+    TEST_ASSERT(pool.acquire(poolCredentials(server)));
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    TEST_ASSERT(pool.numIdle() == 0);
+    TEST_ASSERT(pool.stats().numEvicted == 1);
+  }
+  },
+
+  { "Test server-to-server transfer",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    writeRandomFile(serverRoot/"file.bin", FILE_SIZE);
+    assertConnectAndLogin(client, server);
+
+    const path otherRoot(localTemp/"other-server");
+    fs::create_directories(otherRoot);
+    LocalServer otherServer(otherRoot);
+    TEST_ASSERT(otherServer.start());
+    Client destination;
+    assertConnectAndLogin(destination, otherServer);
+
+    TEST_ASSERT(client.fxp("file.bin", destination, "copy.bin"));
+    TEST_ASSERT(readFile(otherRoot/"copy.bin") == readFile(serverRoot/"file.bin"));
+    TEST_ASSERT(server.commandCount("PASV") == 1 && server.commandCount("RETR") == 1);
+    TEST_ASSERT(otherServer.commandCount("PORT") == 1 && otherServer.commandCount("STOR") == 1);
+    // None of the data came through here.
+    TEST_ASSERT(client.metrics().snapshot().bytesReceived < FILE_SIZE);
+    TEST_ASSERT(destination.metrics().snapshot().bytesSent < FILE_SIZE);
+
+    // A missing file is caught before the destination is asked to store anything,
+    // and both sessions are still usable afterwards.
+    TEST_ASSERT(!client.fxp("missing.bin", destination, "missing.bin"));
+    TEST_ASSERT(!exists(otherRoot/"missing.bin"));
+    TEST_ASSERT(otherServer.commandCount("STOR") == 1);
+    TEST_ASSERT(destination.fxp("copy.bin", client, "round-trip.bin"));
+    TEST_ASSERT(readFile(serverRoot/"round-trip.bin") == readFile(serverRoot/"file.bin"));
+  }
+  },
+
+  { "Test compressed transfers",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    writeCsvFile(serverRoot/"data.csv", 50 * 1000);
+    writeCsvFile(localTemp/"upload.csv", 50 * 1000);
+    writeRandomFile(serverRoot/"random.bin", FILE_SIZE);
+    const auto csvSize = file_size(serverRoot/"data.csv");
+    assertConnectAndLogin(client, server);
+    client.setCompressionLevel(6);
+
+    TEST_ASSERT(client.retr("data.csv", (localTemp/"data.csv").string()));
+    TEST_ASSERT(readFile(localTemp/"data.csv") == readFile(serverRoot/"data.csv"));
+    TEST_ASSERT(server.commandCount("MODE") == 1);
+    TEST_ASSERT(client.metrics().snapshot().bytesReceived < csvSize / 4);
+
+    TEST_ASSERT(client.stor((localTemp/"upload.csv").string(), "upload.csv"));
+    TEST_ASSERT(readFile(serverRoot/"upload.csv") == readFile(localTemp/"upload.csv"));
+    TEST_ASSERT(client.metrics().snapshot().bytesSent < csvSize / 4);
+
+    // Data that doesn't compress still arrives intact.
+    TEST_ASSERT(client.retr("random.bin", (localTemp/"random.bin").string()));
+    TEST_ASSERT(readFile(localTemp/"random.bin") == readFile(serverRoot/"random.bin"));
+
+    // So do listings, and ranges, which start part way through the file.
+    const auto listing = client.list();
+    TEST_ASSERT(listing && listing->find("data.csv") != std::string::npos);
+    TEST_ASSERT(client.retrSegmented("data.csv", (localTemp/"segmented.csv").string(), 3));
+    TEST_ASSERT(readFile(localTemp/"segmented.csv") == readFile(serverRoot/"data.csv"));
+    // The extra connections compress too.
+    const auto modeCount = server.commandCount("MODE");
+    TEST_ASSERT(modeCount > 1);
+
+    client.setCompressionLevel({});
+    TEST_ASSERT(client.retr("data.csv", (localTemp/"uncompressed.csv").string()));
+    TEST_ASSERT(readFile(localTemp/"uncompressed.csv") == readFile(serverRoot/"data.csv"));
+    TEST_ASSERT(server.commandCount("MODE") == modeCount + 1);
+  }
+  },
+
+  { "Test compression falls back to stream mode",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    writeCsvFile(serverRoot/"data.csv", 1000);
+    assertConnectAndLogin(client, server);
+    client.setCompressionLevel(9);
+
+    Faults faults;
+    faults.errorReplies = {{"MODE", "504 Unsupported mode."}};
+    server.setFaults(faults);
+    TEST_ASSERT(client.retr("data.csv", (localTemp/"data.csv").string()));
+    TEST_ASSERT(readFile(localTemp/"data.csv") == readFile(serverRoot/"data.csv"));
+    TEST_ASSERT(client.metrics().snapshot().bytesReceived >= file_size(serverRoot/"data.csv"));
+  }
+  },
+  { "Test client-side compression",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    // Several pieces' worth, so that more than one thread gets some.
+    writeCsvFile(localTemp/"data.csv", 200 * 1000);
+    std::ofstream(localTemp/"empty.csv");
+    assertConnectAndLogin(client, server);
+    const auto uncompressedSize = file_size(localTemp/"data.csv");
+
+    Client::CompressionOptions options;
+    options.numThreads = 4;
+    TEST_ASSERT(client.storCompressed((localTemp/"data.csv").string(), "data.csv.gz", options));
+    const auto report = client.lastCompressionReport();
+    TEST_ASSERT(report);
+    TEST_ASSERT(report->uncompressedBytes == uncompressedSize);
+    TEST_ASSERT(report->compressedBytes == file_size(serverRoot/"data.csv.gz"));
+    TEST_ASSERT(report->ratio() > 4);
+    TEST_ASSERT(report->cpuTime.count() > 0);
+    // The gzip magic number.
+    TEST_ASSERT(readFile(serverRoot/"data.csv.gz").substr(0, 2) == "\x1f\x8b");
+
+    TEST_ASSERT(client.retrDecompressed("data.csv.gz", (localTemp/"copy.csv").string()));
+    TEST_ASSERT(readFile(localTemp/"copy.csv") == readFile(localTemp/"data.csv"));
+    TEST_ASSERT(client.lastCompressionReport()->uncompressedBytes == uncompressedSize);
+
+    TEST_ASSERT(client.storCompressed((localTemp/"empty.csv").string(), "empty.csv.gz"));
+    TEST_ASSERT(client.retrDecompressed("empty.csv.gz", (localTemp/"empty-copy.csv").string()));
+    TEST_ASSERT(file_size(localTemp/"empty-copy.csv") == 0);
+
+    // Cut off part way through, the download must not pass as complete.
+    std::string truncated(readFile(serverRoot/"data.csv.gz"));
+    truncated.resize(truncated.size() / 2);
+    std::ofstream(serverRoot/"truncated.csv.gz", std::ios::binary) << truncated;
+    TEST_ASSERT(!client.retrDecompressed("truncated.csv.gz", (localTemp/"truncated.csv").string()));
+  }
+  },
+  { "Test FTPS resumes the TLS session on data connections",
+  [](Client &client, LocalServer &server, const path &localTemp, const path &serverRoot) {
+    TEST_ASSERT(server.enableTls());
+    auto tlsContext = std::make_shared<io::TlsContext>(io::TlsContext::Role::Client);
+    TEST_ASSERT(tlsContext->trustCertificate(server.certificate()));
+
+    // Without trusting the server's certificate, there's no connecting at all.
+    Client untrusting;
+    untrusting.setTls(std::make_shared<io::TlsContext>(io::TlsContext::Role::Client));
+    TEST_ASSERT(!untrusting.connect(server.host(), server.port()));
+    TEST_ASSERT(server.commandCount("AUTH") == 1 && server.commandCount("PROT") == 0);
+
+    client.setTls(tlsContext);
+    assertConnectAndLogin(client, server);
+    TEST_ASSERT(server.commandCount("AUTH") == 2 && server.commandCount("PROT") == 1);
+
+    // A batch of small files, each needing its own data connection. The server
+    // refuses any which don't resume the session.
+    constexpr size_t numFiles = 10;
+    for (size_t i = 0; i < numFiles; ++i) {
+      const auto name = "small" + std::to_string(i) + ".bin";
+      writeRandomFile(localTemp/name, 1000 + i);
+      TEST_ASSERT(client.stor((localTemp/name).string(), name));
+      TEST_ASSERT(client.retr(name, (localTemp/("copy-" + name)).string()));
+      TEST_ASSERT(readFile(localTemp/("copy-" + name)) == readFile(serverRoot/name));
+      TEST_ASSERT(readFile(serverRoot/name) == readFile(localTemp/name));
+    }
+    TEST_ASSERT(client.list()->find("small9.bin") != std::string::npos);
+
+    writeRandomFile(serverRoot/"large.bin", FILE_SIZE);
+    TEST_ASSERT(client.retrSegmented("large.bin", (localTemp/"large.bin").string(), 3));
+    TEST_ASSERT(readFile(localTemp/"large.bin") == readFile(serverRoot/"large.bin"));
+
+    // Only the first control connection needed the full handshake.
+    const auto metrics = client.metrics().snapshot();
+    TEST_ASSERT(metrics.tlsHandshakes >= 2 * numFiles + 3);
+    TEST_ASSERT(metrics.tlsResumedHandshakes == metrics.tlsHandshakes - 1);
+
+    // Refused rather than sending the file between the servers in the clear.
+    Client destination;
+    destination.setTls(tlsContext);
+    assertConnectAndLogin(destination, server);
+    TEST_ASSERT(!client.fxp("large.bin", destination, "copy.bin"));
+    TEST_ASSERT(!exists(serverRoot/"copy.bin"));
+  }
+  },
+};
+}
+
+int
+main(void)
+{
+  LOG_INFO("");
+  auto testsExecuted = 0;
+  auto testsPassed = 0;
+
+  const path testRoot(fs::temp_directory_path()/"ftp-client-fault-tests");
+  const path localTemp(testRoot/"local"), serverRoot(testRoot/"server");
+
+  for (const auto &[name, testFunc] : tests) {
+    LOG_INFO("");
+    LOG_INFO("===");
+    LOG_INFO("Running test: " << name);
+    LOG_INFO("---");
+
+    fs::remove_all(testRoot);
+    fs::create_directories(localTemp);
+    fs::create_directories(serverRoot);
+
+    // Declared before the client so that the client disconnects first.
+    LocalServer server(serverRoot);
+    Client client;
+
+    try {
+      ++testsExecuted;
+      TEST_ASSERT(server.start());
+      testFunc(client, server, localTemp, serverRoot);
+      // If no exception thrown, test passes.
+      ++testsPassed;
+      LOG_INFO("PASSED");
+    } catch (const std::exception &e) {
+      LOG_INFO("FAILED: " << e.what());
+    }
+
+    LOG_INFO("===");
+  }
+
+  fs::remove_all(testRoot);
+
+  std::stringstream summary;
+  summary << "Tests passed: " << testsPassed << "/" << testsExecuted << std::endl;
+  LOG_INFO("");
+  LOG_INFO(summary.str());
+
+  return testsPassed == testsExecuted ? 0 : -1;
+}
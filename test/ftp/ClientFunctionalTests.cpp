@@ -7,8 +7,11 @@
 #include <vector>
 #include <algorithm>
 
+#include <unistd.h>
+
 #include "util/util.hpp"
 #include "ftp/Client.h"
+#include "server/LocalServer.h"
 
 #define TEST_ASSERT(e) throwIfFalse(e, __LINE__)
 
@@ -16,12 +19,16 @@ namespace fs = std::filesystem;
 using fs::path;
 
 using ftp::Client;
+using server::LocalServer;
 using TestFunction = void(*)(Client&, const path&, const path&);
 
 namespace {
 
 constexpr auto HOST = "127.0.0.1", USERNAME = "anonymous", PASSWORD = "anonymous";
 
+// The port the LocalServer that main starts is listening on.
+std::string serverPort;
+
 template <class T>
 void
 throwIfFalse(const T &expression, int line)
@@ -42,10 +49,26 @@ remove_all_inside(const path &dir)
   }
 }
 
+// Fills the file with `size` bytes that aren't all the same.
+void
+writeFile(const path &file, std::uintmax_t size)
+{
+  std::ofstream stream(file, std::ios::binary);
+  for (std::uintmax_t i = 0; i < size; ++i) {
+    stream.put(static_cast<char>(i * 31 + 7));
+  }
+}
+
+bool
+connectToServer(Client &client)
+{
+  return client.connect(HOST, serverPort);
+}
+
 void
 assertConnectAndLogin(Client &client)
 {
-  TEST_ASSERT(client.connect(HOST));
+  TEST_ASSERT(connectToServer(client));
   TEST_ASSERT(client.login(USERNAME, PASSWORD));
 }
 
@@ -59,7 +82,7 @@ auto tests = std::unordered_map<std::string, TestFunction> {
 
   { "Test successful connection",
   [](Client &client, const path &, const path &) {
-    TEST_ASSERT(client.connect(HOST));
+    TEST_ASSERT(connectToServer(client));
   }
   },
 
@@ -126,6 +149,22 @@ auto tests = std::unordered_map<std::string, TestFunction> {
   }
   },
 
+  { "Test upload of regular file is zero-copy",
+  [](Client &client, const path &, const path &serverTemp) {
+    assertConnectAndLogin(client);
+
+    // Nothing has been sent yet.
+    TEST_ASSERT(!client.lastSendMethod());
+
+    TEST_ASSERT(client.stor("scratch/files/bigfile-2049.txt", "temp/uploadedfile.txt"));
+
+    // Regular files should be sent by the kernel rather than through a buffer.
+    TEST_ASSERT(client.lastSendMethod() == io::Socket::SendMethod::ZeroCopy);
+    const auto uploadedFile(serverTemp/"uploadedfile.txt");
+    TEST_ASSERT(exists(uploadedFile) && file_size(uploadedFile) == 2049);
+  }
+  },
+
   { "Test download big file",
   [](Client &client, const path &localTemp, const path &) {
     assertConnectAndLogin(client);
@@ -137,6 +176,72 @@ auto tests = std::unordered_map<std::string, TestFunction> {
   }
   },
 
+  { "Test download big file with small receive buffer",
+  [](Client &client, const path &localTemp, const path &) {
+    assertConnectAndLogin(client);
+
+    // Not a divisor of the file size, so the last read is a partial one.
+    client.setReceiveBufferSize(7);
+
+    const auto downloadedFile(localTemp/"downloadedfile.txt");
+    TEST_ASSERT(client.retr("files/bigfile.txt", downloadedFile));
+
+    TEST_ASSERT(exists(downloadedFile) && file_size(downloadedFile) == 2050);
+  }
+  },
+
+  { "Test segmented download",
+  [](Client &client, const path &localTemp, const path &) {
+    assertConnectAndLogin(client);
+
+    TEST_ASSERT(client.size("files/bigfile.txt") == 2050u);
+
+    const auto downloadedFile(localTemp/"downloadedfile.txt");
+    TEST_ASSERT(client.retrSegmented("files/bigfile.txt", downloadedFile, 4));
+
+    TEST_ASSERT(exists(downloadedFile) && file_size(downloadedFile) == 2050);
+  }
+  },
+
+  { "Test downloads with data connection prefetch",
+  [](Client &client, const path &localTemp, const path &) {
+    assertConnectAndLogin(client);
+    client.setDataConnectionPrefetch(true);
+
+    for (int i = 0; i < 3; ++i) {
+      const auto downloadedFile(localTemp/("downloadedfile" + std::to_string(i) + ".txt"));
+      TEST_ASSERT(client.retr("files/bigfile.txt", downloadedFile));
+      TEST_ASSERT(exists(downloadedFile) && file_size(downloadedFile) == 2050);
+    }
+    TEST_ASSERT(client.list("files").has_value());
+    TEST_ASSERT(client.quit());
+  }
+  },
+
+  { "Test batch size and modification time",
+  [](Client &client, const path &, const path &) {
+    assertConnectAndLogin(client);
+
+    const std::vector<std::string> files{"files/bigfile.txt", "files/myFileWhichDoesNotExist.txt", "files/bigfile.txt"};
+    TEST_ASSERT(client.sizeBatch(files) == std::vector<std::optional<std::uintmax_t>>({2050u, std::nullopt, 2050u}));
+    const auto times = client.mdtmBatch(files);
+    TEST_ASSERT(times[0] && !times[1] && times[2] == times[0]);
+    TEST_ASSERT(client.noop());
+  }
+  },
+
+  { "Test segmented download of non-existent file",
+  [](Client &client, const path &localTemp, const path &) {
+    assertConnectAndLogin(client);
+
+    const auto downloadedFile(localTemp/"downloadedfile.txt");
+    TEST_ASSERT(!client.retrSegmented("files/myFileWhichDoesNotExist.txt", downloadedFile, 4));
+
+    // Shouldn't leave anything behind.
+    TEST_ASSERT(!exists(downloadedFile));
+  }
+  },
+
   // { "Test download really big file",
   // [](Client &client, const path &localTemp, const path &) {
   //   assertConnectAndLogin(client);
@@ -321,7 +426,7 @@ auto tests = std::unordered_map<std::string, TestFunction> {
 
     const auto maybeList = client.list();
     TEST_ASSERT(maybeList);
-    LOG(*maybeList);
+    LOG_INFO(*maybeList);
 
     // Check that the output has two lines. The output can be quite complicated,
     // and doesn't have a fixed format, so I think it's only practical to
@@ -338,27 +443,143 @@ auto tests = std::unordered_map<std::string, TestFunction> {
 
     const auto maybeList = client.list("files");
     TEST_ASSERT(maybeList);
-    LOG(*maybeList);
+    LOG_INFO(*maybeList);
 
     TEST_ASSERT(std::count(maybeList->cbegin(), maybeList->cend(), '\n') == 2);
   }
   },
 
-  // Annoyingly, vsftpd seems to send an empty string when a client tries to
-  // list a directly that doesn't exist.
-  //
-  // { "Test list non-existent dir",
-  // [](Client &client, const path &, const path &serverTemp) {
-  //   constexpr const auto DIR_NAME = "myDirWhichDoesNotExist";
-  //   assert(!exists(serverTemp/DIR_NAME));
-  //
-  //   assertConnectAndLogin(client);
-  //
-  //   // ~~Should receive a null optional if the dir doesn't exist.~~
-  //   LOG(*client.list(std::string("temp/") + DIR_NAME));
-  //   TEST_ASSERT(!true);
-  // }
-  // }
+  { "Test streaming list matches buffered list",
+  [](Client &client, const path &, const path &) {
+    assertConnectAndLogin(client);
+
+    const auto maybeList = client.list("files");
+    TEST_ASSERT(maybeList);
+
+    std::string joinedLines;
+    TEST_ASSERT(client.list("files", [&joinedLines](std::string_view line) {
+      joinedLines.append(line).append("\r\n");
+    }));
+    TEST_ASSERT(joinedLines == *maybeList);
+  }
+  },
+
+  { "Test streaming name list of big directory",
+  [](Client &client, const path &, const path &serverTemp) {
+    assertConnectAndLogin(client);
+
+    // Enough that the listing spans many reads, so lines get split between them.
+    constexpr size_t NUM_FILES = 5000;
+    for (size_t i = 0; i < NUM_FILES; ++i) {
+      TEST_ASSERT(std::ofstream(serverTemp/("file" + std::to_string(i) + ".txt")));
+    }
+
+    size_t numLines = 0;
+    bool isEveryLineAName = true;
+    TEST_ASSERT(client.cwd("temp"));
+    TEST_ASSERT(client.nlst([&numLines, &isEveryLineAName, &serverTemp](std::string_view line) {
+      ++numLines;
+      isEveryLineAName = isEveryLineAName && exists(serverTemp/std::string(line));
+    }));
+    TEST_ASSERT(numLines == NUM_FILES);
+    TEST_ASSERT(isEveryLineAName);
+  }
+  },
+
+  { "Test structured listing",
+  [](Client &client, const path &, const path &) {
+    assertConnectAndLogin(client);
+
+    const auto maybeEntry = client.mlst("files/bigfile.txt");
+    TEST_ASSERT(maybeEntry && maybeEntry->size == 2050u);
+    std::vector<fsm::ListingEntry> entries;
+    TEST_ASSERT(client.listEntries("files", [&entries](const fsm::ListingEntry &entry) { entries.push_back(entry); }));
+    TEST_ASSERT(entries.size() == 2);
+    const auto bigFile = std::find_if(entries.cbegin(), entries.cend(), [](const auto &entry) { return entry.name == "bigfile.txt"; });
+    TEST_ASSERT(bigFile != entries.cend());
+    TEST_ASSERT(bigFile->type == fsm::ListingEntry::Type::File && bigFile->size == 2050u);
+    TEST_ASSERT(bigFile->modifyTime == maybeEntry->modifyTime && bigFile->unique == maybeEntry->unique);
+  }
+  },
+
+  { "Test mirror directory",
+  [](Client &client, const path &localTemp, const path &serverTemp) {
+    assertConnectAndLogin(client);
+
+    const auto report = client.mirror("files", (localTemp/"mirror").string(), 3);
+    TEST_ASSERT(report.isComplete());
+    TEST_ASSERT(report.files.size() == 2);
+
+    std::uintmax_t totalSize = 0;
+    for (const auto &entry : fs::directory_iterator(serverTemp/".."/"files")) {
+      const auto size = file_size(entry.path());
+      TEST_ASSERT(file_size(localTemp/"mirror"/entry.path().filename()) == size);
+      totalSize += size;
+    }
+    TEST_ASSERT(report.totalBytes == totalSize);
+  }
+  },
+
+  { "Test sync upload",
+  [](Client &client, const path &localTemp, const path &serverTemp) {
+    assertConnectAndLogin(client);
+
+    const auto localTree(localTemp/"tree");
+    fs::create_directories(localTree/"dir");
+    TEST_ASSERT(std::ofstream(localTree/"file.txt") << "hello");
+    TEST_ASSERT(std::ofstream(localTree/"dir"/"other.txt") << "world");
+
+    auto report = client.syncUpload(localTree.string(), "temp/tree", 2);
+    TEST_ASSERT(report.isComplete());
+    TEST_ASSERT(report.uploads.size() == 2 && report.totalBytes == 10);
+    TEST_ASSERT(file_size(serverTemp/"tree"/"dir"/"other.txt") == 5);
+
+    report = client.syncUpload(localTree.string(), "temp/tree", 2);
+    TEST_ASSERT(report.isComplete());
+    TEST_ASSERT(report.uploads.empty() && report.numUnchanged == 2);
+  }
+  },
+
+  { "Test append delta",
+  [](Client &client, const path &localTemp, const path &serverTemp) {
+    assertConnectAndLogin(client);
+
+    const auto localFile(localTemp/"log.txt");
+    TEST_ASSERT(std::ofstream(localFile) << "hello");
+    TEST_ASSERT(client.appeDelta(localFile.string(), "temp/log.txt"));
+    TEST_ASSERT(std::ofstream(localFile, std::ios::app) << " world");
+    TEST_ASSERT(client.appeDelta(localFile.string(), "temp/log.txt"));
+
+    std::ifstream serverFile(serverTemp/"log.txt");
+    const std::string contents((std::istreambuf_iterator<char>(serverFile)), std::istreambuf_iterator<char>());
+    TEST_ASSERT(contents == "hello world");
+  }
+  },
+
+  { "Test streaming list of non-existent file",
+  [](Client &client, const path &, const path &) {
+    assertConnectAndLogin(client);
+
+    // The server replies 550, which has to be reported even though no lines came.
+    size_t numLines = 0;
+    TEST_ASSERT(!client.nlst("files/myFileWhichDoesNotExist.txt", [&numLines](std::string_view) { ++numLines; }));
+    TEST_ASSERT(numLines == 0);
+    TEST_ASSERT(client.noop());
+  }
+  },
+
+  { "Test list non-existent dir",
+  [](Client &client, const path &, const path &serverTemp) {
+    constexpr const auto DIR_NAME = "myDirWhichDoesNotExist";
+    assert(!exists(serverTemp/DIR_NAME));
+
+    assertConnectAndLogin(client);
+
+    // Should receive a null optional if the dir doesn't exist.
+    TEST_ASSERT(!client.list(std::string("temp/") + DIR_NAME));
+    TEST_ASSERT(client.noop());
+  }
+  },
 
   { "Test append",
   [](Client &client, const path &, const path &serverTemp) {
@@ -428,7 +649,7 @@ auto tests = std::unordered_map<std::string, TestFunction> {
 
   { "Test username-only login failure",
   [](Client &client, const path &, const path &) {
-    TEST_ASSERT(client.connect(HOST));
+    TEST_ASSERT(connectToServer(client));
 
     // Not a valid username.
     TEST_ASSERT(!client.login("absjdsfs"));
@@ -437,7 +658,7 @@ auto tests = std::unordered_map<std::string, TestFunction> {
 
   { "Test username & password login succeed",
   [](Client &client, const path &, const path &) {
-    TEST_ASSERT(client.connect(HOST));
+    TEST_ASSERT(connectToServer(client));
 
     // These are the same credentials used for the rest of the tests.
     TEST_ASSERT(client.login("anonymous", "anonymous"));
@@ -449,7 +670,7 @@ auto tests = std::unordered_map<std::string, TestFunction> {
   // it's not used very often...
   // { "Test username, password & account info login",
   // [](Client &client, const path &, const path &) {
-  //   TEST_ASSERT(client.connect(HOST));
+  //   TEST_ASSERT(connectToServer(client));
 
   //   TEST_ASSERT(client.login("anonymous", "anonymous", "guest"));
   // }
@@ -460,20 +681,34 @@ auto tests = std::unordered_map<std::string, TestFunction> {
 int
 main(void)
 {
-  LOG("");
+  LOG_INFO("");
   auto testsExecuted = 0;
   auto testsPassed = 0;
 
-  path localTemp("./scratch/temp");
-  if (!exists(localTemp) || !is_empty(localTemp) || !is_directory(localTemp)) {
-    LOG("Not proceeding with tests because local temp dir either doesn't exist or is not an empty directory.");
-    return -1;
-  }
-  path serverTemp("./vsftpd/anon/temp");
-  if (!exists(serverTemp) || !is_empty(serverTemp) || !is_directory(serverTemp)) {
-    LOG("Not proceeding with tests because server temp dir either doesn't exist or is not an empty directory.");
+  // Everything the tests use is set up from scratch in a directory of its own,
+  // with a LocalServer serving part of it, so nothing outside is needed.
+  const path fixture(fs::temp_directory_path()/("ClientFunctionalTests-" + std::to_string(::getpid())));
+  fs::remove_all(fixture);
+  fs::create_directories(fixture/"scratch"/"files");
+  fs::create_directories(fixture/"scratch"/"temp");
+  fs::create_directories(fixture/"server"/"files");
+  fs::create_directories(fixture/"server"/"temp");
+  writeFile(fixture/"scratch"/"files"/"bigfile-2048.txt", 2048);
+  writeFile(fixture/"scratch"/"files"/"bigfile-2049.txt", 2049);
+  std::ofstream(fixture/"scratch"/"files"/"file.txt") << "hello" << std::endl;
+  writeFile(fixture/"server"/"files"/"bigfile.txt", 2050);
+  std::ofstream(fixture/"server"/"files"/"file.txt") << "hello" << std::endl;
+  fs::current_path(fixture);
+
+  LocalServer server(fixture/"server");
+  if (!server.start()) {
+    LOG_INFO("Not proceeding with tests because the server couldn't be started.");
     return -1;
   }
+  serverPort = server.port();
+
+  path localTemp("./scratch/temp");
+  path serverTemp("./server/temp");
 
 
   const std::vector<std::string> testAllowList{
@@ -486,10 +721,10 @@ main(void)
       // Skip this test because the allow list is populated and this test isn't in it.
       continue;
     }
-    LOG("");
-    LOG("===");
-    LOG("Running test: " << name);
-    LOG("---");
+    LOG_INFO("");
+    LOG_INFO("===");
+    LOG_INFO("Running test: " << name);
+    LOG_INFO("---");
     Client client;
 
     remove_all_inside(localTemp);
@@ -500,19 +735,25 @@ main(void)
       testFunc(client, localTemp, serverTemp);
       // If no exception thrown, test passes.
       ++testsPassed;
-      LOG("PASSED");
+      LOG_INFO("PASSED");
     } catch (const std::exception &e) {
-      LOG("FAILED: " << e.what());
+      LOG_INFO("FAILED: " << e.what());
     }
 
-    LOG("===");
+    LOG_INFO("===");
   }
 
   remove_all_inside(localTemp);
   remove_all_inside(serverTemp);
 
+  server.stop();
+  fs::current_path(fixture.parent_path());
+  fs::remove_all(fixture);
+
   std::stringstream summary;
   summary << "Tests passed: " << testsPassed << "/" << testsExecuted << std::endl;
-  LOG("");
-  LOG(summary.str());
+  LOG_INFO("");
+  LOG_INFO(summary.str());
+
+  return testsPassed == testsExecuted ? 0 : -1;
 }